@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+
+# Connect many AppleMIDI peers to a local raveloxmidi and report the memory used per session
+# and how long it takes for a note sent to the local port to reach every peer. Memory is
+# measured once the sessions are connected and again after MIDI has been sent to them.
+#
+# Usage: load_test.py [--pid PID] [sessions ...]
+# The default is to find the raveloxmidi process and test with 10, 100 and 500 sessions.
+# network.max_connections must allow the largest number of sessions.
+
+import argparse
+import os
+import resource
+import select
+import socket
+import statistics
+import struct
+import sys
+import time
+
+HOST = "127.0.0.1"
+CONTROL_PORT = 5004
+DATA_PORT = 5005
+LOCAL_PORT = 5006
+
+PEER_BASE_PORT = 7000
+NOTES_PER_RUN = 50
+NOTE_TIMEOUT = 2.0
+
+APPLEMIDI_INV = 0x494E
+APPLEMIDI_END = 0x4259
+
+
+def find_pid():
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open("/proc/%s/comm" % entry) as comm:
+                if comm.read().strip() == "raveloxmidi":
+                    return int(entry)
+        except OSError:
+            continue
+    return None
+
+
+def rss_kb(pid):
+    with open("/proc/%d/status" % pid) as status:
+        for line in status:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+    return 0
+
+
+def applemidi(command, ssrc, name=b""):
+    return struct.pack(">HHIII", 0xFFFF, command, 2, ssrc, ssrc) + name
+
+
+class Peer:
+    def __init__(self, index):
+        self.ssrc = 0x10000 + index
+        port = PEER_BASE_PORT + (2 * index)
+        self.control = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.control.bind((HOST, port))
+        self.control.settimeout(2.0)
+        self.data = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.data.bind((HOST, port + 1))
+        self.data.settimeout(2.0)
+
+    def invite(self):
+        inv = applemidi(APPLEMIDI_INV, self.ssrc, b"load%u\0" % self.ssrc)
+        for sock, port in ((self.control, CONTROL_PORT), (self.data, DATA_PORT)):
+            sock.sendto(inv, (HOST, port))
+            reply, _ = sock.recvfrom(1500)
+            if reply[2:4] != b"OK":
+                raise RuntimeError("Invitation from 0x%08x refused" % self.ssrc)
+        self.data.setblocking(False)
+
+    def end(self):
+        self.control.sendto(applemidi(APPLEMIDI_END, self.ssrc), (HOST, CONTROL_PORT))
+        self.control.close()
+        self.data.close()
+
+
+def drain(peers):
+    for peer in peers:
+        try:
+            while True:
+                peer.data.recv(1500)
+        except BlockingIOError:
+            pass
+
+
+def fan_out(local, peers, epoll, by_fd):
+    latencies = []
+    for i in range(NOTES_PER_RUN):
+        pending = set(by_fd)
+        note = 0x30 + (i % 24)
+        start = time.perf_counter()
+        local.send(bytes([0x90, note, 0x40]))
+        last = start
+        deadline = start + NOTE_TIMEOUT
+        while pending and time.perf_counter() < deadline:
+            for fd, _ in epoll.poll(0.1):
+                try:
+                    while True:
+                        by_fd[fd].data.recv(1500)
+                except BlockingIOError:
+                    pass
+                if fd in pending:
+                    pending.discard(fd)
+                    last = time.perf_counter()
+        if pending:
+            sys.stderr.write("%u peers missed note %u\n" % (len(pending), i))
+            continue
+        latencies.append((last - start) * 1000000)
+        local.send(bytes([0x80, note, 0x00]))
+        time.sleep(0.005)
+        drain(peers)
+    return latencies
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--pid", type=int, default=None)
+    parser.add_argument("sessions", type=int, nargs="*", default=[10, 100, 500])
+    args = parser.parse_args()
+
+    pid = args.pid or find_pid()
+    if not pid:
+        sys.stderr.write("Unable to find the raveloxmidi process\n")
+        sys.exit(1)
+    sizes = sorted(args.sessions)
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    wanted = (2 * max(sizes)) + 64
+    if soft < wanted:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(wanted, hard), hard))
+
+    local = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    local.connect((HOST, LOCAL_PORT))
+
+    epoll = select.epoll()
+    by_fd = {}
+    peers = []
+    base_rss = rss_kb(pid)
+
+    print("sessions  idle_kb/session  active_kb/session  median_us  p99_us")
+    try:
+        for size in sizes:
+            added = size - len(peers)
+            before = rss_kb(pid)
+            while len(peers) < size:
+                peer = Peer(len(peers))
+                peer.invite()
+                peers.append(peer)
+                by_fd[peer.data.fileno()] = peer
+                epoll.register(peer.data.fileno(), select.EPOLLIN)
+
+            idle = (rss_kb(pid) - before) / max(1, added)
+            latencies = fan_out(local, peers, epoll, by_fd)
+            active = (rss_kb(pid) - base_rss) / size
+            if latencies:
+                latencies.sort()
+                p99 = latencies[min(len(latencies) - 1, int(len(latencies) * 0.99))]
+                print("%8u  %15.1f  %17.1f  %9.0f  %6.0f" % (size, idle, active, statistics.median(latencies), p99))
+            else:
+                print("%8u  %15.1f  %17.1f  %9s  %6s" % (size, idle, active, "-", "-"))
+    finally:
+        for peer in peers:
+            peer.end()
+        epoll.close()
+        local.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -29,7 +29,7 @@ def main():
         sock.sendall(SEND_BYTES)
 
         try:
-            data, _ = sock.recvfrom(8192)
+            data, _ = sock.recvfrom(65536)
         except socket.timeout:
             sys.stderr.write("Timed out waiting for raveloxmidi list response\n")
             sys.exit(1)
@@ -22,6 +22,8 @@
 #define APPLEMIDI_FEEDBACK_H
 
 void applemidi_feedback_responder( void *data );
-net_response_t * applemidi_feedback_create( uint32_t ssrc, uint16_t rtp_seq );
+size_t applemidi_feedback_pack( net_response_buffer_t *response, uint32_t ssrc, uint16_t rtp_seq );
+void applemidi_feedback_schedule( net_ctx_t *ctx, uint16_t rtp_seq );
+long applemidi_feedback_flush_due( void );
 
 #endif
@@ -21,6 +21,6 @@
 #ifndef APPLEMIDI_INV_H
 #define APPLEMIDI_INV_H
 
-net_response_t * applemidi_inv_responder( char *ip_address, uint16_t port, void *data );
+size_t applemidi_inv_responder( char *ip_address, uint16_t port, void *data, net_response_buffer_t *response );
 
 #endif
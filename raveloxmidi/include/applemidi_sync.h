@@ -21,6 +21,6 @@
 #ifndef APPLEMIDI_SYNC_H
 #define APPLEMIDI_SYNC_H
 
-net_response_t * applemidi_sync_responder( void *data );
+size_t applemidi_sync_responder( void *data, net_response_buffer_t *response, long arrival_time );
 
 #endif
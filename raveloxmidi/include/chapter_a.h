@@ -0,0 +1,46 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#ifndef CHAPTER_A_JOURNAL_H
+#define CHAPTER_A_JOURNAL_H
+
+/* Sec A.9 of RFC6295.txt - Poly Aftertouch */
+#define MAX_CHAPTER_A_NOTES	128
+#define PACKED_CHAPTER_A_HEADER_SIZE	1
+#define PACKED_CHAPTER_A_LOG_SIZE	2
+#define CHAPTER_A_MAX_PACKED_SIZE	( PACKED_CHAPTER_A_HEADER_SIZE + ( MAX_CHAPTER_A_NOTES * PACKED_CHAPTER_A_LOG_SIZE ) )
+
+typedef struct chapter_a_t {
+	uint8_t S;
+	uint64_t present[ JOURNAL_MAP_WORDS ];
+	uint8_t pressure[ MAX_CHAPTER_A_NOTES ];
+	/* Sequence number of the packet that last changed each note */
+	uint32_t seq[ MAX_CHAPTER_A_NOTES ];
+} chapter_a_t;
+
+void chapter_a_reset( chapter_a_t *chapter_a );
+void chapter_a_set( chapter_a_t *chapter_a, uint32_t seq, uint8_t note, uint8_t pressure );
+size_t chapter_a_trim( chapter_a_t *chapter_a, uint32_t checkpoint );
+int chapter_a_has_data( const chapter_a_t *chapter_a );
+size_t chapter_a_pack( const chapter_a_t *chapter_a, unsigned char *packed );
+size_t chapter_a_unpack( const unsigned char *packed, size_t size, chapter_a_t *chapter_a );
+void chapter_a_dump( const chapter_a_t *chapter_a );
+
+#endif
@@ -23,34 +23,25 @@
 
 #define MAX_CHAPTER_C_CONTROLLERS	128
 
-typedef struct controller_log_t {
-	uint8_t S;
-	uint8_t number;
-	uint8_t A;
-	uint8_t T;
-	uint8_t value;
-} controller_log_t;
-
 #define PACKED_CONTROLLER_LOG_SIZE 2
+#define PACKED_CHAPTER_C_HEADER_SIZE 1
+#define CHAPTER_C_MAX_PACKED_SIZE	( PACKED_CHAPTER_C_HEADER_SIZE + ( MAX_CHAPTER_C_CONTROLLERS * PACKED_CONTROLLER_LOG_SIZE ) )
 
+/* Controller state for one channel. present has bit n set if value[n] holds the last value of controller n */
 typedef struct chapter_c_t {
 	uint8_t S;
-	uint8_t len;
-	controller_log_t controller_log[MAX_CHAPTER_C_CONTROLLERS];
+	uint64_t present[ JOURNAL_MAP_WORDS ];
+	uint8_t value[ MAX_CHAPTER_C_CONTROLLERS ];
+	/* Sequence number of the packet that last changed each controller */
+	uint32_t seq[ MAX_CHAPTER_C_CONTROLLERS ];
 } chapter_c_t;
 
-#define PACKED_CHAPTER_C_HEADER_SIZE 1
-
-chapter_c_t *chapter_c_create( void );
-void chapter_c_unpack( unsigned char *packed, size_t size, chapter_c_t **chapter_c );
-void chapter_c_pack( chapter_c_t *chapter_c, unsigned char **packed, size_t *size );
-void chapter_c_destroy( chapter_c_t **chapter_c );
 void chapter_c_reset( chapter_c_t *chapter_c );
-void chapter_c_dump( chapter_c_t *chapter_c );
-
-controller_log_t *controller_log_create( void );
-void controller_log_destroy( controller_log_t **controller_log );
-void controller_log_reset( controller_log_t *controller_log );
-void controller_log_dump( controller_log_t *controller_log );
+void chapter_c_set( chapter_c_t *chapter_c, uint32_t seq, uint8_t controller, uint8_t value );
+size_t chapter_c_trim( chapter_c_t *chapter_c, uint32_t checkpoint );
+int chapter_c_has_data( const chapter_c_t *chapter_c );
+size_t chapter_c_pack( const chapter_c_t *chapter_c, unsigned char *packed );
+size_t chapter_c_unpack( const unsigned char *packed, size_t size, chapter_c_t *chapter_c );
+void chapter_c_dump( const chapter_c_t *chapter_c );
 
 #endif
@@ -0,0 +1,81 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#ifndef CHAPTER_M_JOURNAL_H
+#define CHAPTER_M_JOURNAL_H
+
+/* Sec A.3 of RFC6295.txt - Parameter System (RPN and NRPN) */
+
+/* Controllers that make up the parameter system */
+#define CHAPTER_M_DATA_ENTRY_MSB	6
+#define CHAPTER_M_DATA_ENTRY_LSB	38
+#define CHAPTER_M_DATA_INCREMENT	96
+#define CHAPTER_M_DATA_DECREMENT	97
+#define CHAPTER_M_NRPN_LSB		98
+#define CHAPTER_M_NRPN_MSB		99
+#define CHAPTER_M_RPN_LSB		100
+#define CHAPTER_M_RPN_MSB		101
+
+#define CHAPTER_M_IS_PARAMETER_CONTROLLER(c)	( (c) == CHAPTER_M_DATA_ENTRY_MSB || (c) == CHAPTER_M_DATA_ENTRY_LSB || \
+						( (c) >= CHAPTER_M_DATA_INCREMENT && (c) <= CHAPTER_M_RPN_MSB ) )
+
+/* Parameters are kept in a fixed table. When it is full the one changed longest ago is replaced */
+#define MAX_CHAPTER_M_PARAMETERS	16
+
+#define PACKED_CHAPTER_M_HEADER_SIZE	2
+#define PACKED_CHAPTER_M_LOG_MAX_SIZE	5
+#define CHAPTER_M_MAX_PACKED_SIZE	( PACKED_CHAPTER_M_HEADER_SIZE + ( MAX_CHAPTER_M_PARAMETERS * PACKED_CHAPTER_M_LOG_MAX_SIZE ) )
+
+/* Table of contents bits in a parameter log */
+#define CHAPTER_M_LOG_J	0x80
+#define CHAPTER_M_LOG_K	0x40
+
+typedef struct chapter_m_log_t {
+	uint8_t	in_use;
+	/* Q=1 for NRPN */
+	uint8_t Q;
+	uint8_t pnum_msb;
+	uint8_t pnum_lsb;
+	/* Which of entry_msb and entry_lsb have been set. Uses the CHAPTER_M_LOG_ bits */
+	uint8_t toc;
+	uint8_t entry_msb;
+	uint8_t entry_lsb;
+	/* Sequence number of the packet that last changed the parameter */
+	uint32_t seq;
+} chapter_m_log_t;
+
+typedef struct chapter_m_t {
+	uint8_t S;
+	/* The parameter that data entry applies to */
+	uint8_t selected_Q;
+	uint8_t selected_msb;
+	uint8_t selected_lsb;
+	uint8_t num_logs;
+	chapter_m_log_t logs[ MAX_CHAPTER_M_PARAMETERS ];
+} chapter_m_t;
+
+void chapter_m_init( chapter_m_t *chapter_m );
+void chapter_m_reset( chapter_m_t *chapter_m );
+int chapter_m_control( chapter_m_t *chapter_m, uint32_t seq, uint8_t controller, uint8_t value );
+size_t chapter_m_trim( chapter_m_t *chapter_m, uint32_t checkpoint );
+size_t chapter_m_pack( const chapter_m_t *chapter_m, unsigned char *packed );
+void chapter_m_dump( const chapter_m_t *chapter_m );
+
+#endif
@@ -21,47 +21,34 @@
 #ifndef CHAPTER_N_JOURNAL_H
 #define CHAPTER_N_JOURNAL_H
 
-typedef struct chapter_n_note_t {
-	unsigned char	S:1;
-	unsigned char	num:7;
-	unsigned char	Y:1;
-	unsigned char	velocity:7;
-} chapter_n_note_t;
 #define CHAPTER_N_NOTE_PACKED_SIZE	2
 
 #define MAX_CHAPTER_N_NOTES	127
 #define MAX_OFFBITS		16
 
-typedef struct chapter_n_header_t {
-	unsigned char	B:1;
-	unsigned char	len:7;
-	unsigned char	low:4;
-	unsigned char	high:4;
-} chapter_n_header_t;
 #define CHAPTER_N_HEADER_PACKED_SIZE	2
+#define CHAPTER_N_MAX_PACKED_SIZE	( CHAPTER_N_HEADER_PACKED_SIZE + ( MAX_CHAPTER_N_NOTES * CHAPTER_N_NOTE_PACKED_SIZE ) + MAX_OFFBITS )
 
+/* Note state for one channel.
+   on has bit n set if the last command for note n was a NOTE ON. Its velocity is in velocity[n].
+   offbits has a bit set for each note whose last command was a NOTE OFF. It is kept in the order it goes on the wire */
 typedef struct chapter_n_t {
-	chapter_n_header_t	*header;
-	uint16_t		num_notes;
-	chapter_n_note_t	*notes[MAX_CHAPTER_N_NOTES];
-	unsigned char		*offbits;
+	uint64_t	on[ JOURNAL_MAP_WORDS ];
+	uint8_t		offbits[ MAX_OFFBITS ];
+	uint8_t		velocity[ JOURNAL_MAP_SIZE ];
+	/* Sequence number of the packet that last changed each note */
+	uint32_t	seq[ JOURNAL_MAP_SIZE ];
+	uint8_t		num_notes;
+	uint8_t		B;
 } chapter_n_t;
 
-void chapter_n_header_pack( chapter_n_header_t *header , unsigned char **packed , size_t *size );
-void chapter_n_header_destroy( chapter_n_header_t **header );
-chapter_n_header_t * chapter_n_header_create( void );
-void chapter_n_pack( chapter_n_t *chapter_n, unsigned char **packed, size_t *size );
-chapter_n_t * chapter_n_create( void );
-void chapter_n_destroy( chapter_n_t **chapter_n );
-void chapter_n_header_dump( chapter_n_header_t *header );
-void chapter_n_header_reset( chapter_n_header_t *header );
-void chapter_n_dump( chapter_n_t *chapter_n );
 void chapter_n_reset( chapter_n_t *chapter_n );
-
-void chapter_n_note_pack( const chapter_n_note_t *note , unsigned char **packed , size_t *size );
-void chapter_n_note_destroy( chapter_n_note_t **note );
-chapter_n_note_t * chapter_n_note_create( void );
-void chapter_n_note_dump( chapter_n_note_t *note );
-void chapter_n_note_reset( chapter_n_note_t **note );
+void chapter_n_note_on( chapter_n_t *chapter_n, uint32_t seq, uint8_t note, uint8_t velocity );
+void chapter_n_note_off( chapter_n_t *chapter_n, uint32_t seq, uint8_t note );
+size_t chapter_n_trim( chapter_n_t *chapter_n, uint32_t checkpoint );
+int chapter_n_has_data( const chapter_n_t *chapter_n );
+size_t chapter_n_pack( const chapter_n_t *chapter_n, unsigned char *packed );
+size_t chapter_n_unpack( const unsigned char *packed, size_t size, chapter_n_t *chapter_n );
+void chapter_n_dump( const chapter_n_t *chapter_n );
 
 #endif
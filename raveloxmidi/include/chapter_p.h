@@ -28,14 +28,14 @@ typedef struct chapter_p_t {
 	uint8_t bank_msb;
 	uint8_t	X;
 	uint8_t bank_lsb;
+	/* Sequence number of the packet that last changed the chapter */
+	uint32_t seq;
 } chapter_p_t;
 #define CHAPTER_P_PACKED_SIZE	3
 
-void chapter_p_pack( const chapter_p_t *chapter_p, unsigned char **packed, size_t *size );
-void chapter_p_unpack( const unsigned char *packed, size_t size, chapter_p_t **chapter_p );
-chapter_p_t *chapter_p_create( void );
-void chapter_p_destroy( chapter_p_t **chapter_p );
-void chapter_p_dump( chapter_p_t *chapter_p );
+size_t chapter_p_pack( const chapter_p_t *chapter_p, unsigned char *packed );
+size_t chapter_p_unpack( const unsigned char *packed, size_t size, chapter_p_t *chapter_p );
+void chapter_p_dump( const chapter_p_t *chapter_p );
 void chapter_p_reset( chapter_p_t *chapter_p );
 
 #endif
@@ -0,0 +1,38 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#ifndef CHAPTER_T_JOURNAL_H
+#define CHAPTER_T_JOURNAL_H
+
+/* Sec A.8 of RFC6295.txt - Channel Aftertouch */
+typedef struct chapter_t_t {
+	uint8_t S;
+	uint8_t pressure;
+	/* Sequence number of the packet that last changed the chapter */
+	uint32_t seq;
+} chapter_t_t;
+#define CHAPTER_T_PACKED_SIZE	1
+
+size_t chapter_t_pack( const chapter_t_t *chapter_t, unsigned char *packed );
+size_t chapter_t_unpack( const unsigned char *packed, size_t size, chapter_t_t *chapter_t );
+void chapter_t_dump( const chapter_t_t *chapter_t );
+void chapter_t_reset( chapter_t_t *chapter_t );
+
+#endif
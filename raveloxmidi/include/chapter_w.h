@@ -0,0 +1,40 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#ifndef CHAPTER_W_JOURNAL_H
+#define CHAPTER_W_JOURNAL_H
+
+/* Sec A.5 of RFC6295.txt - Pitch Wheel */
+typedef struct chapter_w_t {
+	uint8_t S;
+	uint8_t first;
+	uint8_t R;
+	uint8_t second;
+	/* Sequence number of the packet that last changed the chapter */
+	uint32_t seq;
+} chapter_w_t;
+#define CHAPTER_W_PACKED_SIZE	2
+
+size_t chapter_w_pack( const chapter_w_t *chapter_w, unsigned char *packed );
+size_t chapter_w_unpack( const unsigned char *packed, size_t size, chapter_w_t *chapter_w );
+void chapter_w_dump( const chapter_w_t *chapter_w );
+void chapter_w_reset( chapter_w_t *chapter_w );
+
+#endif
@@ -22,19 +22,33 @@
 #define DATA_CONTEXT_H
 
 #include <stdint.h>
-#include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 typedef void (*data_context_destroy_func_t)(void *context_data );
 
+/* Small context data can be kept inside the context itself */
+#define DATA_CONTEXT_INLINE_SIZE	32
+
+#define DATA_CONTEXT_POOL_CACHE_SIZE	32
+#define DATA_CONTEXT_POOL_MAX_ITEMS	1024
+
 typedef struct data_context_t {
 	void *data;
-	uint32_t reference;
-	pthread_mutex_t lock;
+	atomic_uint reference;
 	data_context_destroy_func_t destroy_func;
+	union {
+		uint64_t align;
+		unsigned char bytes[ DATA_CONTEXT_INLINE_SIZE ];
+	} inline_data;
 } data_context_t;
 
+void data_context_init( void );
+void data_context_teardown( void );
+
 data_context_t *data_context_create( data_context_destroy_func_t func);
 void data_context_destroy( data_context_t **context );
+void *data_context_inline_data( data_context_t *context, size_t size );
 
 void data_context_acquire( data_context_t *context );
 void data_context_release( data_context_t **context );
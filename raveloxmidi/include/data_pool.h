@@ -0,0 +1,66 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
+*/
+
+#ifndef DATA_POOL_H
+#define DATA_POOL_H
+
+#include <pthread.h>
+
+/* Free-list allocator for fixed size items.
+   Each thread keeps a small cache of free items so get/put are normally
+   lock-free. When a cache runs dry or overflows, half a cache worth of items
+   moves to or from the shared list under the pool lock. This lets items
+   allocated on one thread and released on another be recycled without
+   going back to the heap */
+
+typedef struct data_pool_item_t {
+	struct data_pool_item_t *next;
+} data_pool_item_t;
+
+typedef struct data_pool_cache_t {
+	struct data_pool_t *pool;
+	data_pool_item_t *items;
+	size_t count;
+	unsigned long gets;
+	unsigned long puts;
+} data_pool_cache_t;
+
+typedef struct data_pool_t {
+	char *name;
+	size_t item_size;
+	size_t cache_size;
+	size_t max_items;
+	pthread_key_t cache_key;
+	pthread_mutex_t lock;
+	data_pool_item_t *items;
+	size_t count;
+	unsigned long gets;
+	unsigned long puts;
+	unsigned long mallocs;
+	unsigned long frees;
+} data_pool_t;
+
+data_pool_t *data_pool_create( const char *name, size_t item_size, size_t cache_size, size_t max_items );
+void data_pool_destroy( data_pool_t **pool );
+void *data_pool_get( data_pool_t *pool );
+void data_pool_put( data_pool_t *pool, void *item );
+void data_pool_stats( data_pool_t *pool );
+
+#endif
@@ -21,39 +21,114 @@
 #ifndef DATA_QUEUE_H
 #define DATA_QUEUE_H
 
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define DATA_QUEUE_CACHE_LINE	64
+
 typedef void (*data_queue_action_func_t)(void *item, void *context );
 
-typedef struct data_queue_item_t {
+/* Called for an item that is discarded instead of being handed to the action */
+typedef void (*data_queue_drop_func_t)(void *item, void *context );
+
+/* Returns non-zero if the item must never be discarded to make room */
+typedef int (*data_queue_keep_func_t)(void *item, void *context );
+
+/* Called instead of the action with every item taken from the queue in one pass */
+typedef void (*data_queue_batch_func_t)(void **items, void **contexts, size_t count );
+
+typedef enum data_queue_policy_t {
+	DATA_QUEUE_POLICY_BLOCK,
+	DATA_QUEUE_POLICY_DROP_NEWEST,
+	DATA_QUEUE_POLICY_DROP_OLDEST
+} data_queue_policy_t;
+
+/* What happens to the item in a cell once the consumer reaches it */
+#define DATA_QUEUE_CELL_DROPPABLE	0
+#define DATA_QUEUE_CELL_KEEP		1
+/* Marked by a producer under the drop oldest policy. The consumer drops it instead of handling it */
+#define DATA_QUEUE_CELL_DROPPED		2
+/* Taken by the consumer or never filled */
+#define DATA_QUEUE_CELL_TAKEN		3
+
+/* Bounded multi-producer single-consumer ring.
+   Each cell carries a sequence number that says whether it is free for the
+   producer at that position or holds data for the consumer at that position */
+typedef struct data_queue_cell_t {
+	atomic_size_t sequence;
+	atomic_uchar state;
 	void *data;
 	void *context;
-	struct data_queue_item_t *next;
-} data_queue_item_t;
+} data_queue_cell_t;
 
 typedef struct data_queue_t {
-        char *name;
-        data_queue_item_t *top;
-	data_queue_item_t *bottom;
-	unsigned char state;
-	unsigned char shutdown;
-        pthread_mutex_t lock;
-        data_queue_action_func_t action;
+	atomic_size_t enqueue_pos;
+	char enqueue_pad[ DATA_QUEUE_CACHE_LINE - sizeof( atomic_size_t ) ];
+
+	atomic_size_t dequeue_pos;
+	char dequeue_pad[ DATA_QUEUE_CACHE_LINE - sizeof( atomic_size_t ) ];
+
+	data_queue_cell_t *cells;
+	size_t capacity;
+	size_t mask;
+	data_queue_policy_t policy;
+
+	char *name;
+	data_queue_action_func_t action;
+	data_queue_drop_func_t drop;
+	data_queue_keep_func_t keep;
 	pthread_t queue_thread;
-	unsigned long counter;
-	pthread_cond_t data_signal;
+	atomic_uchar shutdown;
+
+	/* Batch mode. Only the consumer thread touches these once the queue is started */
+	data_queue_batch_func_t batch;
+	size_t batch_max;
+	long batch_linger;
+	void **batch_items;
+	void **batch_contexts;
+	unsigned long batches;
+	unsigned long batched_items;
+
+	/* The consumer sleeps on wake_fd only when the queue is empty */
+	int wake_fd;
+	atomic_int waiting;
+
+	/* Producers wait here for space under the block policy */
+	pthread_mutex_t space_lock;
+	pthread_cond_t space_signal;
+	atomic_int blocked;
+
+	atomic_size_t high_water;
+	atomic_ulong dropped;
 } data_queue_t;
 
 
 /* Public functions */
-data_queue_t * data_queue_create( const char *name, data_queue_action_func_t action );
+data_queue_t * data_queue_create( const char *name, data_queue_action_func_t action, size_t capacity, data_queue_policy_t policy );
+void data_queue_set_drop( data_queue_t *queue, data_queue_drop_func_t drop, data_queue_keep_func_t keep );
+int data_queue_set_batch( data_queue_t *queue, data_queue_batch_func_t batch, size_t max_items, long linger );
 void data_queue_destroy( data_queue_t **queue );
-void data_queue_add( data_queue_t *queue, void *data, void *context);
+int data_queue_add( data_queue_t *queue, void *data, void *context);
 void data_queue_stop( data_queue_t *queue );
 void data_queue_join( data_queue_t *queue );
 void data_queue_start( data_queue_t *queue );
 
+size_t data_queue_depth( data_queue_t *queue );
+size_t data_queue_high_water( data_queue_t *queue );
+unsigned long data_queue_dropped( data_queue_t *queue );
+
+data_queue_policy_t data_queue_policy_from_string( const char *value );
+
 #define DATA_QUEUE_SHUTDOWN 1
 #define DATA_QUEUE_CONTINUE 0
 
-#define DATA_QUEUE_EMPTY	0
-#define DATA_QUEUE_USED		1
+#define DATA_QUEUE_ADDED	0
+#define DATA_QUEUE_DROPPED	-1
+
+#define DATA_QUEUE_DEFAULT_CAPACITY	1024
+#define DATA_QUEUE_DEFAULT_BATCH	64
+
+/* Longest a producer waits, in microseconds, for the consumer to reach an item dropped to make room for it */
+#define DATA_QUEUE_DROP_WAIT	1000
 #endif
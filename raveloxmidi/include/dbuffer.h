@@ -40,6 +40,11 @@ size_t dbuffer_len( dbuffer_t *dbuffer );
 size_t dbuffer_write( dbuffer_t *dbuffer, const char *in_buffer, size_t in_buffer_len );
 size_t dbuffer_read( dbuffer_t *dbuffer, char **out_buffer );
 
+void dbuffer_lock( dbuffer_t *dbuffer );
+void dbuffer_unlock( dbuffer_t *dbuffer );
+size_t dbuffer_write_unlocked( dbuffer_t *dbuffer, const char *in_buffer, size_t in_buffer_len );
+void dbuffer_clear_unlocked( dbuffer_t *dbuffer );
+
 #define DBUFFER_DEFAULT_BLOCK_SIZE	512
 
 #endif
@@ -0,0 +1,71 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
+*/
+
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Open addressing map from a 32 bit key to a pointer. Several items may share a key.
+   Writers are serialised by the index lock. Readers take no lock: they check the
+   sequence counter before and after probing and try again if a writer got in between.
+   Tables replaced when the index grows are kept until the index is destroyed so a
+   reader can never touch freed memory. Items must outlive the index */
+typedef struct hash_index_slot_t {
+	atomic_uint_least32_t key;
+	_Atomic( void * ) data;
+} hash_index_slot_t;
+
+typedef struct hash_index_table_t {
+	size_t size;
+	size_t mask;
+	struct hash_index_table_t *retired;
+	hash_index_slot_t *slots;
+} hash_index_table_t;
+
+typedef struct hash_index_t {
+	char *name;
+	atomic_uint seq;
+	_Atomic( hash_index_table_t * ) table;
+	size_t count;
+	pthread_mutex_t lock;
+} hash_index_t;
+
+/* Returns non-zero if data is the item being looked for */
+typedef int (*hash_index_match_t)( void *data, const void *arg );
+
+#define HASH_INDEX_DEFAULT_SIZE	64
+
+hash_index_t *hash_index_create( const char *name, size_t size );
+void hash_index_destroy( hash_index_t **index );
+
+int hash_index_insert( hash_index_t *index, uint32_t key, void *data );
+int hash_index_remove( hash_index_t *index, uint32_t key, void *data );
+void *hash_index_find( hash_index_t *index, uint32_t key, hash_index_match_t match, const void *arg );
+
+size_t hash_index_count( hash_index_t *index );
+uint32_t hash_index_string_key( const char *string );
+
+void hash_index_dump( hash_index_t *index );
+
+#endif
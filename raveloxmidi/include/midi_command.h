@@ -62,6 +62,9 @@ typedef struct midi_message_t {
 	unsigned char len;
 } midi_message_t;
 
+/* Enough for every channel voice and system common message. Only SysEx data goes on the heap */
+#define MIDI_COMMAND_INLINE_SIZE	8
+
 typedef struct midi_command_t {
 	uint64_t	delta;
 	union {
@@ -71,8 +74,15 @@ typedef struct midi_command_t {
 	};
 	size_t data_len;
 	unsigned char *data;
+	unsigned char inline_data[ MIDI_COMMAND_INLINE_SIZE ];
 } midi_command_t;
 
+#define MIDI_COMMAND_POOL_CACHE_SIZE	64
+#define MIDI_COMMAND_POOL_MAX_ITEMS	4096
+
+void midi_command_init( void );
+void midi_command_teardown( void );
+
 midi_command_t *midi_command_create(void);
 void midi_command_destroy( void **data );
 void midi_command_reset( midi_command_t *command );
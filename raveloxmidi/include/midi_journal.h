@@ -21,13 +21,27 @@
 #ifndef MIDI_JOURNAL_H
 #define MIDI_JOURNAL_H
 
+#include <stdint.h>
+
 #include "midi_note.h"
 #include "midi_control.h"
 #include "midi_program.h"
+#include "net_applemidi.h"
+
+/* 128 bit maps indexed by note or controller number */
+#define JOURNAL_MAP_SIZE	128
+#define JOURNAL_MAP_WORDS	( JOURNAL_MAP_SIZE / 64 )
+#define JOURNAL_MAP_SET(map,n)		( (map)[ (n) >> 6 ] |= ( (uint64_t)1 << ( (n) & 63 ) ) )
+#define JOURNAL_MAP_CLEAR(map,n)	( (map)[ (n) >> 6 ] &= ~( (uint64_t)1 << ( (n) & 63 ) ) )
+#define JOURNAL_MAP_TEST(map,n)		( ( (map)[ (n) >> 6 ] >> ( (n) & 63 ) ) & 1 )
 
 #include "chapter_p.h"
 #include "chapter_n.h"
 #include "chapter_c.h"
+#include "chapter_m.h"
+#include "chapter_w.h"
+#include "chapter_t.h"
+#include "chapter_a.h"
 
 typedef struct journal_header_t {
 	uint8_t	bitfield; // SYAH
@@ -38,7 +52,7 @@ typedef struct journal_header_t {
 
 typedef struct channel_header_t {
 	unsigned char	S:1;
-	unsigned char	chan:4;
+	unsigned char	chan:5; // Channel number + 1. 0 means the channel is not in use
 	unsigned char	H:1;
 	unsigned int	len:10;
 	uint8_t		bitfield; // PCMWNETA
@@ -55,18 +69,41 @@ typedef struct channel_header_t {
 #define CHAPTER_T	0x02
 #define CHAPTER_A	0x01
 
+/* Chapters are held in place and packed straight into the journal */
 typedef struct channel_t {
-	channel_header_t *header;
-	chapter_p_t *chapter_p;
-	chapter_n_t *chapter_n;
-	chapter_c_t *chapter_c;
+	channel_header_t header;
+	chapter_p_t chapter_p;
+	chapter_c_t chapter_c;
+	chapter_n_t chapter_n;
+	chapter_m_t chapter_m;
+	chapter_w_t chapter_w;
+	chapter_t_t chapter_t;
+	chapter_a_t chapter_a;
 } channel_t;
 
 #define MAX_MIDI_CHANNELS	16
 
+#define CHANNEL_MAX_PACKED_SIZE	( CHANNEL_HEADER_PACKED_SIZE + CHAPTER_P_PACKED_SIZE + CHAPTER_C_MAX_PACKED_SIZE + CHAPTER_M_MAX_PACKED_SIZE + \
+				CHAPTER_W_PACKED_SIZE + CHAPTER_N_MAX_PACKED_SIZE + CHAPTER_T_PACKED_SIZE + CHAPTER_A_MAX_PACKED_SIZE )
+
+/* The journal goes in the same datagram as the RTP header and the MIDI list so it is capped to leave room for some commands.
+   A journal that doesn't fit is sent as a header with no channel journals */
+#define JOURNAL_MIDI_LIST_RESERVE	256
+#define JOURNAL_MAX_PACKED_SIZE	( NET_APPLEMIDI_UDPSIZE - JOURNAL_MIDI_LIST_RESERVE )
+
+/* The journal for a connection is a single fixed size block. Nothing in it is allocated separately */
 typedef struct journal_t {
-	journal_header_t *header;
-	channel_t *channels[MAX_MIDI_CHANNELS];
+	journal_header_t header;
+	channel_t channels[MAX_MIDI_CHANNELS];
+	/* Set when anything changed since the journal was last packed */
+	unsigned char dirty;
+	/* Set by journal_request_reset() and journal_request_trim(). The work is done by the next pack or add */
+	unsigned char reset_pending;
+	unsigned char trim_pending;
+	uint32_t trim_checkpoint;
+	/* The journal as it was last packed */
+	size_t packed_len;
+	unsigned char packed[ JOURNAL_MAX_PACKED_SIZE ];
 } journal_t;
 
 #define JOURNAL_HEADER_S_FLAG	0x08
@@ -74,31 +111,27 @@ typedef struct journal_t {
 #define JOURNAL_HEADER_A_FLAG	0x02
 #define JOURNAL_HEADER_H_FLAG	0x01
 
-void channel_header_pack( const channel_header_t *header , unsigned char **packed , size_t *size );
-void channel_header_destroy( channel_header_t **header );
-channel_header_t * channel_header_create( void );
-void channel_pack( channel_t *channel, char **packed, size_t *size );
-void channel_destroy( channel_t **channel );
-channel_t * channel_create( void );
-
-void journal_header_pack( const journal_header_t *header , char **packed , size_t *size );
-journal_header_t * journal_header_create( void );
-void journal_header_destroy( journal_header_t **header );
-void journal_pack( journal_t *journal, char **packed, size_t *size );
+void journal_pack( journal_t *journal, const char **packed, size_t *size );
 int journal_init( journal_t **journal );
 void journal_destroy( journal_t **journal );
-void channel_header_dump( channel_header_t *header );
+void channel_header_dump( const channel_header_t *header );
 void channel_header_reset( channel_header_t *header );
-void channel_journal_dump( channel_t *channel );
+void channel_journal_dump( const channel_t *channel );
 void channel_journal_reset( channel_t *channel );
-int journal_has_data( journal_t *journal );
-void journal_header_dump( journal_header_t *header );
+int journal_has_data( const journal_t *journal );
+void journal_header_dump( const journal_header_t *header );
 void journal_header_reset( journal_header_t *header );
-void journal_dump( journal_t *journal );
+void journal_dump( const journal_t *journal );
 void journal_reset( journal_t *journal );
-
-void midi_journal_add_note( journal_t *journal, uint32_t seq, const midi_note_t *midi_note );
-void midi_journal_add_control( journal_t *journal, uint32_t seq, const midi_control_t *midi_control );
-void midi_journal_add_program( journal_t *journal, uint32_t seq, const midi_program_t *midi_program );
+void journal_request_reset( journal_t *journal );
+void journal_trim( journal_t *journal, uint32_t checkpoint );
+void journal_request_trim( journal_t *journal, uint32_t checkpoint );
+
+void midi_journal_add_note( journal_t *journal, uint32_t seq, const midi_command_t *command );
+void midi_journal_add_control( journal_t *journal, uint32_t seq, const midi_command_t *command );
+void midi_journal_add_program( journal_t *journal, uint32_t seq, const midi_command_t *command );
+void midi_journal_add_pitch_bend( journal_t *journal, uint32_t seq, const midi_command_t *command );
+void midi_journal_add_channel_pressure( journal_t *journal, uint32_t seq, const midi_command_t *command );
+void midi_journal_add_poly_pressure( journal_t *journal, uint32_t seq, const midi_command_t *command );
 
 #endif
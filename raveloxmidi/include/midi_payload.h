@@ -42,6 +42,14 @@ typedef struct midi_payload_t {
 	unsigned char	*buffer;
 } midi_payload_t;
 
+/* MIDI list and journal locations for a payload that is still in the receive buffer */
+typedef struct midi_payload_view_t {
+	midi_payload_header_t header;
+	unsigned char	*buffer;
+	unsigned char	*journal;
+	size_t	journal_len;
+} midi_payload_view_t;
+
 typedef enum midi_payload_data_t {
 	MIDI_PAYLOAD_STREAM = 0,
 	MIDI_PAYLOAD_RTP
@@ -64,5 +72,6 @@ void midi_payload_set_buffer( midi_payload_t *payload, unsigned char *buffer , s
 void midi_payload_header_dump( midi_payload_header_t *header );
 void midi_payload_pack( midi_payload_t *payload, unsigned char **buffer, size_t *buffer_size);
 void midi_payload_unpack( midi_payload_t **payload, unsigned char *buffer, size_t buffer_size);
+int midi_payload_view_unpack( midi_payload_view_t *view, unsigned char *buffer, size_t buffer_len );
 void midi_command_to_payload( const midi_command_t *command, midi_payload_t **payload );
 #endif
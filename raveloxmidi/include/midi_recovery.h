@@ -0,0 +1,62 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#ifndef MIDI_RECOVERY_H
+#define MIDI_RECOVERY_H
+
+#include <stdint.h>
+
+#include "midi_journal.h"
+
+/* What the receiver has played on a channel so far */
+typedef struct midi_recovery_channel_t {
+	uint64_t	notes[ JOURNAL_MAP_WORDS ];
+	uint64_t	controllers[ JOURNAL_MAP_WORDS ];
+	uint8_t		value[ MAX_CHAPTER_C_CONTROLLERS ];
+	uint8_t		program_known;
+	uint8_t		program;
+	uint8_t		bank_msb;
+	uint8_t		bank_lsb;
+} midi_recovery_channel_t;
+
+/* Receiver side of the recovery journal for an inbound RTP MIDI session */
+typedef struct midi_recovery_t {
+	uint8_t		seq_valid;
+	uint16_t	seq;
+	midi_recovery_channel_t channels[ MAX_MIDI_CHANNELS ];
+	uint64_t	lost;
+	uint64_t	repaired;
+} midi_recovery_t;
+
+/* Largest list midi_recovery_repair() can produce. Each command is at most 3 bytes plus a 1 byte delta */
+#define MIDI_RECOVERY_MAX_COMMANDS	( MAX_MIDI_CHANNELS * ( JOURNAL_MAP_SIZE + MAX_CHAPTER_C_CONTROLLERS + 3 ) )
+#define MIDI_RECOVERY_MAX_LIST_SIZE	( ( MIDI_RECOVERY_MAX_COMMANDS * 4 ) + 1 )
+
+midi_recovery_t *midi_recovery_create( void );
+void midi_recovery_destroy( midi_recovery_t **recovery );
+void midi_recovery_reset( midi_recovery_t *recovery );
+
+void midi_recovery_track( midi_recovery_t *recovery, uint8_t status, const uint8_t *data, size_t data_len );
+int midi_recovery_check( midi_recovery_t *recovery, uint16_t seq );
+size_t midi_recovery_repair( midi_recovery_t *recovery, const unsigned char *journal, size_t journal_len, char z_flag, unsigned char *list, size_t list_size );
+
+void midi_recovery_dump( const midi_recovery_t *recovery );
+
+#endif
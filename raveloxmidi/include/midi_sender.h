@@ -26,6 +26,8 @@
 typedef struct midi_sender_context_t {
 	uint32_t ssrc;
 	int	alsa_card_hash;
+	/* Arrival time of the data the command was parsed from, in time_in_microseconds() units */
+	long	timestamp;
 } midi_sender_context_t;
 
 void midi_sender_init( void );
@@ -34,7 +36,7 @@ void midi_sender_stop( void );
 void midi_sender_teardown( void );
 
 void midi_sender_send_from_state( midi_state_t *state, void *context);
-void midi_sender_send_single( midi_command_t *command, uint32_t originator_ssrc , int originator_device_hash );
+void midi_sender_send_single( midi_command_t *command, uint32_t originator_ssrc , int originator_device_hash, long timestamp );
 
 void midi_sender_add( void *data, data_context_t *context );
 
@@ -25,9 +25,10 @@
 #include <pthread.h>
 
 #include "data_table.h"
-#include "ring_buffer.h"
+#include "spsc_ring.h"
 #include "dbuffer.h"
 #include "data_context.h"
+#include "midi_recovery.h"
 
 typedef enum midi_state_status_t {
 	MIDI_STATE_INIT,
@@ -42,11 +43,13 @@ typedef enum midi_state_status_t {
 typedef struct midi_state_t {
 	midi_state_status_t status;
 	unsigned char running_status;
-	ring_buffer_t *ring;
+	spsc_ring_t *ring;
 	dbuffer_t *hold;
 	pthread_mutex_t lock;
 	uint64_t	current_delta;
 	uint8_t	partial_sysex;
+	/* Only set for connections that use the recovery journal in inbound packets */
+	midi_recovery_t *recovery;
 } midi_state_t;
 
 midi_state_t *midi_state_create( size_t size );
@@ -64,6 +67,7 @@ void midi_state_reset( midi_state_t *state );
 void midi_state_dump( midi_state_t *state );
 
 void midi_state_send( midi_state_t *state, data_context_t *context, char mode, char z_flag);
+void midi_state_recover( midi_state_t *state, uint16_t seq, const unsigned char *journal, size_t journal_len, char z_flag );
 
 #define MIDI_PARSE_MODE_SIMPLE	0
 #define MIDI_PARSE_MODE_RTP	1
@@ -22,6 +22,7 @@
 #define NET_APPLEMIDI_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define NET_APPLEMIDI_DONE	0
 #define NET_APPLEMIDI_NEED_DATA	1
@@ -89,6 +90,12 @@ int net_applemidi_unpack( net_applemidi_command **command_buffer, unsigned char
 int net_applemidi_pack( net_applemidi_command *command_buffer, unsigned char **out_buffer, size_t *out_buffer_len );
 net_applemidi_command * net_applemidi_cmd_create( uint16_t command );
 
+size_t net_applemidi_pack_inv( unsigned char *buffer, size_t buffer_size, uint16_t command, const net_applemidi_inv *inv );
+size_t net_applemidi_pack_sync( unsigned char *buffer, size_t buffer_size, const net_applemidi_sync *sync );
+size_t net_applemidi_pack_feedback( unsigned char *buffer, size_t buffer_size, const net_applemidi_feedback *feedback );
+size_t net_applemidi_pack_bitrate( unsigned char *buffer, size_t buffer_size, const net_applemidi_bitrate *bitrate );
+size_t net_applemidi_pack_buffer( uint16_t command, const void *data, unsigned char *buffer, size_t buffer_size );
+
 void net_applemidi_inv_destroy( net_applemidi_inv **inv );
 
 #endif
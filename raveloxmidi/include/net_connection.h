@@ -31,9 +31,16 @@
 #include "rtp_packet.h"
 #include "midi_journal.h"
 #include "midi_state.h"
+#include "net_socket.h"
 
-// Maximum number of connection entries in the connection table
-#define MAX_CTX 8
+// Connection contexts are allocated this many at a time. The first slab is allocated at startup
+#define NET_CTX_SLAB_SIZE	32
+
+// Largest LIST reply. It is sent as a single UDP datagram
+#define NET_CTX_LIST_MAX_SIZE	65507
+
+// Longest session name kept for a connection, including the terminator. Longer names are truncated
+#define NET_CTX_NAME_SIZE	256
 
 #define USE_DATA_PORT	0
 #define USE_CONTROL_PORT	1
@@ -46,6 +53,16 @@ typedef enum net_ctx_status_t {
 	NET_CTX_STATUS_UNUSED,
 } net_ctx_status_t;
 
+/* Receiver feedback (RS) state for inbound RTP. Times are in time_in_microseconds() units */
+typedef struct net_ctx_feedback_t {
+	int		active;
+	uint16_t	seq;
+	unsigned int	pending;
+	unsigned int	packets;
+	long		interval;
+	long		due;
+} net_ctx_feedback_t;
+
 typedef struct net_ctx_t {
 	net_ctx_status_t	status;
 	uint32_t	ssrc;
@@ -59,20 +76,43 @@ typedef struct net_ctx_t {
 	struct sockaddr_storage data_address;
 	socklen_t	data_address_len;
 	long		start;
-	char * 		ip_address;
-	char *		name;
+	/* Fixed buffers so a reader without the lock never sees them freed. The last byte is never written */
+	char		ip_address[ INET6_ADDRSTRLEN ];
+	char		name[ NET_CTX_NAME_SIZE ];
 	journal_t	*journal;
 	midi_state_t	*midi_state;
 	pthread_mutex_t	lock;
+	/* Serialises inbound MIDI for the connection across receive workers */
+	pthread_mutex_t	receive_lock;
+	/* Protected by lock */
+	net_ctx_feedback_t	feedback;
+	/* Next unused context. Protected by the connections lock */
+	struct net_ctx_t	*next_free;
 } net_ctx_t;
 
+/* Immutable list of the connections that are in use. A new one is published whenever a
+   connection is registered or reset. Readers hold it through a hazard pointer so it is
+   never freed underneath them */
+typedef struct net_ctx_snapshot_t {
+	size_t count;
+	net_ctx_t **ctx;
+	/* Only used by the writer to keep replaced snapshots until no reader holds them */
+	struct net_ctx_snapshot_t *retired;
+} net_ctx_snapshot_t;
+
+/* Enough slots for every thread that reads a snapshot: the receive workers plus the main loop,
+   the sender queue and the ALSA listener, with one to spare */
+#define NET_CTX_SNAPSHOT_HAZARDS	( NET_SOCKET_MAX_WORKERS + 4 )
+
 net_ctx_t *net_ctx_create( void );
 void net_ctx_reset( net_ctx_t *ctx );
-void net_ctx_destroy( void **data );
+void net_ctx_destroy( net_ctx_t *ctx );
 void net_ctx_dump( void *data );
 void net_ctx_dump_all( void );
 void net_ctx_lock( net_ctx_t *ctx );
 void net_ctx_unlock( net_ctx_t *ctx );
+void net_ctx_receive_lock( net_ctx_t *ctx );
+void net_ctx_receive_unlock( net_ctx_t *ctx );
 void net_connections_lock( void );
 void net_connections_unlock( void );
 void net_ctx_init( void );
@@ -84,20 +124,27 @@ net_ctx_t * net_ctx_find_by_name( char *name );
 net_ctx_t * net_ctx_register( uint32_t ssrc, uint32_t initiator, const char *ip_address, uint16_t port , const char *name);
 const char *net_ctx_status_to_string( net_ctx_status_t status );
 
-void net_ctx_add_journal_note( net_ctx_t *ctx, const midi_note_t *midi_note );
-void net_ctx_add_journal_control( net_ctx_t *ctx, const midi_control_t *midi_control );
-void net_ctx_add_journal_program( net_ctx_t *ctx, const midi_program_t *midi_program );
+void net_ctx_add_journal_note( net_ctx_t *ctx, const midi_command_t *command );
+void net_ctx_add_journal_control( net_ctx_t *ctx, const midi_command_t *command );
+void net_ctx_add_journal_program( net_ctx_t *ctx, const midi_command_t *command );
+void net_ctx_add_journal_pitch_bend( net_ctx_t *ctx, const midi_command_t *command );
+void net_ctx_add_journal_channel_pressure( net_ctx_t *ctx, const midi_command_t *command );
+void net_ctx_add_journal_poly_pressure( net_ctx_t *ctx, const midi_command_t *command );
 
 void net_ctx_journal_dump( net_ctx_t *ctx);
-void net_ctx_journal_pack( net_ctx_t *ctx, char **journal_buffer, size_t *journal_buffer_size);
+void net_ctx_journal_pack( net_ctx_t *ctx, const char **journal_buffer, size_t *journal_buffer_size);
 void net_ctx_journal_reset( net_ctx_t *ctx );
-void net_ctx_update_rtp_fields( const net_ctx_t *ctx, rtp_packet_t *rtp_packet);
+void net_ctx_journal_trim( net_ctx_t *ctx, uint16_t rtp_seq );
+void net_ctx_update_rtp_fields( const net_ctx_t *ctx, rtp_packet_t *rtp_packet, long timestamp );
 void net_ctx_send( net_ctx_t *ctx, unsigned char *buffer, size_t buffer_len , int use_control );
+socklen_t net_ctx_get_address( net_ctx_t *ctx, int use_control, struct sockaddr_storage *address );
 void net_ctx_increment_seq( net_ctx_t *ctx );
+midi_state_t *net_ctx_get_midi_state( net_ctx_t *ctx );
 
-net_ctx_t *net_ctx_find_by_index( int index );
 int net_ctx_is_used( const net_ctx_t *ctx );
-int net_ctx_get_num_connections( void );
+
+const net_ctx_snapshot_t *net_ctx_snapshot_acquire( int *hazard );
+void net_ctx_snapshot_release( int hazard );
 
 char *net_ctx_connections_to_string( void );
 
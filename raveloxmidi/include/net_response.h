@@ -23,15 +23,29 @@
 
 #include <stdint.h>
 
+#include "net_applemidi.h"
+
 typedef struct net_response_t {
         unsigned char *buffer;
         size_t len;
 } net_response_t;
 
+/* Fixed size response that can live on the stack. Nothing is allocated to build or send it */
+#define NET_RESPONSE_BUFFER_SIZE	NET_APPLEMIDI_UDPSIZE
+
+typedef struct net_response_buffer_t {
+	unsigned char buffer[ NET_RESPONSE_BUFFER_SIZE ];
+	size_t len;
+} net_response_buffer_t;
+
 net_response_t * net_response_create( void ); 
 void net_response_destroy( net_response_t **response );
 
 net_response_t *net_response_inv( uint32_t ssrc, uint32_t initiator, const char *name);
 net_response_t *net_response_sync( uint32_t send_ssrc , long start_time);
 
+size_t net_response_inv_pack( net_response_buffer_t *response, uint16_t command, uint32_t ssrc, uint32_t initiator, const char *name );
+size_t net_response_sync_pack( net_response_buffer_t *response, uint32_t send_ssrc, long start_time );
+size_t net_response_feedback_pack( net_response_buffer_t *response, uint32_t ssrc, uint16_t rtp_seq );
+
 #endif
@@ -23,6 +23,9 @@
 
 #include "config.h"
 
+#include <sys/socket.h>
+#include <time.h>
+
 #ifdef HAVE_ALSA
 #include "raveloxmidi_alsa.h"
 #endif
@@ -43,10 +46,25 @@ typedef struct raveloxmidi_socket_t {
 	size_t packet_size;
 	midi_state_t *state;
 	pthread_mutex_t	lock;
+	/* One of NET_SOCKET_CONTROL_PORT, NET_SOCKET_DATA_PORT, NET_SOCKET_LOCAL_PORT or NET_SOCKET_NO_ROLE */
+	int role;
+	/* Event loop the fd is registered with */
+	int loop_fd;
 	int device_hash;
 #ifdef HAVE_ALSA
 	snd_rawmidi_t	*handle;
 #endif
+	/* Batched receive buffers. Only set up for the control and data sockets */
+	size_t batch_size;
+	unsigned char *batch_buffer;
+	struct mmsghdr *batch_msgs;
+	struct iovec *batch_iov;
+	struct sockaddr_storage *batch_addrs;
+	/* Ancillary data for each datagram in the batch. Holds the kernel receive timestamp */
+	unsigned char *batch_control;
+	/* Read statistics: number of wakeups and the number of datagrams they returned */
+	unsigned long read_count;
+	unsigned long packet_count;
 } raveloxmidi_socket_t;
 
 void net_socket_lock( raveloxmidi_socket_t *raveloxmidi_socket );
@@ -70,7 +88,7 @@ int net_socket_get_data_socket( void );
 int net_socket_get_control_socket( void );
 int net_socket_get_local_socket( void );
 
-void net_socket_set_fds( void );
+void net_socket_loop_remove( int fd );
 int net_socket_get_shutdown_fd( void );
 
 int net_socket_read( int fd );
@@ -81,10 +99,24 @@ void net_socket_dump( void * );
 #define NET_SOCKET_CONTROL_PORT 0
 #define NET_SOCKET_DATA_PORT 1
 #define NET_SOCKET_LOCAL_PORT 2
+#define NET_SOCKET_NO_ROLE -1
 
 #define DEFAULT_BLOCK_SIZE 2048
 #define NET_SOCKET_DEFAULT_RING_BUFFER	10240
 
+#define NET_SOCKET_DEFAULT_BATCH_SIZE	8
+#define NET_SOCKET_MAX_BATCH_SIZE	64
+
+#define NET_SOCKET_MAX_EVENTS	32
+
+/* Space for the SO_TIMESTAMPNS control message on a received datagram */
+#define NET_SOCKET_CONTROL_SIZE	CMSG_SPACE( sizeof( struct timespec ) )
+
+#define NET_SOCKET_MAX_WORKERS	16
+
+/* Upper limit on the number of fds that can be looked up directly */
+#define NET_SOCKET_MAX_INDEX	65536
+
 #define OK		0
 #define SHUTDOWN	1
 #endif
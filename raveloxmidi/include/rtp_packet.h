@@ -39,7 +39,15 @@ typedef struct rtp_packet_t {
 	void *payload;
 } rtp_packet_t;
 
+/* Header fields and payload location for an RTP packet that is still in the receive buffer */
+typedef struct rtp_packet_view_t {
+	rtp_packet_header_t header;
+	size_t payload_len;
+	unsigned char *payload;
+} rtp_packet_view_t;
+
 #define RTP_VERSION 2
+#define RTP_HEADER_SIZE	12
 
 #define RTP_DYNAMIC_PAYLOAD_97	97
 
@@ -48,5 +56,6 @@ void rtp_packet_destroy( rtp_packet_t **packet );
 int rtp_packet_pack( rtp_packet_t *packet, unsigned char **out_buffer, size_t *out_buffer_len );
 void rtp_packet_unpack( unsigned char *buffer, size_t buffer_len, rtp_packet_t *rtp_packet );
 void rtp_packet_dump( rtp_packet_t *packet );
+int rtp_packet_view_unpack( unsigned char *buffer, size_t buffer_len, rtp_packet_view_t *view );
 
 #endif
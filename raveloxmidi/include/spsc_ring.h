@@ -0,0 +1,74 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
+*/
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define SPSC_RING_CACHE_LINE	64
+
+/* Single producer, single consumer byte ring.
+   head and tail are free running counters; the capacity is a power of two so
+   the position in data is the counter masked with size - 1.
+   Each side only writes its own counter and keeps its view of the other in
+   its own cache line: the producer only reloads tail when the ring looks full
+   and the consumer loads head once per peek */
+typedef struct spsc_ring_t
+{
+	/* Producer */
+	atomic_size_t head;
+	size_t tail_cache;
+	char producer_pad[ SPSC_RING_CACHE_LINE - sizeof( atomic_size_t ) - sizeof( size_t ) ];
+
+	/* Consumer */
+	atomic_size_t tail;
+	size_t head_cache;
+	char consumer_pad[ SPSC_RING_CACHE_LINE - sizeof( atomic_size_t ) - sizeof( size_t ) ];
+
+	size_t size;
+	size_t mask;
+	unsigned char *data;
+} spsc_ring_t;
+
+typedef struct spsc_ring_span_t
+{
+	const unsigned char *data;
+	size_t len;
+} spsc_ring_span_t;
+
+spsc_ring_t *spsc_ring_create( size_t size );
+void spsc_ring_destroy( spsc_ring_t **ring );
+void spsc_ring_reset( spsc_ring_t *ring );
+
+size_t spsc_ring_get_size( const spsc_ring_t *ring );
+size_t spsc_ring_used( spsc_ring_t *ring );
+
+/* Producer side */
+size_t spsc_ring_write( spsc_ring_t *ring, const void *data, size_t len );
+
+/* Consumer side */
+size_t spsc_ring_peek_spans( spsc_ring_t *ring, spsc_ring_span_t spans[2] );
+void spsc_ring_commit( spsc_ring_t *ring, size_t len );
+
+void spsc_ring_dump( spsc_ring_t *ring );
+
+#endif
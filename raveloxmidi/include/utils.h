@@ -24,6 +24,7 @@
 #include <netinet/in.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <time.h>
 
 uint64_t ntohll(const uint64_t value);
 uint64_t htonll(const uint64_t value);
@@ -43,6 +44,7 @@ int get_sock_info( char *ip_address, int port, struct sockaddr *socket, socklen_
 
 int random_number( void );
 long time_in_microseconds( void );
+long time_from_timespec( const struct timespec *ts );
 
 void utils_lock( void );
 void utils_unlock( void );
@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 #include <errno.h>
 extern int errno;
@@ -39,11 +41,25 @@ extern int errno;
 
 #include "utils.h"
 
+/* Earliest time any connection has an RS waiting. The receive loops only look at the
+   connections once it has passed. LONG_MAX when nothing is waiting */
+static atomic_long feedback_next_due = LONG_MAX;
+
+/* Bring the earliest due time forward if due is sooner */
+static void applemidi_feedback_lower_due( long due )
+{
+	long current = atomic_load( &feedback_next_due );
+
+	while( due < current )
+	{
+		if( atomic_compare_exchange_weak( &feedback_next_due, &current, due ) ) break;
+	}
+}
+
 void applemidi_feedback_responder( void *data )
 {
 	net_applemidi_feedback  *feedback;
 	net_ctx_t *ctx;
-	uint32_t seq = 0;
 
 	if( ! data ) return;
 
@@ -57,48 +73,174 @@ void applemidi_feedback_responder( void *data )
 		return;
 	}
 
+	logging_printf( LOGGING_DEBUG, "applemidi_feedback_responder: Context found ( search=%u )\n", feedback->rtp_seq[1] );
+
+	// Only the journal entries for packets after the acknowledged one need to be kept
+	net_ctx_journal_trim( ctx, feedback->rtp_seq[1] );
+}
+
+/* Pack an RS packet to acknowledge rtp_seq from ssrc */
+size_t applemidi_feedback_pack( net_response_buffer_t *response, uint32_t ssrc, uint16_t rtp_seq )
+{
+	return net_response_feedback_pack( response, ssrc, rtp_seq );
+}
+
+static void applemidi_feedback_send( net_ctx_t *ctx, uint32_t ssrc, uint16_t rtp_seq )
+{
+	net_response_buffer_t response;
+	struct sockaddr_storage address;
+	socklen_t address_len = 0;
+	ssize_t bytes_written = 0;
+
+	address_len = net_ctx_get_address( ctx, USE_DATA_PORT, &address );
+	if( address_len == 0 ) return;
+
+	if( applemidi_feedback_pack( &response, ssrc, rtp_seq ) == 0 ) return;
+
+	bytes_written = sendto( net_socket_get_data_socket(), response.buffer, response.len, MSG_DONTWAIT, (struct sockaddr *)&address, address_len );
+	logging_printf( LOGGING_DEBUG, "applemidi_feedback_send: feedback write(bytes=%zd,ssrc=0x%08x,seq=%u)\n", bytes_written, ssrc, rtp_seq );
+}
+
+/* Record an inbound RTP sequence number for the connection.
+   An RS is sent once feedback.packets packets are waiting or straight away if there is a gap in the sequence.
+   Otherwise applemidi_feedback_flush_due() sends it when feedback.interval has passed */
+void applemidi_feedback_schedule( net_ctx_t *ctx, uint16_t rtp_seq )
+{
+	net_ctx_feedback_t *feedback = NULL;
+	uint32_t ssrc = 0;
+	int send_gap = 0;
+	int send_now = 0;
+	uint16_t gap_seq = 0;
+	uint16_t send_seq = 0;
+	long now = 0;
+	long due = LONG_MAX;
+
+	if( ! ctx ) return;
+
+	now = time_in_microseconds();
+
 	net_ctx_lock( ctx );
-	seq = ctx->seq;
-	net_ctx_unlock( ctx );
 
-	logging_printf( LOGGING_DEBUG, "applemidi_feedback_responder: Context found ( search=%u, found=%u )\n", feedback->rtp_seq[1], seq );
-	if( feedback->rtp_seq[1] >= seq )
+	feedback = &(ctx->feedback);
+	ssrc = ctx->ssrc;
+
+	if( ! feedback->active )
 	{
-		logging_printf( LOGGING_DEBUG, "applemidi_feedback_responder: Resetting journal\n" );
-		net_ctx_journal_reset(ctx);
+		feedback->active = 1;
+		feedback->seq = rtp_seq;
+		feedback->pending = 1;
+		feedback->due = now + feedback->interval;
+	} else {
+		int16_t delta = (int16_t)( rtp_seq - feedback->seq );
+
+		/* Duplicate or late packet. It doesn't move the acknowledged sequence */
+		if( delta <= 0 )
+		{
+			net_ctx_unlock( ctx );
+			return;
+		}
+
+		if( delta > 1 )
+		{
+			/* Report the last contiguous sequence number now and start again from this packet */
+			send_gap = 1;
+			gap_seq = feedback->seq;
+			feedback->pending = 0;
+		}
+
+		if( feedback->pending == 0 )
+		{
+			feedback->due = now + feedback->interval;
+		}
+
+		feedback->seq = rtp_seq;
+		feedback->pending++;
 	}
-}
 
-net_response_t *applemidi_feedback_create( uint32_t ssrc, uint16_t rtp_seq )
-{
-	net_applemidi_command *cmd = NULL;
-	net_applemidi_feedback *feedback = NULL;
-	net_response_t *response = NULL;
+	if( feedback->pending >= feedback->packets )
+	{
+		send_now = 1;
+		send_seq = feedback->seq;
+		feedback->pending = 0;
+	}
 
-	feedback = net_applemidi_feedback_create();
+	if( feedback->pending > 0 ) due = feedback->due;
 
-	if( feedback == NULL  ) return NULL;
+	net_ctx_unlock( ctx );
 
-	cmd = net_applemidi_cmd_create( NET_APPLEMIDI_CMD_FEEDBACK );
+	applemidi_feedback_lower_due( due );
 
-	if( ! cmd )
+	if( send_gap )
 	{
-		X_FREE( feedback );
-		return NULL;
+		logging_printf( LOGGING_DEBUG, "applemidi_feedback_schedule: gap after seq=%u (received %u)\n", gap_seq, rtp_seq );
+		applemidi_feedback_send( ctx, ssrc, gap_seq );
 	}
-	
-	feedback->ssrc = ssrc;
-	feedback->rtp_seq[1] = rtp_seq;
 
-	cmd->data = feedback;
+	if( send_now )
+	{
+		applemidi_feedback_send( ctx, ssrc, send_seq );
+	}
+}
 
-	response = net_response_create();
-	if( response )
+/* Send any RS whose interval has run out.
+   Returns the number of milliseconds until the next one is due or -1 if nothing is waiting */
+long applemidi_feedback_flush_due( void )
+{
+	const net_ctx_snapshot_t *snapshot = NULL;
+	int hazard = -1;
+	size_t i = 0;
+	long now = 0;
+	long next_due = -1;
+	long earliest = 0;
+
+	now = time_in_microseconds();
+
+	// Only one loop looks at the connections once the earliest RS is due
+	earliest = atomic_load( &feedback_next_due );
+	if( earliest == LONG_MAX ) return -1;
+	if( earliest > now ) return ( earliest - now + 9 ) / 10;
+	// Another loop got there first and will set the next due time when it is done
+	if( ! atomic_compare_exchange_strong( &feedback_next_due, &earliest, LONG_MAX ) ) return -1;
+
+	snapshot = net_ctx_snapshot_acquire( &hazard );
+	if( ! snapshot ) return -1;
+
+	for( i = 0; i < snapshot->count; i++ )
 	{
-		net_applemidi_pack( cmd, &(response->buffer), &(response->len) );
+		net_ctx_t *ctx = snapshot->ctx[i];
+		net_ctx_feedback_t *feedback = NULL;
+		uint32_t ssrc = 0;
+		uint16_t send_seq = 0;
+		int send_now = 0;
+
+		net_ctx_lock( ctx );
+		feedback = &(ctx->feedback);
+		if( feedback->active && feedback->pending > 0 )
+		{
+			if( feedback->due <= now )
+			{
+				send_now = 1;
+				send_seq = feedback->seq;
+				ssrc = ctx->ssrc;
+				feedback->pending = 0;
+			} else if( ( next_due < 0 ) || ( feedback->due - now < next_due ) ) {
+				next_due = feedback->due - now;
+			}
+		}
+		net_ctx_unlock( ctx );
+
+		if( send_now )
+		{
+			applemidi_feedback_send( ctx, ssrc, send_seq );
+		}
 	}
 
-	net_applemidi_cmd_destroy( &cmd );
+	net_ctx_snapshot_release( hazard );
+
+	if( next_due < 0 ) return -1;
+
+	applemidi_feedback_lower_due( now + next_due );
 
-	return response;
+	/* Convert from 100us units and round up */
+	return ( next_due + 9 ) / 10;
 }
@@ -37,21 +37,23 @@ extern int errno;
 
 #include "utils.h"
 
-net_response_t * applemidi_inv_responder( char *ip_address, uint16_t port, void *data )
+size_t applemidi_inv_responder( char *ip_address, uint16_t port, void *data, net_response_buffer_t *response )
 {
-	net_applemidi_command *cmd = NULL;
 	net_applemidi_inv *inv = NULL;
-	net_applemidi_inv *accept_inv = NULL;
 	net_ctx_t *ctx = NULL;
-	net_response_t *response;
 	char *service_name = NULL;
 
-	if( ! data ) return NULL;
+	if( ! data ) return 0;
+	if( ! response ) return 0;
+
+	response->len = 0;
 
 	inv = ( net_applemidi_inv *) data;
 
 	ctx = net_ctx_find_by_ssrc( inv->ssrc );
 
+	service_name = config_string_get("service.name");
+
 	/* See https://en.wikipedia.org/wiki/RTP-MIDI#Apple.27s_session_protocol */
 
 	/* If no context is found, this is a new connection */
@@ -61,58 +63,20 @@ net_response_t * applemidi_inv_responder( char *ip_address, uint16_t port, void
 		logging_printf( LOGGING_INFO, "applemidi_inv_responder: Registering new connection from [%s]:[%u] [%s]\n", ip_address, port, ( inv->name ? inv->name : "") );
 		ctx = net_ctx_register( inv->ssrc, inv->initiator, ip_address, port , inv->name );
 
+		/* Turn the invitation down so the peer stops asking */
 		if( ! ctx ) 
 		{
 			logging_printf( LOGGING_ERROR, "applemidi_inv_responder: Error registering connection\n");
-			return NULL;
+			net_response_inv_pack( response, NET_APPLEMIDI_CMD_REJECT, 0, inv->initiator, ( service_name ? service_name : "RaveloxMIDI" ) );
+			return response->len;
 		}
 	}
 
-	cmd = net_applemidi_cmd_create( NET_APPLEMIDI_CMD_ACCEPT );
-
-	if( ! cmd )
+	if( net_response_inv_pack( response, NET_APPLEMIDI_CMD_ACCEPT, ctx->send_ssrc, ctx->initiator, ( service_name ? service_name : "RaveloxMIDI" ) ) == 0 )
 	{
-		logging_printf( LOGGING_ERROR, "applemidi_inv_responder: Unable to allocate memory for accept_inv command\n");
-		net_ctx_reset( ctx );
-		return NULL;
-	}
-
-	accept_inv = net_applemidi_inv_create();
-	
-	if( ! accept_inv ) {
-		logging_printf( LOGGING_ERROR, "applemidi_inv_responder: Unable to allocate memory for accept_inv command data\n");
-		X_FREE( cmd );
+		logging_printf( LOGGING_ERROR, "applemidi_inv_responder: Unable to pack response to inv command\n");
 		net_ctx_reset( ctx );
-		return NULL;
 	}
 
-	accept_inv->ssrc = ctx->send_ssrc;
-	accept_inv->version = 2;
-	accept_inv->initiator = ctx->initiator;
-	service_name = config_string_get("service.name");
-	if( service_name )
-	{
-		accept_inv->name = (char *)X_STRDUP( service_name );
-	} else {
-		accept_inv->name = (char *)X_STRDUP( "RaveloxMIDI" );
-	}
-
-	cmd->data = accept_inv;
-
-	response = net_response_create();
-
-	if( response )
-	{
-		int ret = 0;
-		ret = net_applemidi_pack( cmd , &(response->buffer), &(response->len) );
-		if( ret != 0 )
-		{
-			logging_printf( LOGGING_ERROR, "applemidi_inv_responder: Unable to pack response to inv command\n");
-			net_response_destroy( &response );
-		}
-	}
-
-	net_applemidi_cmd_destroy( &cmd );
-
-	return response;
+	return response->len;
 }
@@ -38,13 +38,18 @@ extern int errno;
 
 #include "remote_connection.h"
 
-net_response_t * applemidi_ok_responder( char *ip_address, uint16_t port, void *data )
+size_t applemidi_ok_responder( char *ip_address, uint16_t port, void *data, net_response_buffer_t *response )
 {
 	net_applemidi_inv *ok_packet = NULL;
 	net_ctx_t *ctx = NULL;
-	net_response_t *response = NULL;
+	net_response_buffer_t request;
+	char *service_name = NULL;
 
-	if( ! data ) return NULL;
+	if( ! data ) return 0;
+	if( ! response ) return 0;
+
+	/* Nothing goes back to the sender. The next step of the handshake is sent to the peer directly */
+	response->len = 0;
 
 	ok_packet = ( net_applemidi_inv *) data;
 	logging_printf( LOGGING_DEBUG, "applemidi_ok_responder: address=[%s]:%u ssrc=0x%08x version=%u initiator=0x%08x name=%s\n", ip_address, port, ok_packet->ssrc, ok_packet->version, ok_packet->initiator, ok_packet->name);
@@ -54,27 +59,24 @@ net_response_t * applemidi_ok_responder( char *ip_address, uint16_t port, void *
 	if( ! ctx )
 	{
 		logging_printf(LOGGING_WARN,"applemidi_ok_responder: Unexpected OK from ssrc=0x%08x\n", ok_packet->ssrc);
-		return NULL;
+		return 0;
 	}
 
 	logging_printf( LOGGING_DEBUG, "applemidi_ok_responder: address=[%s]:%u status=%s\n", ip_address, port, net_ctx_status_to_string(ctx->status ));
 	switch( ctx->status )
 	{
 		case NET_CTX_STATUS_FIRST_INV:
-			response = net_response_inv( ctx->send_ssrc, ctx->initiator, config_string_get("service.name") );
+			service_name = config_string_get("service.name");
+			net_response_inv_pack( &request, NET_APPLEMIDI_CMD_INV, ctx->send_ssrc, ctx->initiator, ( service_name ? service_name : "RaveloxMIDIClient" ) );
 			ctx->ssrc = ok_packet->ssrc;
-			net_ctx_send( ctx, response->buffer, response->len , USE_DATA_PORT );
-			hex_dump( response->buffer, response->len );
-			net_response_destroy( &response );
-			response = NULL;
+			net_ctx_send( ctx, request.buffer, request.len , USE_DATA_PORT );
+			hex_dump( request.buffer, request.len );
 			ctx->status = NET_CTX_STATUS_SECOND_INV;
 			break;
 		case NET_CTX_STATUS_SECOND_INV:
-			response = net_response_sync( ctx->send_ssrc , ctx->start );
-			net_ctx_send( ctx, response->buffer, response->len, USE_CONTROL_PORT );
-			hex_dump( response->buffer, response->len );
-			net_response_destroy( &response );
-			response = NULL;
+			net_response_sync_pack( &request, ctx->send_ssrc , ctx->start );
+			net_ctx_send( ctx, request.buffer, request.len, USE_CONTROL_PORT );
+			hex_dump( request.buffer, request.len );
 			ctx->status = NET_CTX_STATUS_REMOTE_CONNECTION;
 			logging_printf( LOGGING_INFO, "Remote connection established to [%s]\n", ok_packet->name );
 			remote_connect_sync_start();
@@ -83,5 +85,5 @@ net_response_t * applemidi_ok_responder( char *ip_address, uint16_t port, void *
 			break;
 	}
 
-	return response;
+	return response->len;
 }
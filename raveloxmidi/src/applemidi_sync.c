@@ -33,17 +33,19 @@
 
 #include "logging.h"
 
-net_response_t * applemidi_sync_responder( void *data )
+/* arrival_time is when the kernel received the CK packet, in time_in_microseconds() units */
+size_t applemidi_sync_responder( void *data, net_response_buffer_t *response, long arrival_time )
 {
-	net_applemidi_command *cmd = NULL;
 	net_applemidi_sync *sync = NULL;
-	net_applemidi_sync *sync_resp = NULL;
+	net_applemidi_sync sync_resp;
 	net_ctx_t *ctx = NULL;
-	net_response_t *response = NULL;
 	unsigned long local_timestamp = 0;
 	unsigned long current_time = 0;
 
-	if( ! data ) return NULL;
+	if( ! data ) return 0;
+	if( ! response ) return 0;
+
+	response->len = 0;
 
 	sync = ( net_applemidi_sync *) data;
 
@@ -52,7 +54,7 @@ net_response_t * applemidi_sync_responder( void *data )
 	if( ! ctx )
 	{
 		logging_printf( LOGGING_DEBUG, "applemidi_sync_responder: No context found for ssrc=0x%08x\n", sync->ssrc );
-		return NULL;
+		return 0;
 	}
 
 	net_ctx_dump( ctx );
@@ -60,75 +62,51 @@ net_response_t * applemidi_sync_responder( void *data )
         if ( sync->count == 2 )
 	{
                 long long offset_estimate = ((sync->timestamp3 + sync->timestamp1) / 2) - sync->timestamp2;
-                current_time = time_in_microseconds();
+                current_time = ( arrival_time > 0 ? arrival_time : time_in_microseconds() );
                 local_timestamp = current_time - ctx->start;
                 logging_printf( LOGGING_DEBUG, "applemidi_sync_responder: CK2 Received. Sync Done. now=%lu start=%lu local_timestamp=%lu offset_estimate=%lu\n", current_time, ctx->start, local_timestamp, offset_estimate );
-                return NULL;
+                return 0;
         }
 
-	cmd = net_applemidi_cmd_create( NET_APPLEMIDI_CMD_SYNC );
-
-	if( ! cmd )
-	{
-		logging_printf( LOGGING_ERROR, "applemidi_sync_responder: Unable to allocate memory for sync command\n");
-		return NULL;
-	}
-
-	sync_resp = net_applemidi_sync_create();
-	
-	if( ! sync_resp ) {
-		logging_printf( LOGGING_ERROR, "applemidi_sync_responder: Unable to allocate memory for sync_resp command data\n");
-		X_FREE( cmd );
-		return NULL;
-	}
+	memset( &sync_resp, 0, sizeof( sync_resp ) );
 
-	sync_resp->ssrc = ctx->send_ssrc;
-	sync_resp->count = ( sync->count < 2 ? sync->count + 1 : 0 );
+	sync_resp.ssrc = ctx->send_ssrc;
+	sync_resp.count = ( sync->count < 2 ? sync->count + 1 : 0 );
 
 	/* Copy the timestamps from the SYNC command */
-	sync_resp->timestamp1 = sync->timestamp1;
-	sync_resp->timestamp2 = sync->timestamp2;
-	sync_resp->timestamp3 = sync->timestamp3;
+	sync_resp.timestamp1 = sync->timestamp1;
+	sync_resp.timestamp2 = sync->timestamp2;
+	sync_resp.timestamp3 = sync->timestamp3;
 
-	memcpy( sync_resp->padding, sync->padding, 3 );
+	memcpy( sync_resp.padding, sync->padding, 3 );
 
-	current_time = time_in_microseconds();
+	/* Timestamp with the arrival time so that time spent in our own queues doesn't skew the peer's offset estimate */
+	current_time = ( arrival_time > 0 ? arrival_time : time_in_microseconds() );
 	local_timestamp = current_time - ctx->start;
 
 	logging_printf( LOGGING_DEBUG, "applemidi_sync_responder: now=%lu start=%lu local_timestamp=%lu\n", current_time, ctx->start, local_timestamp );
 	
-	switch( sync_resp->count )
+	switch( sync_resp.count )
 	{
 		case 2:
-			sync_resp->timestamp3 = local_timestamp;
+			sync_resp.timestamp3 = local_timestamp;
 			break;
 		case 1:
-			sync_resp->timestamp2 = local_timestamp;
+			sync_resp.timestamp2 = local_timestamp;
 			break;
 		case 0:
-			sync_resp->timestamp1 = local_timestamp;
+			sync_resp.timestamp1 = local_timestamp;
 			break;
 	}
 
-	cmd->data = sync_resp;
-
-	net_applemidi_command_dump( cmd );
+	logging_printf( LOGGING_DEBUG, "applemidi_sync_responder: sync_resp(ssrc=0x%08x,count=%d,timestamp1=0x%016llx,timestamp2=0x%016llx,timestamp3=0x%016llx)\n",
+		sync_resp.ssrc, sync_resp.count, sync_resp.timestamp1, sync_resp.timestamp2, sync_resp.timestamp3 );
 
-	response = net_response_create();
-
-	if( response )
+	response->len = net_applemidi_pack_sync( response->buffer, sizeof( response->buffer ), &sync_resp );
+	if( response->len == 0 )
 	{
-		int ret = 0;
-		ret = net_applemidi_pack( cmd , &(response->buffer), &(response->len) );
-		if( ret != 0 )
-		{
-			logging_printf( LOGGING_ERROR, "applemidi_sync_responder: Unable to pack response to sync command\n");
-			net_response_destroy( &response );
-			response = NULL;
-		}
+		logging_printf( LOGGING_ERROR, "applemidi_sync_responder: Unable to pack response to sync command\n");
 	}
 
-	net_applemidi_cmd_destroy( &cmd );
-
-	return response;
+	return response->len;
 }
@@ -0,0 +1,178 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "midi_journal.h"
+#include "utils.h"
+
+#include "logging.h"
+
+void chapter_a_reset( chapter_a_t *chapter_a )
+{
+	if( ! chapter_a ) return;
+
+	memset( chapter_a, 0, sizeof( chapter_a_t ) );
+	chapter_a->S = 1;
+}
+
+void chapter_a_set( chapter_a_t *chapter_a, uint32_t seq, uint8_t note, uint8_t pressure )
+{
+	if( ! chapter_a ) return;
+	if( note >= MAX_CHAPTER_A_NOTES ) return;
+
+	JOURNAL_MAP_SET( chapter_a->present, note );
+	chapter_a->pressure[ note ] = pressure & 0x7f;
+	chapter_a->seq[ note ] = seq;
+}
+
+/* Drop the notes that were last changed at or before the checkpoint. Returns the number dropped */
+size_t chapter_a_trim( chapter_a_t *chapter_a, uint32_t checkpoint )
+{
+	size_t trimmed = 0;
+	int word = 0;
+
+	if( ! chapter_a ) return 0;
+
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
+	{
+		uint64_t bits = chapter_a->present[ word ];
+
+		while( bits )
+		{
+			uint8_t note = ( word * 64 ) + __builtin_ctzll( bits );
+
+			bits &= ( bits - 1 );
+
+			if( chapter_a->seq[ note ] > checkpoint ) continue;
+
+			JOURNAL_MAP_CLEAR( chapter_a->present, note );
+			trimmed++;
+		}
+	}
+
+	return trimmed;
+}
+
+int chapter_a_has_data( const chapter_a_t *chapter_a )
+{
+	int word = 0;
+
+	if( ! chapter_a ) return 0;
+
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
+	{
+		if( chapter_a->present[ word ] ) return 1;
+	}
+
+	return 0;
+}
+
+/* Sec A.9 of RFC6295.txt. Returns the packed size, 0 if there are no notes */
+size_t chapter_a_pack( const chapter_a_t *chapter_a, unsigned char *packed )
+{
+	unsigned char *p = NULL;
+	size_t len = 0;
+	int word = 0;
+
+	if( ! chapter_a ) return 0;
+	if( ! packed ) return 0;
+
+	p = packed + PACKED_CHAPTER_A_HEADER_SIZE;
+
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
+	{
+		uint64_t bits = chapter_a->present[ word ];
+
+		while( bits )
+		{
+			uint8_t note = ( word * 64 ) + __builtin_ctzll( bits );
+
+			bits &= ( bits - 1 );
+
+			*p++ = ( 1 << 7 ) | note;
+			*p++ = chapter_a->pressure[ note ] & 0x7f;
+			len++;
+		}
+	}
+
+	if( len == 0 ) return 0;
+
+	// LEN is number of notes - 1
+	packed[0] = ( chapter_a->S << 7 ) | ( ( len - 1 ) & 0x7f );
+
+	return PACKED_CHAPTER_A_HEADER_SIZE + ( len * PACKED_CHAPTER_A_LOG_SIZE );
+}
+
+/* Unpack a chapter into chapter_a. Returns the number of bytes used or 0 if the buffer is too short */
+size_t chapter_a_unpack( const unsigned char *packed, size_t size, chapter_a_t *chapter_a )
+{
+	const unsigned char *p = NULL;
+	size_t len = 0;
+	size_t i = 0;
+
+	if( ! packed ) return 0;
+	if( ! chapter_a ) return 0;
+	if( size < PACKED_CHAPTER_A_HEADER_SIZE ) return 0;
+
+	chapter_a_reset( chapter_a );
+
+	p = packed;
+	chapter_a->S = ( p[0] & 0x80 ) >> 7;
+	len = ( p[0] & 0x7f ) + 1;
+	p++;
+
+	if( size < PACKED_CHAPTER_A_HEADER_SIZE + ( len * PACKED_CHAPTER_A_LOG_SIZE ) )
+	{
+		logging_printf( LOGGING_ERROR, "chapter_a_unpack: Unable to unpack %zu notes. Got %zu bytes\n", len, size );
+		return 0;
+	}
+
+	for( i = 0; i < len; i++ )
+	{
+		chapter_a_set( chapter_a, 0, p[0] & 0x7f, p[1] & 0x7f );
+		p += PACKED_CHAPTER_A_LOG_SIZE;
+	}
+
+	return PACKED_CHAPTER_A_HEADER_SIZE + ( len * PACKED_CHAPTER_A_LOG_SIZE );
+}
+
+void chapter_a_dump( const chapter_a_t *chapter_a )
+{
+	unsigned int note = 0;
+
+	DEBUG_ONLY;
+	if( ! chapter_a ) return;
+
+	logging_printf( LOGGING_DEBUG, "chapter_a: S=%u\n", chapter_a->S );
+
+	for( note = 0; note < MAX_CHAPTER_A_NOTES; note++ )
+	{
+		if( JOURNAL_MAP_TEST( chapter_a->present, note ) )
+		{
+			logging_printf( LOGGING_DEBUG, "chapter_a_note: num=%u pressure=%u\n", note, chapter_a->pressure[ note ] );
+		}
+	}
+}
@@ -30,242 +30,162 @@
 
 #include "logging.h"
 
-chapter_c_t *chapter_c_create( void )
+void chapter_c_reset( chapter_c_t *chapter_c )
 {
-	uint8_t index = 0;
-	chapter_c_t *new_chapter_c = NULL;
+	if( !chapter_c ) return;
 
-	new_chapter_c = (chapter_c_t *)X_MALLOC( sizeof( chapter_c_t ) );
-	if( ! new_chapter_c )
-	{
-		logging_printf(LOGGING_ERROR, "chapter_c_create: Unable to allocate memory to create chapter_c log\n");
-		return NULL;
-	}
-	
-	memset( new_chapter_c, 0, sizeof( chapter_c_t ) );
-	new_chapter_c->S = 1;
+	memset( chapter_c, 0, sizeof(chapter_c_t) );
+	chapter_c->S = 1; 
+}
 
-	for( index = 0 ; index < MAX_CHAPTER_C_CONTROLLERS; index++ )
-	{
-		new_chapter_c->controller_log[ index ].number = 255;
-	}
+void chapter_c_set( chapter_c_t *chapter_c, uint32_t seq, uint8_t controller, uint8_t value )
+{
+	if( ! chapter_c ) return;
+	if( controller >= MAX_CHAPTER_C_CONTROLLERS ) return;
 
-	return new_chapter_c;
+	JOURNAL_MAP_SET( chapter_c->present, controller );
+	chapter_c->value[ controller ] = value & 0x7f;
+	chapter_c->seq[ controller ] = seq;
 }
 
-void chapter_c_unpack( unsigned char *packed, size_t size, chapter_c_t **chapter_c )
+/* Drop the controllers that were last changed at or before the checkpoint. Returns the number dropped */
+size_t chapter_c_trim( chapter_c_t *chapter_c, uint32_t checkpoint )
 {
-	const unsigned char *p = NULL;
-	uint8_t index = 0;
-	size_t current_size;
+	size_t trimmed = 0;
+	int word = 0;
 
-	*chapter_c = NULL;
-	if(! packed )
-	{
-		return;
-	}
+	if( ! chapter_c ) return 0;
 
-	// Buffer size must be at least 1 byte long to determine length
-	if( size == 0 )
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
 	{
-		return;
-	}
-
-	*chapter_c = chapter_c_create();
-	if( ! *chapter_c )
-	{
-		logging_printf(LOGGING_ERROR, "chapter_c_unpack: Unable to unpack buffer\n");
-		return;
-	}
-
-	p = packed;
-	(*chapter_c)->S = ( (*p) & 0x80 ) >> 7;
-	(*chapter_c)->len = (*p) & 0x7f;
-	current_size = size;
+		uint64_t bits = chapter_c->present[ word ];
 
-	// Loop through controller logs in the buffer
-	do
-	{
-		if( current_size < PACKED_CONTROLLER_LOG_SIZE )
+		while( bits )
 		{
-			logging_printf( LOGGING_ERROR, "chapter_c_unpack: Unable to unpack controller log %u. Expected %u, got %d\n", index, PACKED_CONTROLLER_LOG_SIZE, current_size );
-			break;
-		}
+			uint8_t index = ( word * 64 ) + __builtin_ctzll( bits );
 
-		// Get the controller number
-		index = (*p) & 0x7f;
+			bits &= ( bits - 1 );
 
-		(*chapter_c)->controller_log[index].S = ( (*p)  & 0x80 ) >> 7;
-		(*chapter_c)->controller_log[index].number = index;
-		p++;
-		current_size--;
+			if( chapter_c->seq[ index ] > checkpoint ) continue;
 
-		(*chapter_c)->controller_log[index].A = ( (*p) & 0x80 ) >> 7;
-		if( (*chapter_c)->controller_log[index].A == 1 )
-		{
-			(*chapter_c)->controller_log[index].T = ( (*p) & 0x40 ) >> 6;
-			(*chapter_c)->controller_log[index].value = (*p) & 0x3f;
-		} else {
-			(*chapter_c)->controller_log[index].T = 0;
-			(*chapter_c)->controller_log[index].value = (*p) & 0x7f;
+			JOURNAL_MAP_CLEAR( chapter_c->present, index );
+			trimmed++;
 		}
-		current_size--;
-		p++;
-	} while( current_size >= PACKED_CONTROLLER_LOG_SIZE );
+	}
+
+	return trimmed;
 }
 
-void chapter_c_pack( chapter_c_t *chapter_c, unsigned char **packed, size_t *size )
+int chapter_c_has_data( const chapter_c_t *chapter_c )
 {
-	uint8_t index, current_size;
-	unsigned char *p = NULL;
-
-	*packed = NULL;
-	*size = 0;
+	int word = 0;
 
-	if( ! chapter_c ) return;
+	if( ! chapter_c ) return 0;
 
-	// Ensure the len field is correct
-	chapter_c->len = 0;
-	for( index=0; index < MAX_CHAPTER_C_CONTROLLERS; index++ )
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
 	{
-		if( chapter_c->controller_log[index].number == index )
-		{
-			chapter_c->len++;
-		}
+		if( chapter_c->present[ word ] ) return 1;
 	}
 
-	logging_printf(LOGGING_DEBUG, "chapter_c_pack: chapter_c->len=%u\n", chapter_c->len );
-	if( chapter_c->len == 0 ) return;
+	return 0;
+}
 
-	*size = PACKED_CHAPTER_C_HEADER_SIZE + ( (chapter_c->len) * PACKED_CONTROLLER_LOG_SIZE );
-	*packed = (unsigned char *)X_MALLOC( *size );
-	
-	if(! *packed )
-	{
-		*size = 0;
-		logging_printf(LOGGING_ERROR,"chapter_c_pack: Unable to allocate memory for packed chapter_c\n");
-		return;
-	}
+/* Unpack a chapter into chapter_c. Returns the number of bytes used or 0 if the buffer is too short */
+size_t chapter_c_unpack( const unsigned char *packed, size_t size, chapter_c_t *chapter_c )
+{
+	const unsigned char *p = NULL;
+	size_t len = 0;
+	size_t i = 0;
+	uint8_t index = 0;
 
-	memset( *packed, 0, *size );
-	current_size = *size;
-	p = *packed;
-		
-	// Pack the header
-	// LENGTH is number of controllers - 1
-	*p = ( chapter_c->S  << 7 ) | ( ( chapter_c->len - 1 ) & 0x7f );
-	logging_printf(LOGGING_DEBUG,"chapter_c_pack: header = 0x%02x\n", *p);
+	if( ! packed ) return 0;
+	if( ! chapter_c ) return 0;
+
+	// Buffer size must be at least 1 byte long to determine length
+	if( size < PACKED_CHAPTER_C_HEADER_SIZE ) return 0;
+
+	chapter_c_reset( chapter_c );
 
+	p = packed;
+	chapter_c->S = ( (*p) & 0x80 ) >> 7;
+	// LENGTH is number of controllers - 1
+	len = ( (*p) & 0x7f ) + 1;
 	p++;
-	current_size--;
 
-	index = 0;
+	if( size < PACKED_CHAPTER_C_HEADER_SIZE + ( len * PACKED_CONTROLLER_LOG_SIZE ) )
+	{
+		logging_printf( LOGGING_ERROR, "chapter_c_unpack: Unable to unpack %zu controller logs. Got %zu bytes\n", len, size );
+		return 0;
+	}
 
-	// Loop through the controllers
-	while( ( current_size >= PACKED_CONTROLLER_LOG_SIZE ) && ( index < MAX_CHAPTER_C_CONTROLLERS ) )
+	for( i = 0; i < len; i++ )
 	{
-		// Short-circuit if the controller isn't active
-		if( chapter_c->controller_log[index].number == index )
+		index = p[0] & 0x7f;
+
+		// Only plain values are kept. Toggle and count values (A=1) are skipped
+		if( ! ( p[1] & 0x80 ) )
 		{
-			controller_log_dump( &(chapter_c->controller_log[index]) );
-			*p = ( chapter_c->controller_log[index].S << 7 ) | ( chapter_c->controller_log[index].number & 0x7f );
-			logging_printf(LOGGING_DEBUG,"chapter_c_pack: controller = 0x%02x\n", *p);
-			p++;
-			current_size--;
-		
-			*p = chapter_c->controller_log[index].A << 7 ;
-			if( chapter_c->controller_log[index].A == 1 )
-			{
-				*p |= ( chapter_c->controller_log[index].T << 6 );
-				*p |= ( chapter_c->controller_log[index].value & 0x3f );
-			} else {
-				*p |= ( chapter_c->controller_log[index].value  & 0x7f );
-			}
-			logging_printf(LOGGING_DEBUG,"chapter_c_pack: value = 0x%02x\n", *p);
-			p++;
-			current_size--;
+			chapter_c_set( chapter_c, 0, index, p[1] & 0x7f );
 		}
-		index++;
-	}
-}
 
-void chapter_c_destroy( chapter_c_t **chapter_c )
-{
-	if( ! chapter_c ) return;
-	if( ! *chapter_c ) return;
+		p += PACKED_CONTROLLER_LOG_SIZE;
+	}
 
-	X_FREENULL( "chapter_c",(void **)chapter_c );
+	return PACKED_CHAPTER_C_HEADER_SIZE + ( len * PACKED_CONTROLLER_LOG_SIZE );
 }
 
-void chapter_c_reset( chapter_c_t *chapter_c )
+/* Pack the controllers that have a value. Returns the packed size, 0 if there are none */
+size_t chapter_c_pack( const chapter_c_t *chapter_c, unsigned char *packed )
 {
-	uint8_t index;
-	if( !chapter_c ) return;
-	
-	memset( chapter_c, 0, sizeof(chapter_c_t) );
-	chapter_c->S = 1; 
-	for( index = 0 ; index < MAX_CHAPTER_C_CONTROLLERS; index++ )
-	{
-		chapter_c->controller_log[ index ].S = 1;
-		chapter_c->controller_log[ index ].number = 255;
-	}
-}
+	unsigned char *p = NULL;
+	size_t len = 0;
+	int word = 0;
 
-void chapter_c_dump( chapter_c_t *chapter_c )
-{
-	uint8_t index;
-	DEBUG_ONLY;
-	if(! chapter_c) return;
+	if( ! chapter_c ) return 0;
+	if( ! packed ) return 0;
 
-	logging_printf(LOGGING_DEBUG, "chapter_c: S=%u,len=%u\n", chapter_c->S, chapter_c->len);
+	p = packed + PACKED_CHAPTER_C_HEADER_SIZE;
 
-	for( index = 0; index < MAX_CHAPTER_C_CONTROLLERS; index++ )
+	// Loop through the controllers that are present
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
 	{
-		if( chapter_c->controller_log[index].number == index )
+		uint64_t bits = chapter_c->present[ word ];
+
+		while( bits )
 		{
-			controller_log_dump( &(chapter_c->controller_log[index]) );
-		}
-	}
-}
+			uint8_t index = ( word * 64 ) + __builtin_ctzll( bits );
 
-controller_log_t *controller_log_create( void )
-{
-	controller_log_t *new_controller_log = NULL;
+			bits &= ( bits - 1 );
 
-	new_controller_log = (controller_log_t *)X_MALLOC( sizeof(controller_log_t ) );
-	if( ! new_controller_log )
-	{
-		logging_printf( LOGGING_ERROR,"controller_log_create: Unable to allocate memory for new controller_log_t\n");
-		return NULL;
+			*p++ = ( 1 << 7 ) | index;
+			*p++ = chapter_c->value[ index ] & 0x7f;
+			len++;
+		}
 	}
 
-	memset( new_controller_log, 0, sizeof(controller_log_t ));
-	new_controller_log->S = 1;
-	new_controller_log->number=255;
-
-	return new_controller_log;
-}
+	logging_printf(LOGGING_DEBUG, "chapter_c_pack: len=%zu\n", len );
+	if( len == 0 ) return 0;
 
-void controller_log_destroy( controller_log_t **controller_log )
-{
-	if( ! controller_log ) return;
-	if( ! *controller_log) return;
+	// Pack the header
+	// LENGTH is number of controllers - 1
+	packed[0] = ( chapter_c->S  << 7 ) | ( ( len - 1 ) & 0x7f );
 
-	X_FREENULL( "controller_log",(void **)controller_log);
-}
-void controller_log_reset( controller_log_t *controller_log )
-{
-	if(! controller_log ) return;
-	memset( controller_log, 0, sizeof(controller_log_t) );
-	controller_log->S = 1;
-	controller_log->number = 255;
+	return PACKED_CHAPTER_C_HEADER_SIZE + ( len * PACKED_CONTROLLER_LOG_SIZE );
 }
 
-void controller_log_dump( controller_log_t *controller_log )
+void chapter_c_dump( const chapter_c_t *chapter_c )
 {
+	unsigned int index;
 	DEBUG_ONLY;
-	if( ! controller_log ) return;
+	if(! chapter_c) return;
+
+	logging_printf(LOGGING_DEBUG, "chapter_c: S=%u\n", chapter_c->S );
 
-	logging_printf(LOGGING_DEBUG, "controller_log: S=%u,number=%u,A=%u,T=%u,value=%u\n",
-		controller_log->S, controller_log->number, controller_log->A,controller_log->T,controller_log->value);
+	for( index = 0; index < MAX_CHAPTER_C_CONTROLLERS; index++ )
+	{
+		if( JOURNAL_MAP_TEST( chapter_c->present, index ) )
+		{
+			logging_printf(LOGGING_DEBUG, "controller_log: number=%u,value=%u\n", index, chapter_c->value[ index ] );
+		}
+	}
 }
@@ -0,0 +1,247 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "midi_journal.h"
+#include "utils.h"
+
+#include "logging.h"
+
+/*
+*---------------------
+*	Sec A.3 of RFC6295.txt
+*
+*	Only the current value of each parameter is journaled. The PENDING field is never used so a
+*	parameter number that has only been partly selected is not sent. Data increment and decrement
+*	are applied to the 14 bit value and sent as ENTRY-MSB and ENTRY-LSB rather than as counts.
+*---------------------
+*/
+
+/* RPN 127/127 is the null parameter. Data entry is ignored while it is selected */
+#define chapter_m_null_selected( chapter_m )	( ( (chapter_m)->selected_Q == 0 ) && ( (chapter_m)->selected_msb == 127 ) && ( (chapter_m)->selected_lsb == 127 ) )
+
+void chapter_m_init( chapter_m_t *chapter_m )
+{
+	if( ! chapter_m ) return;
+
+	memset( chapter_m, 0, sizeof( chapter_m_t ) );
+	chapter_m->selected_msb = 127;
+	chapter_m->selected_lsb = 127;
+	chapter_m_reset( chapter_m );
+}
+
+/* The selected parameter belongs to the MIDI stream rather than the journal so it is kept */
+void chapter_m_reset( chapter_m_t *chapter_m )
+{
+	if( ! chapter_m ) return;
+
+	memset( chapter_m->logs, 0, sizeof( chapter_m->logs ) );
+	chapter_m->num_logs = 0;
+	chapter_m->S = 1;
+}
+
+/* Find the log for the selected parameter. A new log is used if there isn't one, replacing the oldest if the table is full */
+static chapter_m_log_t *chapter_m_log_get( chapter_m_t *chapter_m )
+{
+	chapter_m_log_t *free_log = NULL;
+	chapter_m_log_t *oldest_log = NULL;
+	int i = 0;
+
+	for( i = 0; i < MAX_CHAPTER_M_PARAMETERS; i++ )
+	{
+		chapter_m_log_t *log = &( chapter_m->logs[i] );
+
+		if( ! log->in_use )
+		{
+			if( ! free_log ) free_log = log;
+			continue;
+		}
+
+		if( log->Q == chapter_m->selected_Q && log->pnum_msb == chapter_m->selected_msb && log->pnum_lsb == chapter_m->selected_lsb )
+		{
+			return log;
+		}
+
+		if( ! oldest_log || log->seq < oldest_log->seq ) oldest_log = log;
+	}
+
+	if( free_log )
+	{
+		chapter_m->num_logs++;
+	} else {
+		free_log = oldest_log;
+	}
+
+	memset( free_log, 0, sizeof( chapter_m_log_t ) );
+	free_log->in_use = 1;
+	free_log->Q = chapter_m->selected_Q;
+	free_log->pnum_msb = chapter_m->selected_msb;
+	free_log->pnum_lsb = chapter_m->selected_lsb;
+
+	return free_log;
+}
+
+/* Apply one of the parameter system controllers. Returns non-zero if a parameter value changed */
+int chapter_m_control( chapter_m_t *chapter_m, uint32_t seq, uint8_t controller, uint8_t value )
+{
+	chapter_m_log_t *log = NULL;
+	int entry = 0;
+
+	if( ! chapter_m ) return 0;
+
+	value &= 0x7f;
+
+	switch( controller )
+	{
+		case CHAPTER_M_RPN_MSB:
+			chapter_m->selected_Q = 0;
+			chapter_m->selected_msb = value;
+			return 0;
+		case CHAPTER_M_RPN_LSB:
+			chapter_m->selected_Q = 0;
+			chapter_m->selected_lsb = value;
+			return 0;
+		case CHAPTER_M_NRPN_MSB:
+			chapter_m->selected_Q = 1;
+			chapter_m->selected_msb = value;
+			return 0;
+		case CHAPTER_M_NRPN_LSB:
+			chapter_m->selected_Q = 1;
+			chapter_m->selected_lsb = value;
+			return 0;
+		default:
+			break;
+	}
+
+	if( chapter_m_null_selected( chapter_m ) ) return 0;
+
+	log = chapter_m_log_get( chapter_m );
+
+	switch( controller )
+	{
+		case CHAPTER_M_DATA_ENTRY_MSB:
+			log->entry_msb = value;
+			log->toc |= CHAPTER_M_LOG_J;
+			break;
+		case CHAPTER_M_DATA_ENTRY_LSB:
+			log->entry_lsb = value;
+			log->toc |= CHAPTER_M_LOG_K;
+			break;
+		case CHAPTER_M_DATA_INCREMENT:
+		case CHAPTER_M_DATA_DECREMENT:
+			entry = ( log->entry_msb << 7 ) | log->entry_lsb;
+			entry += ( controller == CHAPTER_M_DATA_INCREMENT ? 1 : -1 );
+			entry = MAX( 0, MIN( 0x3fff, entry ) );
+			log->entry_msb = ( entry >> 7 ) & 0x7f;
+			log->entry_lsb = entry & 0x7f;
+			log->toc |= ( CHAPTER_M_LOG_J | CHAPTER_M_LOG_K );
+			break;
+		default:
+			return 0;
+	}
+
+	log->seq = seq;
+
+	return 1;
+}
+
+/* Drop the parameters that were last changed at or before the checkpoint. Returns the number dropped */
+size_t chapter_m_trim( chapter_m_t *chapter_m, uint32_t checkpoint )
+{
+	size_t trimmed = 0;
+	int i = 0;
+
+	if( ! chapter_m ) return 0;
+
+	for( i = 0; i < MAX_CHAPTER_M_PARAMETERS; i++ )
+	{
+		chapter_m_log_t *log = &( chapter_m->logs[i] );
+
+		if( ! log->in_use ) continue;
+		if( log->seq > checkpoint ) continue;
+
+		log->in_use = 0;
+		chapter_m->num_logs--;
+		trimmed++;
+	}
+
+	return trimmed;
+}
+
+/* Returns the packed size, 0 if there are no parameters */
+size_t chapter_m_pack( const chapter_m_t *chapter_m, unsigned char *packed )
+{
+	unsigned char *p = NULL;
+	size_t len = 0;
+	int i = 0;
+
+	if( ! chapter_m ) return 0;
+	if( ! packed ) return 0;
+	if( chapter_m->num_logs == 0 ) return 0;
+
+	p = packed + PACKED_CHAPTER_M_HEADER_SIZE;
+
+	for( i = 0; i < MAX_CHAPTER_M_PARAMETERS; i++ )
+	{
+		const chapter_m_log_t *log = &( chapter_m->logs[i] );
+
+		if( ! log->in_use ) continue;
+
+		*p++ = ( 1 << 7 ) | log->pnum_lsb;
+		*p++ = ( ( log->Q & 0x01 ) << 7 ) | log->pnum_msb;
+		*p++ = log->toc;
+		if( log->toc & CHAPTER_M_LOG_J ) *p++ = log->entry_msb;
+		if( log->toc & CHAPTER_M_LOG_K ) *p++ = log->entry_lsb;
+	}
+
+	// LENGTH includes the header. P, E, U, W and Z are all 0
+	len = p - packed;
+	packed[0] = ( chapter_m->S << 7 ) | ( ( len >> 8 ) & 0x03 );
+	packed[1] = len & 0xff;
+
+	return len;
+}
+
+void chapter_m_dump( const chapter_m_t *chapter_m )
+{
+	int i = 0;
+
+	DEBUG_ONLY;
+	if( ! chapter_m ) return;
+
+	logging_printf( LOGGING_DEBUG, "chapter_m: S=%u num_logs=%u selected=%s %u/%u\n", chapter_m->S, chapter_m->num_logs,
+		( chapter_m->selected_Q ? "NRPN" : "RPN" ), chapter_m->selected_msb, chapter_m->selected_lsb );
+
+	for( i = 0; i < MAX_CHAPTER_M_PARAMETERS; i++ )
+	{
+		const chapter_m_log_t *log = &( chapter_m->logs[i] );
+
+		if( ! log->in_use ) continue;
+
+		logging_printf( LOGGING_DEBUG, "chapter_m_log: %s %u/%u toc=0x%02x msb=%u lsb=%u\n", ( log->Q ? "NRPN" : "RPN" ),
+			log->pnum_msb, log->pnum_lsb, log->toc, log->entry_msb, log->entry_lsb );
+	}
+}
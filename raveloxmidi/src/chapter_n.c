@@ -30,336 +30,237 @@
 
 #include "logging.h"
 
-void chapter_n_header_pack( chapter_n_header_t *header , unsigned char **packed , size_t *size )
+void chapter_n_reset( chapter_n_t *chapter_n )
 {
-	unsigned char *p = NULL;
-
-	*packed = NULL;
-	*size = 0;
-
-	if( ! header ) return;
-
-	chapter_n_header_dump( header );
-	*packed = ( unsigned char *)X_MALLOC( CHAPTER_N_HEADER_PACKED_SIZE );
-
-	if( ! *packed ) return;
-	memset( *packed, 0 , CHAPTER_N_HEADER_PACKED_SIZE );
+	if( ! chapter_n ) return;
 
-	p = *packed;
+	memset( chapter_n, 0, sizeof( chapter_n_t ) );
+}
 
-	*p |= ( ( header->B & 0x01 ) << 7 );
-	*p |= ( header->len & 0x7f ) ;
+void chapter_n_note_on( chapter_n_t *chapter_n, uint32_t seq, uint8_t note, uint8_t velocity )
+{
+	if( ! chapter_n ) return;
+	if( note >= JOURNAL_MAP_SIZE ) return;
 
-	p += sizeof( char );
-	*size += sizeof( char );
+	if( ! JOURNAL_MAP_TEST( chapter_n->on, note ) )
+	{
+		if( chapter_n->num_notes == MAX_CHAPTER_N_NOTES ) return;
 
-	*p |= ( ( header->low & 0x0f ) << 4 );
-	*p |= ( header->high & 0x0f );
+		JOURNAL_MAP_SET( chapter_n->on, note );
+		chapter_n->num_notes++;
+	}
 
-	*size += sizeof( char );
+	chapter_n->velocity[ note ] = velocity & 0x7f;
+	chapter_n->seq[ note ] = seq;
+	chapter_n->offbits[ note / 8 ] &= ~( 0x80 >> ( note % 8 ) );
 }
 
-void chapter_n_header_destroy( chapter_n_header_t **header )
+void chapter_n_note_off( chapter_n_t *chapter_n, uint32_t seq, uint8_t note )
 {
-	X_FREENULL( "chapter_n_header",(void **)header);
-}
-
-chapter_n_header_t * chapter_n_header_create( void )
-{
-	chapter_n_header_t *header = NULL;
-
-	header = ( chapter_n_header_t *) X_MALLOC( sizeof( chapter_n_header_t ) );
+	if( ! chapter_n ) return;
+	if( note >= JOURNAL_MAP_SIZE ) return;
 
-	if( header )
+	if( JOURNAL_MAP_TEST( chapter_n->on, note ) )
 	{
-		memset( header, 0 , sizeof( chapter_n_header_t) );
-		header->low = 0x0f;
-		header->high = 0x00;
+		JOURNAL_MAP_CLEAR( chapter_n->on, note );
+		chapter_n->num_notes--;
 	}
 
-	return header;
+	chapter_n->velocity[ note ] = 0;
+	chapter_n->seq[ note ] = seq;
+	chapter_n->offbits[ note / 8 ] |= ( 0x80 >> ( note % 8 ) );
 }
 
-void chapter_n_pack( chapter_n_t *chapter_n, unsigned char **packed, size_t *size )
+/* Drop the notes and off-bits that were last changed at or before the checkpoint. Returns the number dropped */
+size_t chapter_n_trim( chapter_n_t *chapter_n, uint32_t checkpoint )
 {
-	unsigned char *packed_header = NULL;
-	unsigned char *packed_note = NULL;
-	unsigned char *note_buffer = NULL;
-	unsigned char *offbits_buffer = NULL;
-	unsigned char *p = NULL;
+	size_t trimmed = 0;
+	int word = 0;
 	int i = 0;
-	size_t header_size, note_size, note_buffer_size;
-	int offbits_size;
 
-	*packed = NULL;
-	*size = 0;
+	if( ! chapter_n ) return 0;
 
-	header_size = note_size = note_buffer_size = 0;
-
-	if( ! chapter_n ) return;
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
+	{
+		uint64_t bits = chapter_n->on[ word ];
 
-	chapter_n->header->len = chapter_n->num_notes;
+		while( bits )
+		{
+			uint8_t note = ( word * 64 ) + __builtin_ctzll( bits );
 
-	chapter_n_header_pack( chapter_n->header, &packed_header, &header_size) ;
+			bits &= ( bits - 1 );
 
-	if( packed_header )
-	{
-		*size += header_size;
-	}
+			if( chapter_n->seq[ note ] > checkpoint ) continue;
 
-	if( chapter_n->num_notes > 0 )
-	{
-		note_buffer_size = CHAPTER_N_NOTE_PACKED_SIZE * chapter_n->num_notes;
-		note_buffer = ( unsigned char * ) X_MALLOC( note_buffer_size );
-		if( note_buffer ) 
-		{
-			memset( note_buffer, 0 , note_buffer_size);
-			p = note_buffer;
-
-			for( i = 0 ; i < chapter_n->num_notes ; i++ )
-			{
-				chapter_n_note_pack( chapter_n->notes[i], &packed_note, &note_size );
-				memcpy( p, packed_note, note_size );
-				p += note_size;
-				*size += note_size;
-				X_FREE( packed_note );
-			}
-		} else {
-			logging_printf(LOGGING_ERROR, "chapter_n_pack: Insufficient memory to create note buffer\n");
-			goto chapter_n_pack_cleanup;
+			JOURNAL_MAP_CLEAR( chapter_n->on, note );
+			chapter_n->num_notes--;
+			chapter_n->velocity[ note ] = 0;
+			trimmed++;
 		}
-			
 	}
 
-	
-	offbits_size = ( chapter_n->header->high - chapter_n->header->low ) + 1;
-	if( offbits_size > 0 )
+	for( i = 0; i < MAX_OFFBITS; i++ )
 	{
-		offbits_buffer = ( unsigned char * )X_MALLOC( offbits_size );
-		if (!offbits_buffer)
-		{
-			logging_printf(LOGGING_ERROR, "chapter_n_pack: Insufficient memory to create offbits buffer\n");
-			goto chapter_n_pack_cleanup;
-		}
-		p = chapter_n->offbits + chapter_n->header->low;
-		memcpy( offbits_buffer, p, offbits_size );
-		*size += offbits_size;
-	}
-
-	// Now pack it all together
-	*packed = ( unsigned char * ) X_MALLOC( *size );
+		uint8_t bits = chapter_n->offbits[ i ];
 
-	if( ! *packed ) goto chapter_n_pack_cleanup;
-
-	p = *packed;
+		while( bits )
+		{
+			uint8_t bit = 0x80 >> ( __builtin_clz( bits ) - 24 );
+			uint8_t note = ( i * 8 ) + ( __builtin_clz( bits ) - 24 );
 
-	if (packed_header)
-	{
-		memcpy( p , packed_header, header_size );
-		p += header_size;
-	}
+			bits &= ~bit;
 
-	if( note_buffer )
-	{
-		memcpy( p, note_buffer, note_buffer_size );
-		p+= note_buffer_size;
-	}
+			if( chapter_n->seq[ note ] > checkpoint ) continue;
 
-	if( offbits_buffer )
-	{
-		memcpy( p, offbits_buffer, offbits_size );
+			chapter_n->offbits[ i ] &= ~bit;
+			trimmed++;
+		}
 	}
 
-chapter_n_pack_cleanup:
-	X_FREENULL( "chapter_n:packed_header", (void **)&packed_header );
-	X_FREENULL( "chapter_n:note_buffer", (void **)&note_buffer );
-	X_FREENULL( "chapter_n:offbits_buffer",(void **)&offbits_buffer );
+	return trimmed;
 }
 
-chapter_n_t * chapter_n_create( void )
+int chapter_n_has_data( const chapter_n_t *chapter_n )
 {
-	chapter_n_t *chapter_n = NULL;
+	int i = 0;
 
-	chapter_n = ( chapter_n_t * ) X_MALLOC( sizeof( chapter_n_t ) );
+	if( ! chapter_n ) return 0;
+	if( chapter_n->num_notes > 0 ) return 1;
 
-	if( chapter_n )
+	for( i = 0; i < MAX_OFFBITS; i++ )
 	{
-		chapter_n_header_t *header = chapter_n_header_create();
-		unsigned int i;
-
-		memset( chapter_n, 0, sizeof( chapter_n_t ) );
-		if( ! header )
-		{
-			X_FREE( chapter_n );
-			return NULL;
-		}
-
-		chapter_n->header = header;
-
-		chapter_n->num_notes = 0;
-		for( i = 0 ; i < MAX_CHAPTER_N_NOTES ; i++ )
-		{
-			chapter_n->notes[i] = NULL;
-		}
-		
-		chapter_n->offbits = ( unsigned char *)X_MALLOC( MAX_OFFBITS );
-		if (! chapter_n->offbits )
-		{
-			chapter_n_destroy( &chapter_n );
-			return NULL;
-		}
-			
-		memset( chapter_n->offbits, 0, MAX_OFFBITS );
+		if( chapter_n->offbits[ i ] ) return 1;
 	}
 
-	return chapter_n;
+	return 0;
 }
 
-void chapter_n_destroy( chapter_n_t **chapter_n )
+/* Sec A.6 of RFC6295.txt. Returns the packed size */
+size_t chapter_n_pack( const chapter_n_t *chapter_n, unsigned char *packed )
 {
-	int i;
-	if( ! chapter_n ) return;
-	if( ! *chapter_n ) return;
+	unsigned char *p = NULL;
+	int word = 0;
+	int low = 0;
+	int high = 0;
 
-	for( i = 0 ; i < MAX_CHAPTER_N_NOTES ; i++ )
+	if( ! chapter_n ) return 0;
+	if( ! packed ) return 0;
+
+	p = packed + CHAPTER_N_HEADER_PACKED_SIZE;
+
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
 	{
-		if( (*chapter_n)->notes[i] )
+		uint64_t bits = chapter_n->on[ word ];
+
+		while( bits )
 		{
-			chapter_n_note_destroy( &( (*chapter_n)->notes[i] ) );
+			uint8_t note = ( word * 64 ) + __builtin_ctzll( bits );
+
+			bits &= ( bits - 1 );
+
+			*p++ = ( 1 << 7 ) | note;
+			*p++ = chapter_n->velocity[ note ] & 0x7f;
 		}
 	}
 
-	if( (*chapter_n)->offbits )
-	{
-		X_FREE( (*chapter_n)->offbits );
-		(*chapter_n)->offbits = NULL;
-	}
+	// Only send the range of offbits octets that have something in them
+	for( low = 0; low < MAX_OFFBITS && chapter_n->offbits[ low ] == 0; low++ );
+	for( high = MAX_OFFBITS - 1; high >= low && chapter_n->offbits[ high ] == 0; high-- );
 
-	if( (*chapter_n)->header )
+	if( low <= high )
 	{
-		chapter_n_header_destroy( &( (*chapter_n)->header ) );
-		(*chapter_n)->header = NULL;
+		memcpy( p, chapter_n->offbits + low, high - low + 1 );
+		p += ( high - low + 1 );
+	} else {
+		// LOW=15 HIGH=0 means no offbits. With 127 notes that would mean 128 notes so use LOW=1 HIGH=0
+		low = ( chapter_n->num_notes == MAX_CHAPTER_N_NOTES ? 1 : 15 );
+		high = 0;
 	}
 
-	X_FREE( *chapter_n );
+	packed[0] = ( ( chapter_n->B & 0x01 ) << 7 ) | ( chapter_n->num_notes & 0x7f );
+	packed[1] = ( ( low & 0x0f ) << 4 ) | ( high & 0x0f );
 
-	*chapter_n = NULL;
-
-	return;
+	return p - packed;
 }
 
-void chapter_n_header_dump( chapter_n_header_t *header )
+/* Unpack a chapter into chapter_n. Returns the number of bytes used or 0 if the buffer is too short */
+size_t chapter_n_unpack( const unsigned char *packed, size_t size, chapter_n_t *chapter_n )
 {
-	DEBUG_ONLY;
-	if( ! header ) return;
+	const unsigned char *p = NULL;
+	size_t len = 0;
+	size_t num_notes = 0;
+	size_t num_offbits = 0;
+	int low = 0;
+	int high = 0;
+	size_t i = 0;
 
-	logging_printf( LOGGING_DEBUG, "Chapter N(header): B=%d len=%u low=%u high=%u\n", header->B, header->len, header->low, header->high);
-}
+	if( ! packed ) return 0;
+	if( ! chapter_n ) return 0;
+	if( size < CHAPTER_N_HEADER_PACKED_SIZE ) return 0;
 
-void chapter_n_header_reset( chapter_n_header_t *header )
-{
-	if( ! header ) return;
+	chapter_n_reset( chapter_n );
 
-	header->B = 0;
-	header->len = 0;
-	header->high = 0;
-	header->low = 0;
-}
+	p = packed;
+	chapter_n->B = ( p[0] & 0x80 ) >> 7;
+	num_notes = p[0] & 0x7f;
+	low = ( p[1] & 0xf0 ) >> 4;
+	high = p[1] & 0x0f;
 
-void chapter_n_dump( chapter_n_t *chapter_n )
-{
-	uint16_t i = 0;
+	// LEN=127 with LOW=15 and HIGH=0 means there are 128 notes
+	if( num_notes == MAX_CHAPTER_N_NOTES && low == 15 && high == 0 ) num_notes = JOURNAL_MAP_SIZE;
 
-	DEBUG_ONLY;
-	if( ! chapter_n ) return;
+	num_offbits = ( low <= high ? high - low + 1 : 0 );
 
-	for( i = 0 ; i < chapter_n->num_notes ; i++ )
+	len = CHAPTER_N_HEADER_PACKED_SIZE + ( num_notes * CHAPTER_N_NOTE_PACKED_SIZE ) + num_offbits;
+	if( size < len )
 	{
-		chapter_n_note_dump( chapter_n->notes[i] );
+		logging_printf( LOGGING_ERROR, "chapter_n_unpack: Unable to unpack %zu notes and %zu offbits. Got %zu bytes\n", num_notes, num_offbits, size );
+		return 0;
 	}
-	
-	for( i = chapter_n->header->low; i <= chapter_n->header->high ; i++ )
-	{
-		logging_printf( LOGGING_DEBUG, "Offbits[%d]=%02x\n", i, chapter_n->offbits[i]);
-	}
-}
 
-void chapter_n_reset( chapter_n_t *chapter_n )
-{
-	uint16_t i = 0;
+	p += CHAPTER_N_HEADER_PACKED_SIZE;
 
-	if( ! chapter_n ) return;
-
-	for( i = 0 ; i < chapter_n->num_notes ; i++ )
+	for( i = 0; i < num_notes; i++ )
 	{
-		chapter_n_note_reset( &chapter_n->notes[i] );
-	}
-	chapter_n->num_notes = 0;
-	memset( chapter_n->offbits, 0, MAX_OFFBITS );
-	chapter_n_header_reset( chapter_n->header );
-}
-
-void chapter_n_note_pack( const chapter_n_note_t *note , unsigned char **packed , size_t *size )
-{
-	unsigned char *p = NULL;
-
-	*packed = NULL;
-	*size = 0;
-
-	if( ! note ) return;
+		uint8_t note = p[0] & 0x7f;
 
-	*packed = ( unsigned char *)X_MALLOC( CHAPTER_N_NOTE_PACKED_SIZE );
-
-	if( ! *packed ) return;
-
-	memset( *packed, 0, CHAPTER_N_NOTE_PACKED_SIZE );
-	p = *packed;
-
-	*p = ( note->S << 7 ) | ( note->num & 0x7f );
-
-	p += sizeof( char );
-	*size += sizeof( char );
-
-	*p = ( note->Y << 7 ) | ( note->velocity & 0x7f );
-
-	*size += sizeof( char );
-}
-
-void chapter_n_note_destroy( chapter_n_note_t **note )
-{
-	X_FREENULL( "chapter_n:note",(void **)note );
-}
+		if( ! JOURNAL_MAP_TEST( chapter_n->on, note ) )
+		{
+			JOURNAL_MAP_SET( chapter_n->on, note );
+			chapter_n->num_notes++;
+		}
+		chapter_n->velocity[ note ] = p[1] & 0x7f;
 
-chapter_n_note_t * chapter_n_note_create( void )
-{
-	chapter_n_note_t *note = NULL;
-	
-	note = ( chapter_n_note_t * ) X_MALLOC( sizeof( chapter_n_note_t ) );
+		p += CHAPTER_N_NOTE_PACKED_SIZE;
+	}
 
-	if( note )
+	if( num_offbits > 0 )
 	{
-		memset( note , 0 , sizeof( chapter_n_note_t ) );
-		logging_printf(LOGGING_DEBUG,"chapter_n_note_create:note=%p\n", note);
+		memcpy( chapter_n->offbits + low, p, num_offbits );
 	}
 
-	return note;
+	return len;
 }
 
-void chapter_n_note_dump( chapter_n_note_t *note )
+void chapter_n_dump( const chapter_n_t *chapter_n )
 {
-	DEBUG_ONLY;
-	if( ! note ) return;
+	unsigned int i = 0;
 
-	logging_printf( LOGGING_DEBUG, "chapter_n_note: S=%d num=%u Y=%d velocity=%u\n", note->S, note->num, note->Y, note->velocity);
-}
+	DEBUG_ONLY;
+	if( ! chapter_n ) return;
 
-void chapter_n_note_reset( chapter_n_note_t **note )
-{
-	if( ! note ) return;
+	logging_printf( LOGGING_DEBUG, "Chapter N: B=%d num_notes=%u\n", chapter_n->B, chapter_n->num_notes );
 
-	(*note)->S = 0;
-	(*note)->num = 0;
-	(*note)->Y = 0;
-	(*note)->velocity = 0;
-	chapter_n_note_destroy( note );
+	for( i = 0 ; i < JOURNAL_MAP_SIZE ; i++ )
+	{
+		if( JOURNAL_MAP_TEST( chapter_n->on, i ) )
+		{
+			logging_printf( LOGGING_DEBUG, "chapter_n_note: num=%u velocity=%u\n", i, chapter_n->velocity[i] );
+		}
+	}
+	
+	for( i = 0 ; i < MAX_OFFBITS ; i++ )
+	{
+		if( chapter_n->offbits[i] ) logging_printf( LOGGING_DEBUG, "chapter_n_offbits[%u]=0x%02x\n", i, chapter_n->offbits[i] );
+	}
 }
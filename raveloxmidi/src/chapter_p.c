@@ -30,77 +30,42 @@
 
 #include "logging.h"
 
-chapter_p_t *chapter_p_create( void )
+// Sec A.2 of RFC6295.txt
+// Chapter has a fixed size of 24 bits
+size_t chapter_p_pack( const chapter_p_t *chapter_p, unsigned char *packed )
 {
-	chapter_p_t *new_chapter_p;
+	if( ! chapter_p ) return 0;
+	if( ! packed ) return 0;
 
-	new_chapter_p = (chapter_p_t *)X_MALLOC( sizeof( chapter_p_t ) );
+	packed[0] = ( (chapter_p->S & 0x01) << 7 ) | (chapter_p->program & 0x7f);
+	packed[1] = ( (chapter_p->B & 0x01) << 7 ) | (chapter_p->bank_msb & 0x7f);
+	packed[2] = ( (chapter_p->X & 0x01) << 7 ) | (chapter_p->bank_lsb & 0x7f);
 
-	if( ! new_chapter_p )
-	{
-		logging_printf(LOGGING_ERROR,"chapter_p_create: Unable to allocate memory for chapter_p journal\n");
-		return NULL;
-	}
-
-	memset( new_chapter_p, 0, sizeof( chapter_p_t ) );
-
-	return new_chapter_p;
-}
-
-void chapter_p_pack( const chapter_p_t *chapter_p, unsigned char **packed, size_t *size )
-{
-	if( ! chapter_p ) return;
-	*size = 0;
-
-	// Sec A.2 of RFC6295.txt
-	// Chapter has a fixed size of 24 bits
-	*packed = (unsigned char *)X_MALLOC( CHAPTER_P_PACKED_SIZE ); 
-
-	if( ! *packed )
-	{
-		logging_printf(LOGGING_ERROR,"chapter_p_pack: Unable to allocate memory for packed chapter_p journal\n");
-		return;
-	}
-
-	memset(*packed, 0, CHAPTER_P_PACKED_SIZE);
-	*size = CHAPTER_P_PACKED_SIZE;
-	(*packed)[0] = ( (chapter_p->S & 0x01) << 7 ) | (chapter_p->program & 0x7f);
-	(*packed)[1] = ( (chapter_p->B & 0x01) << 7 ) | (chapter_p->bank_msb & 0x7f);
-	(*packed)[2] = ( (chapter_p->X & 0x01) << 7 ) | (chapter_p->bank_lsb & 0x7f);
+	return CHAPTER_P_PACKED_SIZE;
 }
 
-void chapter_p_unpack( const unsigned char *packed, size_t size, chapter_p_t **chapter_p)
+/* Returns the number of bytes used or 0 if there aren't enough */
+size_t chapter_p_unpack( const unsigned char *packed, size_t size, chapter_p_t *chapter_p )
 {
-	*chapter_p = NULL;
-	if( !packed ) return;
-	if( size < CHAPTER_P_PACKED_SIZE ) return;
-	
-	*chapter_p = chapter_p_create();
-	if( ! *chapter_p )
-	{
-		logging_printf(LOGGING_ERROR, "chapter_p_unpack: Unable to create chapter_p from buffer\n");
-		return;
-	}
-
-	(*chapter_p)->S = (packed[0] & 0x80) >> 7;
-	(*chapter_p)->program = packed[0] & 0x7f;
-	(*chapter_p)->B = (packed[1] & 0x80) >> 7;
-	(*chapter_p)->bank_msb = packed[1] & 0x7f;
-	(*chapter_p)->X = (packed[2] & 0x80) >> 7;
-	(*chapter_p)->bank_lsb = packed[2] & 0x7f;
+	if( ! packed ) return 0;
+	if( ! chapter_p ) return 0;
+	if( size < CHAPTER_P_PACKED_SIZE ) return 0;
+
+	chapter_p->S = (packed[0] & 0x80) >> 7;
+	chapter_p->program = packed[0] & 0x7f;
+	chapter_p->B = (packed[1] & 0x80) >> 7;
+	chapter_p->bank_msb = packed[1] & 0x7f;
+	chapter_p->X = (packed[2] & 0x80) >> 7;
+	chapter_p->bank_lsb = packed[2] & 0x7f;
+
+	return CHAPTER_P_PACKED_SIZE;
 }
 
-void chapter_p_destroy( chapter_p_t **chapter_p )
+void chapter_p_dump( const chapter_p_t *chapter_p )
 {
+	DEBUG_ONLY;
 	if( ! chapter_p ) return;
-	if( ! *chapter_p ) return;
-
-	X_FREENULL( "chapter_p",(void **)chapter_p );
-}
 
-void chapter_p_dump( chapter_p_t *chapter_p )
-{
-	DEBUG_ONLY;
 	logging_printf(LOGGING_DEBUG," chapter_p: S=%u,program=%u,B=%u,msb=%u,X=%u,lsb=%u\n",
 		chapter_p->S, chapter_p->program, chapter_p->B, chapter_p->bank_msb, chapter_p->X, chapter_p->bank_lsb);
 }
@@ -115,4 +80,5 @@ void chapter_p_reset( chapter_p_t *chapter_p )
 	chapter_p->bank_msb = 0;
 	chapter_p->X = 0;
 	chapter_p->bank_lsb = 0;
+	chapter_p->seq = 0;
 }
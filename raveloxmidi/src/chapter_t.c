@@ -0,0 +1,73 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "midi_journal.h"
+#include "utils.h"
+
+#include "logging.h"
+
+// Sec A.8 of RFC6295.txt
+// Chapter has a fixed size of 8 bits
+size_t chapter_t_pack( const chapter_t_t *chapter_t, unsigned char *packed )
+{
+	if( ! chapter_t ) return 0;
+	if( ! packed ) return 0;
+
+	packed[0] = ( (chapter_t->S & 0x01) << 7 ) | (chapter_t->pressure & 0x7f);
+
+	return CHAPTER_T_PACKED_SIZE;
+}
+
+/* Returns the number of bytes used or 0 if there aren't enough */
+size_t chapter_t_unpack( const unsigned char *packed, size_t size, chapter_t_t *chapter_t )
+{
+	if( ! packed ) return 0;
+	if( ! chapter_t ) return 0;
+	if( size < CHAPTER_T_PACKED_SIZE ) return 0;
+
+	chapter_t->S = (packed[0] & 0x80) >> 7;
+	chapter_t->pressure = packed[0] & 0x7f;
+
+	return CHAPTER_T_PACKED_SIZE;
+}
+
+void chapter_t_dump( const chapter_t_t *chapter_t )
+{
+	DEBUG_ONLY;
+	if( ! chapter_t ) return;
+
+	logging_printf(LOGGING_DEBUG," chapter_t: S=%u,pressure=%u\n", chapter_t->S, chapter_t->pressure);
+}
+
+void chapter_t_reset( chapter_t_t *chapter_t )
+{
+	if( ! chapter_t ) return;
+
+	chapter_t->S = 0;
+	chapter_t->pressure = 0;
+	chapter_t->seq = 0;
+}
@@ -0,0 +1,79 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "midi_journal.h"
+#include "utils.h"
+
+#include "logging.h"
+
+// Sec A.5 of RFC6295.txt
+// Chapter has a fixed size of 16 bits
+size_t chapter_w_pack( const chapter_w_t *chapter_w, unsigned char *packed )
+{
+	if( ! chapter_w ) return 0;
+	if( ! packed ) return 0;
+
+	packed[0] = ( (chapter_w->S & 0x01) << 7 ) | (chapter_w->first & 0x7f);
+	packed[1] = ( (chapter_w->R & 0x01) << 7 ) | (chapter_w->second & 0x7f);
+
+	return CHAPTER_W_PACKED_SIZE;
+}
+
+/* Returns the number of bytes used or 0 if there aren't enough */
+size_t chapter_w_unpack( const unsigned char *packed, size_t size, chapter_w_t *chapter_w )
+{
+	if( ! packed ) return 0;
+	if( ! chapter_w ) return 0;
+	if( size < CHAPTER_W_PACKED_SIZE ) return 0;
+
+	chapter_w->S = (packed[0] & 0x80) >> 7;
+	chapter_w->first = packed[0] & 0x7f;
+	chapter_w->R = (packed[1] & 0x80) >> 7;
+	chapter_w->second = packed[1] & 0x7f;
+
+	return CHAPTER_W_PACKED_SIZE;
+}
+
+void chapter_w_dump( const chapter_w_t *chapter_w )
+{
+	DEBUG_ONLY;
+	if( ! chapter_w ) return;
+
+	logging_printf(LOGGING_DEBUG," chapter_w: S=%u,first=%u,R=%u,second=%u\n",
+		chapter_w->S, chapter_w->first, chapter_w->R, chapter_w->second);
+}
+
+void chapter_w_reset( chapter_w_t *chapter_w )
+{
+	if( ! chapter_w ) return;
+
+	chapter_w->S = 0;
+	chapter_w->first = 0;
+	chapter_w->R = 0;
+	chapter_w->second = 0;
+	chapter_w->seq = 0;
+}
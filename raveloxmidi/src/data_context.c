@@ -24,28 +24,41 @@
 
 #include <pthread.h>
 
+#include "config.h"
+
 #include "data_context.h"
+#include "data_pool.h"
 
 #include "utils.h"
 #include "logging.h"
 
-void data_context_lock( data_context_t *context )
+static data_pool_t *data_context_pool = NULL;
+
+void data_context_init( void )
 {
-	if( ! context ) return;
-	X_MUTEX_LOCK( &(context->lock) );
+	data_context_pool = data_pool_create( "data_context", sizeof( data_context_t ), DATA_CONTEXT_POOL_CACHE_SIZE, DATA_CONTEXT_POOL_MAX_ITEMS );
+
+	if( ! data_context_pool )
+	{
+		logging_printf( LOGGING_WARN, "data_context_init: Unable to create context pool. Contexts will be allocated individually\n");
+	}
 }
 
-void data_context_unlock( data_context_t *context )
+void data_context_teardown( void )
 {
-	if( ! context ) return;
-	X_MUTEX_UNLOCK( &(context->lock ) );
+	data_pool_destroy( &data_context_pool );
 }
 
 data_context_t *data_context_create( data_context_destroy_func_t destroy_func )
 {
 	data_context_t *new_context = NULL;
 
-	new_context = (data_context_t *)X_MALLOC( sizeof( data_context_t ) );
+	if( data_context_pool )
+	{
+		new_context = (data_context_t *)data_pool_get( data_context_pool );
+	} else {
+		new_context = (data_context_t *)X_MALLOC( sizeof( data_context_t ) );
+	}
 
 	if( ! new_context )
 	{
@@ -54,32 +67,51 @@ data_context_t *data_context_create( data_context_destroy_func_t destroy_func )
 	}
 
 	new_context->data = NULL;
-	new_context->reference = 0;
-	pthread_mutex_init( &(new_context->lock), NULL );
+	atomic_init( &(new_context->reference), 0 );
 	new_context->destroy_func = destroy_func;
 
-	logging_printf( LOGGING_DEBUG, "data_context_create: context=%p\n", new_context );
 	return new_context;
 }
 
+/* Point the context data at storage inside the context. Returns NULL if size doesn't fit */
+void *data_context_inline_data( data_context_t *context, size_t size )
+{
+	if( ! context ) return NULL;
+
+	if( size > DATA_CONTEXT_INLINE_SIZE )
+	{
+		logging_printf( LOGGING_ERROR, "data_context_inline_data: size=%zu is larger than the inline storage (%u)\n", size, DATA_CONTEXT_INLINE_SIZE );
+		return NULL;
+	}
+
+	memset( context->inline_data.bytes, 0, size );
+	context->data = context->inline_data.bytes;
+
+	return context->data;
+}
+
 void data_context_destroy( data_context_t **context )
 {
 	if( ! context ) return;
 	if( ! *context ) return;
 
-	data_context_lock( *context );
-
-	logging_printf( LOGGING_DEBUG, "data_context_destroy: context=%p\n", *context);
-	if( (*context)->destroy_func )
+	if( (*context)->data != (*context)->inline_data.bytes )
 	{
-		(*context)->destroy_func( (*context)->data );
-		(*context)->data = NULL;
+		if( (*context)->destroy_func )
+		{
+			(*context)->destroy_func( (*context)->data );
+		}
 	}
 
-	(*context)->reference = 0;
-	data_context_unlock( *context );
+	(*context)->data = NULL;
+	atomic_store_explicit( &((*context)->reference), 0, memory_order_relaxed );
 
-	pthread_mutex_destroy( &((*context)->lock) );
+	if( data_context_pool )
+	{
+		data_pool_put( data_context_pool, *context );
+		*context = NULL;
+		return;
+	}
 
 	X_FREE( *context );
 	*context = NULL;
@@ -88,28 +120,21 @@ void data_context_destroy( data_context_t **context )
 void data_context_acquire( data_context_t *context )
 {
 	if(! context ) return;
-	
-	data_context_lock( context );
-	context->reference += 1;
-	logging_printf( LOGGING_DEBUG, "data_context_acquire: context=%p: ref=%zu\n", context, context->reference );
-	data_context_unlock( context );
+
+	atomic_fetch_add_explicit( &(context->reference), 1, memory_order_relaxed );
 }
 
 void data_context_release( data_context_t **context )
 {
-	uint32_t ref_count = 0;
-
 	if(! context) return;
 	if(! *context ) return;
 
-	data_context_lock( *context );
-	(*context)->reference -= 1;
-	ref_count = (*context)->reference;
-	logging_printf( LOGGING_DEBUG, "data_context_release: context=%p: ref=%zu\n", *context, (*context)->reference );
-	data_context_unlock( *context );
-
-	if( ref_count == 0 )
+	// The last reference makes sure every other thread's use of the context is visible before it is destroyed
+	if( atomic_fetch_sub_explicit( &((*context)->reference), 1, memory_order_acq_rel ) == 1 )
 	{
 		data_context_destroy( context );
+		return;
 	}
+
+	*context = NULL;
 }
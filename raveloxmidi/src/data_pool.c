@@ -0,0 +1,314 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "config.h"
+
+#include "data_pool.h"
+
+#include "utils.h"
+#include "logging.h"
+
+static void data_pool_lock( data_pool_t *pool )
+{
+	if( ! pool ) return;
+	X_MUTEX_LOCK( &(pool->lock) );
+}
+
+static void data_pool_unlock( data_pool_t *pool )
+{
+	if( ! pool ) return;
+	X_MUTEX_UNLOCK( &(pool->lock) );
+}
+
+/* Return the items held by a thread cache to the shared list. Caller must hold the pool lock */
+static void data_pool_cache_release( data_pool_cache_t *cache )
+{
+	data_pool_t *pool = NULL;
+	data_pool_item_t *item = NULL;
+
+	if( ! cache ) return;
+
+	pool = cache->pool;
+
+	while( cache->items )
+	{
+		item = cache->items;
+		cache->items = item->next;
+
+		item->next = pool->items;
+		pool->items = item;
+		pool->count++;
+	}
+
+	cache->count = 0;
+
+	pool->gets += cache->gets;
+	pool->puts += cache->puts;
+	cache->gets = 0;
+	cache->puts = 0;
+}
+
+/* Called when a thread with a cache exits */
+static void data_pool_cache_destroy( void *data )
+{
+	data_pool_cache_t *cache = NULL;
+	data_pool_t *pool = NULL;
+
+	if( ! data ) return;
+
+	cache = (data_pool_cache_t *)data;
+	pool = cache->pool;
+
+	data_pool_lock( pool );
+	data_pool_cache_release( cache );
+	data_pool_unlock( pool );
+
+	X_FREE( cache );
+}
+
+static data_pool_cache_t *data_pool_cache_get( data_pool_t *pool )
+{
+	data_pool_cache_t *cache = NULL;
+
+	cache = (data_pool_cache_t *)pthread_getspecific( pool->cache_key );
+	if( cache ) return cache;
+
+	cache = (data_pool_cache_t *)X_MALLOC( sizeof( data_pool_cache_t ) );
+	if( ! cache )
+	{
+		logging_printf( LOGGING_ERROR, "data_pool_cache_get: pool=%s Insufficient memory to create thread cache\n", pool->name );
+		return NULL;
+	}
+
+	memset( cache, 0, sizeof( data_pool_cache_t ) );
+	cache->pool = pool;
+
+	if( pthread_setspecific( pool->cache_key, cache ) != 0 )
+	{
+		logging_printf( LOGGING_ERROR, "data_pool_cache_get: pool=%s Unable to set thread cache\n", pool->name );
+		X_FREE( cache );
+		return NULL;
+	}
+
+	return cache;
+}
+
+data_pool_t *data_pool_create( const char *name, size_t item_size, size_t cache_size, size_t max_items )
+{
+	data_pool_t *new_pool = NULL;
+
+	if( item_size == 0 ) return NULL;
+
+	new_pool = ( data_pool_t * ) X_MALLOC( sizeof( data_pool_t ) );
+
+	if( ! new_pool )
+	{
+		logging_printf( LOGGING_ERROR, "data_pool_create: Insufficient memory to create new pool\n");
+		return NULL;
+	}
+
+	memset( new_pool, 0, sizeof( data_pool_t ) );
+
+	if( pthread_key_create( &(new_pool->cache_key), data_pool_cache_destroy ) != 0 )
+	{
+		logging_printf( LOGGING_ERROR, "data_pool_create: Unable to create thread cache key\n");
+		X_FREE( new_pool );
+		return NULL;
+	}
+
+	pthread_mutex_init( &(new_pool->lock), NULL );
+
+	new_pool->name = X_STRDUP( name );
+	new_pool->item_size = MAX( item_size, sizeof( data_pool_item_t ) );
+	new_pool->cache_size = MAX( cache_size, 2 );
+	new_pool->max_items = max_items;
+
+	return new_pool;
+}
+
+void data_pool_stats( data_pool_t *pool )
+{
+	if( ! pool ) return;
+
+	data_pool_lock( pool );
+	logging_printf( LOGGING_INFO, "data_pool: name=%s item_size=%zu gets=%lu puts=%lu mallocs=%lu frees=%lu free_items=%zu\n",
+		pool->name, pool->item_size, pool->gets, pool->puts, pool->mallocs, pool->frees, pool->count );
+	data_pool_unlock( pool );
+}
+
+/* All other threads using the pool must have exited before it is destroyed */
+void data_pool_destroy( data_pool_t **pool )
+{
+	data_pool_cache_t *cache = NULL;
+	data_pool_item_t *item = NULL;
+
+	if( ! pool ) return;
+	if( ! *pool ) return;
+
+	cache = (data_pool_cache_t *)pthread_getspecific( (*pool)->cache_key );
+	pthread_setspecific( (*pool)->cache_key, NULL );
+
+	data_pool_lock( *pool );
+	if( cache ) data_pool_cache_release( cache );
+	data_pool_unlock( *pool );
+
+	if( cache ) X_FREE( cache );
+
+	data_pool_stats( *pool );
+
+	data_pool_lock( *pool );
+	while( (*pool)->items )
+	{
+		item = (*pool)->items;
+		(*pool)->items = item->next;
+		X_FREE( item );
+	}
+	(*pool)->count = 0;
+	data_pool_unlock( *pool );
+
+	pthread_key_delete( (*pool)->cache_key );
+	pthread_mutex_destroy( &((*pool)->lock) );
+
+	X_FREE( (*pool)->name );
+	X_FREENULL( "data_pool", (void **)pool );
+}
+
+void *data_pool_get( data_pool_t *pool )
+{
+	data_pool_cache_t *cache = NULL;
+	data_pool_item_t *item = NULL;
+
+	if( ! pool ) return NULL;
+
+	cache = data_pool_cache_get( pool );
+
+	if( cache )
+	{
+		// Refill the thread cache from the shared list
+		if( ! cache->items )
+		{
+			data_pool_lock( pool );
+			while( pool->items && ( cache->count < ( pool->cache_size / 2 ) ) )
+			{
+				item = pool->items;
+				pool->items = item->next;
+				pool->count--;
+
+				item->next = cache->items;
+				cache->items = item;
+				cache->count++;
+			}
+			data_pool_unlock( pool );
+		}
+
+		if( cache->items )
+		{
+			item = cache->items;
+			cache->items = item->next;
+			cache->count--;
+			cache->gets++;
+			return item;
+		}
+
+		cache->gets++;
+	}
+
+	item = (data_pool_item_t *)X_MALLOC( pool->item_size );
+
+	if( ! item )
+	{
+		logging_printf( LOGGING_ERROR, "data_pool_get: pool=%s Insufficient memory to create new item\n", pool->name );
+		return NULL;
+	}
+
+	data_pool_lock( pool );
+	pool->mallocs++;
+	data_pool_unlock( pool );
+
+	return item;
+}
+
+void data_pool_put( data_pool_t *pool, void *data )
+{
+	data_pool_cache_t *cache = NULL;
+	data_pool_item_t *item = NULL;
+	data_pool_item_t *spill = NULL;
+	size_t spill_count = 0;
+
+	if( ! pool ) return;
+	if( ! data ) return;
+
+	item = (data_pool_item_t *)data;
+
+	cache = data_pool_cache_get( pool );
+
+	if( ! cache )
+	{
+		X_FREE( item );
+		data_pool_lock( pool );
+		pool->frees++;
+		data_pool_unlock( pool );
+		return;
+	}
+
+	item->next = cache->items;
+	cache->items = item;
+	cache->count++;
+	cache->puts++;
+
+	if( cache->count <= pool->cache_size ) return;
+
+	// The cache is full so hand half of it over to the shared list
+	data_pool_lock( pool );
+	while( cache->count > ( pool->cache_size / 2 ) )
+	{
+		item = cache->items;
+		cache->items = item->next;
+		cache->count--;
+
+		if( ( pool->max_items > 0 ) && ( pool->count >= pool->max_items ) )
+		{
+			item->next = spill;
+			spill = item;
+			spill_count++;
+			continue;
+		}
+
+		item->next = pool->items;
+		pool->items = item;
+		pool->count++;
+	}
+	pool->frees += spill_count;
+	data_pool_unlock( pool );
+
+	// Items beyond the pool limit go back to the heap outside the lock
+	while( spill )
+	{
+		item = spill;
+		spill = item->next;
+		X_FREE( item );
+	}
+}
@@ -18,11 +18,19 @@
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
 */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 #include "data_queue.h"
 #include "data_context.h"
@@ -30,44 +38,47 @@
 #include "utils.h"
 #include "logging.h"
 
-void data_queue_lock( data_queue_t *queue )
-{
-	if( ! queue ) return;
-	X_MUTEX_LOCK( &(queue->lock) );
-}
+extern int errno;
 
-void data_queue_unlock( data_queue_t *queue )
+static size_t data_queue_round_capacity( size_t capacity )
 {
-	if( ! queue ) return;
-	X_MUTEX_UNLOCK( &(queue->lock) );
-}
+	size_t rounded = 2;
 
-static void data_queue_wake_handler( data_queue_t *queue )
-{
-	if( ! queue ) return;
-	pthread_cond_signal( &(queue->data_signal) );
+	while( rounded < capacity ) rounded <<= 1;
+
+	return rounded;
 }
 
-data_queue_item_t *data_queue_item_create( void )
+data_queue_policy_t data_queue_policy_from_string( const char *value )
 {
-	data_queue_item_t *new_item = NULL;
+	if( ! value ) return DATA_QUEUE_POLICY_BLOCK;
 
-	new_item = (data_queue_item_t *)X_MALLOC( sizeof( data_queue_item_t ) );
+	if( strcasecmp( value, "drop-newest" ) == 0 ) return DATA_QUEUE_POLICY_DROP_NEWEST;
+	if( strcasecmp( value, "drop-oldest" ) == 0 ) return DATA_QUEUE_POLICY_DROP_OLDEST;
 
-	if( !new_item )
+	if( strcasecmp( value, "block" ) != 0 )
 	{
-		logging_printf(LOGGING_ERROR, "data_queue_item_create: Insufficient memory to create new data_queue_item\n");
-		return NULL;
+		logging_printf( LOGGING_WARN, "data_queue_policy_from_string: Unknown overflow policy [%s]. Using block\n", value );
 	}
-	new_item->data = NULL;
-	new_item->next = NULL;
 
-	return new_item;
+	return DATA_QUEUE_POLICY_BLOCK;
 }
 
-data_queue_t *data_queue_create( const char *name, data_queue_action_func_t action )
+static const char *data_queue_policy_to_string( data_queue_policy_t policy )
+{
+	switch( policy )
+	{
+		case DATA_QUEUE_POLICY_DROP_NEWEST: return "drop-newest";
+		case DATA_QUEUE_POLICY_DROP_OLDEST: return "drop-oldest";
+		case DATA_QUEUE_POLICY_BLOCK:
+		default: return "block";
+	}
+}
+
+data_queue_t *data_queue_create( const char *name, data_queue_action_func_t action, size_t capacity, data_queue_policy_t policy )
 {
 	data_queue_t *new_queue = NULL;
+	size_t i = 0;
 
 	new_queue = ( data_queue_t * ) X_MALLOC( sizeof( data_queue_t ) );
 	
@@ -79,165 +90,592 @@ data_queue_t *data_queue_create( const char *name, data_queue_action_func_t acti
 
 	memset( new_queue, 0, sizeof( data_queue_t ) );
 
-	pthread_mutex_init( &(new_queue->lock), NULL );
+	new_queue->capacity = data_queue_round_capacity( capacity > 0 ? capacity : DATA_QUEUE_DEFAULT_CAPACITY );
+	new_queue->mask = new_queue->capacity - 1;
+	new_queue->policy = policy;
 
-	data_queue_lock( new_queue );
+	new_queue->cells = ( data_queue_cell_t * ) X_MALLOC( new_queue->capacity * sizeof( data_queue_cell_t ) );
+	if( ! new_queue->cells )
+	{
+		logging_printf( LOGGING_ERROR, "data_queue_create: Insufficient memory to create queue cells\n");
+		X_FREE( new_queue );
+		return NULL;
+	}
 
-	pthread_cond_init( &(new_queue->data_signal), NULL );
-	new_queue->state = DATA_QUEUE_EMPTY;
-	new_queue->top = NULL;
-	new_queue->bottom = NULL;
-	new_queue->shutdown = DATA_QUEUE_CONTINUE;
-	new_queue->name = X_STRDUP( name );
-	new_queue->counter = 0;
+	memset( new_queue->cells, 0, new_queue->capacity * sizeof( data_queue_cell_t ) );
 
-	if( action )
+	for( i = 0; i < new_queue->capacity; i++ )
 	{
-		new_queue->action = action;
+		atomic_init( &(new_queue->cells[i].sequence), i );
+		atomic_init( &(new_queue->cells[i].state), DATA_QUEUE_CELL_TAKEN );
 	}
 
-	data_queue_unlock( new_queue );
+	new_queue->wake_fd = eventfd( 0, EFD_CLOEXEC );
+	if( new_queue->wake_fd < 0 )
+	{
+		logging_printf( LOGGING_ERROR, "data_queue_create: Unable to create wake fd: %s\n", strerror( errno ) );
+		X_FREE( new_queue->cells );
+		X_FREE( new_queue );
+		return NULL;
+	}
+
+	atomic_init( &(new_queue->enqueue_pos), 0 );
+	atomic_init( &(new_queue->dequeue_pos), 0 );
+	atomic_init( &(new_queue->shutdown), DATA_QUEUE_CONTINUE );
+	atomic_init( &(new_queue->waiting), 0 );
+	atomic_init( &(new_queue->blocked), 0 );
+	atomic_init( &(new_queue->high_water), 0 );
+	atomic_init( &(new_queue->dropped), 0 );
+
+	pthread_mutex_init( &(new_queue->space_lock), NULL );
+	pthread_cond_init( &(new_queue->space_signal), NULL );
+
+	new_queue->name = X_STRDUP( name );
+	new_queue->action = action;
+
+	logging_printf( LOGGING_DEBUG, "data_queue_create: name=[%s] capacity=%zu policy=%s\n", new_queue->name, new_queue->capacity, data_queue_policy_to_string( policy ) );
 
 	return new_queue;
 }
 
-unsigned char data_queue_shutdown_status( data_queue_t *queue )
+void data_queue_set_drop( data_queue_t *queue, data_queue_drop_func_t drop, data_queue_keep_func_t keep )
 {
-	unsigned char shutdown_status = 0;
+	if( ! queue ) return;
 
-	if( ! queue ) return 0;
+	queue->drop = drop;
+	queue->keep = keep;
+}
+
+/* Hand items to the batch function instead of the action, up to max_items at a time.
+   linger is how long in microseconds to wait for more items once the first one has been taken */
+int data_queue_set_batch( data_queue_t *queue, data_queue_batch_func_t batch, size_t max_items, long linger )
+{
+	void **new_items = NULL;
+	void **new_contexts = NULL;
+
+	if( ! queue ) return -1;
+
+	// No batch function turns batching off
+	if( ! batch )
+	{
+		queue->batch = NULL;
+		queue->batch_max = 0;
+		X_FREENULL( "data_queue_set_batch:queue->batch_items", (void **)&(queue->batch_items) );
+		X_FREENULL( "data_queue_set_batch:queue->batch_contexts", (void **)&(queue->batch_contexts) );
+		return 0;
+	}
+
+	if( max_items == 0 ) max_items = DATA_QUEUE_DEFAULT_BATCH;
+	max_items = MIN( max_items, queue->capacity );
+
+	new_items = (void **)X_MALLOC( max_items * sizeof( void * ) );
+	new_contexts = (void **)X_MALLOC( max_items * sizeof( void * ) );
+	if( ! new_items || ! new_contexts )
+	{
+		logging_printf( LOGGING_ERROR, "data_queue_set_batch: [%s] Insufficient memory for batch of %zu\n", queue->name, max_items );
+		X_FREENULL( "data_queue_set_batch:new_items", (void **)&new_items );
+		X_FREENULL( "data_queue_set_batch:new_contexts", (void **)&new_contexts );
+		return -1;
+	}
+
+	X_FREENULL( "data_queue_set_batch:queue->batch_items", (void **)&(queue->batch_items) );
+	X_FREENULL( "data_queue_set_batch:queue->batch_contexts", (void **)&(queue->batch_contexts) );
 
-	data_queue_lock( queue );
-	shutdown_status = queue->shutdown;
-	data_queue_unlock( queue );
+	queue->batch = batch;
+	queue->batch_max = max_items;
+	queue->batch_linger = ( linger > 0 ? linger : 0 );
+	queue->batch_items = new_items;
+	queue->batch_contexts = new_contexts;
 
-	return shutdown_status;
+	logging_printf( LOGGING_DEBUG, "data_queue_set_batch: name=[%s] max_items=%zu linger=%ld\n", queue->name, queue->batch_max, queue->batch_linger );
+
+	return 0;
 }
 
-void data_queue_destroy( data_queue_t **queue )
+/* Claim the next free cell and publish the item into it. Returns 0 if the queue is full */
+static int data_queue_try_push( data_queue_t *queue, void *data, void *context, unsigned char keep )
 {
-	data_queue_item_t *item = NULL;
+	data_queue_cell_t *cell = NULL;
+	size_t pos = 0;
+	size_t sequence = 0;
+	intptr_t diff = 0;
+	size_t depth = 0;
+	size_t high_water = 0;
 
-	if( ! queue ) return;
-	if( ! *queue ) return;
+	pos = atomic_load_explicit( &(queue->enqueue_pos), memory_order_relaxed );
+
+	while( 1 )
+	{
+		cell = &(queue->cells[ pos & queue->mask ]);
+		sequence = atomic_load_explicit( &(cell->sequence), memory_order_acquire );
+		diff = (intptr_t)sequence - (intptr_t)pos;
+
+		if( diff == 0 )
+		{
+			if( atomic_compare_exchange_weak_explicit( &(queue->enqueue_pos), &pos, pos + 1, memory_order_relaxed, memory_order_relaxed ) ) break;
+		} else if( diff < 0 ) {
+			return 0;
+		} else {
+			pos = atomic_load_explicit( &(queue->enqueue_pos), memory_order_relaxed );
+		}
+	}
 
-	data_queue_lock( *queue );
+	cell->data = data;
+	cell->context = context;
+	atomic_store_explicit( &(cell->state), ( keep ? DATA_QUEUE_CELL_KEEP : DATA_QUEUE_CELL_DROPPABLE ), memory_order_relaxed );
+	atomic_store_explicit( &(cell->sequence), pos + 1, memory_order_release );
 
-	while( (*queue)->top )
+	// Track the deepest the queue has been
+	depth = pos + 1 - atomic_load_explicit( &(queue->dequeue_pos), memory_order_relaxed );
+	high_water = atomic_load_explicit( &(queue->high_water), memory_order_relaxed );
+	while( depth > high_water )
 	{
-		item = (*queue)->top;
-		(*queue)->top = (*queue)->top->next;
-		item->next = NULL;
-		item->data = NULL;
-		X_FREENULL( "data_queue_destroy:item", (void **)&item );
+		if( atomic_compare_exchange_weak_explicit( &(queue->high_water), &high_water, depth, memory_order_relaxed, memory_order_relaxed ) ) break;
 	}
 
-	if( (*queue)->name )
+	return 1;
+}
+
+static void data_queue_drop_item( data_queue_t *queue, void *data, void *context );
+static void data_queue_wake_producers( data_queue_t *queue );
+
+/* Take the oldest item. If skip_keep is set, an oldest item that must be kept is left in place.
+   Items marked as dropped on the way are dropped here.
+   Returns 1 if an item was taken, 0 if the queue is empty and -1 if the oldest item was left in place */
+static int data_queue_try_pop( data_queue_t *queue, void **data, void **context, int skip_keep )
+{
+	data_queue_cell_t *cell = NULL;
+	size_t pos = 0;
+	size_t sequence = 0;
+	intptr_t diff = 0;
+	unsigned char state = 0;
+
+	pos = atomic_load_explicit( &(queue->dequeue_pos), memory_order_relaxed );
+
+	while( 1 )
 	{
-		X_FREENULL( "data_queue_destroy:queue->name", (void **) &( (*queue)->name ) );
+		cell = &(queue->cells[ pos & queue->mask ]);
+		sequence = atomic_load_explicit( &(cell->sequence), memory_order_acquire );
+		diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+		if( diff == 0 )
+		{
+			// The state is only trusted if the claim below succeeds for the same position
+			if( skip_keep && atomic_load_explicit( &(cell->state), memory_order_relaxed ) == DATA_QUEUE_CELL_KEEP ) return -1;
+			if( ! atomic_compare_exchange_weak_explicit( &(queue->dequeue_pos), &pos, pos + 1, memory_order_relaxed, memory_order_relaxed ) ) continue;
+
+			// A producer can no longer mark the item once it is taken
+			state = atomic_exchange( &(cell->state), DATA_QUEUE_CELL_TAKEN );
+
+			*data = cell->data;
+			*context = cell->context;
+			cell->data = NULL;
+			cell->context = NULL;
+			atomic_store_explicit( &(cell->sequence), pos + queue->mask + 1, memory_order_release );
+
+			if( state != DATA_QUEUE_CELL_DROPPED ) return 1;
+
+			data_queue_drop_item( queue, *data, *context );
+			data_queue_wake_producers( queue );
+			*data = NULL;
+			*context = NULL;
+			pos = atomic_load_explicit( &(queue->dequeue_pos), memory_order_relaxed );
+		} else if( diff < 0 ) {
+			return 0;
+		} else {
+			pos = atomic_load_explicit( &(queue->dequeue_pos), memory_order_relaxed );
+		}
 	}
+}
 
-	if( (*queue)->action )
+/* Mark the oldest item that may be discarded so the consumer drops it when it gets there.
+   Returns 1 if an item was marked and sets marked_pos to its position */
+static int data_queue_mark_oldest( data_queue_t *queue, size_t *marked_pos )
+{
+	data_queue_cell_t *cell = NULL;
+	size_t pos = 0;
+	size_t end = 0;
+	unsigned char expected = 0;
+
+	pos = atomic_load( &(queue->dequeue_pos) );
+	end = atomic_load( &(queue->enqueue_pos) );
+
+	for( ; pos != end; pos++ )
 	{
-		(*queue)->action = NULL;
+		cell = &(queue->cells[ pos & queue->mask ]);
+
+		// Skip cells that are still being filled or have already been taken
+		if( atomic_load_explicit( &(cell->sequence), memory_order_acquire ) != pos + 1 ) continue;
+
+		expected = DATA_QUEUE_CELL_DROPPABLE;
+		if( atomic_compare_exchange_strong( &(cell->state), &expected, DATA_QUEUE_CELL_DROPPED ) )
+		{
+			*marked_pos = pos;
+			return 1;
+		}
 	}
 
-	data_queue_unlock( *queue );
+	return 0;
+}
 
-	pthread_cond_destroy( &((*queue)->data_signal) );
-	pthread_mutex_destroy( &((*queue)->lock) );
+/* Give a marked item back to the consumer if it hasn't reached it yet */
+static void data_queue_unmark( data_queue_t *queue, size_t marked_pos )
+{
+	data_queue_cell_t *cell = NULL;
+	unsigned char expected = DATA_QUEUE_CELL_DROPPED;
 
-	X_FREENULL( "data_queue_destroy:queue", (void **)queue );
+	cell = &(queue->cells[ marked_pos & queue->mask ]);
+
+	if( atomic_load_explicit( &(cell->sequence), memory_order_acquire ) != marked_pos + 1 ) return;
+
+	atomic_compare_exchange_strong( &(cell->state), &expected, DATA_QUEUE_CELL_DROPPABLE );
 }
 
-void data_queue_add( data_queue_t *queue, void *data, void *context )
+static int data_queue_is_full( data_queue_t *queue )
 {
-	data_queue_item_t *new_item;
-	unsigned char old_state;
+	size_t pos = 0;
+	size_t sequence = 0;
 
-	if( ! queue ) return;
-	if( ! data ) return;
+	pos = atomic_load( &(queue->enqueue_pos) );
+	sequence = atomic_load( &(queue->cells[ pos & queue->mask ].sequence) );
 
-	new_item = data_queue_item_create();
-	
-	if( ! new_item )
+	return ( (intptr_t)sequence - (intptr_t)pos < 0 );
+}
+
+static int data_queue_is_empty( data_queue_t *queue )
+{
+	size_t pos = 0;
+	size_t sequence = 0;
+
+	pos = atomic_load( &(queue->dequeue_pos) );
+	sequence = atomic_load( &(queue->cells[ pos & queue->mask ].sequence) );
+
+	return ( (intptr_t)sequence - (intptr_t)(pos + 1) < 0 );
+}
+
+static void data_queue_drop_item( data_queue_t *queue, void *data, void *context )
+{
+	atomic_fetch_add_explicit( &(queue->dropped), 1, memory_order_relaxed );
+
+	if( queue->drop ) queue->drop( data, context );
+}
+
+/* Wake the consumer if it went to sleep on an empty queue */
+static void data_queue_wake_handler( data_queue_t *queue )
+{
+	uint64_t value = 1;
+
+	atomic_thread_fence( memory_order_seq_cst );
+
+	if( atomic_load_explicit( &(queue->waiting), memory_order_relaxed ) == 0 ) return;
+	if( atomic_exchange( &(queue->waiting), 0 ) == 0 ) return;
+
+	if( write( queue->wake_fd, &value, sizeof( value ) ) < 0 )
 	{
-		logging_printf(LOGGING_DEBUG, "data_queue_add: Insufficient memory to create new data_queue_item\n");
-		return;
+		logging_printf( LOGGING_ERROR, "data_queue_wake_handler: [%s] write failed: %s\n", queue->name, strerror( errno ) );
 	}
+}
+
+/* Wake producers waiting for space */
+static void data_queue_wake_producers( data_queue_t *queue )
+{
+	atomic_thread_fence( memory_order_seq_cst );
 
-	new_item->data = data;
-	new_item->context = context;
+	if( atomic_load_explicit( &(queue->blocked), memory_order_relaxed ) == 0 ) return;
 
-	data_queue_lock( queue );
+	X_MUTEX_LOCK( &(queue->space_lock) );
+	pthread_cond_broadcast( &(queue->space_signal) );
+	X_MUTEX_UNLOCK( &(queue->space_lock) );
+}
+
+/* A negative timeout in microseconds waits forever.
+   Returns 1 if there is space, 0 if the queue was shut down while waiting and -1 if the timeout ran out */
+static int data_queue_wait_for_space( data_queue_t *queue, long timeout )
+{
+	int ret = 1;
+	struct timespec deadline;
+
+	if( timeout >= 0 )
+	{
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_sec += timeout / 1000000;
+		deadline.tv_nsec += ( timeout % 1000000 ) * 1000;
+		if( deadline.tv_nsec >= 1000000000L )
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
 
-	logging_printf( LOGGING_DEBUG, "data_queue_add: Adding item=%p to [%s]\n", new_item, (queue->name?queue->name:"unknown") );
+	X_MUTEX_LOCK( &(queue->space_lock) );
+	atomic_fetch_add( &(queue->blocked), 1 );
 
-	if( queue->top == NULL )
+	while( data_queue_is_full( queue ) )
 	{
-		queue->top = new_item;
+		if( atomic_load( &(queue->shutdown) ) != DATA_QUEUE_CONTINUE )
+		{
+			ret = 0;
+			break;
+		}
+
+		if( timeout < 0 )
+		{
+			pthread_cond_wait( &(queue->space_signal), &(queue->space_lock) );
+		} else if( pthread_cond_timedwait( &(queue->space_signal), &(queue->space_lock), &deadline ) == ETIMEDOUT ) {
+			ret = ( data_queue_is_full( queue ) ? -1 : 1 );
+			break;
+		}
 	}
 
-	if( queue->bottom )
+	atomic_fetch_sub( &(queue->blocked), 1 );
+	X_MUTEX_UNLOCK( &(queue->space_lock) );
+
+	return ret;
+}
+
+int data_queue_add( data_queue_t *queue, void *data, void *context )
+{
+	void *old_data = NULL;
+	void *old_context = NULL;
+	unsigned char keep = 0;
+	int popped = 0;
+	int marked = 0;
+	size_t marked_pos = 0;
+	int space = 0;
+	long timeout = -1;
+
+	if( ! queue ) return DATA_QUEUE_DROPPED;
+	if( ! data ) return DATA_QUEUE_DROPPED;
+
+	if( queue->keep ) keep = ( queue->keep( data, context ) ? 1 : 0 );
+
+	while( ! data_queue_try_push( queue, data, context, keep ) )
 	{
-		queue->bottom->next = new_item;
+		if( atomic_load( &(queue->shutdown) ) != DATA_QUEUE_CONTINUE )
+		{
+			data_queue_drop_item( queue, data, context );
+			return DATA_QUEUE_DROPPED;
+		}
+
+		switch( queue->policy )
+		{
+			case DATA_QUEUE_POLICY_DROP_NEWEST:
+				data_queue_drop_item( queue, data, context );
+				return DATA_QUEUE_DROPPED;
+
+			case DATA_QUEUE_POLICY_DROP_OLDEST:
+				popped = data_queue_try_pop( queue, &old_data, &old_context, 1 );
+				if( popped > 0 )
+				{
+					data_queue_drop_item( queue, old_data, old_context );
+					data_queue_wake_producers( queue );
+					break;
+				}
+				if( popped == 0 ) break;
+
+				// The oldest item must be kept. Give up the oldest one that can go instead and wait for the consumer to reach it.
+				// If everything queued must be kept, discard the new item unless it has to be kept too
+				if( ! marked ) marked = data_queue_mark_oldest( queue, &marked_pos );
+				if( ! marked && ! keep )
+				{
+					data_queue_drop_item( queue, data, context );
+					return DATA_QUEUE_DROPPED;
+				}
+
+				// Don't hold up the producer if the consumer has stalled
+				if( ! keep ) timeout = DATA_QUEUE_DROP_WAIT;
+				/* fall through */
+
+			case DATA_QUEUE_POLICY_BLOCK:
+			default:
+				data_queue_wake_handler( queue );
+				space = data_queue_wait_for_space( queue, timeout );
+				if( space == 0 || ( space < 0 && ! keep ) )
+				{
+					// Only one item is lost when the consumer has stalled
+					if( marked ) data_queue_unmark( queue, marked_pos );
+					data_queue_drop_item( queue, data, context );
+					return DATA_QUEUE_DROPPED;
+				}
+				break;
+		}
 	}
 
-	queue->bottom = new_item;
-	queue->bottom->next = NULL;
+	data_queue_wake_handler( queue );
+
+	return DATA_QUEUE_ADDED;
+}
 
-	old_state = queue->state;
-	queue->state = DATA_QUEUE_USED;
+size_t data_queue_depth( data_queue_t *queue )
+{
+	size_t enqueue_pos = 0;
+	size_t dequeue_pos = 0;
+
+	if( ! queue ) return 0;
+
+	dequeue_pos = atomic_load( &(queue->dequeue_pos) );
+	enqueue_pos = atomic_load( &(queue->enqueue_pos) );
+
+	return ( enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0 );
+}
+
+size_t data_queue_high_water( data_queue_t *queue )
+{
+	if( ! queue ) return 0;
+
+	return atomic_load( &(queue->high_water) );
+}
+
+unsigned long data_queue_dropped( data_queue_t *queue )
+{
+	if( ! queue ) return 0;
+
+	return atomic_load( &(queue->dropped) );
+}
+
+void data_queue_destroy( data_queue_t **queue )
+{
+	void *data = NULL;
+	void *context = NULL;
+
+	if( ! queue ) return;
+	if( ! *queue ) return;
+
+	logging_printf( LOGGING_INFO, "data_queue_destroy: name=[%s] capacity=%zu policy=%s high_water=%zu dropped=%lu\n",
+		(*queue)->name, (*queue)->capacity, data_queue_policy_to_string( (*queue)->policy ),
+		data_queue_high_water( *queue ), data_queue_dropped( *queue ) );
+
+	if( (*queue)->batch )
+	{
+		logging_printf( LOGGING_INFO, "data_queue_destroy: name=[%s] batches=%lu items=%lu max_items=%zu linger=%ld\n",
+			(*queue)->name, (*queue)->batches, (*queue)->batched_items, (*queue)->batch_max, (*queue)->batch_linger );
+	}
+
+	// Anything still queued is handed to the drop function
+	while( data_queue_try_pop( *queue, &data, &context, 0 ) > 0 )
+	{
+		if( (*queue)->drop ) (*queue)->drop( data, context );
+	}
 
-// If the queue was originally empty, signal the queue handler to wake up
-	if( old_state == DATA_QUEUE_EMPTY )
+	if( (*queue)->name )
 	{
-		data_queue_wake_handler( queue );
+		X_FREENULL( "data_queue_destroy:queue->name", (void **) &( (*queue)->name ) );
 	}
 
-	logging_printf( LOGGING_DEBUG, "data_queue_add: queue=%p, name=[%s], top=%p, bottom=%p, id=%lu, state=%u\n",
-		queue, (queue->name ? queue->name : "unknown" ), queue->top, queue->bottom, queue->counter, queue->state );
+	(*queue)->action = NULL;
+	(*queue)->batch = NULL;
 
+	X_FREENULL( "data_queue_destroy:queue->batch_items", (void **) &( (*queue)->batch_items ) );
+	X_FREENULL( "data_queue_destroy:queue->batch_contexts", (void **) &( (*queue)->batch_contexts ) );
 
-	data_queue_unlock( queue );
+	close( (*queue)->wake_fd );
+	pthread_cond_destroy( &((*queue)->space_signal) );
+	pthread_mutex_destroy( &((*queue)->space_lock) );
+
+	X_FREENULL( "data_queue_destroy:queue->cells", (void **) &( (*queue)->cells ) );
+	X_FREENULL( "data_queue_destroy:queue", (void **)queue );
 }
 
-/* Must be locked by caller */
-data_queue_item_t* data_queue_get( data_queue_t *queue )
+/* Sleep until a producer adds something. A negative timeout in microseconds waits forever */
+static void data_queue_wait_for_data( data_queue_t *queue, long timeout )
 {
-	data_queue_item_t *item = NULL;
+	uint64_t value = 0;
+	struct pollfd wake_poll;
+	struct timespec wait_time;
+	int ready = 0;
 
-	if( ! queue ) return NULL;
+	atomic_store( &(queue->waiting), 1 );
 
-	item = queue->top;
-	logging_printf( LOGGING_DEBUG, "data_queue_get: item=%p\n", item );
+	// Check again now the producers can see we are waiting
+	if( ! data_queue_is_empty( queue ) || ( atomic_load( &(queue->shutdown) ) != DATA_QUEUE_CONTINUE ) )
+	{
+		atomic_store( &(queue->waiting), 0 );
+		return;
+	}
 
-	if( queue->top )
+	if( timeout >= 0 )
 	{
-		queue->top = queue->top->next;
+		wake_poll.fd = queue->wake_fd;
+		wake_poll.events = POLLIN;
+		wake_poll.revents = 0;
+		wait_time.tv_sec = timeout / 1000000;
+		wait_time.tv_nsec = ( timeout % 1000000 ) * 1000;
+
+		ready = ppoll( &wake_poll, 1, &wait_time, NULL );
+		if( ready < 0 && errno != EINTR )
+		{
+			logging_printf( LOGGING_ERROR, "data_queue_wait_for_data: [%s] ppoll failed: %s\n", queue->name, strerror( errno ) );
+		}
+		if( ready <= 0 ) goto data_queue_wait_for_data_end;
 	}
 
-	if( ! queue->top )
+	if( read( queue->wake_fd, &value, sizeof( value ) ) < 0 )
 	{
-		queue->bottom = NULL;
+		if( errno != EINTR )
+		{
+			logging_printf( LOGGING_ERROR, "data_queue_wait_for_data: [%s] read failed: %s\n", queue->name, strerror( errno ) );
+		}
 	}
 
-	queue->state = ( queue->top ? DATA_QUEUE_USED: DATA_QUEUE_EMPTY );
+data_queue_wait_for_data_end:
+	atomic_store( &(queue->waiting), 0 );
+}
+
+static long data_queue_now( void )
+{
+	struct timespec now;
 
-	return item;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+
+	return ( now.tv_sec * 1000000L ) + ( now.tv_nsec / 1000 );
 }
 
-static void data_queue_wait_for_data( data_queue_t *queue )
+/* Take everything that is queued, up to the batch limit, and give it to the batch function in one call.
+   If linger is set, wait that long after the first item for the batch to fill up */
+static void data_queue_handle_batch( data_queue_t *queue )
 {
-	if( ! queue ) return;
-	pthread_cond_wait( &(queue->data_signal), &(queue->lock) );
+	size_t count = 0;
+	long deadline = 0;
+	long remaining = 0;
+
+	if( data_queue_try_pop( queue, &(queue->batch_items[0]), &(queue->batch_contexts[0]), 0 ) <= 0 )
+	{
+		data_queue_wait_for_data( queue, -1 );
+		return;
+	}
+	count = 1;
+
+	if( queue->batch_linger > 0 ) deadline = data_queue_now() + queue->batch_linger;
+
+	while( count < queue->batch_max )
+	{
+		if( data_queue_try_pop( queue, &(queue->batch_items[count]), &(queue->batch_contexts[count]), 0 ) > 0 )
+		{
+			count++;
+			continue;
+		}
+
+		if( deadline == 0 ) break;
+		if( atomic_load( &(queue->shutdown) ) != DATA_QUEUE_CONTINUE ) break;
+
+		remaining = deadline - data_queue_now();
+		if( remaining <= 0 ) break;
+
+		data_queue_wake_producers( queue );
+		data_queue_wait_for_data( queue, remaining );
+	}
+
+	data_queue_wake_producers( queue );
+
+	queue->batches++;
+	queue->batched_items += count;
+
+	queue->batch( queue->batch_items, queue->batch_contexts, count );
 }
-	
+
 static void *data_queue_handler( void *data )
 {
 	data_queue_t *queue = NULL;
-	data_queue_item_t *item = NULL;
-	data_queue_action_func_t action = NULL;
 	void *item_data = NULL;
 	void *item_context = NULL;
 
@@ -252,50 +690,28 @@ static void *data_queue_handler( void *data )
 	logging_printf( LOGGING_DEBUG, "data_queue_handler: [%s] thread started\n", (queue->name ? queue->name : "unknown") );
 
 	// Eternal loop until told to shut down
-	while( 1 )
+	while( atomic_load( &(queue->shutdown) ) == DATA_QUEUE_CONTINUE )
 	{
-		item = NULL;
-		action = NULL;
-		item_data = NULL;
-		item_context = NULL;
-
-		data_queue_lock( queue );
-	
-		while( ( queue->state == DATA_QUEUE_EMPTY ) && ( queue->shutdown == DATA_QUEUE_CONTINUE ) )
-		{
-			data_queue_wait_for_data( queue );
-		}
-
-		if( queue->shutdown != DATA_QUEUE_CONTINUE )
+		if( queue->batch )
 		{
-			data_queue_unlock( queue );
-			break;
+			data_queue_handle_batch( queue );
+			continue;
 		}
 
-		item = data_queue_get( queue );
+		item_data = NULL;
+		item_context = NULL;
 
-		if( item )
+		if( data_queue_try_pop( queue, &item_data, &item_context, 0 ) <= 0 )
 		{
-			logging_printf( LOGGING_DEBUG, "data_queue_handler: [%s] got item=%p\n", (queue->name ? queue->name : "unknown") , item );
-			action = queue->action;
-			item_data = item->data;
-			item_context = item->context;
+			data_queue_wait_for_data( queue, -1 );
+			continue;
 		}
 
-		data_queue_unlock( queue );
+		data_queue_wake_producers( queue );
 
-		if( item )
+		if( queue->action )
 		{
-			if( action )
-			{
-				action( item_data, item_context );
-			}
-
-			item->data = NULL;
-			item->context = NULL;
-			item->next = NULL;
-
-			X_FREENULL( "data_queue_handler:item", (void **)&item);
+			queue->action( item_data, item_context );
 		}
 	}
 
@@ -306,13 +722,21 @@ static void *data_queue_handler( void *data )
 
 void data_queue_stop( data_queue_t *queue )
 {
+	uint64_t value = 1;
+
 	if( ! queue ) return;
 
 	logging_printf( LOGGING_DEBUG, "data_queue_stop: name=[%s]\n", ( queue->name  ? queue->name : "unknown") );
-	data_queue_lock( queue );
-	queue->shutdown = 1;
-	data_queue_wake_handler( queue );
-	data_queue_unlock( queue );
+	atomic_store( &(queue->shutdown), DATA_QUEUE_SHUTDOWN );
+
+	if( write( queue->wake_fd, &value, sizeof( value ) ) < 0 )
+	{
+		logging_printf( LOGGING_ERROR, "data_queue_stop: [%s] write failed: %s\n", queue->name, strerror( errno ) );
+	}
+
+	X_MUTEX_LOCK( &(queue->space_lock) );
+	pthread_cond_broadcast( &(queue->space_signal) );
+	X_MUTEX_UNLOCK( &(queue->space_lock) );
 }
 
 void data_queue_start( data_queue_t *queue )
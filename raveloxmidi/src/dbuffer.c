@@ -28,13 +28,13 @@
 
 #include "dbuffer.h"
 
-static void dbuffer_lock( dbuffer_t *dbuffer )
+void dbuffer_lock( dbuffer_t *dbuffer )
 {
 	if( ! dbuffer ) return;
 	X_MUTEX_LOCK( &(dbuffer->lock) );
 }
 
-static void dbuffer_unlock( dbuffer_t *dbuffer )
+void dbuffer_unlock( dbuffer_t *dbuffer )
 {
 	if( ! dbuffer ) return;
 	X_MUTEX_UNLOCK( &(dbuffer->lock) );
@@ -110,7 +110,8 @@ void dbuffer_dump( dbuffer_t *dbuffer )
 	logging_printf(LOGGING_DEBUG, "dbuffer: buffer=%p, len=%u, blocks=%u\n", dbuffer, dbuffer->len, dbuffer->num_blocks );
 }
 
-size_t dbuffer_write( dbuffer_t *dbuffer, const char *in_buffer, size_t in_buffer_len )
+/* Caller must hold the dbuffer lock */
+size_t dbuffer_write_unlocked( dbuffer_t *dbuffer, const char *in_buffer, size_t in_buffer_len )
 {
 	size_t ret = 0;
 	size_t required_len = 0;
@@ -119,8 +120,6 @@ size_t dbuffer_write( dbuffer_t *dbuffer, const char *in_buffer, size_t in_buffe
 	if( ! dbuffer ) return ret;
 	if( ! in_buffer ) return ret;
 
-	dbuffer_lock( dbuffer );
-	
 	required_len = dbuffer->len + in_buffer_len + 1;
 	allocated_len = dbuffer->num_blocks * dbuffer->block_size;
 
@@ -151,13 +150,34 @@ size_t dbuffer_write( dbuffer_t *dbuffer, const char *in_buffer, size_t in_buffe
 	memcpy( dbuffer->data + dbuffer->len, in_buffer, in_buffer_len );
 	dbuffer->len += in_buffer_len;
 	ret = in_buffer_len;
-	if( LOGGING_DEBUG_ENABLED ) dbuffer_dump( dbuffer );
+
 dbuffer_write_end:
+	return ret;
+}
+
+size_t dbuffer_write( dbuffer_t *dbuffer, const char *in_buffer, size_t in_buffer_len )
+{
+	size_t ret = 0;
+
+	if( ! dbuffer ) return ret;
+	if( ! in_buffer ) return ret;
+
+	dbuffer_lock( dbuffer );
+	ret = dbuffer_write_unlocked( dbuffer, in_buffer, in_buffer_len );
+	if( LOGGING_DEBUG_ENABLED ) dbuffer_dump( dbuffer );
 	dbuffer_unlock( dbuffer );
 
 	return ret;
 }
 
+/* Discard the contents but keep the allocation for reuse. Caller must hold the dbuffer lock */
+void dbuffer_clear_unlocked( dbuffer_t *dbuffer )
+{
+	if( ! dbuffer ) return;
+
+	dbuffer->len = 0;
+}
+
 size_t dbuffer_read( dbuffer_t *dbuffer, char **out_buffer )
 {
 	size_t ret = 0;
@@ -75,6 +75,10 @@ int dstring_reset( dstring_t *dstring )
 	}
 	dstring->num_blocks = 1;
 	dstring->data = (unsigned char *)X_MALLOC( dstring->num_blocks * dstring->block_size );
+	if( dstring->data )
+	{
+		memset( dstring->data, 0, dstring->num_blocks * dstring->block_size );
+	}
 	dstring_unlock( dstring );
 	return 1;
 }
@@ -82,8 +86,12 @@ int dstring_reset( dstring_t *dstring )
 void dstring_destroy( dstring_t **dstring )
 {
 	if( ! dstring ) return;
+	if( ! *dstring ) return;
 
-	dstring_reset( *dstring );
+	if( (*dstring)->data )
+	{
+		X_FREE( (*dstring)->data );
+	}
 	pthread_mutex_destroy( &((*dstring)->lock) );
 	X_FREE( *dstring);
 	*dstring = NULL;
@@ -97,10 +105,28 @@ void dstring_dump( dstring_t *dstring )
 	logging_printf(LOGGING_DEBUG, "dstring: buffer=%p, len=%u, blocks=%u\n", dstring, strlen( dstring->data ), dstring->num_blocks );
 }
 
+size_t dstring_len( dstring_t *dstring )
+{
+	size_t len = 0;
+
+	if( ! dstring ) return 0;
+
+	dstring_lock( dstring );
+	if( dstring->data )
+	{
+		len = strlen( (char *)dstring->data );
+	}
+	dstring_unlock( dstring );
+
+	return len;
+}
+
 size_t dstring_append( dstring_t *dstring, const char *in_string )
 {
 	size_t ret = 0;
 	size_t current_alloc = 0;
+	size_t data_len = 0;
+	size_t in_len = 0;
 
 	if( ! dstring ) return ret;
 	if( ! in_string ) return ret;
@@ -108,16 +134,18 @@ size_t dstring_append( dstring_t *dstring, const char *in_string )
 	dstring_lock( dstring );
 	
 	current_alloc = dstring->num_blocks * dstring->block_size;
+	data_len = strlen( (char *)dstring->data );
+	in_len = strlen( in_string );
 
-	logging_printf( LOGGING_DEBUG, "dstring_append: current_alloc=%zu, data len=%zu, in len=%zu\n", current_alloc, strlen(dstring->data), strlen(in_string) );
+	logging_printf( LOGGING_DEBUG, "dstring_append: current_alloc=%zu, data len=%zu, in len=%zu\n", current_alloc, data_len, in_len );
 
-	if( strlen( dstring->data ) + strlen( in_string ) >= current_alloc )
+	if( data_len + in_len >= current_alloc )
 	{
 		char *new_dstring_data = NULL;
 		size_t new_block_count = 0;
 		size_t new_alloc = 0;
 
-		new_alloc = strlen( dstring->data ) + strlen( in_string ) + 1;
+		new_alloc = data_len + in_len + 1;
 
 		new_block_count = ( new_alloc / dstring->block_size ) + 1;
 		new_dstring_data = (char *)X_REALLOC( dstring->data, new_block_count * dstring->block_size );
@@ -129,14 +157,15 @@ size_t dstring_append( dstring_t *dstring, const char *in_string )
 		}
 
 		// Initialise the new memory
-		memset( new_dstring_data + strlen(dstring->data), 0, strlen( in_string ) + 1 );
+		memset( new_dstring_data + data_len, 0, ( new_block_count * dstring->block_size ) - data_len );
 
 		dstring->num_blocks = new_block_count;
 		dstring->data = new_dstring_data;
 	}
 
 
-	strcat( dstring->data, in_string );
+	memcpy( dstring->data + data_len, in_string, in_len + 1 );
+	ret = data_len + in_len;
 	if( LOGGING_DEBUG_ENABLED ) dstring_dump( dstring );
 
 dstring_write_end:
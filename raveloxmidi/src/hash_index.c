@@ -0,0 +1,355 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "utils.h"
+#include "logging.h"
+#include "hash_index.h"
+
+/* A writer makes the sequence odd while it changes the slots of the current table */
+#define hash_index_write_begin( index )	do { \
+		atomic_store_explicit( &(index)->seq, atomic_load_explicit( &(index)->seq, memory_order_relaxed ) + 1, memory_order_relaxed ); \
+		atomic_thread_fence( memory_order_release ); \
+	} while( 0 )
+
+#define hash_index_write_end( index )	atomic_store_explicit( &(index)->seq, atomic_load_explicit( &(index)->seq, memory_order_relaxed ) + 1, memory_order_release )
+
+static size_t hash_index_home( const hash_index_table_t *table, uint32_t key )
+{
+	// Finalizer from MurmurHash3 so SSRCs and tokens that only differ in the high bits still spread out
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+
+	return key & table->mask;
+}
+
+static hash_index_table_t *hash_index_table_create( size_t size )
+{
+	hash_index_table_t *new_table = NULL;
+	size_t real_size = 8;
+	size_t i = 0;
+
+	while( real_size < size ) real_size <<= 1;
+
+	new_table = ( hash_index_table_t * ) X_MALLOC( sizeof( hash_index_table_t ) + ( real_size * sizeof( hash_index_slot_t ) ) );
+
+	if( ! new_table )
+	{
+		logging_printf( LOGGING_ERROR, "hash_index_table_create: Insufficient memory to create table of %zu slots\n", real_size );
+		return NULL;
+	}
+
+	new_table->size = real_size;
+	new_table->mask = real_size - 1;
+	new_table->retired = NULL;
+	new_table->slots = ( hash_index_slot_t * )( new_table + 1 );
+
+	for( i = 0; i < real_size; i++ )
+	{
+		atomic_init( &new_table->slots[i].key, 0 );
+		atomic_init( &new_table->slots[i].data, NULL );
+	}
+
+	return new_table;
+}
+
+/* Only called by a writer holding the index lock */
+static void hash_index_table_put( hash_index_table_t *table, uint32_t key, void *data )
+{
+	size_t i = hash_index_home( table, key );
+
+	while( atomic_load_explicit( &table->slots[i].data, memory_order_relaxed ) )
+	{
+		i = ( i + 1 ) & table->mask;
+	}
+
+	atomic_store_explicit( &table->slots[i].key, key, memory_order_relaxed );
+	atomic_store_explicit( &table->slots[i].data, data, memory_order_relaxed );
+}
+
+hash_index_t *hash_index_create( const char *name, size_t size )
+{
+	hash_index_t *new_index = NULL;
+	hash_index_table_t *table = NULL;
+
+	new_index = ( hash_index_t * ) X_MALLOC( sizeof( hash_index_t ) );
+
+	if( ! new_index )
+	{
+		logging_printf( LOGGING_ERROR, "hash_index_create: Insufficient memory to create index\n");
+		return NULL;
+	}
+
+	memset( new_index, 0, sizeof( hash_index_t ) );
+
+	// Keep the table no more than half full
+	table = hash_index_table_create( MAX( size, HASH_INDEX_DEFAULT_SIZE ) * 2 );
+	if( ! table )
+	{
+		X_FREE( new_index );
+		return NULL;
+	}
+
+	if( name ) new_index->name = X_STRDUP( name );
+
+	atomic_init( &new_index->seq, 0 );
+	atomic_init( &new_index->table, table );
+	pthread_mutex_init( &new_index->lock, NULL );
+
+	return new_index;
+}
+
+void hash_index_destroy( hash_index_t **index )
+{
+	hash_index_table_t *table = NULL;
+
+	if( ! index ) return;
+	if( ! *index ) return;
+
+	table = atomic_load_explicit( &(*index)->table, memory_order_relaxed );
+
+	while( table )
+	{
+		hash_index_table_t *retired = table->retired;
+		X_FREE( table );
+		table = retired;
+	}
+
+	if( (*index)->name )
+	{
+		X_FREE( (*index)->name );
+	}
+
+	pthread_mutex_destroy( &(*index)->lock );
+
+	X_FREENULL( "hash_index", (void **)index );
+}
+
+/* Returns 0 on success */
+int hash_index_insert( hash_index_t *index, uint32_t key, void *data )
+{
+	hash_index_table_t *table = NULL;
+	int ret = -1;
+
+	if( ! index ) return -1;
+	if( ! data ) return -1;
+
+	X_MUTEX_LOCK( &index->lock );
+
+	table = atomic_load_explicit( &index->table, memory_order_relaxed );
+
+	if( ( index->count + 1 ) * 2 > table->size )
+	{
+		hash_index_table_t *new_table = NULL;
+		size_t i = 0;
+
+		new_table = hash_index_table_create( table->size * 2 );
+		if( ! new_table ) goto hash_index_insert_end;
+
+		for( i = 0; i < table->size; i++ )
+		{
+			void *item = atomic_load_explicit( &table->slots[i].data, memory_order_relaxed );
+
+			if( ! item ) continue;
+
+			hash_index_table_put( new_table, atomic_load_explicit( &table->slots[i].key, memory_order_relaxed ), item );
+		}
+
+		// Readers may still be probing the old table so it is only freed with the index
+		new_table->retired = table;
+		atomic_store_explicit( &index->table, new_table, memory_order_release );
+		table = new_table;
+
+		logging_printf( LOGGING_DEBUG, "hash_index_insert: name=[%s] grown to %zu slots\n", index->name, table->size );
+	}
+
+	hash_index_write_begin( index );
+	hash_index_table_put( table, key, data );
+	hash_index_write_end( index );
+
+	index->count++;
+	ret = 0;
+
+hash_index_insert_end:
+	X_MUTEX_UNLOCK( &index->lock );
+
+	return ret;
+}
+
+/* Remove the item stored with key. Returns 0 on success, -1 if it wasn't found */
+int hash_index_remove( hash_index_t *index, uint32_t key, void *data )
+{
+	hash_index_table_t *table = NULL;
+	hash_index_slot_t *slots = NULL;
+	size_t hole = 0;
+	size_t i = 0;
+	int ret = -1;
+
+	if( ! index ) return -1;
+	if( ! data ) return -1;
+
+	X_MUTEX_LOCK( &index->lock );
+
+	table = atomic_load_explicit( &index->table, memory_order_relaxed );
+	slots = table->slots;
+	i = hash_index_home( table, key );
+
+	while( 1 )
+	{
+		void *item = atomic_load_explicit( &slots[i].data, memory_order_relaxed );
+
+		if( ! item ) goto hash_index_remove_end;
+
+		if( item == data && atomic_load_explicit( &slots[i].key, memory_order_relaxed ) == key ) break;
+
+		i = ( i + 1 ) & table->mask;
+	}
+
+	hash_index_write_begin( index );
+
+	// Shift later items in the probe run back so there are no gaps for a lookup to stop at
+	hole = i;
+	while( 1 )
+	{
+		void *item = NULL;
+		size_t home = 0;
+
+		i = ( i + 1 ) & table->mask;
+		item = atomic_load_explicit( &slots[i].data, memory_order_relaxed );
+		if( ! item ) break;
+
+		home = hash_index_home( table, atomic_load_explicit( &slots[i].key, memory_order_relaxed ) );
+
+		// Leave the item alone if its home lies cyclically between the hole and where it is now
+		if( hole <= i ? ( hole < home && home <= i ) : ( hole < home || home <= i ) ) continue;
+
+		atomic_store_explicit( &slots[hole].key, atomic_load_explicit( &slots[i].key, memory_order_relaxed ), memory_order_relaxed );
+		atomic_store_explicit( &slots[hole].data, item, memory_order_relaxed );
+		hole = i;
+	}
+
+	atomic_store_explicit( &slots[hole].data, NULL, memory_order_relaxed );
+	atomic_store_explicit( &slots[hole].key, 0, memory_order_relaxed );
+
+	hash_index_write_end( index );
+
+	index->count--;
+	ret = 0;
+
+hash_index_remove_end:
+	X_MUTEX_UNLOCK( &index->lock );
+
+	return ret;
+}
+
+/* Lock free lookup. Returns the first item with the key that match accepts. If match is NULL, any item with the key is returned */
+void *hash_index_find( hash_index_t *index, uint32_t key, hash_index_match_t match, const void *arg )
+{
+	if( ! index ) return NULL;
+
+	while( 1 )
+	{
+		hash_index_table_t *table = NULL;
+		void *found = NULL;
+		unsigned int start = 0;
+		size_t i = 0;
+		size_t probes = 0;
+
+		start = atomic_load_explicit( &index->seq, memory_order_acquire );
+		if( start & 1 ) continue;
+
+		table = atomic_load_explicit( &index->table, memory_order_acquire );
+		i = hash_index_home( table, key );
+
+		for( probes = 0; probes < table->size; probes++ )
+		{
+			void *item = atomic_load_explicit( &table->slots[i].data, memory_order_relaxed );
+
+			if( ! item ) break;
+
+			if( atomic_load_explicit( &table->slots[i].key, memory_order_relaxed ) == key )
+			{
+				if( ! match || match( item, arg ) )
+				{
+					found = item;
+					break;
+				}
+			}
+
+			i = ( i + 1 ) & table->mask;
+		}
+
+		atomic_thread_fence( memory_order_acquire );
+
+		if( atomic_load_explicit( &index->seq, memory_order_relaxed ) == start )
+		{
+			return found;
+		}
+	}
+}
+
+size_t hash_index_count( hash_index_t *index )
+{
+	size_t count = 0;
+
+	if( ! index ) return 0;
+
+	X_MUTEX_LOCK( &index->lock );
+	count = index->count;
+	X_MUTEX_UNLOCK( &index->lock );
+
+	return count;
+}
+
+/* FNV-1a */
+uint32_t hash_index_string_key( const char *string )
+{
+	uint32_t key = 2166136261u;
+
+	if( ! string ) return 0;
+
+	while( *string )
+	{
+		key ^= ( unsigned char )*string++;
+		key *= 16777619u;
+	}
+
+	return key;
+}
+
+void hash_index_dump( hash_index_t *index )
+{
+	hash_index_table_t *table = NULL;
+
+	DEBUG_ONLY;
+	if( ! index ) return;
+
+	X_MUTEX_LOCK( &index->lock );
+	table = atomic_load_explicit( &index->table, memory_order_relaxed );
+	logging_printf( LOGGING_DEBUG, "hash_index: name=[%s] count=%zu size=%zu\n", index->name, index->count, table->size );
+	X_MUTEX_UNLOCK( &index->lock );
+}
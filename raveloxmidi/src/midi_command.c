@@ -22,10 +22,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "config.h"
 
 #include "midi_command.h"
+#include "data_pool.h"
 #include "utils.h"
 
 #include "logging.h"
@@ -57,17 +59,57 @@ static midi_message_t midi_message_map[] = {
         { 0x00, MIDI_NULL, "NULL" , 0}
 };
 
+static data_pool_t *midi_command_pool = NULL;
+static pthread_mutex_t midi_command_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long midi_command_data_mallocs = 0;
+
+void midi_command_init( void )
+{
+	midi_command_pool = data_pool_create( "midi_command", sizeof( midi_command_t ), MIDI_COMMAND_POOL_CACHE_SIZE, MIDI_COMMAND_POOL_MAX_ITEMS );
+
+	if( ! midi_command_pool )
+	{
+		logging_printf( LOGGING_WARN, "midi_command_init: Unable to create command pool. Commands will be allocated individually\n");
+	}
+}
+
+void midi_command_teardown( void )
+{
+	X_MUTEX_LOCK( &midi_command_stats_lock );
+	logging_printf( LOGGING_INFO, "midi_command_teardown: data_mallocs=%lu\n", midi_command_data_mallocs );
+	X_MUTEX_UNLOCK( &midi_command_stats_lock );
+
+	data_pool_destroy( &midi_command_pool );
+}
+
+static void midi_command_free_data( midi_command_t *command )
+{
+	if( command->data && ( command->data != command->inline_data ) )
+	{
+		X_FREE( command->data );
+	}
+
+	command->data = NULL;
+	command->data_len = 0;
+}
+
 midi_command_t *midi_command_create(void)
 {
 	midi_command_t *new_command = NULL;
 
-	new_command = ( midi_command_t * ) X_MALLOC ( sizeof( midi_command_t ) );
+	if( midi_command_pool )
+	{
+		new_command = ( midi_command_t * ) data_pool_get( midi_command_pool );
+	} else {
+		new_command = ( midi_command_t * ) X_MALLOC ( sizeof( midi_command_t ) );
+	}
 
 	if( ! new_command ) return NULL;
 
 	new_command->delta = 0;
 	new_command->status = 0;
 	new_command->data = NULL;
+	new_command->data_len = 0;
 
 	return new_command;
 }
@@ -80,7 +122,14 @@ void midi_command_destroy( void **data )
 	if( ! *data ) return;
 
 	command = (midi_command_t **)data;
-	if( (*command)->data ) X_FREENULL( "midi_command:command->data",(void **) &( (*command)->data ) );
+	midi_command_free_data( *command );
+
+	if( midi_command_pool )
+	{
+		data_pool_put( midi_command_pool, *command );
+		*command = NULL;
+		return;
+	}
 
 	X_FREENULL( "midi_command:command", (void **) command );
 }
@@ -92,8 +141,7 @@ void midi_command_reset( midi_command_t *command )
 	command->delta = 0;
 	command->status = 0;
 
-	if(command->data) X_FREE( command->data );
-	command->data = NULL;
+	midi_command_free_data( command );
 }
 
 void midi_command_map( const midi_command_t *command, char **description, enum midi_message_type_t *message_type)
@@ -159,14 +207,22 @@ void midi_command_set( midi_command_t *command, uint64_t delta, uint8_t status,
 	
 	if( data )
 	{
-		command->data = ( char * ) X_MALLOC( data_len );
-		if( ! command->data )
+		if( data_len <= MIDI_COMMAND_INLINE_SIZE )
 		{
-			logging_printf( LOGGING_ERROR, "midi_command_set: Insufficient memory to create command data buffer\n");
-		return;
+			command->data = command->inline_data;
+		} else {
+			command->data = ( unsigned char * ) X_MALLOC( data_len );
+			if( ! command->data )
+			{
+				logging_printf( LOGGING_ERROR, "midi_command_set: Insufficient memory to create command data buffer\n");
+				return;
+			}
+
+			X_MUTEX_LOCK( &midi_command_stats_lock );
+			midi_command_data_mallocs++;
+			X_MUTEX_UNLOCK( &midi_command_stats_lock );
 		}
 
-		memset( command->data, 0, data_len );
 		memcpy( command->data, data, data_len );
 		command->data_len = data_len;
 	}
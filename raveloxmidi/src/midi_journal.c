@@ -30,251 +30,83 @@
 
 #include "logging.h"
 
-void journal_header_pack( const journal_header_t *header , char **packed , size_t *size )
+/* Write the journal header into JOURNAL_HEADER_PACKED_SIZE bytes at p */
+static void journal_header_write( const journal_header_t *header, unsigned char *p )
 {
-	char *p = NULL;
+	size_t size = 0;
 
-	*packed = NULL;
-	*size = 0;
-
-	if( ! header ) return;
-
-	*packed = ( char *)X_MALLOC( JOURNAL_HEADER_PACKED_SIZE );
-
-	if( ! *packed ) return;
-	memset( *packed, 0 , JOURNAL_HEADER_PACKED_SIZE );
-
-	p = *packed;
-
-	*p |= ( ( header->bitfield & 0x0f ) << 4 );
+	*p = ( ( header->bitfield & 0x0f ) << 4 );
 	*p |= ( ( header->totchan == 0 ? 0 : header->totchan - 1 ) & 0x0f ) ;
+	p++;
 
-	p += sizeof( char );
-	*size += sizeof( char );
-
-	put_uint16( (unsigned char **)&p, header->seq, size );
-}
-
-journal_header_t * journal_header_create( void )
-{
-	journal_header_t *journal_header = NULL;
-
-	journal_header = ( journal_header_t * ) X_MALLOC( sizeof( journal_header_t ) );
-	
-	if( journal_header )
-	{
-		memset( journal_header , 0 , sizeof( journal_header_t ) );
-		journal_header->bitfield |= JOURNAL_HEADER_S_FLAG;
-	}
-
-	return journal_header;
+	put_uint16( &p, header->seq, &size );
 }
 
-void journal_header_destroy( journal_header_t **header )
+/* Write the channel header into CHANNEL_HEADER_PACKED_SIZE bytes at p */
+static void channel_header_write( const channel_header_t *header, unsigned char *p )
 {
-	if( header ) X_FREENULL( "journal_header", (void **)header );
-}
-
-void channel_header_pack( const channel_header_t *header , unsigned char **packed , size_t *size )
-{
-	unsigned char *p = NULL;
 	uint16_t temp_header = 0;
-
-	*packed = NULL;
-	*size = 0;
-
-	if( ! header ) return;
-
-	*packed = ( unsigned char *)X_MALLOC( CHANNEL_HEADER_PACKED_SIZE );
-
-	if( ! *packed ) return;
-
-	memset( *packed, 0, CHANNEL_HEADER_PACKED_SIZE );
-
-	p = *packed;
+	size_t size = 0;
 
 	temp_header |= ( header->S << 15 );
 	temp_header |= ( ( ( header->chan == 0 ? 0 : header->chan - 1 ) & 0x0f ) << 11 );
 	temp_header |= ( ( header->H & 0x01 ) << 10 );
 	temp_header |= ( ( header->len & 0x03ff ) );
 
-	put_uint16( &p, temp_header, size );
+	put_uint16( &p, temp_header, &size );
 
 	*p = header->bitfield;
-	*size += sizeof( header->bitfield );
 }
 
-void channel_header_destroy( channel_header_t **header )
+/* Pack the channel journal at p. Returns the packed length or 0 if it would need more than space bytes */
+static size_t channel_pack( channel_t *channel, unsigned char *p, size_t space )
 {
-	if( header) X_FREENULL( "channel_header", (void **)header);
-}
+	unsigned char buffer[ CHANNEL_MAX_PACKED_SIZE ];
+	unsigned char *q = buffer + CHANNEL_HEADER_PACKED_SIZE;
 
-channel_header_t * channel_header_create( void )
-{
-	channel_header_t *header = NULL;
+	// The order of chapters is: PCMWNETA
+	if( channel->header.bitfield & CHAPTER_P ) q += chapter_p_pack( &(channel->chapter_p), q );
+	if( channel->header.bitfield & CHAPTER_C ) q += chapter_c_pack( &(channel->chapter_c), q );
+	if( channel->header.bitfield & CHAPTER_M ) q += chapter_m_pack( &(channel->chapter_m), q );
+	if( channel->header.bitfield & CHAPTER_W ) q += chapter_w_pack( &(channel->chapter_w), q );
+	if( channel->header.bitfield & CHAPTER_N ) q += chapter_n_pack( &(channel->chapter_n), q );
+	if( channel->header.bitfield & CHAPTER_T ) q += chapter_t_pack( &(channel->chapter_t), q );
+	if( channel->header.bitfield & CHAPTER_A ) q += chapter_a_pack( &(channel->chapter_a), q );
 
-	header = ( channel_header_t * ) X_MALLOC( sizeof( channel_header_t ) );
+	channel->header.len = q - buffer;
+	if( channel->header.len > space ) return 0;
 
-	if( header )
-	{
-		memset( header, 0 , sizeof( channel_header_t ) );
-		header->S = 1;
-	}
+	channel_header_write( &(channel->header), buffer );
+	memcpy( p, buffer, channel->header.len );
 
-	return header;
+	return channel->header.len;
 }
 
-void channel_pack( channel_t *channel, char **packed, size_t *size )
-{
-	unsigned char *packed_channel_header = NULL;
-	unsigned char *packed_chapter_n = NULL;
-	unsigned char *packed_chapter_c = NULL;
-	unsigned char *packed_chapter_p = NULL;
-	
-	size_t packed_channel_header_size = 0;
-	size_t packed_chapter_n_size = 0;
-	size_t packed_chapter_c_size = 0;
-	size_t packed_chapter_p_size = 0;
-
-	char *p = NULL;
-
-	*packed = NULL;
-	*size = 0;
-
-	if( ! channel ) return;
-
-	channel->header->len = CHANNEL_HEADER_PACKED_SIZE;
-	logging_printf(LOGGING_DEBUG, "channel_pack: channel->header->len=%u\n", channel->header->len);
-
-// The order of chapters is: PCMWNETA
-	if( channel->chapter_p )
-	{
-		chapter_p_pack( channel->chapter_p, &packed_chapter_p, &packed_chapter_p_size );
-		channel->header->len += packed_chapter_p_size;
-		logging_printf(LOGGING_DEBUG, "channel_pack: packed_chapter_p_size=%u channel->header->len=%u\n", packed_chapter_p_size,channel->header->len);
-	}
-
-	if( channel->chapter_c )
-	{
-		chapter_c_pack( channel->chapter_c, &packed_chapter_c, &packed_chapter_c_size );
-		channel->header->len += packed_chapter_c_size;
-		logging_printf(LOGGING_DEBUG, "channel_pack: packed_chapter_c_size=%u channel->header->len=%u\n", packed_chapter_c_size,channel->header->len);
-	}
-
-	if( channel->chapter_n )
-	{
-		chapter_n_pack( channel->chapter_n, &packed_chapter_n, &packed_chapter_n_size );
-		channel->header->len += packed_chapter_n_size;
-		logging_printf(LOGGING_DEBUG, "channel_pack: packed_chapter_n_size=%u channel->header->len=%u\n", packed_chapter_n_size,channel->header->len);
-	}
-
-
-	channel_header_dump( channel->header );
-	channel_header_pack( channel->header, &packed_channel_header, &packed_channel_header_size );
-	logging_printf(LOGGING_DEBUG, "channel_pack: packed_channel_header_size=%u channel->header->len=%u\n", packed_channel_header_size,channel->header->len);
-
-	*packed = ( char * ) X_MALLOC( packed_channel_header_size + packed_chapter_n_size + packed_chapter_c_size + packed_chapter_p_size );
-
-	if( ! *packed ) goto channel_pack_cleanup;
-
-	p = *packed;
-
-	memcpy( p, packed_channel_header, packed_channel_header_size );
-	*size += packed_channel_header_size;
-	p += packed_channel_header_size;
-	
-// The order of chapters is: PCMWNETA
-	if( packed_chapter_p_size > 0 )
-	{
-		memcpy( p, packed_chapter_p, packed_chapter_p_size );
-		*size += packed_chapter_p_size;
-		p += packed_chapter_p_size;
-	}
-
-	if( packed_chapter_c_size > 0 )
-	{
-		memcpy( p, packed_chapter_c, packed_chapter_c_size );
-		*size += packed_chapter_c_size;
-		p += packed_chapter_c_size;
-	}
-
-	if( packed_chapter_n_size > 0 )
-	{
-		memcpy( p, packed_chapter_n, packed_chapter_n_size );
-		*size += packed_chapter_n_size;
-	}
-
-channel_pack_cleanup:
-	X_FREENULL( "packed_channel_header", (void **)&packed_channel_header );
-	X_FREENULL( "packed_chapter_n", (void **)&packed_chapter_n );
-	X_FREENULL( "packed_chapter_c", (void **)&packed_chapter_c );
-	X_FREENULL( "packed_chapter_p", (void **)&packed_chapter_p );
-}
+#define channel_is_active( channel )	( (channel)->header.chan != 0 )
 
-void channel_destroy( channel_t **channel )
+/* Carry out any reset or trim that was asked for since the journal was last changed */
+static void journal_apply_pending( journal_t *journal )
 {
-	if( ! channel ) return;
-	if( ! *channel ) return;
-
-	if( (*channel)->chapter_n )
-	{
-		chapter_n_destroy( &( (*channel)->chapter_n ) );
-	}
-
-	if( (*channel)->chapter_c )
-	{
-		chapter_c_destroy( &( (*channel)->chapter_c ) );
-	}
-
-	if( (*channel)->chapter_p )
-	{
-		chapter_p_destroy( &( (*channel)->chapter_p ) );
-
-	}
-
-	if( (*channel)->header )
+	if( journal->reset_pending )
 	{
-		channel_header_destroy( &( (*channel)->header ) );
+		journal->reset_pending = 0;
+		journal->trim_pending = 0;
+		journal_reset( journal );
+		return;
 	}
 
-	X_FREENULL("channel", (void **) channel);
-}
-
-channel_t * channel_create( void )
-{
-	channel_t *new_channel = NULL;
-	channel_header_t *new_header = NULL;
-	
-	new_channel = ( channel_t * ) X_MALLOC( sizeof( channel_t ) );
-
-	if( ! new_channel ) return NULL;
-
-	new_header = channel_header_create();
-
-	if( ! new_header )
+	if( journal->trim_pending )
 	{
-		channel_destroy( &new_channel );
-		return NULL;
+		journal->trim_pending = 0;
+		journal_trim( journal, journal->trim_checkpoint );
 	}
-
-	new_channel->header = new_header;
-
-	new_channel->chapter_n = NULL;
-	new_channel->chapter_c = NULL;
-	new_channel->chapter_p = NULL;
-		
-	return new_channel;
 }
 
-void journal_pack( journal_t *journal, char **packed, size_t *size )
+/* Hand out the packed journal. The bytes are held in the journal and are only packed again if it changed.
+   They stay valid until the journal is next changed or packed so the caller must not free them */
+void journal_pack( journal_t *journal, const char **packed, size_t *size )
 {
-	char *packed_journal_header = NULL;
-	size_t packed_journal_header_size = 0;
-	char *packed_channel = NULL;
-	size_t packed_channel_size = 0;
-	char *packed_channel_buffer = NULL;	
-	size_t packed_channel_buffer_size = 0;
-	char *p = NULL;
+	unsigned char *p = NULL;
 	int i = 0;
 
 	*packed = NULL;
@@ -282,49 +114,53 @@ void journal_pack( journal_t *journal, char **packed, size_t *size )
 
 	if( ! journal ) return;
 
-	logging_printf( LOGGING_DEBUG, "journal_pack: journal_has_data = %s header->totchan=%u\n", ( journal_has_data( journal )  ? "YES" : "NO" ) , journal->header->totchan);
-	if(  ! journal_has_data( journal ) ) return;
+	journal_apply_pending( journal );
 
-	journal_header_pack( journal->header, &packed_journal_header, &packed_journal_header_size );
+	logging_printf( LOGGING_DEBUG, "journal_pack: journal_has_data = %s header.totchan=%u dirty=%u\n", ( journal_has_data( journal )  ? "YES" : "NO" ) , journal->header.totchan, journal->dirty);
+	if(  ! journal_has_data( journal ) ) return;
 
-	for( i = 0 ; i < MAX_MIDI_CHANNELS ; i++ )
+	if( journal->dirty )
 	{
-		if( ! journal->channels[i] ) continue;
+		p = journal->packed + JOURNAL_HEADER_PACKED_SIZE;
+
+		for( i = 0 ; i < MAX_MIDI_CHANNELS ; i++ )
+		{
+			channel_t *channel = &(journal->channels[i]);
+			size_t channel_len = 0;
 
-		channel_pack( journal->channels[i], &packed_channel, &packed_channel_size );
+			if( ! channel_is_active( channel ) ) continue;
 
-		packed_channel_buffer = ( char * )X_REALLOC( packed_channel_buffer, packed_channel_buffer_size + packed_channel_size );
-		if( ! packed_channel_buffer ) goto journal_pack_cleanup;
+			channel_len = channel_pack( channel, p, JOURNAL_MAX_PACKED_SIZE - ( p - journal->packed ) );
+			if( channel_len == 0 ) break;
 
-		p = packed_channel_buffer + packed_channel_buffer_size;
-		memset( p, 0, packed_channel_size );
+			p += channel_len;
+		}
 
-		packed_channel_buffer_size += packed_channel_size;
-		memcpy( p, packed_channel, packed_channel_size );
+		if( i == MAX_MIDI_CHANNELS )
+		{
+			journal_header_write( &(journal->header), journal->packed );
+		} else {
+			journal_header_t empty_header;
+
+			// Too big to send. Fall back to a journal header with no channel journals until feedback trims it
+			logging_printf( LOGGING_DEBUG, "journal_pack: journal is bigger than %d bytes. Sending the header only\n", JOURNAL_MAX_PACKED_SIZE );
+			empty_header.bitfield = JOURNAL_HEADER_S_FLAG;
+			empty_header.totchan = 0;
+			empty_header.seq = journal->header.seq;
+			journal_header_write( &empty_header, journal->packed );
+			p = journal->packed + JOURNAL_HEADER_PACKED_SIZE;
+		}
 
-		X_FREENULL( "packed_channel", (void **)&packed_channel );
+		journal->packed_len = p - journal->packed;
+		journal->dirty = 0;
 	}
 
-	// Join it all together
-
-	*packed = ( char * )X_MALLOC( packed_journal_header_size + packed_channel_buffer_size );
-	p = *packed;
-	memcpy( p, packed_journal_header, packed_journal_header_size );
-	*size += packed_journal_header_size;
-	p += packed_journal_header_size;
-
-	memcpy( p, packed_channel_buffer, packed_channel_buffer_size );
-	*size += packed_channel_buffer_size;
-	
-journal_pack_cleanup:
-	X_FREENULL( "packed_channel", (void **)&packed_channel );
-	X_FREENULL( "packed_channel_buffer", (void **)&packed_channel_buffer );
-	X_FREENULL( "packed_journal_header", (void **)&packed_journal_header );
+	*packed = (const char *)journal->packed;
+	*size = journal->packed_len;
 }
 
 int journal_init( journal_t **journal )
 {
-	journal_header_t *header;
 	unsigned char i;
 
 	*journal = ( journal_t * ) X_MALLOC( sizeof ( journal_t ) );
@@ -334,218 +170,205 @@ int journal_init( journal_t **journal )
 		return -1;
 	}
 
-	header = journal_header_create();
-		
-	if( ! header )
-	{
-		X_FREE( *journal );
-		*journal = NULL;
-		return -1;
-	}
+	memset( *journal, 0, sizeof( journal_t ) );
 
-	(*journal)->header = header;
+	journal_header_reset( &( (*journal)->header ) );
 
 	for( i = 0 ; i < MAX_MIDI_CHANNELS ; i++ )
 	{
-		(*journal)->channels[i] = NULL;
+		chapter_m_init( &( (*journal)->channels[i].chapter_m ) );
+		channel_journal_reset( &( (*journal)->channels[i] ) );
 	}
 
+	(*journal)->dirty = 1;
+
 	return 0;
 }
 
 void journal_destroy( journal_t **journal )
 {
-	unsigned int i = 0;
-
 	if( ! journal ) return;
 	if( ! *journal) return;
 
-	for( i = 0 ; i < MAX_MIDI_CHANNELS ; i++ )
+	X_FREENULL( "journal", (void **)journal );
+}
+
+/* Get the channel ready to take a new command and mark the chapter as changed */
+static channel_t *journal_channel_touch( journal_t *journal, uint32_t seq, unsigned char channel, uint8_t chapter )
+{
+	channel_t *channel_journal = &( journal->channels[ channel ] );
+
+	// The checkpoint is the oldest packet the journal covers
+	if( ! journal_has_data( journal ) )
 	{
-		if( (*journal)->channels[i] )
-		{
-			channel_destroy( &( (*journal)->channels[i] ) );
-		}
+		journal->header.seq = seq;
 	}
 
-	if( (*journal)->header )
+	// Set Journal Header A and S flags
+	journal->header.bitfield |= ( JOURNAL_HEADER_A_FLAG | JOURNAL_HEADER_S_FLAG );
+
+	// Set flag to show that the chapter is present
+	channel_journal->header.bitfield |= chapter;
+
+	if( channel_journal->header.chan != ( channel + 1 ) )
 	{
-		journal_header_destroy( &( (*journal)->header ) );
-		(*journal)->header = NULL;
+		channel_journal->header.chan = ( channel + 1 );
+		journal->header.totchan +=1;
 	}
 
-	X_FREE( *journal );
-	*journal = NULL;
+	journal->dirty = 1;
+
+	return channel_journal;
 }
 
-void midi_journal_add_note( journal_t *journal, uint32_t seq, const midi_note_t *midi_note)
+void midi_journal_add_note( journal_t *journal, uint32_t seq, const midi_command_t *command )
 {
-	uint16_t note_slot = 0;
-	chapter_n_note_t *new_note = NULL;
+	channel_t *channel_journal = NULL;
 	unsigned char channel = 0;
+	unsigned char note = 0;
+	unsigned char velocity = 0;
 
 	if( ! journal ) return;
-	if( ! midi_note ) return;
+	if( ! command ) return;
+	if( command->data_len < 2 ) return;
+
+	journal_apply_pending( journal );
 
-	channel = midi_note->channel;
+	channel = command->channel_message.channel;
 	if( channel >= MAX_MIDI_CHANNELS ) return;
 
-	// Set Journal Header A and S flags
-	journal->header->bitfield |= ( JOURNAL_HEADER_A_FLAG | JOURNAL_HEADER_S_FLAG );
-	
-	if( ! journal->channels[ channel ] )
-	{
-		channel_t *channel_journal = channel_create();
+	note = command->data[0] & 0x7f;
+	velocity = command->data[1] & 0x7f;
 
-		if( ! channel_journal ) return;
-		journal->channels[ channel ] = channel_journal;
+	channel_journal = journal_channel_touch( journal, seq, channel, CHAPTER_N );
 
-	}
+	channel_journal->chapter_n.B = 1;
 
-	if( ! journal->channels[ channel ]->chapter_n )
+	// A NOTE ON with zero velocity is a NOTE OFF
+	if( command->channel_message.message == MIDI_COMMAND_NOTE_OFF || velocity == 0 )
 	{
-		journal->channels[ channel ]->chapter_n = chapter_n_create();
+		chapter_n_note_off( &(channel_journal->chapter_n), seq, note );
+	} else {
+		chapter_n_note_on( &(channel_journal->chapter_n), seq, note, velocity );
 	}
+}
 
-	journal->channels[ channel ]->header->bitfield |= CHAPTER_N;
-	journal->channels[ channel ]->chapter_n->header->B = 1;
+void midi_journal_add_control( journal_t *journal, uint32_t seq, const midi_command_t *command )
+{
+	channel_t *channel_journal = NULL;
+	unsigned char channel = 0;
+	unsigned char controller = 0;
+	unsigned char value = 0;
 
-	if( journal->channels[ channel ]->header->chan != ( channel + 1 ) )
-	{
-		journal->channels[ channel ]->header->chan = ( channel + 1 );
-		journal->header->totchan +=1;
-	}
+	if( ! journal ) return;
+	if( ! command ) return;
+	if( command->data_len < 2 ) return;
 
-	journal->header->seq = seq;
+	journal_apply_pending( journal );
 
-	// Need to update NOTE OFF bits if the command is NOTE OFF
-	if( midi_note->command == MIDI_COMMAND_NOTE_OFF )
-	{
-		uint8_t offset, shift;
+	channel = command->channel_message.channel;
+	if( channel >= MAX_MIDI_CHANNELS ) return;
 
-		// Which element
-		offset = (midi_note->note) / 8;
-		shift = ( (midi_note->note) - ( offset * 8 )) - 1;
+	controller = command->data[0] & 0x7f;
+	if( controller > (MAX_CHAPTER_C_CONTROLLERS - 1) ) return;
 
-		// Set low and high values;
-		journal->channels[ channel ]->chapter_n->header->high = MAX( offset , journal->channels[ channel ]->chapter_n->header->high );
-		journal->channels[ channel ]->chapter_n->header->low = MIN( offset , journal->channels[ channel ]->chapter_n->header->low );
+	value = command->data[1] & 0x7f;
 
-		journal->channels[ channel ]->chapter_n->offbits[offset] |=  ( 1 << shift );
+	// RPN and NRPN controllers are journaled as parameters in chapter M rather than as values in chapter C
+	if( CHAPTER_M_IS_PARAMETER_CONTROLLER( controller ) )
+	{
+		channel_journal = &( journal->channels[ channel ] );
 
+		if( chapter_m_control( &(channel_journal->chapter_m), seq, controller, value ) )
+		{
+			journal_channel_touch( journal, seq, channel, CHAPTER_M );
+		}
 		return;
 	}
 
-	if( journal->channels[ channel ]->chapter_n->num_notes == MAX_CHAPTER_N_NOTES ) return;
-
-	new_note = chapter_n_note_create();
-	if(! new_note ) return;
+	channel_journal = journal_channel_touch( journal, seq, channel, CHAPTER_C );
 
-	new_note->num = midi_note->note;
-	new_note->velocity = midi_note->velocity;
-
-	note_slot = journal->channels[ channel ]->chapter_n->num_notes;
-
-	journal->channels[ channel ]->chapter_n->notes[note_slot] = new_note;
-	journal->channels[ channel ]->chapter_n->num_notes++;
+	chapter_c_set( &(channel_journal->chapter_c), seq, controller, value );
 }
 
-void midi_journal_add_control( journal_t *journal, uint32_t seq, const midi_control_t *midi_control)
+void midi_journal_add_program( journal_t *journal, uint32_t seq, const midi_command_t *command )
 {
+	channel_t *channel_journal = NULL;
 	unsigned char channel = 0;
-	unsigned char controller = 0;
 
 	if( ! journal ) return;
-	if( ! midi_control ) return;
-
-	channel = midi_control->channel;
-	if( channel >= MAX_MIDI_CHANNELS ) return;
-
-	controller = midi_control->controller_number;
-	if( controller > (MAX_CHAPTER_C_CONTROLLERS - 1) ) return;
+	if( ! command ) return;
+	if( command->data_len < 1 ) return;
 
-	// Set Journal Header A and S flags
-	journal->header->bitfield |= ( JOURNAL_HEADER_A_FLAG | JOURNAL_HEADER_S_FLAG );
-	
-	if( ! journal->channels[ channel ] )
-	{
-		channel_t *channel_journal = channel_create();
+	journal_apply_pending( journal );
 
-		if( ! channel_journal ) return;
-		journal->channels[ channel ] = channel_journal;
+	channel = command->channel_message.channel;
+	if( channel >= MAX_MIDI_CHANNELS ) return;
 
-	}
+	channel_journal = journal_channel_touch( journal, seq, channel, CHAPTER_P );
 
-	if( ! journal->channels[ channel ]->chapter_c )
-	{
-		journal->channels[ channel ]->chapter_c = chapter_c_create();
-	}
+	channel_journal->chapter_p.S = 1;
+	channel_journal->chapter_p.B = 0;
+	channel_journal->chapter_p.program = command->data[0] & 0x7f;
+	channel_journal->chapter_p.X =0;
+	channel_journal->chapter_p.bank_msb = 0;
+	channel_journal->chapter_p.bank_lsb = 0;
+	channel_journal->chapter_p.seq = seq;
+}
 
-	// Set flag to show that chapter C is present
-	journal->channels[ channel ]->header->bitfield |= CHAPTER_C;
+void midi_journal_add_pitch_bend( journal_t *journal, uint32_t seq, const midi_command_t *command )
+{
+	channel_t *channel_journal = NULL;
 
-	if( journal->channels[ channel ]->header->chan != ( channel + 1 ) )
-	{
-		journal->channels[ channel ]->header->chan = ( channel + 1 );
-		journal->header->totchan +=1;
-	}
+	if( ! journal ) return;
+	if( ! command ) return;
+	if( command->data_len < 2 ) return;
 
-	journal->header->seq = seq;
+	journal_apply_pending( journal );
 
+	channel_journal = journal_channel_touch( journal, seq, command->channel_message.channel, CHAPTER_W );
 
-	journal->channels[ channel ]->chapter_c->controller_log[ controller ].S = 1;
-	journal->channels[ channel ]->chapter_c->controller_log[ controller ].number = controller;
-	journal->channels[ channel ]->chapter_c->controller_log[ controller ].value = midi_control->controller_value;
+	channel_journal->chapter_w.S = 1;
+	channel_journal->chapter_w.first = command->data[0] & 0x7f;
+	channel_journal->chapter_w.R = 0;
+	channel_journal->chapter_w.second = command->data[1] & 0x7f;
+	channel_journal->chapter_w.seq = seq;
 }
 
-void midi_journal_add_program( journal_t *journal, uint32_t seq, const midi_program_t *midi_program)
+void midi_journal_add_channel_pressure( journal_t *journal, uint32_t seq, const midi_command_t *command )
 {
-	unsigned char channel = 0;
+	channel_t *channel_journal = NULL;
 
 	if( ! journal ) return;
-	if( ! midi_program ) return;
-
-	channel = midi_program->channel;
-	if( channel >= MAX_MIDI_CHANNELS ) return;
+	if( ! command ) return;
+	if( command->data_len < 1 ) return;
 
-	// Set Journal Header A and S flags
-	journal->header->bitfield |= ( JOURNAL_HEADER_A_FLAG | JOURNAL_HEADER_S_FLAG );
-	
-	if( ! journal->channels[ channel ] )
-	{
-		channel_t *channel_journal = channel_create();
+	journal_apply_pending( journal );
 
-		if( ! channel_journal ) return;
-		journal->channels[ channel ] = channel_journal;
+	channel_journal = journal_channel_touch( journal, seq, command->channel_message.channel, CHAPTER_T );
 
-	}
+	channel_journal->chapter_t.S = 1;
+	channel_journal->chapter_t.pressure = command->data[0] & 0x7f;
+	channel_journal->chapter_t.seq = seq;
+}
 
-	if( ! journal->channels[ channel ]->chapter_p )
-	{
-		journal->channels[ channel ]->chapter_p = chapter_p_create();
-	}
+void midi_journal_add_poly_pressure( journal_t *journal, uint32_t seq, const midi_command_t *command )
+{
+	channel_t *channel_journal = NULL;
 
-	// Set flag to show that chapter P is present
-	journal->channels[ channel ]->header->bitfield |= CHAPTER_P;
+	if( ! journal ) return;
+	if( ! command ) return;
+	if( command->data_len < 2 ) return;
 
-	if( journal->channels[ channel ]->header->chan != ( channel + 1 ) )
-	{
-		journal->channels[ channel ]->header->chan = ( channel + 1 );
-		journal->header->totchan +=1;
-	}
+	journal_apply_pending( journal );
 
-	journal->header->seq = seq;
+	channel_journal = journal_channel_touch( journal, seq, command->channel_message.channel, CHAPTER_A );
 
-	journal->channels[ channel]->chapter_p->S = 1;
-	journal->channels[ channel]->chapter_p->B = 0;
-	journal->channels[ channel]->chapter_p->program = midi_program->program;
-	journal->channels[ channel]->chapter_p->X =0;
-	journal->channels[ channel]->chapter_p->bank_msb = 0;
-	journal->channels[ channel]->chapter_p->bank_lsb = 0;
+	chapter_a_set( &(channel_journal->chapter_a), seq, command->data[0] & 0x7f, command->data[1] );
 }
 
 
-void channel_header_dump( channel_header_t *header )
+void channel_header_dump( const channel_header_t *header )
 {
 	DEBUG_ONLY;
 	if( ! header ) return;
@@ -560,28 +383,46 @@ void channel_header_reset( channel_header_t *header )
 	header->chan = 0;
 	header->S = 1;
 	header->H = 0;
+	header->len = 0;
 	header->bitfield = 0;
 }
 
-void channel_journal_dump( channel_t *channel )
+void channel_journal_dump( const channel_t *channel )
 {
 	DEBUG_ONLY;
 	if( ! channel ) return;
+	if( ! channel_is_active( channel ) ) return;
 
 	logging_printf(LOGGING_DEBUG,"channel_journal_dump\n");
-	channel_header_dump( channel->header );
+	channel_header_dump( &(channel->header) );
 
-	if( channel->header->bitfield & CHAPTER_P )
+	if( channel->header.bitfield & CHAPTER_P )
+	{
+		chapter_p_dump( &(channel->chapter_p) );
+	}
+	if( channel->header.bitfield & CHAPTER_C )
+	{
+		chapter_c_dump( &(channel->chapter_c) );
+	}
+	if( channel->header.bitfield & CHAPTER_M )
+	{
+		chapter_m_dump( &(channel->chapter_m) );
+	}
+	if( channel->header.bitfield & CHAPTER_W )
+	{
+		chapter_w_dump( &(channel->chapter_w) );
+	}
+	if( channel->header.bitfield & CHAPTER_N )
 	{
-		chapter_p_dump( channel->chapter_p );
+		chapter_n_dump( &(channel->chapter_n) );
 	}
-	if( channel->header->bitfield & CHAPTER_C )
+	if( channel->header.bitfield & CHAPTER_T )
 	{
-		chapter_c_dump( channel->chapter_c );
+		chapter_t_dump( &(channel->chapter_t) );
 	}
-	if( channel->header->bitfield & CHAPTER_N )
+	if( channel->header.bitfield & CHAPTER_A )
 	{
-		chapter_n_dump( channel->chapter_n );
+		chapter_a_dump( &(channel->chapter_a) );
 	}
 }
 
@@ -589,30 +430,32 @@ void channel_journal_reset( channel_t *channel )
 {
 	if( ! channel ) return;
 
-	if( channel->header )
-	{
-		logging_printf(LOGGING_DEBUG, "channel_journal_reset( %u )\n", channel->header->chan);
-	}
-	chapter_n_reset( channel->chapter_n );
-	chapter_c_reset( channel->chapter_c );
-	channel_header_reset( channel->header );
+	logging_printf(LOGGING_DEBUG, "channel_journal_reset( %u )\n", channel->header.chan);
+
+	chapter_p_reset( &(channel->chapter_p) );
+	chapter_n_reset( &(channel->chapter_n) );
+	chapter_c_reset( &(channel->chapter_c) );
+	chapter_m_reset( &(channel->chapter_m) );
+	chapter_w_reset( &(channel->chapter_w) );
+	chapter_t_reset( &(channel->chapter_t) );
+	chapter_a_reset( &(channel->chapter_a) );
+	channel_header_reset( &(channel->header) );
 }
 
-int journal_has_data( journal_t *journal )
+int journal_has_data( const journal_t *journal )
 {
 	if( ! journal ) return 0;
-	if( ! journal->header ) return 0;
 
-	return (journal->header->totchan > 0);
+	return (journal->header.totchan > 0);
 }
 
-void journal_header_dump( journal_header_t *header )
+void journal_header_dump( const journal_header_t *header )
 {
 	DEBUG_ONLY;
 	if( ! header ) return;
 
 	logging_printf( LOGGING_DEBUG, "Journal (Header: bitfield=%02x totchan=%d seq=%04x)\n", header->bitfield, header->totchan, header->seq);
-	logging_printf( LOGGING_DEBUG, "Header Size = %u\n", sizeof( journal_header_t ) );
+	logging_printf( LOGGING_DEBUG, "Header Size = %zu\n", sizeof( journal_header_t ) );
 }
 
 void journal_header_reset( journal_header_t *header )
@@ -624,17 +467,17 @@ void journal_header_reset( journal_header_t *header )
 	header->seq = 0;
 }
 
-void journal_dump( journal_t *journal )
+void journal_dump( const journal_t *journal )
 {
 	unsigned int i = 0;
 	DEBUG_ONLY;
 	if( ! journal ) return;
 
-	journal_header_dump( journal->header );
+	journal_header_dump( &(journal->header) );
 
 	for( i = 0 ; i < MAX_MIDI_CHANNELS ; i++ )
 	{
-		channel_journal_dump( journal->channels[i] );
+		channel_journal_dump( &(journal->channels[i]) );
 	}
 }
 
@@ -647,9 +490,153 @@ void journal_reset( journal_t *journal )
 
 	for( i = 0 ; i < MAX_MIDI_CHANNELS ; i++ )
 	{
-		channel_journal_reset( journal->channels[i] );
+		channel_journal_reset( &(journal->channels[i]) );
+	}
+
+	journal_header_reset( &(journal->header) );
+	journal->dirty = 1;
+}
+
+/* Ask for the journal to be reset. This can be called while another thread is still sending the packed journal */
+void journal_request_reset( journal_t *journal )
+{
+	if( ! journal ) return;
+
+	journal->reset_pending = 1;
+
+}
+
+/* Drop the chapters of a channel that only hold history up to the checkpoint. Returns non-zero if anything changed */
+static int channel_journal_trim( channel_t *channel, uint32_t checkpoint )
+{
+	int changed = 0;
+
+	if( ( channel->header.bitfield & CHAPTER_P ) && channel->chapter_p.seq <= checkpoint )
+	{
+		chapter_p_reset( &(channel->chapter_p) );
+		channel->header.bitfield &= ~CHAPTER_P;
+		changed = 1;
+	}
+
+	if( channel->header.bitfield & CHAPTER_C )
+	{
+		if( chapter_c_trim( &(channel->chapter_c), checkpoint ) > 0 )
+		{
+			changed = 1;
+		}
+
+		if( ! chapter_c_has_data( &(channel->chapter_c) ) )
+		{
+			channel->header.bitfield &= ~CHAPTER_C;
+		}
+	}
+
+	if( channel->header.bitfield & CHAPTER_M )
+	{
+		if( chapter_m_trim( &(channel->chapter_m), checkpoint ) > 0 )
+		{
+			changed = 1;
+		}
+
+		if( channel->chapter_m.num_logs == 0 )
+		{
+			channel->header.bitfield &= ~CHAPTER_M;
+		}
+	}
+
+	if( ( channel->header.bitfield & CHAPTER_W ) && channel->chapter_w.seq <= checkpoint )
+	{
+		chapter_w_reset( &(channel->chapter_w) );
+		channel->header.bitfield &= ~CHAPTER_W;
+		changed = 1;
+	}
+
+	if( channel->header.bitfield & CHAPTER_N )
+	{
+		if( chapter_n_trim( &(channel->chapter_n), checkpoint ) > 0 )
+		{
+			changed = 1;
+		}
+
+		if( ! chapter_n_has_data( &(channel->chapter_n) ) )
+		{
+			channel->header.bitfield &= ~CHAPTER_N;
+		}
+	}
+
+	if( ( channel->header.bitfield & CHAPTER_T ) && channel->chapter_t.seq <= checkpoint )
+	{
+		chapter_t_reset( &(channel->chapter_t) );
+		channel->header.bitfield &= ~CHAPTER_T;
+		changed = 1;
+	}
+
+	if( channel->header.bitfield & CHAPTER_A )
+	{
+		if( chapter_a_trim( &(channel->chapter_a), checkpoint ) > 0 )
+		{
+			changed = 1;
+		}
+
+		if( ! chapter_a_has_data( &(channel->chapter_a) ) )
+		{
+			channel->header.bitfield &= ~CHAPTER_A;
+		}
+	}
+
+	return changed;
+}
+
+/* RFC6295 Appendix C.2.2.2. Once a packet has been acknowledged the journal no longer needs to cover it or anything before it.
+   checkpoint is the extended sequence number of the acknowledged packet */
+void journal_trim( journal_t *journal, uint32_t checkpoint )
+{
+	unsigned int i = 0;
+	int changed = 0;
+
+	if( ! journal ) return;
+	if( ! journal_has_data( journal ) ) return;
+
+	for( i = 0 ; i < MAX_MIDI_CHANNELS ; i++ )
+	{
+		channel_t *channel = &(journal->channels[i]);
+
+		if( ! channel_is_active( channel ) ) continue;
+
+		if( ! channel_journal_trim( channel, checkpoint ) ) continue;
+
+		changed = 1;
+
+		if( channel->header.bitfield == 0 )
+		{
+			channel_journal_reset( channel );
+			journal->header.totchan -= 1;
+		}
+	}
+
+	if( ! changed ) return;
+
+	logging_printf( LOGGING_DEBUG, "journal_trim: checkpoint=%u totchan=%u\n", checkpoint, journal->header.totchan );
+
+	if( journal->header.totchan == 0 )
+	{
+		journal_header_reset( &(journal->header) );
+	} else {
+		journal->header.seq = checkpoint + 1;
 	}
 
-	journal_header_reset( journal->header );
+	journal->dirty = 1;
+}
+
+/* Ask for the journal to be trimmed back to the checkpoint. Like journal_request_reset(), this can be called while the packed journal is still being sent */
+void journal_request_trim( journal_t *journal, uint32_t checkpoint )
+{
+	if( ! journal ) return;
+
+	if( ! journal->trim_pending || checkpoint > journal->trim_checkpoint )
+	{
+		journal->trim_checkpoint = checkpoint;
+	}
 
+	journal->trim_pending = 1;
 }
@@ -318,6 +318,69 @@ midi_payload_unpack_success:
 	return;
 }
 
+/* Parse the MIDI payload header in place. The command list and journal are left in buffer */
+int midi_payload_view_unpack( midi_payload_view_t *view, unsigned char *buffer, size_t buffer_len )
+{
+	unsigned char *p;
+	size_t current_len;
+	uint16_t temp_len;
+
+	if( ! view ) return -1;
+
+	memset( view, 0, sizeof( midi_payload_view_t ) );
+
+	if( ! buffer ) return -1;
+	if( buffer_len == 0 ) return -1;
+
+	p = buffer;
+	current_len = buffer_len;
+
+	view->header.B = ( *p & PAYLOAD_HEADER_B ) ? 1 : 0;
+	view->header.J = ( *p & PAYLOAD_HEADER_J ) ? 1 : 0;
+	view->header.Z = ( *p & PAYLOAD_HEADER_Z ) ? 1 : 0;
+	view->header.P = ( *p & PAYLOAD_HEADER_P ) ? 1 : 0;
+
+	if( view->header.B && ( current_len == 1 ) )
+	{
+		logging_printf(LOGGING_ERROR, "midi_payload_view_unpack: B flag set but insufficent buffer data\n" );
+		return -1;
+	} 
+
+	temp_len = ( *p & 0x0f );
+	current_len--;
+
+	if( view->header.B )
+	{
+		p++;
+		current_len--;
+		temp_len <<= 8;
+		temp_len += *p;
+	}
+
+	view->header.len = temp_len;
+	p++;
+
+	if( current_len < temp_len ) 
+	{
+		logging_printf(LOGGING_ERROR, "midi_payload_view_unpack: Insufficent buffer data : current_len=%zu temp_len=%u\n", current_len, temp_len );
+		return -1;
+	}
+
+	view->buffer = p;
+	p += temp_len;
+	current_len -= temp_len;
+
+	if( view->header.J && ( current_len > 0 ) )
+	{
+		view->journal = p;
+		view->journal_len = current_len;
+	}
+
+	midi_payload_header_dump( &(view->header) );
+
+	return 0;
+}
+
 void midi_command_to_payload( const midi_command_t *command, midi_payload_t **payload )
 {
 	size_t new_payload_size = 0;
@@ -0,0 +1,417 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "midi_recovery.h"
+#include "midi_note.h"
+#include "midi_control.h"
+#include "midi_program.h"
+#include "utils.h"
+
+#include "logging.h"
+
+/*
+*---------------------
+*	RFC6295 Section 4 and Appendix B.
+*
+*	The receiver keeps track of the notes, controllers and programs it has played for each channel.
+*	When packets are lost, the recovery journal in the next packet is compared with that state and
+*	the differences are turned into MIDI commands. Those are played before the commands in the packet.
+*
+*	Only chapters P, C and N are used. Other chapters are skipped. Lost note-ons are not replayed
+*	because the note would sound late, but lost note-offs, controller values and program changes are.
+*---------------------
+*/
+
+/* Where the repair commands are written */
+typedef struct midi_recovery_list_t {
+	unsigned char *data;
+	size_t size;
+	size_t len;
+	size_t count;
+	char z_flag;
+} midi_recovery_list_t;
+
+midi_recovery_t *midi_recovery_create( void )
+{
+	midi_recovery_t *new_recovery = NULL;
+
+	new_recovery = ( midi_recovery_t * )X_MALLOC( sizeof( midi_recovery_t ) );
+
+	if( ! new_recovery )
+	{
+		logging_printf( LOGGING_ERROR, "midi_recovery_create: Insufficient memory\n" );
+		return NULL;
+	}
+
+	memset( new_recovery, 0, sizeof( midi_recovery_t ) );
+
+	return new_recovery;
+}
+
+void midi_recovery_destroy( midi_recovery_t **recovery )
+{
+	if( ! recovery ) return;
+	if( ! *recovery ) return;
+
+	X_FREENULL( "midi_recovery", (void **)recovery );
+}
+
+void midi_recovery_reset( midi_recovery_t *recovery )
+{
+	if( ! recovery ) return;
+
+	memset( recovery, 0, sizeof( midi_recovery_t ) );
+}
+
+/* Record a command that the receiver has played */
+void midi_recovery_track( midi_recovery_t *recovery, uint8_t status, const uint8_t *data, size_t data_len )
+{
+	midi_recovery_channel_t *channel = NULL;
+
+	if( ! recovery ) return;
+	if( status < 0x80 || status >= 0xF0 ) return;
+
+	channel = &( recovery->channels[ status & 0x0f ] );
+
+	switch( ( status & 0xf0 ) >> 4 )
+	{
+		case MIDI_COMMAND_NOTE_OFF:
+			if( data_len < 1 ) return;
+			JOURNAL_MAP_CLEAR( channel->notes, data[0] & 0x7f );
+			break;
+		case MIDI_COMMAND_NOTE_ON:
+			if( data_len < 2 ) return;
+			// A NOTE ON with zero velocity is a NOTE OFF
+			if( data[1] == 0 )
+			{
+				JOURNAL_MAP_CLEAR( channel->notes, data[0] & 0x7f );
+			} else {
+				JOURNAL_MAP_SET( channel->notes, data[0] & 0x7f );
+			}
+			break;
+		case MIDI_COMMAND_CONTROL_CHANGE:
+			if( data_len < 2 ) return;
+			JOURNAL_MAP_SET( channel->controllers, data[0] & 0x7f );
+			channel->value[ data[0] & 0x7f ] = data[1] & 0x7f;
+
+			switch( data[0] )
+			{
+				// Bank select MSB and LSB
+				case 0:
+					channel->bank_msb = data[1] & 0x7f;
+					break;
+				case 32:
+					channel->bank_lsb = data[1] & 0x7f;
+					break;
+				// All Sound Off and All Notes Off
+				case 120:
+				case 123:
+					memset( channel->notes, 0, sizeof( channel->notes ) );
+					break;
+				default:
+					break;
+			}
+			break;
+		case MIDI_COMMAND_PROGRAM_CHANGE:
+			if( data_len < 1 ) return;
+			channel->program_known = 1;
+			channel->program = data[0] & 0x7f;
+			break;
+		default:
+			break;
+	}
+}
+
+/* Check the sequence number of an inbound packet.
+   Returns the number of packets lost since the previous one, 0 if there are none or -1 if the packet is late or a duplicate */
+int midi_recovery_check( midi_recovery_t *recovery, uint16_t seq )
+{
+	int16_t delta = 0;
+
+	if( ! recovery ) return 0;
+
+	if( ! recovery->seq_valid )
+	{
+		recovery->seq_valid = 1;
+		recovery->seq = seq;
+		return 0;
+	}
+
+	delta = (int16_t)( seq - recovery->seq );
+
+	if( delta <= 0 ) return -1;
+
+	recovery->seq = seq;
+
+	if( delta > 1 )
+	{
+		recovery->lost += ( delta - 1 );
+	}
+
+	return delta - 1;
+}
+
+/* Add a command to the repair list. Every command is given a zero delta so they are all played straight away */
+static void midi_recovery_emit( midi_recovery_list_t *list, uint8_t status, uint8_t data1, uint8_t data2, size_t data_len )
+{
+	// Room for a delta, the command and the final delta
+	if( list->len + 1 + 1 + data_len + 1 > list->size ) return;
+
+	if( list->count > 0 || list->z_flag )
+	{
+		list->data[ list->len++ ] = 0x00;
+	}
+
+	list->data[ list->len++ ] = status;
+	list->data[ list->len++ ] = data1 & 0x7f;
+	if( data_len > 1 )
+	{
+		list->data[ list->len++ ] = data2 & 0x7f;
+	}
+
+	list->count++;
+}
+
+static void midi_recovery_program( midi_recovery_channel_t *channel, uint8_t chan, const chapter_p_t *chapter_p, midi_recovery_list_t *list )
+{
+	if( channel->program_known && channel->program == chapter_p->program )
+	{
+		if( ! chapter_p->B ) return;
+		if( channel->bank_msb == chapter_p->bank_msb && channel->bank_lsb == chapter_p->bank_lsb ) return;
+	}
+
+	// The bank has to be selected before the program change
+	if( chapter_p->B )
+	{
+		midi_recovery_emit( list, ( MIDI_COMMAND_CONTROL_CHANGE << 4 ) | chan, 0, chapter_p->bank_msb, 2 );
+		midi_recovery_emit( list, ( MIDI_COMMAND_CONTROL_CHANGE << 4 ) | chan, 32, chapter_p->bank_lsb, 2 );
+	}
+
+	midi_recovery_emit( list, ( MIDI_COMMAND_PROGRAM_CHANGE << 4 ) | chan, chapter_p->program, 0, 1 );
+}
+
+static void midi_recovery_controllers( midi_recovery_channel_t *channel, uint8_t chan, const chapter_c_t *chapter_c, midi_recovery_list_t *list )
+{
+	int word = 0;
+
+	for( word = 0; word < JOURNAL_MAP_WORDS; word++ )
+	{
+		uint64_t bits = chapter_c->present[ word ];
+
+		while( bits )
+		{
+			uint8_t controller = ( word * 64 ) + __builtin_ctzll( bits );
+
+			bits &= ( bits - 1 );
+
+			if( JOURNAL_MAP_TEST( channel->controllers, controller ) && channel->value[ controller ] == chapter_c->value[ controller ] ) continue;
+
+			midi_recovery_emit( list, ( MIDI_COMMAND_CONTROL_CHANGE << 4 ) | chan, controller, chapter_c->value[ controller ], 2 );
+		}
+	}
+}
+
+static void midi_recovery_notes( midi_recovery_channel_t *channel, uint8_t chan, const chapter_n_t *chapter_n, midi_recovery_list_t *list )
+{
+	int i = 0;
+
+	// Only the notes that the sender has turned off but are still playing here need to be sent
+	for( i = 0; i < MAX_OFFBITS; i++ )
+	{
+		uint8_t bits = chapter_n->offbits[ i ];
+
+		while( bits )
+		{
+			uint8_t bit = __builtin_clz( bits ) - 24;
+			uint8_t note = ( i * 8 ) + bit;
+
+			bits &= ~( 0x80 >> bit );
+
+			if( ! JOURNAL_MAP_TEST( channel->notes, note ) ) continue;
+
+			midi_recovery_emit( list, ( MIDI_COMMAND_NOTE_OFF << 4 ) | chan, note, 0, 2 );
+		}
+	}
+}
+
+/* Compare the chapters in a channel journal with what has been played on the channel */
+static void midi_recovery_channel( midi_recovery_t *recovery, uint8_t chan, uint8_t bitfield, const unsigned char *chapters, size_t len, midi_recovery_list_t *list )
+{
+	midi_recovery_channel_t *channel = &( recovery->channels[ chan ] );
+	chapter_p_t chapter_p;
+	chapter_c_t chapter_c;
+	chapter_n_t chapter_n;
+	size_t used = 0;
+
+	// The order of chapters is: PCMWNETA
+	if( bitfield & CHAPTER_P )
+	{
+		used = chapter_p_unpack( chapters, len, &chapter_p );
+		if( used == 0 ) return;
+
+		midi_recovery_program( channel, chan, &chapter_p, list );
+		chapters += used;
+		len -= used;
+	}
+
+	if( bitfield & CHAPTER_C )
+	{
+		used = chapter_c_unpack( chapters, len, &chapter_c );
+		if( used == 0 ) return;
+
+		midi_recovery_controllers( channel, chan, &chapter_c, list );
+		chapters += used;
+		len -= used;
+	}
+
+	// Chapter M has a 10 bit length that includes its header
+	if( bitfield & CHAPTER_M )
+	{
+		if( len < 2 ) return;
+
+		used = ( ( chapters[0] & 0x03 ) << 8 ) | chapters[1];
+		if( used < 2 || used > len ) return;
+
+		chapters += used;
+		len -= used;
+	}
+
+	// Chapter W is always 2 bytes
+	if( bitfield & CHAPTER_W )
+	{
+		if( len < 2 ) return;
+
+		chapters += 2;
+		len -= 2;
+	}
+
+	if( bitfield & CHAPTER_N )
+	{
+		used = chapter_n_unpack( chapters, len, &chapter_n );
+		if( used == 0 ) return;
+
+		midi_recovery_notes( channel, chan, &chapter_n, list );
+	}
+}
+
+/* Turn the differences between the recovery journal and the played state into a MIDI list.
+   The list is written so that it can go in front of the MIDI list of the packet that the journal arrived in.
+   Returns the length of the list */
+size_t midi_recovery_repair( midi_recovery_t *recovery, const unsigned char *journal, size_t journal_len, char z_flag, unsigned char *list, size_t list_size )
+{
+	midi_recovery_list_t repair;
+	const unsigned char *p = NULL;
+	size_t remaining = 0;
+	uint8_t flags = 0;
+	unsigned int totchan = 0;
+	unsigned int i = 0;
+
+	if( ! recovery ) return 0;
+	if( ! journal ) return 0;
+	if( ! list ) return 0;
+
+	if( journal_len < JOURNAL_HEADER_PACKED_SIZE ) return 0;
+
+	memset( &repair, 0, sizeof( midi_recovery_list_t ) );
+	repair.data = list;
+	repair.size = list_size;
+	repair.z_flag = z_flag;
+
+	p = journal;
+	remaining = journal_len;
+
+	flags = ( p[0] & 0xf0 ) >> 4;
+	totchan = ( p[0] & 0x0f ) + 1;
+
+	logging_printf( LOGGING_DEBUG, "midi_recovery_repair: flags=0x%02x totchan=%u checkpoint=%u journal_len=%zu\n", flags, totchan, ( p[1] << 8 ) | p[2], journal_len );
+
+	p += JOURNAL_HEADER_PACKED_SIZE;
+	remaining -= JOURNAL_HEADER_PACKED_SIZE;
+
+	// Skip the system journal. Its 10 bit length includes its header
+	if( flags & JOURNAL_HEADER_Y_FLAG )
+	{
+		size_t system_len = 0;
+
+		if( remaining < 2 ) return 0;
+
+		system_len = ( ( p[0] & 0x03 ) << 8 ) | p[1];
+		if( system_len < 2 || system_len > remaining ) return 0;
+
+		p += system_len;
+		remaining -= system_len;
+	}
+
+	if( ! ( flags & JOURNAL_HEADER_A_FLAG ) ) return 0;
+
+	for( i = 0; i < totchan; i++ )
+	{
+		uint8_t chan = 0;
+		size_t channel_len = 0;
+		uint8_t bitfield = 0;
+
+		if( remaining < CHANNEL_HEADER_PACKED_SIZE ) break;
+
+		chan = ( p[0] & 0x78 ) >> 3;
+		channel_len = ( ( p[0] & 0x03 ) << 8 ) | p[1];
+		bitfield = p[2];
+
+		if( channel_len < CHANNEL_HEADER_PACKED_SIZE || channel_len > remaining )
+		{
+			logging_printf( LOGGING_WARN, "midi_recovery_repair: Invalid channel journal length (%zu) for channel %u\n", channel_len, chan + 1 );
+			break;
+		}
+
+		midi_recovery_channel( recovery, chan, bitfield, p + CHANNEL_HEADER_PACKED_SIZE, channel_len - CHANNEL_HEADER_PACKED_SIZE, &repair );
+
+		p += channel_len;
+		remaining -= channel_len;
+	}
+
+	if( repair.count == 0 ) return 0;
+
+	// The first command in the packet needs a delta after the repair commands
+	if( ! z_flag )
+	{
+		repair.data[ repair.len++ ] = 0x00;
+	}
+
+	recovery->repaired += repair.count;
+
+	logging_printf( LOGGING_DEBUG, "midi_recovery_repair: commands=%zu len=%zu\n", repair.count, repair.len );
+
+	return repair.len;
+}
+
+void midi_recovery_dump( const midi_recovery_t *recovery )
+{
+	DEBUG_ONLY;
+	if( ! recovery ) return;
+
+	logging_printf( LOGGING_DEBUG, "midi_recovery: seq=%u lost=%llu repaired=%llu\n", recovery->seq,
+		(unsigned long long)recovery->lost, (unsigned long long)recovery->repaired );
+}
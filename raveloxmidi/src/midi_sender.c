@@ -18,12 +18,17 @@
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
 */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include "midi_command.h"
 
 #include "utils.h"
@@ -39,8 +44,6 @@ extern int errno;
 // File handle for storing inbound MIDI commands
 extern int inbound_midi_fd;
 
-#include "config.h"
-
 #include "net_applemidi.h"
 #include "net_response.h"
 #include "net_socket.h"
@@ -68,9 +71,253 @@ extern int inbound_midi_fd;
 
 data_queue_t *midi_queue = NULL;
 static unsigned int journal_enabled = 0;
+static unsigned int batch_enabled = 0;
 
 #define RTP_PACKET_HEADER_SIZE 12
 
+#define MIDI_SENDER_HEADER_SIZE	( RTP_PACKET_HEADER_SIZE + 2 )
+
+/* One outbound packet per connection. These are reused for every fan-out so the sender doesn't allocate per packet.
+   Only the header and journal belong to the connection. The MIDI list is shared and goes out with its own iovec */
+typedef struct midi_sender_slot_t {
+	net_ctx_t *ctx;
+	unsigned char header[ MIDI_SENDER_HEADER_SIZE ];
+	size_t header_len;
+	const unsigned char *list;
+	size_t list_len;
+	const char *journal;
+	size_t journal_len;
+	size_t len;
+	struct sockaddr_storage address;
+	socklen_t address_len;
+	/* Range of batch items packed into this packet and what the list was built for */
+	size_t first;
+	size_t end;
+	size_t list_offset;
+	size_t list_limit;
+	char list_filtered;
+	long timestamp;
+} midi_sender_slot_t;
+
+#define MIDI_SENDER_IOV_PER_SLOT	3
+
+static midi_sender_slot_t *send_slots = NULL;
+static struct mmsghdr *send_msgs = NULL;
+static struct iovec *send_iov = NULL;
+static net_ctx_t **send_peers = NULL;
+static size_t *send_next = NULL;
+static size_t send_capacity = 0;
+
+/* A queued command along with the details taken from its context */
+typedef struct midi_sender_item_t {
+	midi_command_t *command;
+	uint32_t originator_ssrc;
+	int alsa_card_hash;
+	long timestamp;
+	enum midi_message_type_t message_type;
+} midi_sender_item_t;
+
+static midi_sender_item_t *batch_items = NULL;
+static unsigned char *batch_list = NULL;
+static size_t batch_list_size = 0;
+
+/* Largest delta time that fits in the four octets RFC6295 allows */
+#define MIDI_SENDER_MAX_DELTA	0x0fffffff
+
+/* Make sure there is a slot for each connection */
+static int midi_sender_slots_reserve( size_t count )
+{
+	midi_sender_slot_t *new_slots = NULL;
+	struct mmsghdr *new_msgs = NULL;
+	struct iovec *new_iov = NULL;
+	net_ctx_t **new_peers = NULL;
+	size_t *new_next = NULL;
+	size_t new_capacity = 0;
+
+	if( count <= send_capacity ) return 0;
+
+	new_capacity = MAX( count, send_capacity * 2 );
+
+	new_slots = (midi_sender_slot_t *)X_REALLOC( send_slots, new_capacity * sizeof( midi_sender_slot_t ) );
+	if( ! new_slots ) goto midi_sender_slots_reserve_fail;
+	send_slots = new_slots;
+	memset( send_slots + send_capacity, 0, ( new_capacity - send_capacity ) * sizeof( midi_sender_slot_t ) );
+
+	new_msgs = (struct mmsghdr *)X_REALLOC( send_msgs, new_capacity * sizeof( struct mmsghdr ) );
+	if( ! new_msgs ) goto midi_sender_slots_reserve_fail;
+	send_msgs = new_msgs;
+
+	new_iov = (struct iovec *)X_REALLOC( send_iov, new_capacity * MIDI_SENDER_IOV_PER_SLOT * sizeof( struct iovec ) );
+	if( ! new_iov ) goto midi_sender_slots_reserve_fail;
+	send_iov = new_iov;
+
+	new_next = (size_t *)X_REALLOC( send_next, new_capacity * sizeof( size_t ) );
+	if( ! new_next ) goto midi_sender_slots_reserve_fail;
+	send_next = new_next;
+
+	new_peers = (net_ctx_t **)X_REALLOC( send_peers, new_capacity * sizeof( net_ctx_t * ) );
+	if( ! new_peers ) goto midi_sender_slots_reserve_fail;
+	send_peers = new_peers;
+
+	send_capacity = new_capacity;
+	return 0;
+
+midi_sender_slots_reserve_fail:
+	logging_printf( LOGGING_ERROR, "midi_sender_slots_reserve: Insufficient memory for %zu send slots\n", new_capacity );
+	return -1;
+}
+
+static void midi_sender_slots_destroy( void )
+{
+	X_FREENULL( "send_slots", (void **)&send_slots );
+	X_FREENULL( "send_msgs", (void **)&send_msgs );
+	X_FREENULL( "send_iov", (void **)&send_iov );
+	X_FREENULL( "send_next", (void **)&send_next );
+	X_FREENULL( "send_peers", (void **)&send_peers );
+	send_capacity = 0;
+
+	X_FREENULL( "batch_items", (void **)&batch_items );
+	X_FREENULL( "batch_list", (void **)&batch_list );
+	batch_list_size = 0;
+}
+
+/* Submit the prepared packets with as few sendmmsg() calls as possible and report any that didn't go */
+static void midi_sender_slots_flush( size_t count )
+{
+	int send_socket = -1;
+	size_t i = 0;
+	size_t next = 0;
+
+	if( count == 0 ) return;
+
+	send_socket = net_socket_get_data_socket();
+
+	for( i = 0; i < count; i++ )
+	{
+		struct iovec *iov = &send_iov[ i * MIDI_SENDER_IOV_PER_SLOT ];
+
+		iov[0].iov_base = send_slots[i].header;
+		iov[0].iov_len = send_slots[i].header_len;
+		iov[1].iov_base = (void *)send_slots[i].list;
+		iov[1].iov_len = send_slots[i].list_len;
+		iov[2].iov_base = (void *)send_slots[i].journal;
+		iov[2].iov_len = send_slots[i].journal_len;
+
+		memset( &send_msgs[i], 0, sizeof( struct mmsghdr ) );
+		send_msgs[i].msg_hdr.msg_name = &(send_slots[i].address);
+		send_msgs[i].msg_hdr.msg_namelen = send_slots[i].address_len;
+		send_msgs[i].msg_hdr.msg_iov = iov;
+		send_msgs[i].msg_hdr.msg_iovlen = ( send_slots[i].journal_len > 0 ? 3 : 2 );
+	}
+
+	while( next < count )
+	{
+		int sent = 0;
+
+		sent = sendmmsg( send_socket, send_msgs + next, count - next, MSG_DONTWAIT );
+
+		/* Nothing from next onwards was sent. Report the packet at next and carry on with the rest */
+		if( sent < 0 )
+		{
+			if( errno == EINTR ) continue;
+			logging_printf( LOGGING_ERROR, "midi_sender_slots_flush: Failed to send %zu bytes to [%s]:%u\t%s\n", send_slots[next].len, send_slots[next].ctx->ip_address, send_slots[next].ctx->data_port, strerror( errno ) );
+			next++;
+			continue;
+		}
+
+		/* Only possible if the kernel stops early without an error, skip the packet rather than spin */
+		if( sent == 0 )
+		{
+			next++;
+			continue;
+		}
+
+		for( i = next; i < next + sent; i++ )
+		{
+			if( send_msgs[i].msg_len == 0 )
+			{
+				logging_printf( LOGGING_ERROR, "midi_sender_slots_flush: Failed to send %zu bytes to [%s]:%u\n", send_slots[i].len, send_slots[i].ctx->ip_address, send_slots[i].ctx->data_port );
+			} else if( send_msgs[i].msg_len < send_slots[i].len ) {
+				logging_printf( LOGGING_ERROR, "midi_sender_slots_flush: Partial send of %u/%zu bytes to [%s]:%u\n", send_msgs[i].msg_len, send_slots[i].len, send_slots[i].ctx->ip_address, send_slots[i].ctx->data_port );
+			} else {
+				logging_printf( LOGGING_DEBUG, "midi_sender_slots_flush: write( bytes=%u,host=[%s]:%u )\n", send_msgs[i].msg_len, send_slots[i].ctx->ip_address, send_slots[i].ctx->data_port );
+			}
+		}
+
+		/* A short count is not an error, the remaining packets are retried from where it stopped */
+		next += sent;
+	}
+
+	for( i = 0; i < count; i++ )
+	{
+		send_slots[i].journal = NULL;
+		send_slots[i].journal_len = 0;
+	}
+}
+
+/* Pack the RTP header and MIDI payload header for a connection into the slot.
+   The MIDI list and journal are not copied, they are sent from where they are */
+static void midi_sender_pack_header( midi_sender_slot_t *slot, net_ctx_t *ctx, const midi_payload_header_t *payload_header, long timestamp )
+{
+	unsigned char *p = NULL;
+	size_t packed_header_len = 0;
+	uint16_t temp_header = 0;
+	uint8_t temp_payload_header = 0;
+	rtp_packet_t rtp_packet;
+
+	memset( &rtp_packet, 0, sizeof( rtp_packet_t ) );
+
+	rtp_packet.header.v = RTP_VERSION;
+	rtp_packet.header.p = 0;
+	rtp_packet.header.x = 0;
+	rtp_packet.header.cc = 0;
+	rtp_packet.header.m = 0;
+	rtp_packet.header.pt = RTP_DYNAMIC_PAYLOAD_97;
+
+	net_ctx_increment_seq( ctx );
+
+	// Transfer the connection details to the RTP packet
+	net_ctx_update_rtp_fields( ctx , &rtp_packet, timestamp );
+
+	rtp_packet.payload_len = 1 + payload_header->len + ( payload_header->len > 15 ? 1 : 0 ) + slot->journal_len;
+	if( LOGGING_DEBUG_ENABLED ) rtp_packet_dump( &rtp_packet );
+
+	p = slot->header;
+
+	temp_header |= ( rtp_packet.header.v << 6 ) << 8;
+	temp_header |= ( rtp_packet.header.p << 5 ) << 8;
+	temp_header |= ( rtp_packet.header.x << 4 ) << 8;
+	temp_header |= ( rtp_packet.header.cc & 0x0f ) << 8;
+	temp_header |= ( rtp_packet.header.m << 7 );
+	temp_header |= ( rtp_packet.header.pt & 0x7f );
+
+	put_uint16( &p , temp_header,  &packed_header_len );
+	put_uint16( &p , rtp_packet.header.seq, &packed_header_len );
+	put_uint32( &p , rtp_packet.header.timestamp, &packed_header_len );
+	put_uint32( &p , rtp_packet.header.ssrc, &packed_header_len );
+
+	if( payload_header->B || payload_header->len > 15 ) temp_payload_header |= PAYLOAD_HEADER_B;
+	if( slot->journal_len > 0 ) temp_payload_header |= PAYLOAD_HEADER_J;
+	if( payload_header->Z ) temp_payload_header |= PAYLOAD_HEADER_Z;
+	if( payload_header->P ) temp_payload_header |= PAYLOAD_HEADER_P;
+
+	if( payload_header->len <= 15 )
+	{
+		*p = temp_payload_header | ( payload_header->len & 0x0f );
+		packed_header_len++;
+	} else {
+		*p = temp_payload_header | ( ( payload_header->len & 0x0f00 ) >> 8 );
+		p++;
+		*p = ( payload_header->len & 0x00ff );
+		packed_header_len += 2;
+	}
+
+	slot->header_len = packed_header_len;
+	slot->list_len = payload_header->len;
+	slot->len = slot->header_len + slot->list_len + slot->journal_len;
+	slot->ctx = ctx;
+}
+
 void midi_sender_start( void )
 {
 	if( ! midi_queue )
@@ -100,279 +347,545 @@ void midi_sender_add( void *data, data_context_t *context )
 	data_queue_add( midi_queue, data, context );
 }
 
-void midi_sender_teardown( void )
+/* Real-time messages are never discarded to make room in the queue */
+static int midi_sender_keep( void *data, void *context )
 {
+	const midi_command_t *command = NULL;
+
+	(void)context;
+
+	if( ! data ) return 0;
+	command = (const midi_command_t *)data;
+
+	return ( command->status >= MIDI_TIMING_CLOCK );
 }
 
-/* Send MIDI commands to all connections */
-void midi_sender_handler( void *data, void *context )
+static void midi_sender_drop( void *data, void *context )
 {
 	data_context_t *data_context = NULL;
-	const midi_sender_context_t *sender_context = NULL;
 	midi_command_t *command = NULL;
 
-	uint32_t originator_ssrc = 0;
-	int alsa_originator_card = 0;
-
-	if( ! data ) return;
-	command = (midi_command_t *)data;
-
 	if( context )
 	{
 		data_context = (data_context_t *)context;
-		if( data_context->data )
-		{
-			sender_context = (midi_sender_context_t *)(data_context->data);
-			originator_ssrc = sender_context->ssrc;
-			alsa_originator_card = sender_context->alsa_card_hash;
-		}
 		data_context_release( &data_context );
 	}
 
-	midi_sender_send_single( command, originator_ssrc, alsa_originator_card );
+	if( data )
+	{
+		command = (midi_command_t *)data;
+		logging_printf( LOGGING_DEBUG, "midi_sender_drop: Queue full, dropping command status=0x%02x\n", command->status );
+		midi_command_destroy( (void **)&command );
+	}
+}
 
-	midi_command_destroy( (void **)&command );
+void midi_sender_teardown( void )
+{
+	midi_sender_slots_destroy();
 }
 
-void midi_sender_send_single( midi_command_t *command, uint32_t originator_ssrc , int alsa_originator_card )
+/* Work out the message type. The journal is fed straight from the command */
+static void midi_sender_item_prepare( midi_sender_item_t *item )
 {
-	midi_payload_t *single_midi_payload = NULL;
-	enum midi_message_type_t message_type = 0;
-	midi_note_t *midi_note = NULL;
-	midi_control_t *midi_control = NULL;
-	midi_program_t *midi_program = NULL;
-	int i = 0;
-	int total_connections = 0;
-	char output_available = 0;
-	unsigned char *raw_buffer = NULL;
+	item->message_type = 0;
 
-	midi_command_to_payload( command, &single_midi_payload );
-	if( ! single_midi_payload ) return;
+	midi_command_map( item->command, NULL, &(item->message_type) );
+	if( LOGGING_DEBUG_ENABLED ) midi_command_dump( item->command );
+}
 
-	midi_command_map( command, NULL, &message_type );
-	if( LOGGING_DEBUG_ENABLED ) midi_command_dump( command );
-	switch( message_type )
+static void midi_sender_item_journal( net_ctx_t *ctx, const midi_sender_item_t *item )
+{
+	switch( item->message_type )
 	{
 		case MIDI_NOTE_OFF:
 		case MIDI_NOTE_ON:
-			midi_note_from_command( command, &midi_note);
-			if( LOGGING_DEBUG_ENABLED ) midi_note_dump( midi_note );
+			net_ctx_add_journal_note( ctx, item->command );
+			break;
+		case MIDI_CONTROL_CHANGE:
+			net_ctx_add_journal_control( ctx, item->command );
 			break;
-		case MIDI_CONTROL_CHANGE:	
-			midi_control_from_command( command, &midi_control);
-			if( LOGGING_DEBUG_ENABLED ) midi_control_dump( midi_control );
+		case MIDI_PROGRAM_CHANGE:	
+			net_ctx_add_journal_program( ctx, item->command );
 			break;
-		case MIDI_PROGRAM_CHANGE:
-			midi_program_from_command( command, &midi_program);
-			if( LOGGING_DEBUG_ENABLED ) midi_program_dump( midi_program );
+		case MIDI_PITCH_BEND:
+			net_ctx_add_journal_pitch_bend( ctx, item->command );
+			break;
+		case MIDI_CHANNEL_PRESSURE:
+			net_ctx_add_journal_channel_pressure( ctx, item->command );
+			break;
+		case MIDI_POLY_PRESSURE:
+			net_ctx_add_journal_poly_pressure( ctx, item->command );
 			break;
 		default:
 			break;
 	}
+}
+
+/* Determine if the MIDI command needs to be written out to ALSA or the local MIDI file descriptor */
+static void midi_sender_write_local( const midi_command_t *command, int alsa_originator_card )
+{
+	char output_available = 0;
+	unsigned char *raw_buffer = NULL;
+
+	output_available = ( inbound_midi_fd >= 0 );
+#ifdef HAVE_ALSA
+	output_available |= raveloxmidi_alsa_out_available();
+#else
+	(void)alsa_originator_card;
+#endif
+	if( !output_available ) return;
+
+	raw_buffer = (unsigned char *)X_MALLOC( 2 + command->data_len );
+	if( raw_buffer )
+	{       
+		memset( raw_buffer, 0, 2 + command->data_len );
+
+		raw_buffer[0]=command->status;
+
+		if( command->data_len > 0 )
+		{       
+			memcpy( raw_buffer + 1, command->data, command->data_len );
+		}       
+
+		if( inbound_midi_fd >= 0 )
+		{       
+			ssize_t bytes_written;
+
+			//net_socket_send_lock();
+			bytes_written = write( inbound_midi_fd, raw_buffer, 1 + command->data_len );
+			//net_socket_send_unlock();
+			logging_printf( LOGGING_DEBUG, "net_socket_read: inbound MIDI write(bytes=%zd)\n", bytes_written );
+		}       
+
+#ifdef HAVE_ALSA
+		//net_socket_send_lock();
+		raveloxmidi_alsa_write( raw_buffer, 1 + command->data_len , alsa_originator_card );
+		//net_socket_send_unlock();
+#endif
+		X_FREE( raw_buffer );
+	}       
+}
+
+/* Copy the originator details out of the context and let it go */
+static void midi_sender_item_from_context( midi_sender_item_t *item, midi_command_t *command, void *context )
+{
+	data_context_t *data_context = NULL;
+	const midi_sender_context_t *sender_context = NULL;
+
+	memset( item, 0, sizeof( midi_sender_item_t ) );
+	item->command = command;
+
+	if( ! context ) return;
 
-	total_connections = net_ctx_get_num_connections();
-	// Build the RTP packet for each connection
-	for( i = 0; i < total_connections; i++ )
+	data_context = (data_context_t *)context;
+	if( data_context->data )
 	{
-		char *packed_journal = NULL;
-		size_t packed_journal_len = 0;
-		unsigned char *packed_rtp_buffer = NULL;
-		size_t packed_rtp_buffer_len = 0;
-		unsigned char *p = NULL;
-		size_t packed_payload_len = 0;
-		uint16_t temp_header = 0;
-		uint8_t temp_payload_header = 0;
-		int packet_ready = 0;
-		rtp_packet_t rtp_packet;
+		sender_context = (midi_sender_context_t *)(data_context->data);
+		item->originator_ssrc = sender_context->ssrc;
+		item->alsa_card_hash = sender_context->alsa_card_hash;
+		item->timestamp = sender_context->timestamp;
+	}
+	data_context_release( &data_context );
+}
 
-		net_ctx_t *current_ctx = net_ctx_find_by_index( i );
+/* Send MIDI commands to all connections */
+void midi_sender_handler( void *data, void *context )
+{
+	midi_sender_item_t item;
+	midi_command_t *command = NULL;
 
-		memset( &rtp_packet, 0, sizeof( rtp_packet_t ) );
+	if( ! data ) return;
+	command = (midi_command_t *)data;
 
-		logging_printf( LOGGING_DEBUG, "midi_sender_send_single: current_ctx=%p\n", current_ctx );
-		if(! current_ctx ) continue;
+	midi_sender_item_from_context( &item, command, context );
 
-		logging_printf( LOGGING_DEBUG, "midi_sender_send_single: current_ctx->ssrc=0x%08x, originator_ssrc=0x%08x\n", current_ctx->ssrc, originator_ssrc );
-		// If the current ctx is the originator, we don't need to send anything
-		if( current_ctx->ssrc == originator_ssrc ) continue;
+	midi_sender_send_single( command, item.originator_ssrc, item.alsa_card_hash, item.timestamp );
 
-		// Get a journal if there is one
-		net_ctx_journal_pack( current_ctx , &packed_journal, &packed_journal_len);
+	midi_command_destroy( (void **)&command );
+}
 
-		if( packed_journal_len > 0 )
-		{
-			midi_payload_set_j( single_midi_payload );
-		} else {
-			midi_payload_unset_j( single_midi_payload );
-		}
+/* Write a delta time as RFC6295 variable length octets. Returns the number of octets used */
+static size_t midi_sender_put_delta( unsigned long delta, unsigned char *buffer )
+{
+	size_t len = 0;
+	int shift = 21;
 
-		// We have to pack the payload again each time because some connections may not have a journal
-		// and the flag to indicate the journal being present is in the payload
-		packed_payload_len = 1 + single_midi_payload->header->len + ( single_midi_payload->header->len > 15 ? 1 : 0 );
-		logging_printf(LOGGING_DEBUG, "midi_sender_send_single: packed_payload_len=%u packed_journal_len=%u\n", packed_payload_len, packed_journal_len);
+	if( delta > MIDI_SENDER_MAX_DELTA ) delta = MIDI_SENDER_MAX_DELTA;
 
-		packed_rtp_buffer_len = RTP_PACKET_HEADER_SIZE + packed_payload_len + packed_journal_len;
-		packed_rtp_buffer = (unsigned char *)X_MALLOC( packed_rtp_buffer_len );
-		if( ! packed_rtp_buffer )
-		{
-			logging_printf( LOGGING_ERROR, "midi_sender_send_single: Unable to allocate RTP packet buffer\n" );
-			goto midi_sender_send_single_clean;
-		}
+	// Skip the leading octets that would be zero
+	while( shift > 0 && ( delta >> shift ) == 0 ) shift -= 7;
 
-		rtp_packet.header.v = RTP_VERSION;
-		rtp_packet.header.p = 0;
-		rtp_packet.header.x = 0;
-		rtp_packet.header.cc = 0;
-		rtp_packet.header.m = 0;
-		rtp_packet.header.pt = RTP_DYNAMIC_PAYLOAD_97;
+	for( ; shift > 0; shift -= 7 )
+	{
+		buffer[ len++ ] = 0x80 | ( ( delta >> shift ) & 0x7f );
+	}
+	buffer[ len++ ] = delta & 0x7f;
 
-		net_ctx_increment_seq( current_ctx );
+	return len;
+}
 
-		// Transfer the connection details to the RTP packet
-		net_ctx_update_rtp_fields( current_ctx , &rtp_packet );
+static int midi_sender_list_reserve( size_t size )
+{
+	unsigned char *new_list = NULL;
 
-		// Add the MIDI data to the RTP packet
-		rtp_packet.payload_len = packed_payload_len + packed_journal_len;
-		rtp_packet.payload = single_midi_payload->buffer;
-		if( LOGGING_DEBUG_ENABLED ) rtp_packet_dump( &rtp_packet );
+	if( size <= batch_list_size ) return 0;
 
-		p = packed_rtp_buffer;
-		packed_rtp_buffer_len = 0;
+	size = MAX( size, NET_APPLEMIDI_UDPSIZE );
+	new_list = (unsigned char *)X_REALLOC( batch_list, size );
+	if( ! new_list ) return -1;
 
-		temp_header |= ( rtp_packet.header.v << 6 ) << 8;
-		temp_header |= ( rtp_packet.header.p << 5 ) << 8;
-		temp_header |= ( rtp_packet.header.x << 4 ) << 8;
-		temp_header |= ( rtp_packet.header.cc & 0x0f ) << 8;
-		temp_header |= ( rtp_packet.header.m << 7 );
-		temp_header |= ( rtp_packet.header.pt & 0x7f );
+	batch_list = new_list;
+	batch_list_size = size;
 
-		put_uint16( &p , temp_header,  &packed_rtp_buffer_len );
-		put_uint16( &p , rtp_packet.header.seq, &packed_rtp_buffer_len );
-		put_uint32( &p , rtp_packet.header.timestamp, &packed_rtp_buffer_len );
-		put_uint32( &p , rtp_packet.header.ssrc, &packed_rtp_buffer_len );
+	return 0;
+}
 
-		if( single_midi_payload->header->B ) temp_payload_header |= PAYLOAD_HEADER_B;
-		if( single_midi_payload->header->J ) temp_payload_header |= PAYLOAD_HEADER_J;
-		if( single_midi_payload->header->Z ) temp_payload_header |= PAYLOAD_HEADER_Z;
-		if( single_midi_payload->header->P ) temp_payload_header |= PAYLOAD_HEADER_P;
+/* Pack the commands from first onwards that did not come from ssrc into one MIDI list at offset in batch_list.
+   The first command has no delta time, every other command has the time since the one before it.
+   Channel messages use running status. The list stops before it grows beyond limit but always holds
+   at least one command. Returns the list length and sets end to the first command that was not packed */
+static size_t midi_sender_build_list( const midi_sender_item_t *items, size_t count, uint32_t ssrc, size_t first, size_t limit, size_t offset, size_t *end, long *timestamp )
+{
+	size_t list_len = 0;
+	size_t needed = 0;
+	size_t delta_len = 0;
+	unsigned char delta_buffer[4];
+	unsigned char running_status = 0;
+	unsigned char use_status = 0;
+	long previous = 0;
+	size_t i = 0;
+
+	for( i = first; i < count; i++ )
+	{
+		const midi_command_t *command = items[i].command;
 
-		*p = temp_payload_header;
+		if( items[i].originator_ssrc == ssrc ) continue;
 
-		if( single_midi_payload->header->len <= 15 )
+		delta_len = 0;
+		if( list_len == 0 )
 		{
-			*p |= ( single_midi_payload->header->len & 0x0f );
-			p++;
-			packed_rtp_buffer_len++;
+			*timestamp = items[i].timestamp;
 		} else {
-			temp_payload_header |= ( single_midi_payload->header->len & 0x0f00 ) >> 8;
-			*p = temp_payload_header;
-			p++;
-			*p = ( single_midi_payload->header->len & 0x00ff );
-			p++;
-			packed_rtp_buffer_len += 2;
+			unsigned long delta = 0;
+
+			if( items[i].timestamp > previous && previous > 0 ) delta = items[i].timestamp - previous;
+			delta_len = midi_sender_put_delta( delta, delta_buffer );
 		}
 
-		memcpy( p, single_midi_payload->buffer, single_midi_payload->header->len );
-		p += single_midi_payload->header->len;
-		packed_rtp_buffer_len += single_midi_payload->header->len;
+		use_status = ( command->status >= 0xf0 || command->status != running_status );
 
-		if( packed_journal_len > 0 )
+		needed = delta_len + use_status + command->data_len;
+		if( list_len > 0 && list_len + needed > limit ) break;
+
+		if( midi_sender_list_reserve( offset + list_len + needed ) != 0 )
 		{
-			memcpy( p, packed_journal, packed_journal_len );
-			packed_rtp_buffer_len += packed_journal_len;
+			logging_printf( LOGGING_ERROR, "midi_sender_build_list: Insufficient memory for MIDI list\n" );
+			break;
 		}
 
-		net_ctx_send( current_ctx, packed_rtp_buffer, packed_rtp_buffer_len , USE_DATA_PORT );
-		packet_ready = 1;
+		memcpy( batch_list + offset + list_len, delta_buffer, delta_len );
+		list_len += delta_len;
 
-midi_sender_send_single_clean:
-		X_FREENULL( "packed_rtp_buffer", (void **)&packed_rtp_buffer );
-		X_FREENULL( "packed_journal", (void **)&packed_journal );
+		if( use_status ) batch_list[ offset + list_len++ ] = command->status;
 
-		if( ! packet_ready || ! journal_enabled )
+		if( command->data_len > 0 )
 		{
-			continue;
+			memcpy( batch_list + offset + list_len, command->data, command->data_len );
+			list_len += command->data_len;
+		}
+
+		// System common messages cancel running status, real-time messages leave it alone
+		if( command->status < 0xf0 )
+		{
+			running_status = command->status;
+		} else if( command->status < 0xf8 ) {
+			running_status = 0;
 		}
-		
-		switch( message_type )
+
+		previous = items[i].timestamp;
+	}
+
+	*end = i;
+
+	return list_len;
+}
+
+/* Check if any command from first onwards came from ssrc */
+static char midi_sender_originates( const midi_sender_item_t *items, size_t first, size_t count, uint32_t ssrc )
+{
+	size_t i = 0;
+
+	for( i = first; i < count; i++ )
+	{
+		if( items[i].originator_ssrc == ssrc ) return 1;
+	}
+
+	return 0;
+}
+
+/* Find a MIDI list already built in this round that holds exactly what another connection needs.
+   A list holding every remaining command suits any connection with room for it. A list that was cut short only suits the same limit */
+static const midi_sender_slot_t *midi_sender_find_list( int slot_count, size_t count, size_t first, char filtered, uint32_t ssrc, size_t limit )
+{
+	int i = 0;
+
+	for( i = 0; i < slot_count; i++ )
+	{
+		const midi_sender_slot_t *slot = &send_slots[i];
+
+		if( slot->first != first ) continue;
+		if( slot->list_filtered != filtered ) continue;
+		if( filtered && slot->ctx->ssrc != ssrc ) continue;
+		if( slot->list_limit == limit ) return slot;
+		if( slot->end == count && slot->list_len <= limit ) return slot;
+	}
+
+	return NULL;
+}
+
+/* Send a batch of commands to all connections with as few packets as possible.
+   Each connection gets one MIDI list holding every command it should see. A connection only gets
+   more than one packet if its commands don't fit in NET_APPLEMIDI_UDPSIZE. Connections that
+   should see the same commands share the same list */
+static void midi_sender_send_batch( midi_sender_item_t *items, size_t count )
+{
+	midi_payload_header_t payload_header;
+	const net_ctx_snapshot_t *snapshot = NULL;
+	int hazard = -1;
+	int i = 0;
+	int peer_count = 0;
+	int slot_count = 0;
+	int pending = 0;
+	size_t list_used = 0;
+	size_t k = 0;
+
+	snapshot = net_ctx_snapshot_acquire( &hazard );
+	if( ! snapshot ) return;
+	if( snapshot->count == 0 ) goto midi_sender_send_batch_end;
+	if( midi_sender_slots_reserve( snapshot->count ) != 0 ) goto midi_sender_send_batch_end;
+
+	for( k = 0; k < snapshot->count; k++ )
+	{
+		send_peers[ peer_count ] = snapshot->ctx[k];
+		send_next[ peer_count ] = 0;
+		peer_count++;
+	}
+
+	do
+	{
+		slot_count = 0;
+		pending = 0;
+		list_used = 0;
+
+		// Build the next packet for each connection that still has commands to send
+		for( i = 0; i < peer_count; i++ )
 		{
-			case MIDI_NOTE_OFF:
-			case MIDI_NOTE_ON:
-				net_ctx_add_journal_note( current_ctx , midi_note );
-				break;
-			case MIDI_CONTROL_CHANGE:
-				net_ctx_add_journal_control( current_ctx, midi_control );
-				break;
-			case MIDI_PROGRAM_CHANGE:	
-				net_ctx_add_journal_program( current_ctx, midi_program );
-				break;
-			default:
+			const midi_sender_slot_t *shared = NULL;
+			size_t list_limit = 0;
+			midi_sender_slot_t *slot = &send_slots[ slot_count ];
+			net_ctx_t *current_ctx = send_peers[i];
+
+			if( send_next[i] >= count ) continue;
+
+			slot->address_len = net_ctx_get_address( current_ctx, USE_DATA_PORT, &(slot->address) );
+			if( slot->address_len == 0 )
+			{
+				send_next[i] = count;
+				continue;
+			}
+
+			// Get a journal if there is one
+			net_ctx_journal_pack( current_ctx , &(slot->journal), &(slot->journal_len) );
+
+			// The packed journal is capped so there is always room left for commands
+			list_limit = NET_APPLEMIDI_UDPSIZE - MIDI_SENDER_HEADER_SIZE - slot->journal_len;
+
+			slot->first = send_next[i];
+			slot->list_filtered = midi_sender_originates( items, slot->first, count, current_ctx->ssrc );
+
+			memset( &payload_header, 0, sizeof( midi_payload_header_t ) );
+
+			shared = midi_sender_find_list( slot_count, count, slot->first, slot->list_filtered, current_ctx->ssrc, list_limit );
+			if( shared )
+			{
+				payload_header.len = shared->list_len;
+				slot->list_offset = shared->list_offset;
+				slot->end = shared->end;
+				slot->timestamp = shared->timestamp;
+			} else {
+				slot->list_offset = list_used;
+				payload_header.len = midi_sender_build_list( items, count, current_ctx->ssrc, slot->first, list_limit, list_used, &(slot->end), &(slot->timestamp) );
+				list_used += payload_header.len;
+			}
+			slot->list_limit = list_limit;
+
+			send_next[i] = slot->end;
+			if( slot->end < count ) pending = 1;
+
+			// Nothing left for this connection
+			if( payload_header.len == 0 )
+			{
+				slot->journal = NULL;
+				slot->journal_len = 0;
 				continue;
+			}
+
+			logging_printf(LOGGING_DEBUG, "midi_sender_send_batch: list_len=%u journal_len=%zu commands=%zu shared=%s\n", payload_header.len, slot->journal_len, slot->end - slot->first, ( shared ? "yes" : "no" ) );
+
+			midi_sender_pack_header( slot, current_ctx, &payload_header, slot->timestamp );
+			slot_count++;
+		}
+
+		// The list buffer may have moved while it was being filled
+		for( i = 0; i < slot_count; i++ )
+		{
+			send_slots[i].list = batch_list + send_slots[i].list_offset;
+		}
+
+		midi_sender_slots_flush( slot_count );
+
+		for( i = 0; i < slot_count && journal_enabled; i++ )
+		{
+			net_ctx_t *current_ctx = send_slots[i].ctx;
+
+			for( k = send_slots[i].first; k < send_slots[i].end; k++ )
+			{
+				if( items[k].originator_ssrc == current_ctx->ssrc ) continue;
+				midi_sender_item_journal( current_ctx, &items[k] );
+			}
 		}
+	} while( pending );
+
+midi_sender_send_batch_end:
+	net_ctx_snapshot_release( hazard );
+}
+
+/* Queue batch handler. A single command takes the same path as when batching is off */
+static void midi_sender_batch_handler( void **data, void **contexts, size_t count )
+{
+	size_t i = 0;
+
+	if( ! data ) return;
+	if( count == 0 ) return;
+
+	for( i = 0; i < count; i++ )
+	{
+		midi_sender_item_from_context( &batch_items[i], (midi_command_t *)data[i], contexts[i] );
 	}
 
-	// Clean up
-	midi_payload_destroy( &single_midi_payload );
-	switch( message_type )
+	if( count == 1 )
 	{
-		case MIDI_NOTE_OFF:
-		case MIDI_NOTE_ON:
-			midi_note_destroy( &midi_note );
-			break;
-		case MIDI_CONTROL_CHANGE:
-			midi_control_destroy( &midi_control );
-			break;
-		case MIDI_PROGRAM_CHANGE:
-			midi_program_destroy( &midi_program );
-			break;
-		default:
-			break;
+		midi_sender_send_single( batch_items[0].command, batch_items[0].originator_ssrc, batch_items[0].alsa_card_hash, batch_items[0].timestamp );
+		midi_command_destroy( (void **)&(batch_items[0].command) );
+		return;
 	}
 
-	// Determine if the MIDI commands need to be written out to ALSA or the local MIDI file descriptor
-	output_available = ( inbound_midi_fd >= 0 );
-#ifdef HAVE_ALSA
-	output_available |= raveloxmidi_alsa_out_available();
-#endif
-	if( !output_available ) return;
+	for( i = 0; i < count; i++ )
+	{
+		midi_sender_item_prepare( &batch_items[i] );
+	}
 
-	raw_buffer = (unsigned char *)X_MALLOC( 2 + command->data_len );
-	if( raw_buffer )
-	{       
-		memset( raw_buffer, 0, 2 + command->data_len );
+	midi_sender_send_batch( batch_items, count );
 
-		raw_buffer[0]=command->status;
+	for( i = 0; i < count; i++ )
+	{
+		midi_sender_write_local( batch_items[i].command, batch_items[i].alsa_card_hash );
+		midi_command_destroy( (void **)&(batch_items[i].command) );
+	}
+}
 
-		if( command->data_len > 0 )
-		{       
-			memcpy( raw_buffer + 1, command->data, command->data_len );
-		}       
+void midi_sender_send_single( midi_command_t *command, uint32_t originator_ssrc , int alsa_originator_card, long timestamp )
+{
+	midi_payload_t *single_midi_payload = NULL;
+	midi_sender_item_t item;
+	const net_ctx_snapshot_t *snapshot = NULL;
+	int hazard = -1;
+	int i = 0;
+	size_t k = 0;
+	int slot_count = 0;
 
-		if( inbound_midi_fd >= 0 )
-		{       
-			ssize_t bytes_written;
+	midi_command_to_payload( command, &single_midi_payload );
+	if( ! single_midi_payload ) return;
 
-			//net_socket_send_lock();
-			bytes_written = write( inbound_midi_fd, raw_buffer, 1 + command->data_len );
-			//net_socket_send_unlock();
-			logging_printf( LOGGING_DEBUG, "net_socket_read: inbound MIDI write(bytes=%zd)\n", bytes_written );
-		}       
+	memset( &item, 0, sizeof( midi_sender_item_t ) );
+	item.command = command;
+	midi_sender_item_prepare( &item );
 
-#ifdef HAVE_ALSA
-		//net_socket_send_lock();
-		raveloxmidi_alsa_write( raw_buffer, 1 + command->data_len , alsa_originator_card );
-		//net_socket_send_unlock();
-#endif
-		X_FREE( raw_buffer );
-	}       
+	snapshot = net_ctx_snapshot_acquire( &hazard );
+	if( ! snapshot ) goto midi_sender_send_single_clean;
+	if( midi_sender_slots_reserve( snapshot->count ) != 0 ) goto midi_sender_send_single_clean;
+
+	// Build the RTP header for each connection in use. The payload is shared by all of them
+	for( k = 0; k < snapshot->count; k++ )
+	{
+		midi_sender_slot_t *slot = &send_slots[ slot_count ];
+
+		net_ctx_t *current_ctx = snapshot->ctx[k];
+
+		logging_printf( LOGGING_DEBUG, "midi_sender_send_single: current_ctx=%p\n", current_ctx );
+
+		logging_printf( LOGGING_DEBUG, "midi_sender_send_single: current_ctx->ssrc=0x%08x, originator_ssrc=0x%08x\n", current_ctx->ssrc, originator_ssrc );
+		// If the current ctx is the originator, we don't need to send anything
+		if( current_ctx->ssrc == originator_ssrc ) continue;
+
+		slot->address_len = net_ctx_get_address( current_ctx, USE_DATA_PORT, &(slot->address) );
+		if( slot->address_len == 0 ) continue;
+
+		// Get a journal if there is one. The J flag is set in the header if there is
+		net_ctx_journal_pack( current_ctx , &(slot->journal), &(slot->journal_len) );
+		logging_printf(LOGGING_DEBUG, "midi_sender_send_single: list_len=%u journal_len=%zu\n", single_midi_payload->header->len, slot->journal_len);
+
+		if( LOGGING_DEBUG_ENABLED )
+		{
+			net_ctx_dump( current_ctx );
+			net_ctx_journal_dump( current_ctx );
+		}
+
+		slot->list = single_midi_payload->buffer;
+		midi_sender_pack_header( slot, current_ctx, single_midi_payload->header, timestamp );
+		slot_count++;
+	}
+
+	// Send everything in one go
+	midi_sender_slots_flush( slot_count );
+
+	for( i = 0; i < slot_count && journal_enabled; i++ )
+	{
+		midi_sender_item_journal( send_slots[i].ctx, &item );
+	}
+
+midi_sender_send_single_clean:
+	// Clean up
+	net_ctx_snapshot_release( hazard );
+	midi_payload_destroy( &single_midi_payload );
+
+	midi_sender_write_local( command, alsa_originator_card );
 }
 
 void midi_sender_init( void )
 {
-	midi_queue = data_queue_create("MIDI sender", midi_sender_handler );
+	midi_queue = data_queue_create("MIDI sender", midi_sender_handler, config_int_get("sender.queue_size"),
+		data_queue_policy_from_string( config_string_get("sender.queue_overflow") ) );
 	if( ! midi_queue )
 	{
 		logging_printf( LOGGING_ERROR, "midi_sender_init: Unable to create midi queue\n");
+	} else {
+		data_queue_set_drop( midi_queue, midi_sender_drop, midi_sender_keep );
+
+		batch_enabled = is_yes( config_string_get("sender.batch") );
+		if( batch_enabled )
+		{
+			if( data_queue_set_batch( midi_queue, midi_sender_batch_handler, config_int_get("sender.batch_size"), config_long_get("sender.batch_linger") ) == 0 )
+			{
+				batch_items = (midi_sender_item_t *)X_MALLOC( midi_queue->batch_max * sizeof( midi_sender_item_t ) );
+			}
+			if( ! batch_items )
+			{
+				logging_printf( LOGGING_ERROR, "midi_sender_init: Unable to set up batching. Sending one command per packet\n");
+				data_queue_set_batch( midi_queue, NULL, 0, 0 );
+				batch_enabled = 0;
+			}
+		}
 	}
 
 	journal_enabled = is_yes( config_string_get("journal.write") ); 
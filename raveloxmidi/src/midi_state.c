@@ -36,6 +36,22 @@
 
 #include "logging.h"
 
+/* Bytes needed after a command byte and after a running status data byte */
+static pthread_once_t midi_state_table_once = PTHREAD_ONCE_INIT;
+static unsigned char midi_state_command_need[256];
+static unsigned char midi_state_running_need[256];
+
+static void midi_state_table_init( void )
+{
+	unsigned int byte = 0;
+
+	for( byte = 0x80; byte <= 0xFF; byte++ )
+	{
+		midi_state_command_need[ byte ] = midi_command_bytes_needed( byte & 0xF0 );
+		midi_state_running_need[ byte ] = midi_command_bytes_needed( byte );
+	}
+}
+
 void midi_state_lock( midi_state_t *state )
 {
 	if( ! state ) return;
@@ -64,14 +80,16 @@ midi_state_t *midi_state_create( size_t buffer_size )
 
 	new_midi_state->status = MIDI_STATE_INIT;
 	new_midi_state->hold = dbuffer_create( DBUFFER_DEFAULT_BLOCK_SIZE );
-	new_midi_state->ring = ring_buffer_create( buffer_size );
+	new_midi_state->ring = spsc_ring_create( buffer_size );
 	new_midi_state->running_status = 0;
 	new_midi_state->partial_sysex = 0;
+	new_midi_state->recovery = NULL;
 	pthread_mutex_init( &(new_midi_state->lock) , NULL);
 
 	return new_midi_state;
 }
 
+/* The ring is reset as well so the caller must make sure nothing is writing to or parsing the state */
 void midi_state_reset( midi_state_t *state )
 {
 	if( ! state ) return;
@@ -88,10 +106,11 @@ void midi_state_reset( midi_state_t *state )
 
 	if( state->ring )
 	{
-		size_t ring_buffer_size = ring_buffer_get_size( state->ring );
-		ring_buffer_reset( state->ring , ring_buffer_size );
+		spsc_ring_reset( state->ring );
 	}
 
+	midi_recovery_reset( state->recovery );
+
 	midi_state_unlock( state );
 }
 
@@ -104,12 +123,9 @@ int midi_state_write( midi_state_t *state, const char *in_buffer, size_t in_buff
 	if( ! in_buffer ) return ret;
 	if ( in_buffer_len == 0 ) return ret;
 
-	midi_state_lock( state );
-
-	ring_buffer_write( state->ring, in_buffer, in_buffer_len );
+	// The ring is single producer so only the receiving thread writes to it
+	if( spsc_ring_write( state->ring, in_buffer, in_buffer_len ) == 0 ) return ret;
 
-	midi_state_unlock( state );
-	
 	return 1;
 }
 
@@ -122,7 +138,7 @@ void midi_state_destroy( midi_state_t **state )
 	midi_state_lock( (*state) );
 	if( (*state)->ring )
 	{
-		ring_buffer_destroy( &( (*state)->ring ) );
+		spsc_ring_destroy( &( (*state)->ring ) );
 		(*state)->ring = NULL;
 	}
 
@@ -132,6 +148,8 @@ void midi_state_destroy( midi_state_t **state )
 		(*state)->hold = NULL;
 	}
 
+	midi_recovery_destroy( &( (*state)->recovery ) );
+
 	midi_state_unlock( (*state) );
 	pthread_mutex_destroy( &( (*state)->lock ) );
 
@@ -141,73 +159,89 @@ void midi_state_destroy( midi_state_t **state )
 
 int midi_state_compare( midi_state_t *state, const char *compare, size_t compare_len )
 {
+	spsc_ring_span_t spans[2];
+	size_t real_compare_len = 0;
+	size_t used = 0;
+	size_t i = 0;
+
 	if( ! state ) return -1;
 	if( ! state->ring ) return -1;
+	if( ! compare ) return -1;
+
+	used = spsc_ring_peek_spans( state->ring, spans );
+	real_compare_len = ( compare_len > 0 ? compare_len : strlen( compare ) + 1 );
+
+	for( i = 0; i < real_compare_len; i++ )
+	{
+		unsigned char ring_byte = 0;
+		unsigned char compare_byte = 0;
+
+		if( i >= used ) return -1;
 
-	return ring_buffer_compare( state->ring, compare, compare_len );
+		ring_byte = ( i < spans[0].len ? spans[0].data[i] : spans[1].data[ i - spans[0].len ] );
+		compare_byte = compare[i];
+		if( ring_byte != compare_byte ) return ring_byte - compare_byte;
+	}
+
+	return 0;
 }
 
 int midi_state_char_compare( midi_state_t *state, uint8_t compare, size_t index )
 {
+	spsc_ring_span_t spans[2];
+	size_t used = 0;
+
 	if(! state ) return -1;
 	if( ! state->ring ) return -1;
 
-	return ring_buffer_char_compare( state->ring, compare, index );
+	used = spsc_ring_peek_spans( state->ring, spans );
+	if( index >= used ) return 0;
+
+	if( index < spans[0].len ) return ( spans[0].data[index] == compare );
+
+	return ( spans[1].data[ index - spans[0].len ] == compare );
 }
 
 char *midi_state_drain( midi_state_t *state, size_t *len)
 {
+	spsc_ring_span_t spans[2];
 	char *return_buffer = NULL;
+	size_t used = 0;
 
 	if( ! state ) return NULL;
 	if( ! len ) return NULL;
 
-	midi_state_lock( state );
-
 	*len = 0;
-	if( ! state->ring ) goto midi_state_drain_end;
+	if( ! state->ring ) return NULL;
 
-	return_buffer = ring_buffer_drain( state->ring, len );
+	used = spsc_ring_peek_spans( state->ring, spans );
+	if( used == 0 ) return NULL;
 
-midi_state_drain_end:
-	midi_state_unlock( state );
+	return_buffer = ( char * ) X_MALLOC( used );
+	if( ! return_buffer )
+	{
+		logging_printf( LOGGING_ERROR, "midi_state_drain: Insufficient memory to drain %zu bytes\n", used );
+		return NULL;
+	}
+
+	memcpy( return_buffer, spans[0].data, spans[0].len );
+	if( spans[1].len > 0 ) memcpy( return_buffer + spans[0].len, spans[1].data, spans[1].len );
+
+	spsc_ring_commit( state->ring, used );
+	*len = used;
 
 	return return_buffer;
 }
 
 void midi_state_advance( midi_state_t *state, size_t steps )
 {
-	if( ! state ) return;
-
-	midi_state_lock( state );
-	if( ! state->ring ) goto midi_state_advance_end;
-	
-	ring_buffer_advance( state->ring, steps );
+	spsc_ring_span_t spans[2];
 
-midi_state_advance_end:
-	midi_state_unlock( state );
-}
-
-char midi_state_read_byte( midi_state_t *state, uint8_t *byte )
-{
-	if( ! byte )
-	{
-		return -1;
-	}
-
-	if( ! state )
-	{
-		*byte = 0;
-		return -1;
-	}
-
-	if( ! state->ring )
-	{
-		*byte = 0;
-		return -1;
-	}
+	if( ! state ) return;
+	if( ! state->ring ) return;
 
-	return ring_buffer_read_byte( state->ring, byte, RING_YES );
+	spsc_ring_peek_spans( state->ring, spans );
+	spsc_ring_commit( state->ring, steps );
 }
 
 const char *midi_status_to_string( midi_state_status_t status )
@@ -235,47 +269,53 @@ void midi_state_dump( midi_state_t *state )
 	logging_printf( LOGGING_DEBUG, "midi_state=%p, status=[%s], running_status=0x%02x\n", 
 		state, midi_status_to_string( state->status ), state->running_status);
 
-	ring_buffer_dump( state->ring );
+	spsc_ring_dump( state->ring );
 	dbuffer_dump( state->hold );
+	midi_recovery_dump( state->recovery );
 }
 
-void midi_state_send( midi_state_t *state , data_context_t *context, char mode, char z_flag)
+static void midi_state_emit( midi_state_t *state, data_context_t *context, uint8_t status, const uint8_t *data, size_t data_len )
 {
-	uint8_t byte = 0;
-	unsigned char bytes_needed = 0;
-	char *buffer_value = NULL;
-	size_t buffer_len = 0;
 	midi_command_t *new_command = NULL;
-	char get_delta = 0;
 
-	if( ! state ) return;
+	new_command = midi_command_create();
 
-	get_delta = z_flag;
+	if( ! new_command )
+	{
+		logging_printf( LOGGING_ERROR, "midi_state_emit: Insufficient memory to create new command\n");
+		return;
+	}
 
-	logging_printf( LOGGING_DEBUG, "midi_state_send: state=%p, context=%p, mode=%s, z=%d\n", state, context, (mode==MIDI_PARSE_MODE_SIMPLE ? "simple" : "RTP"), z_flag );
-	while( 1 )
+	midi_command_set( new_command, state->current_delta, status, data, data_len );
+
+	// Keep track of what has been played so it can be repaired if packets go missing
+	if( state->recovery )
 	{
-		char read_status;
-		read_status = midi_state_read_byte( state, &byte );
+		midi_recovery_track( state->recovery, status, data, data_len );
+	}
 
-		// If no bytes are available...return
-		if( read_status != 0 )
-		{
-			// Special case if this is a RTP buffer, we need to set the state back to MIDI_STATE_INIT
-			if( mode == MIDI_PARSE_MODE_RTP )
-			{
-				state->status = MIDI_STATE_INIT;
-			}
-			return;
-		}
+	// Add it to the command sender queue
+	midi_sender_add( new_command, context );
+}
+
+/* Run the state machine over a contiguous span of bytes.
+   Caller must hold the hold buffer lock */
+static void midi_state_parse( midi_state_t *state, data_context_t *context, char mode, char *get_delta, const unsigned char *bytes, size_t len )
+{
+	dbuffer_t *hold = state->hold;
+	size_t i = 0;
+	size_t run = 0;
+	uint8_t byte = 0;
 
-		logging_printf( LOGGING_DEBUG, "midi_state_send: STATE_IN read_byte byte=0x%02x, running_status=0x%02x, status=%s\n", byte , state->running_status, midi_status_to_string( state->status) );
+	while( i < len )
+	{
+		byte = bytes[i];
 
 		// If the delta has been provided, we need to get it first
-		if( state->status == MIDI_STATE_INIT)
+		if( state->status == MIDI_STATE_INIT )
 		{
-				state->status = ( get_delta ? MIDI_STATE_WAIT_DELTA : MIDI_STATE_WAIT_COMMAND );
-				state->current_delta = 0;
+			state->status = ( *get_delta ? MIDI_STATE_WAIT_DELTA : MIDI_STATE_WAIT_COMMAND );
+			state->current_delta = 0;
 		}
 
 		if( state->status == MIDI_STATE_WAIT_DELTA )
@@ -288,69 +328,48 @@ void midi_state_send( midi_state_t *state , data_context_t *context, char mode,
 			if( ! (byte & 0x80) )
 			{
 				state->status = MIDI_STATE_WAIT_COMMAND;
-				
 			}
-			logging_printf( LOGGING_DEBUG, "midi_state_send: delta=%lu\n", state->current_delta);
+			i++;
 			continue;
-		// Check for real-time MIDI messages that should go through at any time
-		} else {
-			if( byte >= MIDI_TIMING_CLOCK )
-			{
-				logging_printf( LOGGING_DEBUG, "midi_state_send: real-time message: message=0x%02x\n", byte);
-				new_command = midi_command_create();
-				if( ! new_command )
-				{
-					logging_printf( LOGGING_DEBUG, "midi_state_send: real-time: Insufficient memory to create command structure\n");
-					continue;
-				}
-				midi_command_set( new_command, state->current_delta, byte, NULL, 0);
-				midi_sender_add( new_command, context );
-				continue;
-			}
 		}
 
-		if( state->status == MIDI_STATE_WAIT_COMMAND )
+		// Real-time MIDI messages go through at any time
+		if( byte >= MIDI_TIMING_CLOCK )
 		{
-			if( byte < 0x80 )
-			{
-				// If this is a data byte but there is no running status, we need to loop
-				if( state->running_status == 0 ) continue;
-				
-				// Using the running status, determine how many bytes we need
-				bytes_needed = midi_command_bytes_needed( state->running_status );
-				logging_printf( LOGGING_DEBUG, "midi_state_send: data byte received: need=%d\n", bytes_needed );
-				
-				// Copy the running status into the hold buffer
-				dbuffer_write( state->hold, &(state->running_status), 1);
-
-				// Copy the byte into the hold buffer
-				dbuffer_write( state->hold, &byte, 1 );
-
-				switch( bytes_needed )
+			midi_state_emit( state, context, byte, NULL, 0 );
+			i++;
+			continue;
+		}
+
+		switch( state->status )
+		{
+			case MIDI_STATE_WAIT_COMMAND:
+				if( byte < 0x80 )
 				{
-					case 1:
-						state->status = MIDI_STATE_COMMAND_RECEIVED;
-						break;
-					case 2:
-						state->status = MIDI_STATE_WAIT_BYTE_1;
-						break;
+					// If this is a data byte but there is no running status, skip it
+					if( state->running_status == 0 ) break;
+
+					dbuffer_write_unlocked( hold, (const char *)&(state->running_status), 1 );
+					dbuffer_write_unlocked( hold, (const char *)&byte, 1 );
+
+					switch( midi_state_running_need[ state->running_status ] )
+					{
+						case 1:
+							state->status = MIDI_STATE_COMMAND_RECEIVED;
+							break;
+						case 2:
+							state->status = MIDI_STATE_WAIT_BYTE_1;
+							break;
+					}
+					break;
 				}
-			} else {
+
 				// This is a command byte
-				// Copy command byte to hold buffer
-				dbuffer_write( state->hold, &byte, 1);
+				dbuffer_write_unlocked( hold, (const char *)&byte, 1 );
 
 				// Special cases for SysEx
-				if( (byte == 0xF0) || ( state->partial_sysex && (byte==0xF7) ) )
+				if( (byte == 0xF0) || ( state->partial_sysex && (byte == 0xF7) ) )
 				{
-					if( (byte == 0xF0) && (state->partial_sysex == 1) )
-					{
-						logging_printf( LOGGING_DEBUG, "midi_state_send: SYSEX 0xF0 read: Expected 0xF7\n");
-					}
-					if( state->partial_sysex == 1 )
-					{
-						logging_printf( LOGGING_DEBUG, "midi_state_send: partial SysEx\n");
-					}
 					state->status = MIDI_STATE_WAIT_END_SYSEX;
 					state->running_status = 0;
 				// RFC6295 - p 19 - Unpaired 0xF7 cancels running status
@@ -358,10 +377,7 @@ void midi_state_send( midi_state_t *state , data_context_t *context, char mode,
 					state->status = MIDI_STATE_COMMAND_RECEIVED;
 					state->running_status = 0;
 				} else {
-					bytes_needed = midi_command_bytes_needed( byte & 0xF0 );
-					logging_printf( LOGGING_DEBUG, "midi_state_send: command byte received: need=%d\n", bytes_needed );
-
-					switch( bytes_needed )
+					switch( midi_state_command_need[ byte ] )
 					{
 						case 1:
 							state->status = MIDI_STATE_WAIT_BYTE_1;
@@ -369,92 +385,141 @@ void midi_state_send( midi_state_t *state , data_context_t *context, char mode,
 						case 2:
 							state->status = MIDI_STATE_WAIT_BYTE_2;
 							break;
-						case 0:
 						default:
 							state->status = MIDI_STATE_COMMAND_RECEIVED;
 							break;
 					}
-
-					// Set the running status
 					state->running_status = byte;
 				}
-			}
-			goto midi_state_send_end;
-		}
-		
-		if( state->status == MIDI_STATE_WAIT_BYTE_2)
-		{
-			// Copy byte to hold buffer
-			dbuffer_write( state->hold, &byte, 1 );
+				break;
 
-			state->status = MIDI_STATE_WAIT_BYTE_1;
-			goto midi_state_send_end;
-		}
+			case MIDI_STATE_WAIT_BYTE_2:
+				dbuffer_write_unlocked( hold, (const char *)&byte, 1 );
+				state->status = MIDI_STATE_WAIT_BYTE_1;
+				break;
 
-		if( state->status == MIDI_STATE_WAIT_BYTE_1 )
-		{
-			// Copy byte to hold buffer
-			dbuffer_write( state->hold, &byte, 1 );
+			case MIDI_STATE_WAIT_BYTE_1:
+				dbuffer_write_unlocked( hold, (const char *)&byte, 1 );
+				state->status = MIDI_STATE_COMMAND_RECEIVED;
+				break;
 
-			state->status = MIDI_STATE_COMMAND_RECEIVED;
-			goto midi_state_send_end;
-		}
+			case MIDI_STATE_WAIT_END_SYSEX:
+				// Copy a run of SysEx data bytes in one go
+				for( run = i; ( run < len ) && ( bytes[run] < 0x80 ); run++ );
+				if( run > i )
+				{
+					dbuffer_write_unlocked( hold, (const char *)bytes + i, run - i );
+					i = run;
+					continue;
+				}
 
-		if( state->status == MIDI_STATE_WAIT_END_SYSEX )
-		{
-			// Copy byte to hold buffer
-			dbuffer_write( state->hold, &byte, 1 );
+				dbuffer_write_unlocked( hold, (const char *)&byte, 1 );
 
-			if( (byte==0xF7) || ((state->partial_sysex==1) && (byte==0xF4)) )
-			{
-				state->status = MIDI_STATE_COMMAND_RECEIVED;
-				state->partial_sysex = 0;
-			}
+				if( (byte == 0xF7) || ( (state->partial_sysex == 1) && (byte == 0xF4) ) )
+				{
+					state->status = MIDI_STATE_COMMAND_RECEIVED;
+					state->partial_sysex = 0;
+				}
 
-			if( byte == 0xF0 )
-			{
-				state->status = MIDI_STATE_COMMAND_RECEIVED;
-				state->partial_sysex = 1;
-			}
+				if( byte == 0xF0 )
+				{
+					state->status = MIDI_STATE_COMMAND_RECEIVED;
+					state->partial_sysex = 1;
+				}
 
-			// Clear the running status
-			state->running_status = 0;
+				state->running_status = 0;
+				break;
 
-			goto midi_state_send_end;
+			default:
+				break;
 		}
 
-midi_state_send_end:
-		logging_printf( LOGGING_DEBUG, "midi_state_send: STATE_OUT read_byte byte=0x%02x, running_status=0x%02x, status=%s\n", byte , state->running_status, midi_status_to_string( state->status) );
+		i++;
 
 		// If we're waiting for more data, loop around
-		if( state->status != MIDI_STATE_COMMAND_RECEIVED) continue;
+		if( state->status != MIDI_STATE_COMMAND_RECEIVED ) continue;
 
-		// Take the full command from the hold buffer
-		buffer_len = dbuffer_read( state->hold, &buffer_value );
-		logging_printf( LOGGING_DEBUG, "midi_state_send: hold buffer len=%ld\n", buffer_len );
+		midi_state_emit( state, context, hold->data[0], hold->data + 1, hold->len - 1 );
+		dbuffer_clear_unlocked( hold );
 
-		dbuffer_reset( state->hold );
+		state->status = MIDI_STATE_INIT;
 
-		// Create a new midi command structure
-		new_command = midi_command_create();
+		// If this is a RTP buffer, we need to get subsequent deltas
+		if( mode == MIDI_PARSE_MODE_RTP ) *get_delta = 1;
+	}
+}
 
-		if( ! new_command )
-		{
-			logging_printf( LOGGING_ERROR, "midi_state_send: Insufficient memory to create new command\n");
-		} else {
+void midi_state_send( midi_state_t *state , data_context_t *context, char mode, char z_flag)
+{
+	spsc_ring_span_t spans[2];
+	size_t used = 0;
+	char get_delta = 0;
 
-			midi_command_set( new_command, state->current_delta, buffer_value[0], buffer_value + 1, buffer_len - 1);
+	if( ! state ) return;
+	if( ! state->ring ) return;
+	if( ! state->hold ) return;
 
-			// Add it to the command sender queue
-			midi_sender_add( new_command, context );
-		}
+	pthread_once( &midi_state_table_once, midi_state_table_init );
+
+	get_delta = z_flag;
+
+	logging_printf( LOGGING_DEBUG, "midi_state_send: state=%p, context=%p, mode=%s, z=%d\n", state, context, (mode==MIDI_PARSE_MODE_SIMPLE ? "simple" : "RTP"), z_flag );
+
+	// Parse everything that is readable in place and consume it in one step
+	dbuffer_lock( state->hold );
+
+	used = spsc_ring_peek_spans( state->ring, spans );
+
+	if( used > 0 )
+	{
+		midi_state_parse( state, context, mode, &get_delta, spans[0].data, spans[0].len );
+		midi_state_parse( state, context, mode, &get_delta, spans[1].data, spans[1].len );
+		spsc_ring_commit( state->ring, used );
+	}
 
-		X_FREE( buffer_value );
+	dbuffer_unlock( state->hold );
 
-		// Set the status back to INIT
+	// Special case if this is a RTP buffer, we need to set the state back to MIDI_STATE_INIT
+	if( mode == MIDI_PARSE_MODE_RTP )
+	{
 		state->status = MIDI_STATE_INIT;
+	}
+}
 
-		// If this is a RTP buffer, we need to get subsequent deltas
-		if( mode == MIDI_PARSE_MODE_RTP ) get_delta = 1;
+/* Called for each inbound RTP packet before its MIDI list is written.
+   If packets have been lost, the commands needed to catch up from the recovery journal are written first */
+void midi_state_recover( midi_state_t *state, uint16_t seq, const unsigned char *journal, size_t journal_len, char z_flag )
+{
+	unsigned char *repair_list = NULL;
+	size_t repair_len = 0;
+	int lost = 0;
+
+	if( ! state ) return;
+	if( ! state->recovery ) return;
+
+	lost = midi_recovery_check( state->recovery, seq );
+	if( lost <= 0 ) return;
+
+	logging_printf( LOGGING_DEBUG, "midi_state_recover: %d packet(s) lost before seq=%u journal_len=%zu\n", lost, seq, journal_len );
+
+	if( ! journal || journal_len == 0 ) return;
+
+	repair_list = ( unsigned char * )X_MALLOC( MIDI_RECOVERY_MAX_LIST_SIZE );
+	if( ! repair_list )
+	{
+		logging_printf( LOGGING_ERROR, "midi_state_recover: Insufficient memory for repair list\n" );
+		return;
 	}
+
+	repair_len = midi_recovery_repair( state->recovery, journal, journal_len, z_flag, repair_list, MIDI_RECOVERY_MAX_LIST_SIZE );
+
+	if( repair_len > 0 )
+	{
+		if( midi_state_write( state, (const char *)repair_list, repair_len ) == 0 )
+		{
+			logging_printf( LOGGING_WARN, "midi_state_recover: Unable to write %zu byte repair list\n", repair_len );
+		}
+	}
+
+	X_FREE( repair_list );
 }
@@ -377,143 +377,166 @@ int net_applemidi_unpack( net_applemidi_command **command_buffer, unsigned char
 	return NET_APPLEMIDI_DONE;
 }
 
-int net_applemidi_pack( net_applemidi_command *command_buffer, unsigned char **out_buffer, size_t *out_buffer_len )
+/* Encoders that pack a command straight into a caller supplied buffer.
+   Each returns the number of bytes written or 0 if the command doesn't fit */
+static size_t net_applemidi_pack_header( unsigned char **p, uint16_t command, size_t buffer_size, size_t needed )
 {
-	unsigned char *p;
+	size_t len = 0;
 
-	*out_buffer_len = 0;
+	if( buffer_size < needed ) return 0;
 
-	if( ! command_buffer )
+	put_uint16( p, 0xffff, &len );
+	put_uint16( p, command, &len );
+
+	return len;
+}
+
+size_t net_applemidi_pack_inv( unsigned char *buffer, size_t buffer_size, uint16_t command, const net_applemidi_inv *inv )
+{
+	unsigned char *p = buffer;
+	size_t len = 0;
+	size_t name_len = 0;
+
+	if( ! buffer ) return 0;
+	if( ! inv ) return 0;
+
+	if( inv->name )
 	{
-		return NET_APPLEMIDI_NEED_DATA;
+		name_len = strlen( inv->name ) + 1;
 	}
 
-	*out_buffer = ( unsigned char * ) X_MALLOC( NET_APPLEMIDI_COMMAND_SIZE );
+	len = net_applemidi_pack_header( &p, command, buffer_size, NET_APPLEMIDI_COMMAND_SIZE + ( NET_APPLEMIDI_INV_STATIC_SIZE - sizeof( char * ) ) + name_len );
+	if( len == 0 ) return 0;
 
-	if( ! *out_buffer )
+	put_uint32( &p, inv->version, &len );
+	put_uint32( &p, inv->initiator, &len );
+	put_uint32( &p, inv->ssrc, &len );
+
+	if( name_len > 0 )
 	{
-		return NET_APPLEMIDI_NO_MEMORY;
+		memcpy( p, inv->name, name_len );
+		len += name_len;
 	}
-	
-	p = *out_buffer;
 
-	put_uint16( &p , command_buffer->signature, out_buffer_len );
-	put_uint16( &p , command_buffer->command, out_buffer_len );
+	return len;
+}
 
-	if(	command_buffer->command == NET_APPLEMIDI_CMD_INV  ||
-		command_buffer->command == NET_APPLEMIDI_CMD_ACCEPT ||
-		command_buffer->command == NET_APPLEMIDI_CMD_REJECT ||
-		command_buffer->command == NET_APPLEMIDI_CMD_END )
-	{
+size_t net_applemidi_pack_sync( unsigned char *buffer, size_t buffer_size, const net_applemidi_sync *sync )
+{
+	unsigned char *p = buffer;
+	size_t len = 0;
 
-		const net_applemidi_inv *inv = ( const net_applemidi_inv *) command_buffer->data;
+	if( ! buffer ) return 0;
+	if( ! sync ) return 0;
 
-		if( ! inv )
-		{
-			X_FREE( *out_buffer );
-			*out_buffer = NULL;
-			*out_buffer_len = 0;
-			return NET_APPLEMIDI_NEED_DATA;
-		}
+	len = net_applemidi_pack_header( &p, NET_APPLEMIDI_CMD_SYNC, buffer_size, NET_APPLEMIDI_COMMAND_SIZE + NET_APPLEMIDI_SYNC_SIZE );
+	if( len == 0 ) return 0;
 
-		*out_buffer = ( unsigned char * ) X_REALLOC( *out_buffer, NET_APPLEMIDI_COMMAND_SIZE + NET_APPLEMIDI_INV_STATIC_SIZE );
-		p = *out_buffer + *out_buffer_len;
+	put_uint32( &p , sync->ssrc, &len );
 
-		put_uint32( &p, inv->version, out_buffer_len );
-		put_uint32( &p, inv->initiator, out_buffer_len );
-		put_uint32( &p, inv->ssrc, out_buffer_len );
+	memcpy( p, &(sync->count), 1 );
+	p += 1;
+	len += 1;
 
-		if( inv->name )
-		{
-			*out_buffer = ( unsigned char * ) X_REALLOC( *out_buffer, *out_buffer_len + strlen( inv->name ) + 1 );
+	memcpy( p, &(sync->padding), sizeof(sync->padding) );
+	p += sizeof( sync->padding );
+	len += sizeof( sync->padding );
 
-			if( ! *out_buffer )
-			{
-				*out_buffer_len = 0;
-				return NET_APPLEMIDI_NO_MEMORY;
-			}
+	put_uint64( &p, sync->timestamp1 , &len );
+	put_uint64( &p, sync->timestamp2 , &len );
+	put_uint64( &p, sync->timestamp3 , &len );
 
-			p = *out_buffer + *out_buffer_len;
-			memcpy( p , inv->name, strlen( inv->name ) );
-			p += strlen( inv->name );
-			*out_buffer_len += strlen( inv->name );
-			*p = '\0';
-			*out_buffer_len += 1;
-		}
-	}
+	return len;
+}
 
-	if( command_buffer->command ==  NET_APPLEMIDI_CMD_FEEDBACK )
-	{
+size_t net_applemidi_pack_feedback( unsigned char *buffer, size_t buffer_size, const net_applemidi_feedback *feedback )
+{
+	unsigned char *p = buffer;
+	size_t len = 0;
 
-		const net_applemidi_feedback *feedback = ( const net_applemidi_feedback *) command_buffer->data;
+	if( ! buffer ) return 0;
+	if( ! feedback ) return 0;
 
-		if( ! feedback )
-		{
-			X_FREE( *out_buffer );
-			*out_buffer = NULL;
-			*out_buffer_len = 0;
-			return NET_APPLEMIDI_NEED_DATA;
-		}
+	len = net_applemidi_pack_header( &p, NET_APPLEMIDI_CMD_FEEDBACK, buffer_size, NET_APPLEMIDI_COMMAND_SIZE + NET_APPLEMIDI_FEEDBACK_SIZE );
+	if( len == 0 ) return 0;
 
-		*out_buffer = ( unsigned char * ) X_REALLOC( *out_buffer, NET_APPLEMIDI_COMMAND_SIZE + NET_APPLEMIDI_FEEDBACK_SIZE );
-		p = *out_buffer + *out_buffer_len;
+	put_uint32( &p, feedback->ssrc ,  &len );
+	put_uint32( &p, feedback->apple_seq ,  &len );
 
-		put_uint32( &p, feedback->ssrc ,  out_buffer_len );
-		put_uint32( &p, feedback->apple_seq ,  out_buffer_len );
-	}
+	return len;
+}
 
-	if( command_buffer->command ==  NET_APPLEMIDI_CMD_BITRATE )
-	{
+size_t net_applemidi_pack_bitrate( unsigned char *buffer, size_t buffer_size, const net_applemidi_bitrate *bitrate )
+{
+	unsigned char *p = buffer;
+	size_t len = 0;
 
-		const net_applemidi_bitrate *bitrate = ( const net_applemidi_bitrate *) command_buffer->data;
+	if( ! buffer ) return 0;
+	if( ! bitrate ) return 0;
 
-		if( ! bitrate )
-		{
-			X_FREE( *out_buffer );
-			*out_buffer = NULL;
-			*out_buffer_len = 0;
-			return NET_APPLEMIDI_NEED_DATA;
-		}
+	len = net_applemidi_pack_header( &p, NET_APPLEMIDI_CMD_BITRATE, buffer_size, NET_APPLEMIDI_COMMAND_SIZE + NET_APPLEMIDI_BITRATE_SIZE );
+	if( len == 0 ) return 0;
 
-		*out_buffer = ( unsigned char * ) X_REALLOC( *out_buffer, NET_APPLEMIDI_COMMAND_SIZE + NET_APPLEMIDI_BITRATE_SIZE );
-		p = *out_buffer + *out_buffer_len;
+	put_uint32( &p, bitrate->ssrc ,  &len );
+	put_uint32( &p, bitrate->limit ,  &len );
 
-		put_uint32( &p, bitrate->ssrc ,  out_buffer_len );
-		put_uint32( &p, bitrate->limit ,  out_buffer_len );
-	}
+	return len;
+}
 
-	if( command_buffer->command == NET_APPLEMIDI_CMD_SYNC )
-	{
-		const net_applemidi_sync *sync;
+size_t net_applemidi_pack_buffer( uint16_t command, const void *data, unsigned char *buffer, size_t buffer_size )
+{
+	unsigned char *p = buffer;
 
-		sync = (const net_applemidi_sync *)command_buffer->data;
+	if( ! buffer ) return 0;
 
-		*out_buffer = ( unsigned char * ) X_REALLOC( *out_buffer, NET_APPLEMIDI_COMMAND_SIZE + NET_APPLEMIDI_SYNC_SIZE );
+	switch( command )
+	{
+		case NET_APPLEMIDI_CMD_INV:
+		case NET_APPLEMIDI_CMD_ACCEPT:
+		case NET_APPLEMIDI_CMD_REJECT:
+		case NET_APPLEMIDI_CMD_END:
+			return net_applemidi_pack_inv( buffer, buffer_size, command, (const net_applemidi_inv *)data );
+		case NET_APPLEMIDI_CMD_SYNC:
+			return net_applemidi_pack_sync( buffer, buffer_size, (const net_applemidi_sync *)data );
+		case NET_APPLEMIDI_CMD_FEEDBACK:
+			return net_applemidi_pack_feedback( buffer, buffer_size, (const net_applemidi_feedback *)data );
+		case NET_APPLEMIDI_CMD_BITRATE:
+			return net_applemidi_pack_bitrate( buffer, buffer_size, (const net_applemidi_bitrate *)data );
+		default:
+			return net_applemidi_pack_header( &p, command, buffer_size, NET_APPLEMIDI_COMMAND_SIZE );
+	}
+}
 
-		if( ! *out_buffer )
-		{
-			*out_buffer_len = 0;
-			return NET_APPLEMIDI_NO_MEMORY;
-		}
+int net_applemidi_pack( net_applemidi_command *command_buffer, unsigned char **out_buffer, size_t *out_buffer_len )
+{
+	unsigned char packed[ NET_APPLEMIDI_UDPSIZE ];
+	size_t packed_len = 0;
 
-		p = *out_buffer + *out_buffer_len;
+	*out_buffer = NULL;
+	*out_buffer_len = 0;
 
-		put_uint32( &p , sync->ssrc, out_buffer_len );
+	if( ! command_buffer )
+	{
+		return NET_APPLEMIDI_NEED_DATA;
+	}
 
-		memcpy( p, &(sync->count), 1 );
-		p += 1;
-		*out_buffer_len += 1;
+	packed_len = net_applemidi_pack_buffer( command_buffer->command, command_buffer->data, packed, sizeof( packed ) );
 
-		memcpy( p, &(sync->padding), sizeof(sync->padding) );
-		p += sizeof( sync->padding );
-		*out_buffer_len += sizeof( sync->padding );
+	if( packed_len == 0 )
+	{
+		return NET_APPLEMIDI_NEED_DATA;
+	}
 
-		put_uint64( &p, sync->timestamp1 , out_buffer_len );
-		put_uint64( &p, sync->timestamp2 , out_buffer_len );
-		put_uint64( &p, sync->timestamp3 , out_buffer_len );
+	*out_buffer = ( unsigned char * ) X_MALLOC( packed_len );
 
+	if( ! *out_buffer )
+	{
+		return NET_APPLEMIDI_NO_MEMORY;
 	}
 
+	memcpy( *out_buffer, packed, packed_len );
+	*out_buffer_len = packed_len;
+
 	return NET_APPLEMIDI_DONE;
 }
 
@@ -29,6 +29,8 @@
 #include <arpa/inet.h>
 
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include <errno.h>
 extern int errno;
@@ -36,6 +38,7 @@ extern int errno;
 #include "config.h"
 
 #include "midi_journal.h"
+#include "midi_recovery.h"
 #include "midi_state.h"
 #include "net_connection.h"
 #include "net_socket.h"
@@ -47,18 +50,44 @@ extern int errno;
 #include "raveloxmidi_config.h"
 #include "logging.h"
 
-#include "data_table.h"
-
-static data_table_t *connections = NULL;
+#include "hash_index.h"
+
+/* Contexts are carved out of slabs and are only freed at teardown. Every context handed out is
+   listed in sessions, where its position is its id. Contexts that are reset wait on a free list */
+typedef struct net_ctx_slab_t {
+	struct net_ctx_slab_t *next;
+	size_t used;
+	net_ctx_t ctx[ NET_CTX_SLAB_SIZE ];
+} net_ctx_slab_t;
+
+static net_ctx_slab_t *slabs = NULL;
+static net_ctx_t **sessions = NULL;
+static size_t session_count = 0;
+static size_t session_capacity = 0;
+static size_t max_sessions = 0;
+static net_ctx_t *free_sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Lookups that don't need the connections lock. Contexts are only freed at teardown so the indexes can hand them out freely */
+static hash_index_t *ssrc_index = NULL;
+static hash_index_t *initiator_index = NULL;
+static hash_index_t *name_index = NULL;
+
+/* Connections in use for the sender and the feedback timer. Readers publish the snapshot they
+   are using in one of the hazard slots. A replaced snapshot is only freed once it isn't in any slot */
+static _Atomic( net_ctx_snapshot_t * ) current_snapshot = NULL;
+static _Atomic( net_ctx_snapshot_t * ) snapshot_hazards[ NET_CTX_SNAPSHOT_HAZARDS ];
+static net_ctx_snapshot_t *retired_snapshots = NULL;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void net_connections_lock( void )
 {
-	data_table_lock( connections );
+	X_MUTEX_LOCK( &sessions_lock );
 }
 
 void net_connections_unlock( void )
 {
-	data_table_unlock( connections );
+	X_MUTEX_UNLOCK( &sessions_lock );
 }
 
 void net_ctx_lock( net_ctx_t *ctx )
@@ -73,24 +102,32 @@ void net_ctx_unlock( net_ctx_t *ctx )
 	X_MUTEX_UNLOCK( &(ctx->lock) );
 }
 
-void net_ctx_destroy( void **data )
+void net_ctx_receive_lock( net_ctx_t *ctx )
 {
-	net_ctx_t **ctx = NULL;
-	if( ! data ) return;
-	if( ! *data ) return;
+	if( ! ctx ) return;
+	X_MUTEX_LOCK( &(ctx->receive_lock) );
+}
+
+void net_ctx_receive_unlock( net_ctx_t *ctx )
+{
+	if( ! ctx ) return;
+	X_MUTEX_UNLOCK( &(ctx->receive_lock) );
+}
+
+/* Release what the context owns. The context itself belongs to its slab */
+void net_ctx_destroy( net_ctx_t *ctx )
+{
+	if( ! ctx ) return;
 
-	ctx = (net_ctx_t **)data;
-	logging_printf(LOGGING_DEBUG,"net_ctx_destroy: ctx=%p\n", *ctx);
-	if( (*ctx)->name ) X_FREENULL( "name",(void **)&((*ctx)->name) );
-	if( (*ctx)->ip_address) X_FREENULL( "ip_address",(void **)&((*ctx)->ip_address) );
-	journal_destroy( &((*ctx)->journal) );
+	logging_printf(LOGGING_DEBUG,"net_ctx_destroy: ctx=%p\n", ctx);
+	journal_destroy( &(ctx->journal) );
 
-	if( (*ctx)->midi_state )
+	if( ctx->midi_state )
 	{
-		midi_state_destroy( &((*ctx)->midi_state) );
+		midi_state_destroy( &(ctx->midi_state) );
 	}
-	pthread_mutex_destroy( &((*ctx)->lock) );
-	X_FREENULL( "net_ctx_destroy: ctx", data );
+	pthread_mutex_destroy( &(ctx->lock) );
+	pthread_mutex_destroy( &(ctx->receive_lock) );
 }
 
 void net_ctx_dump( void *data )
@@ -108,17 +145,54 @@ void net_ctx_dump( void *data )
 void net_ctx_dump_all( void )
 {
 	DEBUG_ONLY;
+
+	size_t i = 0;
+
 	logging_printf( LOGGING_DEBUG, "net_ctx_dump_all: start\n");
 
-	data_table_dump( connections );
+	net_connections_lock();
+	logging_printf( LOGGING_DEBUG, "net_ctx_dump_all: sessions=%zu max=%zu\n", session_count, max_sessions );
+	for( i = 0; i < session_count; i++ )
+	{
+		net_ctx_dump( sessions[i] );
+	}
+	net_connections_unlock();
 
 	logging_printf( LOGGING_DEBUG, "net_ctx_dump_all: end\n");
 }
 
+/* The RTP path parses the inbound ring holding only the receive lock so the reset has to wait for it.
+   Must not be called with the context lock held */
+static void net_ctx_midi_state_reset( net_ctx_t *ctx )
+{
+	net_ctx_receive_lock( ctx );
+	if( ctx->midi_state )
+	{
+		midi_state_reset( ctx->midi_state );
+	}
+	net_ctx_receive_unlock( ctx );
+}
+
+/* Copy into one of the context's fixed buffers without touching the last byte so
+   the buffer stays terminated for readers that don't hold the context lock */
+static void net_ctx_copy_string( char *dest, size_t dest_size, const char *src )
+{
+	size_t len = 0;
+
+	if( src )
+	{
+		len = MIN( strlen( src ), dest_size - 1 );
+		memcpy( dest, src, len );
+	}
+	memset( dest + len, 0, dest_size - 1 - len );
+}
+
 static void net_ctx_set( net_ctx_t *ctx, uint32_t ssrc, uint32_t initiator, uint32_t send_ssrc, uint16_t port, const char *ip_address , const char *name)
 {
 	if( ! ctx ) return;
 
+	net_ctx_midi_state_reset( ctx );
+
 	net_ctx_lock( ctx );
 	ctx->ssrc = ssrc;
 	ctx->send_ssrc = send_ssrc;
@@ -131,280 +205,515 @@ static void net_ctx_set( net_ctx_t *ctx, uint32_t ssrc, uint32_t initiator, uint
 	memset( &ctx->control_address, 0, sizeof( ctx->control_address ) );
 	memset( &ctx->data_address, 0, sizeof( ctx->data_address ) );
 
+	memset( &ctx->feedback, 0, sizeof( ctx->feedback ) );
+	ctx->feedback.packets = MAX( 1, config_int_get("feedback.packets") );
+	ctx->feedback.interval = MAX( 0, config_int_get("feedback.interval") ) * 10;
 
-	if( ctx->ip_address )
-	{
-		X_FREE( ctx->ip_address );
-	}
-	ctx->ip_address = ( char *) X_STRDUP( ip_address );
+	net_ctx_copy_string( ctx->ip_address, sizeof( ctx->ip_address ), ip_address );
 
-	if( ctx->ip_address )
+	if( ctx->ip_address[0] )
 	{
 		get_sock_info( ctx->ip_address, ctx->control_port, (struct sockaddr *)&ctx->control_address, &ctx->control_address_len, NULL );
 		get_sock_info( ctx->ip_address, ctx->data_port, (struct sockaddr *)&ctx->data_address, &ctx->data_address_len, NULL );
 	}
 
-	if( ctx->name )
-	{
-		X_FREE( ctx->name );
-	}
-	ctx->name = ( char *) X_STRDUP( name );
-
-	if( ctx->midi_state )
-	{
-		midi_state_reset( ctx->midi_state );
-	}
+	net_ctx_copy_string( ctx->name, sizeof( ctx->name ), name );
 
 	ctx->status = NET_CTX_STATUS_IDLE;
 	net_ctx_unlock( ctx );
 }
 
+/* Take a context off the free list. Returns NULL if there isn't one */
 net_ctx_t * net_ctx_find_unused( void )
 {
 	net_ctx_t *current_ctx = NULL;
-	size_t i = 0;
-	size_t num_connections = 0;
 
-	num_connections = data_table_item_count( connections );
+	net_connections_lock();
+
+	current_ctx = free_sessions;
+	if( current_ctx )
+	{
+		free_sessions = current_ctx->next_free;
+		current_ctx->next_free = NULL;
+	}
+
+	net_connections_unlock();
+
+	logging_printf( LOGGING_DEBUG, "net_ctx_find_unused: ctx=%p\n", current_ctx );
+
+	return current_ctx; 
+}
+
+/* Called with the connections lock held */
+static int net_ctx_slab_add( void )
+{
+	net_ctx_slab_t *new_slab = NULL;
+	net_ctx_t **new_sessions = NULL;
+	size_t new_capacity = 0;
+
+	new_slab = ( net_ctx_slab_t * ) X_MALLOC( sizeof( net_ctx_slab_t ) );
 
-	/* If there are no connections at all, there can't be any unused ones */
-	if( num_connections == 0 )
+	if( ! new_slab )
 	{
-		logging_printf( LOGGING_DEBUG, "net_ctx_find_unused: zero items in connections list\n");
-		return NULL;
+		logging_printf(LOGGING_ERROR,"net_ctx_slab_add: Unable to allocate memory for %u contexts\n", NET_CTX_SLAB_SIZE );
+		return -1;
 	}
 
+	memset( new_slab, 0, sizeof( net_ctx_slab_t ) );
+
+	// Make room to list every context in the new slab
+	new_capacity = session_capacity + NET_CTX_SLAB_SIZE;
+	new_sessions = ( net_ctx_t ** ) X_REALLOC( sessions, new_capacity * sizeof( net_ctx_t * ) );
+
+	if( ! new_sessions )
+	{
+		logging_printf(LOGGING_ERROR,"net_ctx_slab_add: Unable to extend the session list to %zu\n", new_capacity );
+		X_FREE( new_slab );
+		return -1;
+	}
+
+	sessions = new_sessions;
+	session_capacity = new_capacity;
+
+	new_slab->next = slabs;
+	slabs = new_slab;
+
+	logging_printf(LOGGING_DEBUG,"net_ctx_slab_add: slab=%p sessions=%zu\n", new_slab, session_capacity );
+
+	return 0;
+}
+
+/* Hand out a context that has never been used. Its ring and journal are only allocated once there is data for them */
+net_ctx_t * net_ctx_create( void )
+{
+	net_ctx_t *new_ctx = NULL;
+
 	net_connections_lock();
 
-	/* Work through the current list to find an unused connection */
-	for( i = 0 ; i < num_connections; i++ )
+	if( session_count >= max_sessions )
 	{
-		current_ctx = (net_ctx_t *) data_table_item_get( connections, i );
-		logging_printf( LOGGING_DEBUG, "net_ctx_find_unused: index=%zu, ctx=%p\n", i, current_ctx );
-		if( current_ctx )
+		logging_printf(LOGGING_ERROR,"net_ctx_create: network.max_connections (%zu) reached\n", max_sessions );
+		goto net_ctx_create_end;
+	}
+
+	if( ! slabs || slabs->used == NET_CTX_SLAB_SIZE )
+	{
+		if( net_ctx_slab_add() != 0 ) goto net_ctx_create_end;
+	}
+
+	new_ctx = &( slabs->ctx[ slabs->used++ ] );
+
+	new_ctx->seq = 1;
+	new_ctx->status = NET_CTX_STATUS_UNUSED;
+	pthread_mutex_init( &new_ctx->lock , NULL);
+	pthread_mutex_init( &new_ctx->receive_lock , NULL);
+
+	sessions[ session_count++ ] = new_ctx;
+
+net_ctx_create_end:
+	net_connections_unlock();
+
+	return new_ctx;
+}
+
+/* Create the inbound MIDI state the first time RTP MIDI arrives on the connection */
+midi_state_t *net_ctx_get_midi_state( net_ctx_t *ctx )
+{
+	midi_state_t *midi_state = NULL;
+	size_t ring_buffer_size = 0;
+
+	if( ! ctx ) return NULL;
+
+	net_ctx_lock( ctx );
+
+	if( ! ctx->midi_state )
+	{
+		ring_buffer_size = config_int_get("read.ring_buffer_size");
+		ring_buffer_size = MAX( NET_SOCKET_DEFAULT_RING_BUFFER, ring_buffer_size );
+		ctx->midi_state = midi_state_create( ring_buffer_size );
+		if( ! ctx->midi_state )
 		{
-			logging_printf( LOGGING_DEBUG, "net_ctx_find_unused: index=%zu,status=[%s]\n", i, net_ctx_status_to_string( current_ctx->status ) );
-			if( current_ctx->status == NET_CTX_STATUS_UNUSED )
+			logging_printf( LOGGING_ERROR, "net_ctx_get_midi_state: Unable to create midi_state_t for net_ctx_t\n");
+		} else {
+			if( is_yes( config_string_get("journal.read") ) )
 			{
-				break;
+				ctx->midi_state->recovery = midi_recovery_create();
 			}
+			logging_printf( LOGGING_DEBUG, "net_ctx_get_midi_state: ctx=%p midi_state->ring=%p\n", ctx, ctx->midi_state->ring );
 		}
-		current_ctx = NULL;
 	}
 
-	net_connections_unlock();
+	midi_state = ctx->midi_state;
 
-	return current_ctx; 
+	net_ctx_unlock( ctx );
+
+	return midi_state;
 }
 
-net_ctx_t * net_ctx_create( void )
+static int net_ctx_match_ssrc( void *data, const void *arg )
 {
-	net_ctx_t *new_ctx = NULL;
-	journal_t *journal = NULL;
-	midi_state_t *new_midi_state = NULL;
-	size_t ring_buffer_size = 0;
+	net_ctx_t *ctx = ( net_ctx_t * )data;
 
-	new_ctx = ( net_ctx_t * ) X_MALLOC( sizeof( net_ctx_t ) );
+	return ( ctx->status != NET_CTX_STATUS_UNUSED ) && ( ctx->ssrc == *( const uint32_t * )arg );
+}
 
-	if( ! new_ctx )
+static int net_ctx_match_initiator( void *data, const void *arg )
+{
+	net_ctx_t *ctx = ( net_ctx_t * )data;
+
+	return ( ctx->status != NET_CTX_STATUS_UNUSED ) && ( ctx->initiator == *( const uint32_t * )arg );
+}
+
+static int net_ctx_match_name( void *data, const void *arg )
+{
+	net_ctx_t *ctx = ( net_ctx_t * )data;
+	int match = 0;
+
+	// The name is replaced under the context lock when the slot is reused
+	net_ctx_lock( ctx );
+	match = ( ctx->status != NET_CTX_STATUS_UNUSED ) && ( strcmp( ctx->name, ( const char * )arg ) == 0 );
+	net_ctx_unlock( ctx );
+
+	return match;
+}
+
+static void net_ctx_index_add( net_ctx_t *ctx )
+{
+	uint32_t ssrc = 0;
+	uint32_t initiator = 0;
+	uint32_t name_key = 0;
+
+	net_ctx_lock( ctx );
+	ssrc = ctx->ssrc;
+	initiator = ctx->initiator;
+	name_key = hash_index_string_key( ctx->name );
+	net_ctx_unlock( ctx );
+
+	hash_index_insert( ssrc_index, ssrc, ctx );
+	hash_index_insert( initiator_index, initiator, ctx );
+	hash_index_insert( name_index, name_key, ctx );
+}
+
+static void net_ctx_index_remove( net_ctx_t *ctx )
+{
+	uint32_t ssrc = 0;
+	uint32_t initiator = 0;
+	uint32_t name_key = 0;
+
+	net_ctx_lock( ctx );
+	ssrc = ctx->ssrc;
+	initiator = ctx->initiator;
+	name_key = hash_index_string_key( ctx->name );
+	net_ctx_unlock( ctx );
+
+	// A context that is already unused isn't in the indexes so these do nothing
+	hash_index_remove( ssrc_index, ssrc, ctx );
+	hash_index_remove( initiator_index, initiator, ctx );
+	hash_index_remove( name_index, name_key, ctx );
+}
+
+static net_ctx_snapshot_t *net_ctx_snapshot_create( size_t count )
+{
+	net_ctx_snapshot_t *new_snapshot = NULL;
+
+	new_snapshot = ( net_ctx_snapshot_t * ) X_MALLOC( sizeof( net_ctx_snapshot_t ) + ( count * sizeof( net_ctx_t * ) ) );
+
+	if( ! new_snapshot )
 	{
-		logging_printf(LOGGING_ERROR,"net_ctx_create: Unable to allocate memory for new net_ctx_t\n");
+		logging_printf( LOGGING_ERROR, "net_ctx_snapshot_create: Insufficient memory for %zu connections\n", count );
 		return NULL;
 	}
 
-	memset( new_ctx, 0, sizeof( net_ctx_t ) );
-	new_ctx->seq = 1;
+	new_snapshot->count = 0;
+	new_snapshot->ctx = ( net_ctx_t ** )( new_snapshot + 1 );
+	new_snapshot->retired = NULL;
+
+	return new_snapshot;
+}
 
-	journal_init( &journal );
-	new_ctx->journal = journal;
+static int net_ctx_snapshot_in_use( const net_ctx_snapshot_t *snapshot )
+{
+	int i = 0;
 
-	ring_buffer_size = config_int_get("read.ring_buffer_size");
-	ring_buffer_size = MAX( NET_SOCKET_DEFAULT_RING_BUFFER, ring_buffer_size );
-	new_midi_state = midi_state_create( ring_buffer_size );
-	if( ! new_midi_state )
+	for( i = 0; i < NET_CTX_SNAPSHOT_HAZARDS; i++ )
 	{
-		logging_printf( LOGGING_ERROR, "net_ctx_create: Unable to create midi_state_t for net_ctx_t\n");
-	} else {
-		new_ctx->midi_state = new_midi_state;
-		logging_printf( LOGGING_DEBUG, "net_ctx_create: midi_state->ring=%p\n", new_midi_state->ring );
+		if( atomic_load( &snapshot_hazards[i] ) == snapshot ) return 1;
 	}
-	new_ctx->status = NET_CTX_STATUS_UNUSED;
 
-	pthread_mutex_init( &new_ctx->lock , NULL);
-	return new_ctx;
+	return 0;
+}
+
+/* Free the replaced snapshots that no reader holds. Called with snapshot_lock held */
+static void net_ctx_snapshot_reclaim( void )
+{
+	net_ctx_snapshot_t **prev = &retired_snapshots;
+
+	while( *prev )
+	{
+		net_ctx_snapshot_t *snapshot = *prev;
+
+		if( net_ctx_snapshot_in_use( snapshot ) )
+		{
+			prev = &( snapshot->retired );
+			continue;
+		}
+
+		*prev = snapshot->retired;
+		X_FREE( snapshot );
+	}
+}
+
+/* Build a new snapshot of the connections in use and swap it in */
+static void net_ctx_snapshot_publish( void )
+{
+	net_ctx_snapshot_t *new_snapshot = NULL;
+	net_ctx_snapshot_t *old_snapshot = NULL;
+	size_t i = 0;
+
+	X_MUTEX_LOCK( &snapshot_lock );
+
+	net_connections_lock();
+
+	new_snapshot = net_ctx_snapshot_create( session_count );
+	if( ! new_snapshot )
+	{
+		net_connections_unlock();
+		goto net_ctx_snapshot_publish_end;
+	}
+
+	for( i = 0; i < session_count; i++ )
+	{
+		net_ctx_t *ctx = sessions[i];
+
+		if( ! net_ctx_is_used( ctx ) ) continue;
+
+		new_snapshot->ctx[ new_snapshot->count++ ] = ctx;
+	}
+	net_connections_unlock();
+
+	old_snapshot = atomic_exchange( &current_snapshot, new_snapshot );
+
+	logging_printf( LOGGING_DEBUG, "net_ctx_snapshot_publish: snapshot=%p count=%zu\n", new_snapshot, new_snapshot->count );
+
+	if( old_snapshot )
+	{
+		old_snapshot->retired = retired_snapshots;
+		retired_snapshots = old_snapshot;
+	}
+
+	net_ctx_snapshot_reclaim();
+
+net_ctx_snapshot_publish_end:
+	X_MUTEX_UNLOCK( &snapshot_lock );
+}
 
+/* Lock free. Returns the current snapshot, which stays valid until net_ctx_snapshot_release() is called with the hazard slot.
+   Returns NULL if there isn't one */
+const net_ctx_snapshot_t *net_ctx_snapshot_acquire( int *hazard )
+{
+	net_ctx_snapshot_t *snapshot = NULL;
+	size_t i = 0;
+
+	if( ! hazard ) return NULL;
+
+	*hazard = -1;
+
+	while( 1 )
+	{
+		snapshot = atomic_load( &current_snapshot );
+		if( ! snapshot ) return NULL;
+
+		// Claim a free hazard slot for the snapshot
+		if( *hazard < 0 )
+		{
+			for( i = 0; i < NET_CTX_SNAPSHOT_HAZARDS; i++ )
+			{
+				net_ctx_snapshot_t *expected = NULL;
+
+				if( atomic_compare_exchange_strong( &snapshot_hazards[i], &expected, snapshot ) )
+				{
+					*hazard = i;
+					break;
+				}
+			}
+
+			// Only happens if more threads than expected read at once. Let them finish
+			if( *hazard < 0 )
+			{
+				sched_yield();
+				continue;
+			}
+		} else {
+			atomic_store( &snapshot_hazards[ *hazard ], snapshot );
+		}
+
+		// The snapshot is safe once it is still current after being published in the slot
+		if( atomic_load( &current_snapshot ) == snapshot ) return snapshot;
+	}
+}
+
+void net_ctx_snapshot_release( int hazard )
+{
+	if( hazard < 0 ) return;
+	if( hazard >= NET_CTX_SNAPSHOT_HAZARDS ) return;
+
+	atomic_store_explicit( &snapshot_hazards[ hazard ], NULL, memory_order_release );
 }
 
 void net_ctx_reset( net_ctx_t *ctx )
 {
+	int was_used = 0;
+
 	if( ! ctx ) return;
 
 	logging_printf(LOGGING_DEBUG, "net_ctx_reset: ctx=%p\n", ctx );
+	net_ctx_index_remove( ctx );
 	net_ctx_journal_reset( ctx );
+	net_ctx_midi_state_reset( ctx );
 	net_ctx_lock( ctx );
+	was_used = ( ctx->status != NET_CTX_STATUS_UNUSED );
 	ctx->seq = 1;
 	ctx->status = NET_CTX_STATUS_UNUSED;
 	ctx->control_address_len = 0;
 	ctx->data_address_len = 0;
 	memset( &ctx->control_address, 0, sizeof( ctx->control_address ) );
 	memset( &ctx->data_address, 0, sizeof( ctx->data_address ) );
+	ctx->feedback.active = 0;
+	ctx->feedback.pending = 0;
+	net_ctx_unlock( ctx );
 
-	if( ctx->midi_state )
+	// Only put the context back once even if it is reset more than once
+	if( was_used )
 	{
-		midi_state_reset( ctx->midi_state );
+		net_connections_lock();
+		ctx->next_free = free_sessions;
+		free_sessions = ctx;
+		net_connections_unlock();
 	}
 
-	net_ctx_unlock( ctx );
+	net_ctx_snapshot_publish();
 }
 
 
 void net_ctx_init( void )
 {
-	connections = data_table_create( "connections", net_ctx_destroy, net_ctx_dump );
-}
+	max_sessions = MAX( 1, config_int_get("network.max_connections") );
 
-void net_ctx_teardown( void )
-{
-	data_table_destroy( &connections );
+	net_connections_lock();
+	net_ctx_slab_add();
+	net_connections_unlock();
+
+	ssrc_index = hash_index_create( "connections.ssrc", NET_CTX_SLAB_SIZE );
+	initiator_index = hash_index_create( "connections.initiator", NET_CTX_SLAB_SIZE );
+	name_index = hash_index_create( "connections.name", NET_CTX_SLAB_SIZE );
+	net_ctx_snapshot_publish();
 }
 
-net_ctx_t * net_ctx_find_by_ssrc( uint32_t ssrc)
+void net_ctx_teardown( void )
 {
-	size_t i = 0;
-	size_t num_connections = 0;
-	net_ctx_t *current_ctx = NULL;
+	net_ctx_snapshot_t *snapshot = NULL;
+	int i = 0;
 
-	num_connections = data_table_item_count( connections );
+	hash_index_destroy( &ssrc_index );
+	hash_index_destroy( &initiator_index );
+	hash_index_destroy( &name_index );
 
-	if( num_connections == 0 )
+	// Nothing is reading the snapshots by now
+	X_MUTEX_LOCK( &snapshot_lock );
+	snapshot = atomic_exchange( &current_snapshot, NULL );
+	if( snapshot )
 	{
-		logging_printf( LOGGING_DEBUG, "net_ctx_find_by_ssrc: zero items in connections list\n");
-		return NULL;
+		X_FREE( snapshot );
 	}
-
-	logging_printf( LOGGING_DEBUG, "net_ctx_find_by_ssrc: ssrc=0x%08x\n", ssrc );
+	for( i = 0; i < NET_CTX_SNAPSHOT_HAZARDS; i++ )
+	{
+		atomic_store( &snapshot_hazards[i], NULL );
+	}
+	net_ctx_snapshot_reclaim();
+	X_MUTEX_UNLOCK( &snapshot_lock );
 
 	net_connections_lock();
-
-	for( i = 0; i < num_connections; i++ )
+	for( i = 0; i < session_count; i++ )
 	{
-		current_ctx = (net_ctx_t *) data_table_item_get( connections, i );
-		if( current_ctx && (current_ctx->status != NET_CTX_STATUS_UNUSED ) )
-		{
-			if( current_ctx->ssrc == ssrc )
-			{
-				break;
-			}
-		}
-		current_ctx = NULL;
+		net_ctx_destroy( sessions[i] );
 	}
-	if( ! current_ctx )
+
+	while( slabs )
 	{
-		logging_printf( LOGGING_DEBUG, "net_ctx_find_by_ssrc: not found\n");
+		net_ctx_slab_t *next = slabs->next;
+		X_FREE( slabs );
+		slabs = next;
 	}
 
+	if( sessions )
+	{
+		X_FREENULL( "sessions", (void **)&sessions );
+	}
+	session_count = 0;
+	session_capacity = 0;
+	free_sessions = NULL;
 	net_connections_unlock();
-
-	return current_ctx;
 }
 
-net_ctx_t * net_ctx_find_by_initiator( uint32_t initiator)
+net_ctx_t * net_ctx_find_by_ssrc( uint32_t ssrc)
 {
-	size_t i = 0;
-	size_t num_connections = 0;
 	net_ctx_t *current_ctx = NULL;
 
-	num_connections = data_table_item_count( connections );
+	logging_printf( LOGGING_DEBUG, "net_ctx_find_by_ssrc: ssrc=0x%08x\n", ssrc );
+
+	current_ctx = ( net_ctx_t * ) hash_index_find( ssrc_index, ssrc, net_ctx_match_ssrc, &ssrc );
 
-	if( num_connections == 0 )
+	if( ! current_ctx )
 	{
-		logging_printf( LOGGING_DEBUG, "net_ctx_find_by_initiator: zero items in connections list\n");
-	  	return NULL;
+		logging_printf( LOGGING_DEBUG, "net_ctx_find_by_ssrc: not found\n");
 	}
 
+	return current_ctx;
+}
+
+net_ctx_t * net_ctx_find_by_initiator( uint32_t initiator)
+{
+	net_ctx_t *current_ctx = NULL;
+
 	logging_printf( LOGGING_DEBUG, "net_ctx_find_by_initiator: initiator=0x%08x\n", initiator );
 
-	net_connections_lock();
+	current_ctx = ( net_ctx_t * ) hash_index_find( initiator_index, initiator, net_ctx_match_initiator, &initiator );
 
-	for( i = 0; i < num_connections; i++ )
-	{
-		current_ctx = (net_ctx_t *) data_table_item_get( connections, i );
-		if( current_ctx && (current_ctx->status != NET_CTX_STATUS_UNUSED ) )
-		{
-			if( current_ctx->initiator == initiator )
-			{
-				break;
-			}
-		}
-		current_ctx = NULL;
-	}
 	if( ! current_ctx )
 	{
 		logging_printf( LOGGING_DEBUG, "net_ctx_find_by_initiator: not found\n");
 	}
 
-	net_connections_unlock();
-
 	return current_ctx;
 }
 
 net_ctx_t * net_ctx_find_by_name( char *name )
 {
-	size_t i = 0;
-	size_t num_connections = 0;
 	net_ctx_t *current_ctx = NULL;
+	char key[ NET_CTX_NAME_SIZE ];
 
 	if( ! name ) return NULL;
 
-	num_connections = data_table_item_count( connections );
-
-	if( num_connections == 0 )
-	{
-		logging_printf( LOGGING_DEBUG, "net_find_by_name: zero items in connections list\n");
-		return NULL;
-	}
-
 	logging_printf( LOGGING_DEBUG, "net_ctx_find_by_name: name=%s\n", name );
 
-	net_connections_lock();
+	// Match the name as it was stored
+	memset( key, 0, sizeof( key ) );
+	strncpy( key, name, sizeof( key ) - 1 );
 
-	for( i = 0; i < num_connections; i++ )
-	{
-		current_ctx = (net_ctx_t *)data_table_item_get( connections, i );
-		if( current_ctx && (current_ctx->status != NET_CTX_STATUS_UNUSED ) )
-		{
-			if( strcmp(current_ctx->name, name) == 0 )
-			{
-				break;
-			}
-		}
-		current_ctx = NULL;
-	}
+	current_ctx = ( net_ctx_t * ) hash_index_find( name_index, hash_index_string_key( key ), net_ctx_match_name, key );
 
 	if( ! current_ctx )
 	{
 		logging_printf( LOGGING_DEBUG, "net_ctx_find_by_name: not found\n");
 	}
 
-	net_connections_unlock();
-
 	return current_ctx;
 }
 	
-void net_ctx_add( net_ctx_t *ctx )
-{
-	net_ctx_lock( ctx );
-	ctx->status = NET_CTX_STATUS_IDLE;
-	net_ctx_unlock( ctx );
-
-	data_table_add_item( connections, ctx );
-}
-
 net_ctx_t * net_ctx_register( uint32_t ssrc, uint32_t initiator, const char *ip_address, uint16_t port, const char *name )
 {
 	net_ctx_t *new_ctx = NULL;
 	uint32_t send_ssrc = 0;
-	uint8_t reuse = 0;
 
 	logging_printf( LOGGING_DEBUG, "net_ctx_register: ssrc=0x%08x initiator=0x%08x ip_address=[%s] port=%u name=[%s]\n", ssrc, initiator, ip_address, port, name );
 
@@ -431,7 +740,6 @@ net_ctx_t * net_ctx_register( uint32_t ssrc, uint32_t initiator, const char *ip_
 			}
 		} else {
 			logging_printf(LOGGING_DEBUG, "net_ctx_register: Using existing unused slot\n");
-			reuse = 1;
 		}
 	} else {
 		logging_printf(LOGGING_WARN, "net_ctx_register: net_ctx: Attempt to register existing ssrc: 0x%08x\n", ssrc );
@@ -441,11 +749,8 @@ net_ctx_t * net_ctx_register( uint32_t ssrc, uint32_t initiator, const char *ip_
 	send_ssrc = random_number();
 	net_ctx_set( new_ctx, ssrc, initiator, send_ssrc, port, ip_address , name);
 
-	/* This is a new slot we need to create */
-	if( reuse == 0)
-	{
-		net_ctx_add( new_ctx );
-	}
+	net_ctx_index_add( new_ctx );
+	net_ctx_snapshot_publish();
 
 register_end:
 	if( LOGGING_DEBUG_ENABLED ) net_ctx_dump_all();
@@ -453,32 +758,76 @@ register_end:
 	return new_ctx;
 }
 
-void net_ctx_add_journal_note( net_ctx_t *ctx, const midi_note_t *midi_note )
+/* The journal is only allocated once there is something to put in it. Called with the context lock held */
+static journal_t *net_ctx_journal_get( net_ctx_t *ctx )
+{
+	if( ! ctx->journal )
+	{
+		if( journal_init( &(ctx->journal) ) != 0 )
+		{
+			logging_printf( LOGGING_ERROR, "net_ctx_journal_get: Unable to create journal for ctx=%p\n", ctx );
+		}
+	}
+
+	return ctx->journal;
+}
+
+void net_ctx_add_journal_note( net_ctx_t *ctx, const midi_command_t *command )
 {
-	if( ! midi_note ) return;
+	if( !command ) return;
 	if( ! ctx) return;
 	net_ctx_lock( ctx );
-	midi_journal_add_note( ctx->journal, ctx->seq, midi_note );
+	midi_journal_add_note( net_ctx_journal_get( ctx ), ctx->seq, command );
 	net_ctx_unlock( ctx );
 	if( LOGGING_DEBUG_ENABLED ) net_ctx_journal_dump( ctx );
 }
 
-void net_ctx_add_journal_control( net_ctx_t *ctx, const midi_control_t *midi_control )
+void net_ctx_add_journal_control( net_ctx_t *ctx, const midi_command_t *command )
 {
-	if( ! midi_control ) return;
+	if( !command ) return;
 	if( !ctx ) return;
 	net_ctx_lock( ctx );
-	midi_journal_add_control( ctx->journal, ctx->seq, midi_control );
+	midi_journal_add_control( net_ctx_journal_get( ctx ), ctx->seq, command );
 	net_ctx_unlock( ctx );
 	if( LOGGING_DEBUG_ENABLED ) net_ctx_journal_dump( ctx );
 }
 
-void net_ctx_add_journal_program( net_ctx_t *ctx, const midi_program_t *midi_program )
+void net_ctx_add_journal_program( net_ctx_t *ctx, const midi_command_t *command )
 {
-	if( !midi_program ) return;
+	if( !command ) return;
 	if( !ctx ) return;
 	net_ctx_lock( ctx );
-	midi_journal_add_program( ctx->journal, ctx->seq, midi_program );
+	midi_journal_add_program( net_ctx_journal_get( ctx ), ctx->seq, command );
+	net_ctx_unlock( ctx );
+	if( LOGGING_DEBUG_ENABLED ) net_ctx_journal_dump( ctx );
+}
+
+void net_ctx_add_journal_pitch_bend( net_ctx_t *ctx, const midi_command_t *command )
+{
+	if( !command ) return;
+	if( !ctx ) return;
+	net_ctx_lock( ctx );
+	midi_journal_add_pitch_bend( net_ctx_journal_get( ctx ), ctx->seq, command );
+	net_ctx_unlock( ctx );
+	if( LOGGING_DEBUG_ENABLED ) net_ctx_journal_dump( ctx );
+}
+
+void net_ctx_add_journal_channel_pressure( net_ctx_t *ctx, const midi_command_t *command )
+{
+	if( !command ) return;
+	if( !ctx ) return;
+	net_ctx_lock( ctx );
+	midi_journal_add_channel_pressure( net_ctx_journal_get( ctx ), ctx->seq, command );
+	net_ctx_unlock( ctx );
+	if( LOGGING_DEBUG_ENABLED ) net_ctx_journal_dump( ctx );
+}
+
+void net_ctx_add_journal_poly_pressure( net_ctx_t *ctx, const midi_command_t *command )
+{
+	if( !command ) return;
+	if( !ctx ) return;
+	net_ctx_lock( ctx );
+	midi_journal_add_poly_pressure( net_ctx_journal_get( ctx ), ctx->seq, command );
 	net_ctx_unlock( ctx );
 	if( LOGGING_DEBUG_ENABLED ) net_ctx_journal_dump( ctx );
 }
@@ -498,7 +847,8 @@ void net_ctx_journal_dump( net_ctx_t *ctx )
 	net_ctx_unlock( ctx );
 }
 
-void net_ctx_journal_pack( net_ctx_t *ctx, char **journal_buffer, size_t *journal_buffer_size)
+/* The journal buffer belongs to the connection and is only changed by the thread that sends to it */
+void net_ctx_journal_pack( net_ctx_t *ctx, const char **journal_buffer, size_t *journal_buffer_size)
 {
 	*journal_buffer = NULL;
 	*journal_buffer_size = 0;
@@ -516,17 +866,49 @@ void net_ctx_journal_reset( net_ctx_t *ctx )
 
 	net_ctx_lock( ctx );
 	logging_printf(LOGGING_DEBUG,"net_ctx_journal_reset:ssrc=0x%08x\n", ctx->ssrc );
-	journal_reset( ctx->journal);
+	journal_request_reset( ctx->journal);
 	net_ctx_unlock( ctx );
 }
 
-void net_ctx_update_rtp_fields( const net_ctx_t *ctx, rtp_packet_t *rtp_packet)
+/* rtp_seq has been acknowledged by the peer. The journal only needs to cover the packets sent after it */
+void net_ctx_journal_trim( net_ctx_t *ctx, uint16_t rtp_seq )
+{
+	uint32_t last_seq = 0;
+	int16_t behind = 0;
+	uint32_t checkpoint = 0;
+
+	if( ! ctx ) return;
+
+	net_ctx_lock( ctx );
+
+	// The journal uses the full sequence number so work out which one the 16 bit RTP sequence number refers to.
+	// ctx->seq is moved on before each packet is sent so it holds the last one sent
+	last_seq = ctx->seq;
+	behind = (int16_t)( (uint16_t)last_seq - rtp_seq );
+
+	// Anything ahead of the last packet sent acknowledges everything
+	if( behind < 0 )
+	{
+		checkpoint = last_seq;
+	} else {
+		checkpoint = last_seq - behind;
+	}
+
+	logging_printf(LOGGING_DEBUG,"net_ctx_journal_trim:ssrc=0x%08x rtp_seq=%u checkpoint=%u\n", ctx->ssrc, rtp_seq, checkpoint );
+	journal_request_trim( ctx->journal, checkpoint );
+	net_ctx_unlock( ctx );
+}
+
+/* timestamp is when the MIDI data arrived, in time_in_microseconds() units. Use 0 for the current time */
+void net_ctx_update_rtp_fields( const net_ctx_t *ctx, rtp_packet_t *rtp_packet, long timestamp )
 {
 	if( ! rtp_packet ) return;
 	if( ! ctx ) return;
 
+	if( timestamp <= 0 ) timestamp = time_in_microseconds();
+
 	rtp_packet->header.seq = ctx->seq;
-	rtp_packet->header.timestamp = time_in_microseconds() - ctx->start;
+	rtp_packet->header.timestamp = timestamp - ctx->start;
 	rtp_packet->header.ssrc = ctx->send_ssrc;
 }
 
@@ -592,6 +974,31 @@ void net_ctx_send( net_ctx_t *ctx, unsigned char *buffer, size_t buffer_len , in
 	net_ctx_unlock( ctx );
 }
 
+/* Copy the cached destination address for a connection. Returns 0 when there is nowhere to send to */
+socklen_t net_ctx_get_address( net_ctx_t *ctx, int use_control, struct sockaddr_storage *address )
+{
+	socklen_t addr_len = 0;
+
+	if( ! ctx ) return 0;
+	if( ! address ) return 0;
+
+	net_ctx_lock( ctx );
+	if( ctx->status != NET_CTX_STATUS_UNUSED )
+	{
+		if( use_control == USE_CONTROL_PORT )
+		{
+			addr_len = ctx->control_address_len;
+			memcpy( address, &ctx->control_address, sizeof( struct sockaddr_storage ) );
+		} else {
+			addr_len = ctx->data_address_len;
+			memcpy( address, &ctx->data_address, sizeof( struct sockaddr_storage ) );
+		}
+	}
+	net_ctx_unlock( ctx );
+
+	return addr_len;
+}
+
 const char *net_ctx_status_to_string( net_ctx_status_t status )
 {
 	switch( status )
@@ -605,59 +1012,48 @@ const char *net_ctx_status_to_string( net_ctx_status_t status )
 	}
 }
 
-int net_ctx_get_num_connections( void )
-{
-	return data_table_item_count( connections );
-}
-
 int net_ctx_is_used( const net_ctx_t *ctx )
 {
 	if( ! ctx ) return 0;
 	return ctx->status != NET_CTX_STATUS_UNUSED;
 }
 
-net_ctx_t *net_ctx_find_by_index( int index )
-{
-	return (net_ctx_t *)data_table_item_get( connections, index );
-}
-
 char *net_ctx_connections_to_string( void )
 {
 	dstring_t *dstring = NULL;
 	unsigned char *out_buffer = NULL;
-	int i = 0;
+	size_t i = 0;
 	char ctx_buffer[1024];
 	size_t connection_count = 0;
-	size_t num_connections = 0;
+	size_t listed_count = 0;
 
 	dstring = dstring_create( DSTRING_DEFAULT_BLOCK_SIZE );
+	if( ! dstring ) return NULL;
 
-	num_connections = data_table_item_count( connections );
 	net_connections_lock();
 
 	memset(ctx_buffer, 0, sizeof(ctx_buffer) );
 	snprintf( ctx_buffer, sizeof(ctx_buffer), "{\"connections\":[");
 	dstring_append( dstring, ctx_buffer );
 
-	for( i=0 ; i < num_connections; i++ )
+	for( i=0 ; i < session_count; i++ )
 	{
 		net_ctx_t *ctx = NULL;
 
-		ctx = data_table_item_get( connections, i );
+		ctx = sessions[i];
 
 		if( ctx->status == NET_CTX_STATUS_UNUSED ) continue;
 
 		connection_count += 1;
-		memset( ctx_buffer, 0, sizeof(ctx_buffer) );
-		snprintf( ctx_buffer, sizeof(ctx_buffer), "{\"id\":%d,\"name\":\"%s\",\"ctx\":\"%p\",\"ssrc\":\"0x%08x\",\"status\":\"%s\",\"send_ssrc\":\"0x%08x\",\"initiator\":\"0x%08x\",\"seq\":%u,\"host\":\"%s\",\"control\":%u,\"data\":%u,\"start\":%lu}",
-			i, ( ctx->name ? ctx->name : "unknown"), ctx, ctx->ssrc, net_ctx_status_to_string( ctx->status ), ctx->send_ssrc, ctx->initiator, ctx->seq, ctx->ip_address, ctx->control_port, ctx->data_port, ctx->start);
-		dstring_append( dstring, ctx_buffer );
 
-		if( (i+1) < num_connections )
-		{
-			dstring_append(dstring, ",");
-		}
+		// The reply has to fit in one datagram. Entries that don't fit are still counted
+		if( dstring_len( dstring ) + sizeof( ctx_buffer ) + 64 > NET_CTX_LIST_MAX_SIZE ) continue;
 
+		memset( ctx_buffer, 0, sizeof(ctx_buffer) );
+		snprintf( ctx_buffer, sizeof(ctx_buffer), "%s{\"id\":%zu,\"name\":\"%s\",\"ctx\":\"%p\",\"ssrc\":\"0x%08x\",\"status\":\"%s\",\"send_ssrc\":\"0x%08x\",\"initiator\":\"0x%08x\",\"seq\":%u,\"host\":\"%s\",\"control\":%u,\"data\":%u,\"start\":%lu}",
+			( listed_count > 0 ? "," : "" ), i, ( ctx->name[0] ? ctx->name : "unknown"), ctx, ctx->ssrc, net_ctx_status_to_string( ctx->status ), ctx->send_ssrc, ctx->initiator, ctx->seq, ctx->ip_address, ctx->control_port, ctx->data_port, ctx->start);
+		dstring_append( dstring, ctx_buffer );
+		listed_count += 1;
 	}
 	dstring_append( dstring, "]" );
 
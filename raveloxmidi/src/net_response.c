@@ -70,110 +70,101 @@ void net_response_destroy( net_response_t **response )
 	*response = NULL;
 }
 
-net_response_t *net_response_inv( uint32_t ssrc, uint32_t initiator, const char *name )
+/* Copy a packed response into a newly allocated net_response_t */
+static net_response_t *net_response_from_buffer( const net_response_buffer_t *packed, const char *caller )
 {
-	net_applemidi_inv *inv = NULL;
 	net_response_t *response = NULL;
-	net_applemidi_command *cmd = NULL;
 
-	// Build the INV packet
-	inv = net_applemidi_inv_create();
-	
-	if( ! inv )
+	if( packed->len == 0 )
 	{
-		logging_printf( LOGGING_ERROR, "net_response_inv: Cannot create INV packet\n");
+		logging_printf( LOGGING_ERROR, "%s: Unable to pack RESPONSE packet\n", caller );
 		return NULL;
 	}
 
-	inv->ssrc = ssrc;
-	inv->version = 2;
-	inv->initiator = initiator;
-	if( name )
+	response = net_response_create();
+	if( ! response )
 	{
-		inv->name = (char *)X_STRDUP( name );
-	} else {
-		inv->name = (char *)X_STRDUP( "RaveloxMIDIClient" );
+		logging_printf( LOGGING_ERROR, "%s: Unable to create RESPONSE packet\n", caller );
+		return NULL;
 	}
 
-	cmd = net_applemidi_cmd_create( NET_APPLEMIDI_CMD_INV );
-	
-	if( cmd )
+	response->buffer = (unsigned char *)X_MALLOC( packed->len );
+	if( ! response->buffer )
 	{
-		cmd->data = inv;
-		response = net_response_create();
-		if( ! response )
-		{
-			logging_printf( LOGGING_ERROR, "net_response_inv: Unable to create RESPONSE packet\n");
-		} else {
-			int ret = 0;
-			ret = net_applemidi_pack( cmd , &(response->buffer), &(response->len) );
-			net_applemidi_cmd_destroy( &cmd );
-			if( ret != 0 )
-			{
-				logging_printf( LOGGING_ERROR, "Unable to pack RESPONSE packet\n");
-			} else {
-				return response;
-			}
-		}
-
-	} else {
-		logging_printf( LOGGING_ERROR, "net_response_inv: Unable to create AppleMIDI command\n");
+		logging_printf( LOGGING_ERROR, "%s: Insufficient memory for RESPONSE packet\n", caller );
+		net_response_destroy( &response );
+		return NULL;
 	}
 
-	net_response_destroy( &response );
-	net_applemidi_cmd_destroy( &cmd );
+	memcpy( response->buffer, packed->buffer, packed->len );
+	response->len = packed->len;
 
-	return NULL;
+	return response;
+}
+
+net_response_t *net_response_inv( uint32_t ssrc, uint32_t initiator, const char *name )
+{
+	net_response_buffer_t packed;
+
+	net_response_inv_pack( &packed, NET_APPLEMIDI_CMD_INV, ssrc, initiator, ( name ? name : "RaveloxMIDIClient" ) );
+
+	return net_response_from_buffer( &packed, "net_response_inv" );
 }
 
 net_response_t *net_response_sync( uint32_t send_ssrc , long start_time )
 {
-	net_applemidi_sync *sync = NULL;
-	net_response_t *response = NULL;
-	net_applemidi_command *cmd = NULL;
+	net_response_buffer_t packed;
 
-	sync = net_applemidi_sync_create();
-	
-	if( ! sync )
-	{
-		logging_printf( LOGGING_ERROR, "net_response_sync: Unable to allocate memory for sync packet\n");
-		return NULL;
-	}
+	net_response_sync_pack( &packed, send_ssrc, start_time );
 
-	sync->ssrc = send_ssrc;
-	sync->count = 0;
-	sync->timestamp1 = time_in_microseconds() - start_time;
-	sync->timestamp2 = random_number();
-	sync->timestamp3 = random_number();
+	return net_response_from_buffer( &packed, "net_response_sync" );
+}
 
-	cmd = net_applemidi_cmd_create( NET_APPLEMIDI_CMD_SYNC );
-	
-	if( cmd )
-	{
-		cmd->data = sync;
-
-		response = net_response_create();
-
-		if( response )
-		{
-			int ret = 0;
-			ret = net_applemidi_pack( cmd , &(response->buffer), &(response->len) );
-			if( ret != 0 )
-			{
-				logging_printf( LOGGING_ERROR, "net_response_sync: Unable to pack response to sync command\n");
-			} else {
-				net_applemidi_cmd_destroy( &cmd );
-				return response;
-			}
-		} else {
-			logging_printf( LOGGING_ERROR, "net_response_sync: Unable to create response packet\n");
-		}
-	} else {
-		logging_printf( LOGGING_ERROR, "net_response_sync: Unable to create AppleMIDI command\n");
-	}
+size_t net_response_inv_pack( net_response_buffer_t *response, uint16_t command, uint32_t ssrc, uint32_t initiator, const char *name )
+{
+	net_applemidi_inv inv;
+
+	if( ! response ) return 0;
+
+	inv.ssrc = ssrc;
+	inv.version = 2;
+	inv.initiator = initiator;
+	inv.name = (char *)name;
+
+	response->len = net_applemidi_pack_inv( response->buffer, sizeof( response->buffer ), command, &inv );
+
+	return response->len;
+}
+
+size_t net_response_sync_pack( net_response_buffer_t *response, uint32_t send_ssrc, long start_time )
+{
+	net_applemidi_sync sync;
+
+	if( ! response ) return 0;
+
+	memset( &sync, 0, sizeof( sync ) );
+	sync.ssrc = send_ssrc;
+	sync.count = 0;
+	sync.timestamp1 = time_in_microseconds() - start_time;
+	sync.timestamp2 = random_number();
+	sync.timestamp3 = random_number();
+
+	response->len = net_applemidi_pack_sync( response->buffer, sizeof( response->buffer ), &sync );
+
+	return response->len;
+}
+
+size_t net_response_feedback_pack( net_response_buffer_t *response, uint32_t ssrc, uint16_t rtp_seq )
+{
+	net_applemidi_feedback feedback;
+
+	if( ! response ) return 0;
+
+	memset( &feedback, 0, sizeof( feedback ) );
+	feedback.ssrc = ssrc;
+	feedback.rtp_seq[1] = rtp_seq;
 
-	net_response_destroy( &response );
-	net_applemidi_cmd_destroy( &cmd );
+	response->len = net_applemidi_pack_feedback( response->buffer, sizeof( response->buffer ), &feedback );
 
-	return NULL;
+	return response->len;
 }
@@ -18,6 +18,8 @@
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
 */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,7 +27,9 @@
 
 #include <fcntl.h>
 #include <sys/socket.h>
-#include <poll.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -36,8 +40,6 @@
 #include <errno.h>
 extern int errno;
 
-#include "config.h"
-
 #include "net_applemidi.h"
 #include "net_response.h"
 #include "net_socket.h"
@@ -76,55 +78,82 @@ static int shutdown_fd[2] = {0,0};
 
 int inbound_midi_fd = -1;
 
-static struct pollfd *poll_fds = NULL;
-static nfds_t poll_fds_count = 0;
-static nfds_t poll_fds_capacity = 0;
+static int epoll_fd = -1;
+
+/* Direct fd to socket lookup. Slots are only written when sockets are added or destroyed */
+static raveloxmidi_socket_t **socket_index = NULL;
+static size_t socket_index_size = 0;
+
+/* Additional receive workers. Each one runs its own event loop over SO_REUSEPORT copies of the control and data sockets */
+typedef struct net_socket_worker_t {
+	pthread_t thread;
+	int loop_fd;
+	int started;
+} net_socket_worker_t;
+
+static net_socket_worker_t *workers = NULL;
+static int num_workers = 0;
+
+/* Listening sockets, cached once they are created */
+static int control_socket_fd = -1;
+static int data_socket_fd = -1;
+static int local_socket_fd = -1;
 
 static pthread_mutex_t shutdown_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t poll_fds_lock = PTHREAD_MUTEX_INITIALIZER;
 int socket_timeout = 0;
 
 static void net_socket_set_shutdown_lock( int i );
 static void net_socket_signal_shutdown( const char *caller );
 static void net_socket_drain_shutdown_signal( void );
+static raveloxmidi_socket_t *net_socket_find_by_fd( int fd_to_find );
 
-static int net_socket_poll_fds_add( int fd )
+/* Register an fd with an event loop. The socket pointer comes back with each event */
+static int net_socket_loop_add( int loop_fd, int fd, raveloxmidi_socket_t *socket )
 {
-	if( fd <= 0 ) return 0;
+	struct epoll_event event;
 
-	if( poll_fds_count >= poll_fds_capacity )
-	{
-		nfds_t new_capacity = poll_fds_capacity + 8;
-		struct pollfd *new_poll_fds = NULL;
+	if( fd < 0 ) return -1;
+	if( loop_fd < 0 ) return -1;
 
-		new_poll_fds = (struct pollfd *)X_REALLOC( poll_fds, new_capacity * sizeof( struct pollfd ) );
-		if( ! new_poll_fds )
-		{
-			logging_printf( LOGGING_ERROR, "net_socket_poll_fds_add: Unable to extend poll fd table\n" );
-			return 0;
-		}
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN;
+	event.data.ptr = socket;
 
-		poll_fds = new_poll_fds;
-		poll_fds_capacity = new_capacity;
+	if( epoll_ctl( loop_fd, EPOLL_CTL_ADD, fd, &event ) < 0 )
+	{
+		logging_printf( LOGGING_ERROR, "net_socket_loop_add: Unable to add fd=%d to event loop: %s\n", fd, strerror( errno ) );
+		return -1;
 	}
 
-	poll_fds[poll_fds_count].fd = fd;
-	poll_fds[poll_fds_count].events = POLLIN | POLLERR | POLLHUP | POLLNVAL;
-	poll_fds[poll_fds_count].revents = 0;
-	poll_fds_count++;
-
-	return 1;
+	logging_printf( LOGGING_DEBUG, "net_socket_loop_add: loop=%d fd=%d socket=%p\n", loop_fd, fd, socket );
+	return 0;
 }
 
-void net_socket_poll_fds_lock( void )
+static void net_socket_loop_remove_from( int loop_fd, int fd )
 {
-	X_MUTEX_LOCK( &poll_fds_lock );
+	if( fd < 0 ) return;
+	if( loop_fd < 0 ) return;
+
+	if( epoll_ctl( loop_fd, EPOLL_CTL_DEL, fd, NULL ) < 0 )
+	{
+		if( errno != ENOENT && errno != EBADF )
+		{
+			logging_printf( LOGGING_WARN, "net_socket_loop_remove: Unable to remove fd=%d from event loop: %s\n", fd, strerror( errno ) );
+		}
+		return;
+	}
+
+	logging_printf( LOGGING_DEBUG, "net_socket_loop_remove: loop=%d fd=%d\n", loop_fd, fd );
 }
 
-void net_socket_poll_fds_unlock( void )
+void net_socket_loop_remove( int fd )
 {
-	X_MUTEX_UNLOCK( &poll_fds_lock );
+	raveloxmidi_socket_t *socket = NULL;
+
+	socket = net_socket_find_by_fd( fd );
+
+	net_socket_loop_remove_from( ( socket ? socket->loop_fd : epoll_fd ), fd );
 }
 
 void net_socket_send_lock( void )
@@ -158,10 +187,42 @@ void net_socket_dump( void *data )
 	socket = ( raveloxmidi_socket_t *)data;
 
 	net_socket_lock( socket );
-	logging_printf(LOGGING_DEBUG, "net_socket: fd=%d, packet_size=%u\n", socket->fd, socket->packet_size );
+	logging_printf(LOGGING_DEBUG, "net_socket: fd=%d, packet_size=%u, batch_size=%zu, reads=%lu, packets=%lu\n", socket->fd, socket->packet_size, socket->batch_size, socket->read_count, socket->packet_count );
 	net_socket_unlock( socket );
 }
 
+static int net_socket_index_init( void )
+{
+	struct rlimit fd_limit;
+
+	memset( &fd_limit, 0, sizeof( fd_limit ) );
+	if( getrlimit( RLIMIT_NOFILE, &fd_limit ) != 0 || fd_limit.rlim_cur == RLIM_INFINITY )
+	{
+		fd_limit.rlim_cur = NET_SOCKET_MAX_INDEX;
+	}
+
+	socket_index_size = MIN( fd_limit.rlim_cur, NET_SOCKET_MAX_INDEX );
+	socket_index = (raveloxmidi_socket_t **)X_MALLOC( socket_index_size * sizeof( raveloxmidi_socket_t * ) );
+
+	if( ! socket_index )
+	{
+		logging_printf( LOGGING_ERROR, "net_socket_index_init: Insufficient memory for socket index of %zu entries\n", socket_index_size );
+		socket_index_size = 0;
+		return -1;
+	}
+
+	memset( socket_index, 0, socket_index_size * sizeof( raveloxmidi_socket_t * ) );
+	return 0;
+}
+
+static void net_socket_index_set( int fd, raveloxmidi_socket_t *socket )
+{
+	if( fd < 0 ) return;
+	if( (size_t)fd >= socket_index_size ) return;
+
+	socket_index[ fd ] = socket;
+}
+
 void net_socket_destroy( void **data )
 {
 	raveloxmidi_socket_t *socket = NULL;
@@ -182,6 +243,12 @@ void net_socket_destroy( void **data )
 	if( socket->handle ) socket->handle = NULL;
 #endif
 
+	net_socket_loop_remove_from( socket->loop_fd, socket->fd );
+	if( socket_index && (size_t)socket->fd < socket_index_size && socket_index[ socket->fd ] == socket )
+	{
+		net_socket_index_set( socket->fd, NULL );
+	}
+
 	/* Only close the FD if it's a non-ALSA socket */
 	if( socket->type == RAVELOXMIDI_SOCKET_FD_TYPE )
 	{
@@ -200,6 +267,13 @@ void net_socket_destroy( void **data )
 		socket->state = NULL;
 	}
 
+	X_FREENULL( "batch_buffer", (void **)&(socket->batch_buffer) );
+	X_FREENULL( "batch_msgs", (void **)&(socket->batch_msgs) );
+	X_FREENULL( "batch_iov", (void **)&(socket->batch_iov) );
+	X_FREENULL( "batch_addrs", (void **)&(socket->batch_addrs) );
+	X_FREENULL( "batch_control", (void **)&(socket->batch_control) );
+	socket->batch_size = 0;
+
 	net_socket_unlock( socket );
 	pthread_mutex_destroy( &(socket->lock) );
 
@@ -212,26 +286,29 @@ static raveloxmidi_socket_t *net_socket_find_by_fd( int fd_to_find )
 	size_t i = 0;
 	size_t num_sockets = 0;
 
-	num_sockets = data_table_item_count( sockets );
+	if( fd_to_find < 0 ) return NULL;
 
-	if( num_sockets == 0 ) return NULL;
+	if( (size_t)fd_to_find < socket_index_size )
+	{
+		return socket_index[ fd_to_find ];
+	}
+
+	/* Only fds beyond the index need to be searched for */
+	num_sockets = data_table_item_count( sockets );
 
+	data_table_lock( sockets );
 	for( i = 0; i < num_sockets; i++ )
 	{
-		raveloxmidi_socket_t *socket = NULL;
-
-		data_table_lock( sockets );
-		socket = (raveloxmidi_socket_t *)data_table_item_get( sockets, i );
-		data_table_unlock( sockets );
+		raveloxmidi_socket_t *socket = (raveloxmidi_socket_t *)data_table_item_get( sockets, i );
 
-		if( socket )
+		if( socket && socket->fd == fd_to_find )
 		{
-			if( socket->fd == fd_to_find )
-			{
-				return socket;
-			}
+			data_table_unlock( sockets );
+			return socket;
 		}
 	}
+	data_table_unlock( sockets );
+
 	return NULL;
 }
 
@@ -256,6 +333,8 @@ static raveloxmidi_socket_t *net_socket_create_item( void )
 	new_socket->fd = 0;
 	new_socket->packet = NULL;
 	new_socket->type = RAVELOXMIDI_SOCKET_FD_TYPE;
+	new_socket->role = NET_SOCKET_NO_ROLE;
+	new_socket->loop_fd = -1;
 	new_socket->device_hash = -1;
 
 #ifdef HAVE_ALSA
@@ -290,7 +369,7 @@ static raveloxmidi_socket_t *net_socket_create_item( void )
 	return new_socket;
 }
 
-raveloxmidi_socket_t *net_socket_add( int new_socket_fd )
+static raveloxmidi_socket_t *net_socket_add_to_loop( int new_socket_fd, int loop_fd )
 {
 	raveloxmidi_socket_t *new_socket_item = NULL;
 
@@ -300,27 +379,90 @@ raveloxmidi_socket_t *net_socket_add( int new_socket_fd )
 	if( ! new_socket_item ) return NULL;
 
 	new_socket_item->fd = new_socket_fd;
+	new_socket_item->loop_fd = loop_fd;
 
 	data_table_add_item( sockets, new_socket_item );
 
+	net_socket_index_set( new_socket_fd, new_socket_item );
+	net_socket_loop_add( loop_fd, new_socket_fd, new_socket_item );
+
 	return new_socket_item;
 }
 
-int net_socket_listener_create( int family, char *ip_address, unsigned int port )
+raveloxmidi_socket_t *net_socket_add( int new_socket_fd )
+{
+	return net_socket_add_to_loop( new_socket_fd, epoll_fd );
+}
+
+/* Set up the buffers to receive up to batch_size datagrams with a single recvmmsg() call */
+static int net_socket_batch_create( raveloxmidi_socket_t *socket, size_t batch_size )
+{
+	size_t i = 0;
+	size_t stride = 0;
+
+	if( ! socket ) return -1;
+	if( batch_size <= 1 ) return 0;
+
+	batch_size = MIN( batch_size, NET_SOCKET_MAX_BATCH_SIZE );
+	stride = socket->packet_size + 1;
+
+	net_socket_lock( socket );
+
+	socket->batch_buffer = (unsigned char *)X_MALLOC( batch_size * stride );
+	socket->batch_msgs = (struct mmsghdr *)X_MALLOC( batch_size * sizeof( struct mmsghdr ) );
+	socket->batch_iov = (struct iovec *)X_MALLOC( batch_size * sizeof( struct iovec ) );
+	socket->batch_addrs = (struct sockaddr_storage *)X_MALLOC( batch_size * sizeof( struct sockaddr_storage ) );
+	socket->batch_control = (unsigned char *)X_MALLOC( batch_size * NET_SOCKET_CONTROL_SIZE );
+
+	if( !socket->batch_buffer || !socket->batch_msgs || !socket->batch_iov || !socket->batch_addrs || !socket->batch_control )
+	{
+		logging_printf( LOGGING_ERROR, "net_socket_batch_create: Insufficient memory for batch of %zu on fd=%d\n", batch_size, socket->fd );
+		X_FREENULL( "batch_buffer", (void **)&(socket->batch_buffer) );
+		X_FREENULL( "batch_msgs", (void **)&(socket->batch_msgs) );
+		X_FREENULL( "batch_iov", (void **)&(socket->batch_iov) );
+		X_FREENULL( "batch_addrs", (void **)&(socket->batch_addrs) );
+		X_FREENULL( "batch_control", (void **)&(socket->batch_control) );
+		net_socket_unlock( socket );
+		return -1;
+	}
+
+	memset( socket->batch_msgs, 0, batch_size * sizeof( struct mmsghdr ) );
+
+	for( i = 0; i < batch_size; i++ )
+	{
+		socket->batch_iov[i].iov_base = socket->batch_buffer + ( i * stride );
+		socket->batch_iov[i].iov_len = NET_APPLEMIDI_UDPSIZE;
+		socket->batch_msgs[i].msg_hdr.msg_iov = &(socket->batch_iov[i]);
+		socket->batch_msgs[i].msg_hdr.msg_iovlen = 1;
+		socket->batch_msgs[i].msg_hdr.msg_name = &(socket->batch_addrs[i]);
+		socket->batch_msgs[i].msg_hdr.msg_control = socket->batch_control + ( i * NET_SOCKET_CONTROL_SIZE );
+	}
+
+	socket->batch_size = batch_size;
+
+	logging_printf( LOGGING_DEBUG, "net_socket_batch_create: fd=%d batch_size=%zu\n", socket->fd, batch_size );
+
+	net_socket_unlock( socket );
+
+	return 0;
+}
+
+static raveloxmidi_socket_t *net_socket_listener_open( int family, char *ip_address, unsigned int port, int role, int reuse_port, int loop_fd )
 {
 	int new_socket = -1;
 	struct sockaddr_in6 socket_address;
 	socklen_t addr_len = 0;
 	int optionvalue = 0;
+	raveloxmidi_socket_t *new_socket_item = NULL;
 	
-	logging_printf(LOGGING_DEBUG, "net_socket_create: Creating socket for [%s]:%u, family=%d\n", ip_address, port, family);
+	logging_printf(LOGGING_DEBUG, "net_socket_listener_open: Creating socket for [%s]:%u, family=%d, reuse_port=%d\n", ip_address, port, family, reuse_port);
 
 	new_socket = socket(family, SOCK_DGRAM, IPPROTO_UDP);
 
 	if( new_socket < 0 )
 	{ 
-		logging_printf( LOGGING_ERROR, "net_socket_listener_create: Unable to create socket %s:%u : %s\n", ip_address, port, strerror(errno));
-		return new_socket;
+		logging_printf( LOGGING_ERROR, "net_socket_listener_open: Unable to create socket %s:%u : %s\n", ip_address, port, strerror(errno));
+		return NULL;
 	}
 
 	switch( family )
@@ -332,162 +474,196 @@ int net_socket_listener_create( int family, char *ip_address, unsigned int port
 		default:
 			break;
 	}
+
+	if( reuse_port )
+	{
+		optionvalue = 1;
+		if( setsockopt( new_socket, SOL_SOCKET, SO_REUSEPORT, (char *)&optionvalue, sizeof( optionvalue ) ) < 0 )
+		{
+			logging_printf( LOGGING_WARN, "net_socket_listener_open: Unable to set SO_REUSEPORT on %s:%u : %s\n", ip_address, port, strerror(errno));
+		}
+	}
 			
 	get_sock_info( ip_address, port, (struct sockaddr *)&socket_address, &addr_len, NULL);
 
 	if ( bind(new_socket, (struct sockaddr *)&socket_address, addr_len) < 0 )
 	{       
-		return errno;
-        } 
-
-	net_socket_add( new_socket );
+		int bind_errno = errno;
+		close( new_socket );
+		errno = bind_errno;
+		return NULL;
+	} 
 
 	fcntl(new_socket, F_SETFL, O_NONBLOCK);
 
+	new_socket_item = net_socket_add_to_loop( new_socket, loop_fd );
+	if( ! new_socket_item )
+	{
+		close( new_socket );
+		return NULL;
+	}
+
+	new_socket_item->role = role;
+
+	if( ( role == NET_SOCKET_CONTROL_PORT ) || ( role == NET_SOCKET_DATA_PORT ) )
+	{
+		/* Have the kernel record when each datagram arrived */
+		optionvalue = 1;
+		if( setsockopt( new_socket, SOL_SOCKET, SO_TIMESTAMPNS, (char *)&optionvalue, sizeof( optionvalue ) ) < 0 )
+		{
+			logging_printf( LOGGING_WARN, "net_socket_listener_open: Unable to set SO_TIMESTAMPNS on %s:%u : %s\n", ip_address, port, strerror(errno));
+		}
+	}
+
+	if( ( role == NET_SOCKET_CONTROL_PORT ) || ( role == NET_SOCKET_DATA_PORT ) )
+	{
+		int batch_size = config_int_get("network.read.batch_size");
+
+		if( batch_size < 1 ) batch_size = NET_SOCKET_DEFAULT_BATCH_SIZE;
+		if( batch_size > NET_SOCKET_MAX_BATCH_SIZE )
+		{
+			logging_printf( LOGGING_WARN, "net_socket_listener_open: network.read.batch_size=%d is too large. Using %d\n", batch_size, NET_SOCKET_MAX_BATCH_SIZE );
+			batch_size = NET_SOCKET_MAX_BATCH_SIZE;
+		}
+
+		if( batch_size > 1 ) net_socket_batch_create( new_socket_item, batch_size );
+	}
+
+	return new_socket_item;
+}
+
+int net_socket_listener_create( int family, char *ip_address, unsigned int port )
+{
+	if( ! net_socket_listener_open( family, ip_address, port, NET_SOCKET_NO_ROLE, 0, epoll_fd ) )
+	{
+		return errno;
+	}
+
 	return 0;
 }
 
 
 int net_socket_teardown( void )
 {
+	size_t i = 0;
+	size_t num_sockets = 0;
+
 	if( inbound_midi_fd >= 0 ) close(inbound_midi_fd);
 
+	num_sockets = data_table_item_count( sockets );
+	for( i = 0; i < num_sockets; i++ )
+	{
+		const raveloxmidi_socket_t *socket = NULL;
+
+		data_table_lock( sockets );
+		socket = (const raveloxmidi_socket_t *)data_table_item_get( sockets, i );
+		data_table_unlock( sockets );
+
+		if( ! socket ) continue;
+		if( socket->read_count == 0 ) continue;
+
+		logging_printf( LOGGING_INFO, "net_socket_teardown: fd=%d reads=%lu packets=%lu average_batch_fill=%.2f\n",
+			socket->fd, socket->read_count, socket->packet_count, (double)socket->packet_count / (double)socket->read_count );
+	}
+
 	data_table_destroy( &sockets );
 
-	return 0;
-}
+	if( epoll_fd >= 0 )
+	{
+		close( epoll_fd );
+		epoll_fd = -1;
+	}
 
-void net_socket_originators_destroy( void *originators )
-{
-	if( ! originators ) return;
+	X_FREENULL( "socket_index", (void **)&socket_index );
+	socket_index_size = 0;
 
-	X_FREE( originators );
+	for( i = 1; i < num_workers; i++ )
+	{
+		if( workers[i].loop_fd >= 0 ) close( workers[i].loop_fd );
+	}
+	X_FREENULL( "workers", (void **)&workers );
+	num_workers = 0;
+
+	control_socket_fd = -1;
+	data_socket_fd = -1;
+	local_socket_fd = -1;
+
+	return 0;
 }
 
-int net_socket_read( int fd )
+/* Dispatch a single packet that has been read from a socket */
+static int net_socket_process_packet( raveloxmidi_socket_t *found_socket, unsigned char *packet, ssize_t recv_len, struct sockaddr_storage *from_addr, socklen_t from_len, long arrival_time )
 {
-	ssize_t recv_len = 0;
-	unsigned from_len = 0;
-	struct sockaddr_storage from_addr;
 	char ip_address[ INET6_ADDRSTRLEN ];
 	uint16_t from_port = 0;
 	net_applemidi_command *command;
 	int ret = 0;
-	int data_fd = 0;
-	int control_fd = 0;
-	int local_fd = 0;
-	unsigned char *packet = NULL;
-	size_t packet_size = 0;
-	raveloxmidi_socket_t *found_socket = NULL;
-
-	char *read_buffer = NULL;
-	size_t read_buffer_size = 0;
+	int fd = 0;
+	int role = 0;
 
 	midi_sender_context_t *originators = NULL;
 	data_context_t *context = NULL;
 
-	data_fd = net_socket_get_data_socket();
-	control_fd = net_socket_get_control_socket();
-	local_fd = net_socket_get_local_socket();
+	if( recv_len <= 0 ) return 0;
 
-	memset( ip_address, 0, INET6_ADDRSTRLEN );
-	from_len = sizeof( from_addr );
+	fd = found_socket->fd;
+	role = found_socket->role;
 
-	found_socket = net_socket_find_by_fd( fd );
-
-	if( ! found_socket )
-	{
-		logging_printf(LOGGING_ERROR, "net_socket_read: Cannot locate fd=%d\n", fd );
-		return 0;
-	}
-
-	net_socket_lock( found_socket );
-
-	packet = found_socket->packet;
-	packet_size = found_socket->packet_size;
-
-	if( fd == data_fd )
-	{
-		logging_printf(LOGGING_DEBUG, "net_socket_read: data_fd\n");
-	} else if (fd == control_fd ) {
-		logging_printf(LOGGING_DEBUG, "net_socket_read: control_fd\n");
-	} else if (fd == local_fd ) {
-		logging_printf(LOGGING_DEBUG, "net_socket_read: local_fd\n");
-	}
-
-#ifdef HAVE_ALSA
-	if( found_socket->type == RAVELOXMIDI_SOCKET_ALSA_TYPE )
-	{
-		logging_printf(LOGGING_DEBUG, "net_socket_read: alsa handle\n");
-	} 
-#endif
+	memset( ip_address, 0, INET6_ADDRSTRLEN );
 
-	memset( packet, 0, packet_size + 1 );
-#ifdef HAVE_ALSA
-	if( found_socket->type  == RAVELOXMIDI_SOCKET_ALSA_TYPE )
-	{
-		recv_len = raveloxmidi_alsa_read( fd, found_socket->handle, packet, packet_size);
-	} else {
-#endif
-		recv_len = recvfrom( fd, packet, NET_APPLEMIDI_UDPSIZE, 0, (struct sockaddr *)&from_addr, &from_len );
-		get_ip_string( (struct sockaddr *)&from_addr, ip_address, INET6_ADDRSTRLEN );
-		from_port = ntohs( ((struct sockaddr_in *)&from_addr)->sin_port );
 #ifdef HAVE_ALSA
-	}
 	if( found_socket->type  != RAVELOXMIDI_SOCKET_ALSA_TYPE )
 	{
 #endif
-		if( recv_len > 0 )
-		{
-			logging_printf( LOGGING_DEBUG, "net_socket_read: read socket=%d, recv_len=%ld, host=%s, port=%u, first_byte=%02x)\n", fd, recv_len, ip_address, from_port, packet[0]);
-		}
-
+		get_ip_string( (struct sockaddr *)from_addr, ip_address, INET6_ADDRSTRLEN );
+		from_port = ntohs( ((struct sockaddr_in *)from_addr)->sin_port );
+		logging_printf( LOGGING_DEBUG, "net_socket_process_packet: read socket=%d, recv_len=%ld, host=%s, port=%u, first_byte=%02x)\n", fd, recv_len, ip_address, from_port, packet[0]);
 #ifdef HAVE_ALSA
 	} else {
-		if( recv_len > 0 )
-		{
-			logging_printf( LOGGING_DEBUG, "net_socket_read: read socket=ALSA(%d) recv_len=%ld first_byte=%02x\n", fd, recv_len, packet[0] );
-		}
+		logging_printf( LOGGING_DEBUG, "net_socket_process_packet: read socket=ALSA(%d) recv_len=%ld first_byte=%02x\n", fd, recv_len, packet[0] );
 	}
 #endif
-	if ( recv_len > 0)
-	{
-		if( LOGGING_HEX_DUMP_ENABLED ) hex_dump( packet, recv_len );
-		midi_state_write( found_socket->state, packet, recv_len );
-	} else {
-		goto net_socket_read_clean;
-	}
+
+	if( LOGGING_HEX_DUMP_ENABLED ) hex_dump( packet, recv_len );
+
+/*
+	Packets from the network are decoded straight from the receive buffer.
+	Only MIDI data from the local socket or ALSA goes through the socket's MIDI state.
+*/
 
 /*
 	Apple MIDI command
 */
-	if( ( ( fd == control_fd ) || ( fd == data_fd ) ) && ( ( midi_state_char_compare( found_socket->state, 0xff, 0 ) == 1 )  && ( midi_state_char_compare( found_socket->state, 0xff, 1 ) == 1 ) ) )
+	if( ( ( role == NET_SOCKET_CONTROL_PORT ) || ( role == NET_SOCKET_DATA_PORT ) ) && ( recv_len >= 2 ) && ( packet[0] == 0xff ) && ( packet[1] == 0xff ) )
 	{
-		net_response_t *response = NULL;
+		net_response_buffer_t response;
 
-		read_buffer = midi_state_drain( found_socket->state, &read_buffer_size );
+		response.len = 0;
 
-		if( LOGGING_HEX_DUMP_ENABLED ) hex_dump( read_buffer, read_buffer_size );
-
-		ret = net_applemidi_unpack( &command, read_buffer, read_buffer_size );
+		ret = net_applemidi_unpack( &command, packet, recv_len );
+		if( ! command )
+		{
+			logging_printf( LOGGING_WARN, "net_socket_process_packet: Unable to decode Apple MIDI command from host=%s, port=%u\n", ip_address, from_port );
+			return ret;
+		}
 		net_applemidi_command_dump( command );
 
 		switch( command->command )
 		{
 			case NET_APPLEMIDI_CMD_INV:
-				response = applemidi_inv_responder( ip_address, from_port, command->data );
+				applemidi_inv_responder( ip_address, from_port, command->data, &response );
 				break;
 			case NET_APPLEMIDI_CMD_ACCEPT:
-				response = applemidi_ok_responder( ip_address, from_port, command->data );
+				applemidi_ok_responder( ip_address, from_port, command->data, &response );
 				break;
 			case NET_APPLEMIDI_CMD_REJECT:
-				logging_printf( LOGGING_ERROR, "net_socket_read: Connection rejected host=%s, port=%u\n", ip_address, from_port);
+				logging_printf( LOGGING_ERROR, "net_socket_process_packet: Connection rejected host=%s, port=%u\n", ip_address, from_port);
 				break;
 			case NET_APPLEMIDI_CMD_END:
 				applemidi_by_responder( command->data );
 				break;
 			case NET_APPLEMIDI_CMD_SYNC:
-				response = applemidi_sync_responder( command->data );
+				applemidi_sync_responder( command->data, &response, arrival_time );
 				break;
 			case NET_APPLEMIDI_CMD_FEEDBACK:
 				applemidi_feedback_responder( command->data );
@@ -496,49 +672,46 @@ int net_socket_read( int fd )
 				break;
 		}
 
-		if( response )
+		if( response.len > 0 )
 		{
 			size_t bytes_written = 0;
-			bytes_written = sendto( fd, response->buffer, response->len , MSG_DONTWAIT, (void *)&from_addr, from_len);
-			logging_printf( LOGGING_DEBUG, "net_socket_read: response write(bytes=%u,socket=%d,host=%s,port=%u)\n", bytes_written, fd,ip_address, from_port );	
-			net_response_destroy( &response );
+			bytes_written = sendto( fd, response.buffer, response.len , MSG_DONTWAIT, (void *)from_addr, from_len);
+			logging_printf( LOGGING_DEBUG, "net_socket_process_packet: response write(bytes=%u,socket=%d,host=%s,port=%u)\n", bytes_written, fd,ip_address, from_port );	
 		}
 
 		net_applemidi_cmd_destroy( &command );
 /*
 	Heartbeat request
 */
-	} else if( ( fd == local_fd ) && ( midi_state_compare( found_socket->state, "STAT", 4) == 0) )
+	} else if( ( role == NET_SOCKET_LOCAL_PORT ) && ( recv_len >= 4 ) && ( memcmp( packet, "STAT", 4 ) == 0) )
 	{
 		const char *buffer="OK";
 		size_t bytes_written = 0;
 
-		bytes_written = sendto( fd, buffer, strlen(buffer), MSG_DONTWAIT, (void *)&from_addr, from_len);
+		bytes_written = sendto( fd, buffer, strlen(buffer), MSG_DONTWAIT, (void *)from_addr, from_len);
 
-		logging_printf(LOGGING_DEBUG, "net_socket_read: Heartbeat request. Response written: %u\n", bytes_written);
-		midi_state_advance( found_socket->state, 4);
+		logging_printf(LOGGING_DEBUG, "net_socket_process_packet: Heartbeat request. Response written: %u\n", bytes_written);
 /*
 	Shutdown request
 */
-	} else if( ( fd == local_fd ) && ( midi_state_compare( found_socket->state, "QUIT", 4) == 0 ) )
+	} else if( ( role == NET_SOCKET_LOCAL_PORT ) && ( recv_len >= 4 ) && ( memcmp( packet, "QUIT", 4 ) == 0 ) )
 	{
 		const char *buffer="QT";
 		size_t bytes_written = 0;
 
-		bytes_written = sendto( fd, buffer, strlen(buffer), MSG_DONTWAIT, (void *)&from_addr, from_len);
+		bytes_written = sendto( fd, buffer, strlen(buffer), MSG_DONTWAIT, (void *)from_addr, from_len);
 
-		logging_printf(LOGGING_DEBUG, "net_socket_read: Shutdown request. Response written: %u\n", bytes_written);
-		logging_printf(LOGGING_NORMAL, "net_socket_read: Shutdown request received on local socket\n");
+		logging_printf(LOGGING_DEBUG, "net_socket_process_packet: Shutdown request. Response written: %u\n", bytes_written);
+		logging_printf(LOGGING_NORMAL, "net_socket_process_packet: Shutdown request received on local socket\n");
 
 		net_socket_set_shutdown_lock(1);
 
-		net_socket_signal_shutdown( "net_socket_read" );
+		net_socket_signal_shutdown( "net_socket_process_packet" );
 
-		midi_state_advance( found_socket->state, 4);
 /*
 	Connection list request
 */
-	} else if( ( fd == local_fd ) && ( midi_state_compare( found_socket->state, "LIST", 4) == 0 ) )
+	} else if( ( role == NET_SOCKET_LOCAL_PORT ) && ( recv_len >= 4 ) && ( memcmp( packet, "LIST", 4 ) == 0 ) )
 	{
 		char *buffer = NULL;
 		size_t bytes_written = 0;
@@ -548,41 +721,36 @@ int net_socket_read( int fd )
 		{
 			if( LOGGING_HEX_DUMP_ENABLED ) hex_dump( buffer, strlen( buffer ) );
 
-			bytes_written = sendto( fd, (const char *)buffer, strlen(buffer), MSG_DONTWAIT, (void *)&from_addr, from_len);
+			bytes_written = sendto( fd, (const char *)buffer, strlen(buffer), MSG_DONTWAIT, (void *)from_addr, from_len);
 
 			X_FREE( buffer );
 		}
 
-		logging_printf(LOGGING_DEBUG, "net_socket_read: List request. Response written: %u\n", bytes_written);
+		logging_printf(LOGGING_DEBUG, "net_socket_process_packet: List request. Response written: %u\n", bytes_written);
 
-		midi_state_advance( found_socket->state, 4);
 
 #ifdef HAVE_ALSA
-	} else if( ( fd == local_fd ) || (found_socket->type==RAVELOXMIDI_SOCKET_ALSA_TYPE) )
+	} else if( ( role == NET_SOCKET_LOCAL_PORT ) || (found_socket->type==RAVELOXMIDI_SOCKET_ALSA_TYPE) )
 #else
-	} else if( fd == local_fd )
+	} else if( role == NET_SOCKET_LOCAL_PORT )
 #endif
 /*
 	MIDI data on internal socket or ALSA rawmidi device
 */
 	{
-		originators = ( midi_sender_context_t *)X_MALLOC( sizeof( midi_sender_context_t ) );
-		if( ! originators )
-		{
-			logging_printf( LOGGING_WARN, "net_socket_read: Unable to create originator context for internal or ALSA socket\n");
-		} else {
-			originators->ssrc = 0;
-			originators->alsa_card_hash = found_socket->device_hash;
-		}
+		midi_state_write( found_socket->state, packet, recv_len );
 
-		context = data_context_create( net_socket_originators_destroy );
+		context = data_context_create( NULL );
 		if( ! context )
 		{
-			logging_printf( LOGGING_WARN, "net_socket_read: Unable to create data context for internal or ALSA socket\n");
+			logging_printf( LOGGING_WARN, "net_socket_process_packet: Unable to create data context for internal or ALSA socket\n");
 		} else {
+			originators = ( midi_sender_context_t *)data_context_inline_data( context, sizeof( midi_sender_context_t ) );
 			if( originators )
 			{
-				context->data = originators;
+				originators->ssrc = 0;
+				originators->alsa_card_hash = found_socket->device_hash;
+				originators->timestamp = arrival_time;
 			}
 			data_context_acquire( context );
 		}
@@ -595,14 +763,12 @@ int net_socket_read( int fd )
 /*
 	RTP MIDI inbound from remote socket
 */
-		rtp_packet_t *rtp_packet = NULL;
-		midi_payload_t *midi_payload=NULL;
-		net_response_t *response = NULL;
+		rtp_packet_view_t rtp_packet;
+		midi_payload_view_t midi_payload;
 		net_ctx_t *current_ctx = NULL;
+		midi_state_t *midi_state = NULL;
 
-		logging_printf(LOGGING_DEBUG, "net_socket_read: inbound MIDI received\n");
-
-		read_buffer = midi_state_drain( found_socket->state, &read_buffer_size );
+		logging_printf(LOGGING_DEBUG, "net_socket_process_packet: inbound MIDI received\n");
 
 /*
 *---------------------
@@ -616,84 +782,230 @@ int net_socket_read( int fd )
 *	While we're there, we can also get RTP version of the packet to ensure it's what we expected
 *	and also we need to unpack the delta times if they are supplied. This is indicated in the Z flag
 *	in the RTP payload header.
+*
+*	The RTP header and MIDI payload are read in place from the packet. The MIDI command list is
+*	copied once, into the connection's MIDI state.
 *---------------------
 */
-		rtp_packet = rtp_packet_create();
-		rtp_packet_unpack( read_buffer, read_buffer_size, rtp_packet );
-		if( LOGGING_DEBUG_ENABLED ) rtp_packet_dump( rtp_packet );
+		if( rtp_packet_view_unpack( packet, recv_len, &rtp_packet ) != 0 )
+		{
+			return ret;
+		}
 
-		if( rtp_packet->header.v != RTP_VERSION )
+		logging_printf( LOGGING_DEBUG, "net_socket_process_packet: rtp v=%u,pt=%u,seq=%u,timestamp=0x%08x,ssrc=0x%08x,payload_length=%zu\n",
+			rtp_packet.header.v, rtp_packet.header.pt, rtp_packet.header.seq, rtp_packet.header.timestamp, rtp_packet.header.ssrc, rtp_packet.payload_len );
+
+		if( rtp_packet.header.v != RTP_VERSION )
 		{
-			logging_printf( LOGGING_WARN, "net_socket_read: Invalid RTP packet received: version=%u\n", rtp_packet->header.v );
-			goto net_socket_read_rtp_clean;
+			logging_printf( LOGGING_WARN, "net_socket_process_packet: Invalid RTP packet received: version=%u\n", rtp_packet.header.v );
+			return ret;
 		}
 
-		midi_payload_unpack( &midi_payload, rtp_packet->payload, rtp_packet->payload_len );
+		if( midi_payload_view_unpack( &midi_payload, rtp_packet.payload, rtp_packet.payload_len ) != 0 )
+		{
+			logging_printf( LOGGING_WARN, "net_socket_process_packet: Invalid MIDI payload from SSRC (0x%08x)\n", rtp_packet.header.ssrc );
+			return ret;
+		}
 
 		// Find the midi state for the RTP context
-		current_ctx = net_ctx_find_by_ssrc( rtp_packet->header.ssrc );
+		current_ctx = net_ctx_find_by_ssrc( rtp_packet.header.ssrc );
 
 		if( ! current_ctx )
 		{
-			logging_printf( LOGGING_WARN, "net_socket_read: RTP packet received from unknown SSRC (0x%08x)\n", rtp_packet->header.ssrc );
-			goto net_socket_read_midi_clean;
+			logging_printf( LOGGING_WARN, "net_socket_process_packet: RTP packet received from unknown SSRC (0x%08x)\n", rtp_packet.header.ssrc );
+			return ret;
 		}
 
-		// Transfer the MIDI payload into the MIDI state for the connection context
-		midi_state_write( current_ctx->midi_state, midi_payload->buffer, midi_payload->header->len );
+		// Another receive worker may be handling a packet for the same connection
+		net_ctx_receive_lock( current_ctx );
 
-		// Sent a FEEDBACK packet back to the originating host to ack the MIDI packet
-		response = applemidi_feedback_create( rtp_packet->header.ssrc, rtp_packet->header.seq );
-		if( response )
+		// The MIDI state is only created once the connection sends MIDI
+		midi_state = net_ctx_get_midi_state( current_ctx );
+		if( ! midi_state )
 		{
-			size_t bytes_written = 0;
-			bytes_written = sendto( fd, response->buffer, response->len , MSG_DONTWAIT, (void *)&from_addr, from_len);
-			logging_printf( LOGGING_DEBUG, "net_socket_read: feedback write(bytes=%u,socket=%d,host=%s,port=%u)\n", bytes_written, fd,ip_address, from_port);
-			net_response_destroy( &response );
+			net_ctx_receive_unlock( current_ctx );
+			return ret;
 		}
 
-                originators = ( midi_sender_context_t *)X_MALLOC( sizeof( midi_sender_context_t ) );
-		if( ! originators )
-		{
-			logging_printf( LOGGING_WARN, "net_socket_read: Unable to create originator context for internal or ALSA socket\n");
-		} else {
-			originators->ssrc = rtp_packet->header.ssrc;
-			originators->alsa_card_hash = 0;
-		}
+		// Repair any state lost with missing packets using the recovery journal
+		midi_state_recover( midi_state, rtp_packet.header.seq, midi_payload.journal, midi_payload.journal_len, midi_payload.header.Z );
+
+		// Transfer the MIDI payload into the MIDI state for the connection context
+		midi_state_write( midi_state, (char *)midi_payload.buffer, midi_payload.header.len );
+
+		// Let the feedback scheduler decide when to ack the MIDI packet
+		applemidi_feedback_schedule( current_ctx, rtp_packet.header.seq );
 
-		context = data_context_create( net_socket_originators_destroy );
+		context = data_context_create( NULL );
 		if( ! context )
 		{
-			logging_printf( LOGGING_WARN, "net_socket_read: Unable to create data context for internal or ALSA socket\n");
+			logging_printf( LOGGING_WARN, "net_socket_process_packet: Unable to create data context for RTP MIDI\n");
 		} else {
+			originators = ( midi_sender_context_t *)data_context_inline_data( context, sizeof( midi_sender_context_t ) );
 			if( originators )
 			{
-				context->data = originators;
+				originators->ssrc = rtp_packet.header.ssrc;
+				originators->alsa_card_hash = 0;
+				originators->timestamp = arrival_time;
 			}
 			data_context_acquire( context );
 		}
-		midi_state_send( current_ctx->midi_state , context, MIDI_PARSE_MODE_RTP, midi_payload->header->Z );
+		midi_state_send( midi_state , context, MIDI_PARSE_MODE_RTP, midi_payload.header.Z );
+		net_ctx_receive_unlock( current_ctx );
 		if( context )
 		{
 			data_context_release( &context );
 		}
+	}
+
+	return ret;
+}
+
+/* Kernel receive time of a datagram from its SO_TIMESTAMPNS control message, or the current time if there isn't one */
+static long net_socket_arrival_time( struct msghdr *msg )
+{
+	struct cmsghdr *cmsg = NULL;
+
+	if( ! msg ) return time_in_microseconds();
+	if( ! msg->msg_control ) return time_in_microseconds();
+
+	for( cmsg = CMSG_FIRSTHDR( msg ); cmsg; cmsg = CMSG_NXTHDR( msg, cmsg ) )
+	{
+		if( ( cmsg->cmsg_level == SOL_SOCKET ) && ( cmsg->cmsg_type == SCM_TIMESTAMPNS ) )
+		{
+			struct timespec ts;
+
+			memcpy( &ts, CMSG_DATA( cmsg ), sizeof( ts ) );
+			return time_from_timespec( &ts );
+		}
+	}
+
+	return time_in_microseconds();
+}
+
+/* Read up to batch_size datagrams in one call and dispatch each of them */
+static int net_socket_read_batch( raveloxmidi_socket_t *found_socket )
+{
+	int received = 0;
+	int i = 0;
+
+	for( i = 0; i < found_socket->batch_size; i++ )
+	{
+		found_socket->batch_msgs[i].msg_hdr.msg_namelen = sizeof( struct sockaddr_storage );
+		found_socket->batch_msgs[i].msg_hdr.msg_controllen = NET_SOCKET_CONTROL_SIZE;
+		found_socket->batch_msgs[i].msg_len = 0;
+	}
+
+	received = recvmmsg( found_socket->fd, found_socket->batch_msgs, found_socket->batch_size, MSG_DONTWAIT, NULL );
+
+	if( received < 0 )
+	{
+		if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+		{
+			logging_printf( LOGGING_WARN, "net_socket_read_batch: recvmmsg error on fd=%d: %s\n", found_socket->fd, strerror( errno ) );
+		}
+		return 0;
+	}
+
+	found_socket->read_count++;
+	found_socket->packet_count += received;
 
-		// Clean up
-net_socket_read_midi_clean:
-		midi_payload_destroy( &midi_payload );
+	logging_printf( LOGGING_DEBUG, "net_socket_read_batch: fd=%d received=%d\n", found_socket->fd, received );
 
-net_socket_read_rtp_clean:
-		rtp_packet_destroy( &rtp_packet );
+	for( i = 0; i < received; i++ )
+	{
+		unsigned char *packet = (unsigned char *)found_socket->batch_iov[i].iov_base;
+		ssize_t recv_len = found_socket->batch_msgs[i].msg_len;
+
+		packet[ recv_len ] = 0;
+
+		net_socket_process_packet( found_socket, packet, recv_len, &(found_socket->batch_addrs[i]), found_socket->batch_msgs[i].msg_hdr.msg_namelen, net_socket_arrival_time( &(found_socket->batch_msgs[i].msg_hdr) ) );
+	}
+
+	return 0;
+}
+
+static int net_socket_read_socket( raveloxmidi_socket_t *found_socket )
+{
+	ssize_t recv_len = 0;
+	socklen_t from_len = 0;
+	struct sockaddr_storage from_addr;
+	int ret = 0;
+	int fd = 0;
+	unsigned char *packet = NULL;
+	size_t packet_size = 0;
+	long arrival_time = 0;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned char control[ NET_SOCKET_CONTROL_SIZE ];
+
+	from_len = sizeof( from_addr );
+	memset( &from_addr, 0, sizeof( from_addr ) );
+
+	net_socket_lock( found_socket );
+
+	fd = found_socket->fd;
+
+	if( found_socket->batch_size > 1 )
+	{
+		ret = net_socket_read_batch( found_socket );
+		goto net_socket_read_clean;
+	}
+
+	packet = found_socket->packet;
+	packet_size = found_socket->packet_size;
+
+	memset( packet, 0, packet_size + 1 );
+#ifdef HAVE_ALSA
+	if( found_socket->type  == RAVELOXMIDI_SOCKET_ALSA_TYPE )
+	{
+		recv_len = raveloxmidi_alsa_read( fd, found_socket->handle, packet, packet_size);
+		arrival_time = time_in_microseconds();
+	} else {
+#endif
+		iov.iov_base = packet;
+		iov.iov_len = NET_APPLEMIDI_UDPSIZE;
+		memset( &msg, 0, sizeof( msg ) );
+		msg.msg_name = &from_addr;
+		msg.msg_namelen = from_len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof( control );
+
+		recv_len = recvmsg( fd, &msg, 0 );
+		from_len = msg.msg_namelen;
+		arrival_time = net_socket_arrival_time( &msg );
+#ifdef HAVE_ALSA
+	}
+#endif
+
+	if( recv_len > 0 )
+	{
+		found_socket->read_count++;
+		found_socket->packet_count++;
+		ret = net_socket_process_packet( found_socket, packet, recv_len, &from_addr, from_len, arrival_time );
 	}
 
 net_socket_read_clean:
 	net_socket_unlock( found_socket );
 
-	if( read_buffer )
+	return ret;
+}
+
+int net_socket_read( int fd )
+{
+	raveloxmidi_socket_t *found_socket = NULL;
+
+	found_socket = net_socket_find_by_fd( fd );
+
+	if( ! found_socket )
 	{
-		X_FREE( read_buffer );
+		logging_printf(LOGGING_ERROR, "net_socket_read: Cannot locate fd=%d\n", fd );
+		return 0;
 	}
-	return ret;
+
+	return net_socket_read_socket( found_socket );
 }
 
 static void net_socket_set_shutdown_lock( int i )
@@ -754,6 +1066,7 @@ int net_socket_get_shutdown_status( void )
 void net_socket_loop_init()
 {
 	int err = 0;
+	int i = 0;
 
 	pthread_mutex_init( &shutdown_lock, NULL);
 	net_socket_set_shutdown_lock(0);
@@ -770,67 +1083,129 @@ void net_socket_loop_init()
 	}
 	fcntl(shutdown_fd[0], F_SETFL, O_NONBLOCK);
 	fcntl(shutdown_fd[1], F_SETFL, O_NONBLOCK);
+
+	// The shutdown pipe is the only fd in the event loops without a socket
+	net_socket_loop_add( epoll_fd, shutdown_fd[0], NULL );
+	for( i = 1; i < num_workers; i++ )
+	{
+		net_socket_loop_add( workers[i].loop_fd, shutdown_fd[0], NULL );
+	}
 }
 
 void net_socket_loop_teardown()
 {
-	X_FREENULL( "poll_fds", (void **)&poll_fds );
-	poll_fds_count = 0;
-	poll_fds_capacity = 0;
+	int i = 0;
+
+	net_socket_loop_remove_from( epoll_fd, shutdown_fd[0] );
+	for( i = 1; i < num_workers; i++ )
+	{
+		net_socket_loop_remove_from( workers[i].loop_fd, shutdown_fd[0] );
+	}
+	close( shutdown_fd[0] );
+	close( shutdown_fd[1] );
 
-	pthread_mutex_destroy( &poll_fds_lock );
 	pthread_mutex_destroy( &shutdown_lock );
 	pthread_mutex_destroy( &send_lock );
 }
 
-int net_socket_fd_loop()
+/* Wait time in milliseconds for the event loops. Sends any feedback that is due on the way */
+static int net_socket_loop_timeout( void )
+{
+	long timeout = 0;
+	long feedback_due = 0;
+
+	timeout = socket_timeout * 1000;
+
+	feedback_due = applemidi_feedback_flush_due();
+	if( ( feedback_due >= 0 ) && ( feedback_due < timeout ) )
+	{
+		timeout = feedback_due;
+	}
+
+	return (int)timeout;
+}
+
+static int net_socket_loop_run( int loop_fd )
 {
 	int ret = 0;
+	struct epoll_event events[ NET_SOCKET_MAX_EVENTS ];
 
 	do {
 		int timeout = 0;
 
-		net_socket_set_fds();
-
-		timeout = socket_timeout * 1000;
+		timeout = net_socket_loop_timeout();
 
-		net_socket_poll_fds_lock();
-		ret = poll( poll_fds, poll_fds_count, timeout );
-		net_socket_poll_fds_unlock();
+		ret = epoll_wait( loop_fd, events, NET_SOCKET_MAX_EVENTS, timeout );
 
 		if( ret > 0 )
 		{
-			nfds_t i = 0;
-			for( i = 0; i < poll_fds_count; i++ )
+			int i = 0;
+			for( i = 0; i < ret; i++ )
 			{
-				int fd = 0;
-				short revents = 0;
-
-				net_socket_poll_fds_lock();
-				fd = poll_fds[i].fd;
-				revents = poll_fds[i].revents;
-				net_socket_poll_fds_unlock();
+				raveloxmidi_socket_t *socket = (raveloxmidi_socket_t *)events[i].data.ptr;
 
-				if( revents == 0 ) continue;
-
-				if( fd == shutdown_fd[0] )
+				if( ! socket )
 				{
-					net_socket_drain_shutdown_signal();
+					/* Leave the signal in the pipe on shutdown so every loop sees it */
+					if( net_socket_get_shutdown_status() == OK )
+					{
+						net_socket_drain_shutdown_signal();
+					}
 					continue;
 				}
 
-				if( revents & POLLIN )
+				/* Reading also collects any pending error on the fd */
+				if( events[i].events & ( EPOLLIN | EPOLLERR ) )
 				{
-					net_socket_read(fd);
-				} else if( revents & ( POLLERR | POLLHUP | POLLNVAL ) ) {
-					logging_printf( LOGGING_WARN, "net_socket_fd_loop: poll event on fd=%d revents=%d\n", fd, revents );
+					net_socket_read_socket( socket );
+				} else if( events[i].events & EPOLLHUP ) {
+					logging_printf( LOGGING_WARN, "net_socket_loop_run: hangup on fd=%d. Removing from event loop\n", socket->fd );
+					net_socket_loop_remove_from( loop_fd, socket->fd );
 				}
 			}
 		} else if( ( ret < 0 ) && ( errno != EINTR ) ) {
-			logging_printf( LOGGING_WARN, "net_socket_fd_loop: poll error: %s\n", strerror( errno ) );
+			logging_printf( LOGGING_WARN, "net_socket_loop_run: epoll_wait error: %s\n", strerror( errno ) );
 		}
 	} while( net_socket_get_shutdown_status() == OK );
 
+	return ret;
+}
+
+static void *net_socket_worker_thread( void *data )
+{
+	net_socket_worker_t *worker = (net_socket_worker_t *)data;
+
+	logging_printf( LOGGING_DEBUG, "net_socket_worker_thread: start loop=%d\n", worker->loop_fd );
+	net_socket_loop_run( worker->loop_fd );
+	logging_printf( LOGGING_DEBUG, "net_socket_worker_thread: stop loop=%d\n", worker->loop_fd );
+
+	return NULL;
+}
+
+int net_socket_fd_loop()
+{
+	int ret = 0;
+	int i = 0;
+
+	/* The calling thread is worker 0 */
+	for( i = 1; i < num_workers; i++ )
+	{
+		if( pthread_create( &(workers[i].thread), NULL, net_socket_worker_thread, &(workers[i]) ) != 0 )
+		{
+			logging_printf( LOGGING_ERROR, "net_socket_fd_loop: Unable to start receive worker %d: %s\n", i, strerror( errno ) );
+			continue;
+		}
+		workers[i].started = 1;
+	}
+
+	ret = net_socket_loop_run( epoll_fd );
+
+	for( i = 1; i < num_workers; i++ )
+	{
+		if( ! workers[i].started ) continue;
+		pthread_join( workers[i].thread, NULL );
+		workers[i].started = 0;
+	}
 
 	return ret;
 }
@@ -842,9 +1217,6 @@ void net_socket_loop_shutdown(int signal)
 	net_socket_set_shutdown_lock( 1 );
 
 	net_socket_signal_shutdown( "net_socket_loop_shutdown" );
-
-	close( shutdown_fd[0] );
-	close( shutdown_fd[1] );
 }
 
 int net_socket_init( void )
@@ -853,15 +1225,20 @@ int net_socket_init( void )
 	char *bind_address = NULL;
 	int address_family = 0;
 	int control_port, data_port, local_port;
+	raveloxmidi_socket_t *control_socket = NULL;
+	raveloxmidi_socket_t *data_socket = NULL;
+	raveloxmidi_socket_t *local_socket = NULL;
+	int reuse_port = 0;
+	int i = 0;
 
 	pthread_mutex_init( &send_lock, NULL );
 
-	pthread_mutex_init( &poll_fds_lock, NULL);
-	
-	net_socket_poll_fds_lock();
-	poll_fds_count = 0;
-	poll_fds_capacity = 0;
-	net_socket_poll_fds_unlock();
+	epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+	if( epoll_fd < 0 )
+	{
+		logging_printf( LOGGING_ERROR, "net_socket_init: Unable to create event loop: %s\n", strerror( errno ) );
+		return -1;
+	}
 
 	sockets = data_table_create("sockets", net_socket_destroy, net_socket_dump );
 
@@ -871,6 +1248,39 @@ int net_socket_init( void )
 		return -1;
 	}
 
+	if( net_socket_index_init() != 0 )
+	{
+		return -1;
+	}
+
+	num_workers = config_int_get("network.receive_workers");
+	num_workers = MAX( 1, MIN( num_workers, NET_SOCKET_MAX_WORKERS ) );
+	reuse_port = ( num_workers > 1 );
+
+	workers = (net_socket_worker_t *)X_MALLOC( num_workers * sizeof( net_socket_worker_t ) );
+	if( ! workers )
+	{
+		logging_printf( LOGGING_ERROR, "net_socket_init: Insufficient memory for %d receive workers\n", num_workers );
+		num_workers = 0;
+		return -1;
+	}
+	memset( workers, 0, num_workers * sizeof( net_socket_worker_t ) );
+	for( i = 0; i < num_workers; i++ )
+	{
+		workers[i].loop_fd = -1;
+	}
+
+	workers[0].loop_fd = epoll_fd;
+	for( i = 1; i < num_workers; i++ )
+	{
+		workers[i].loop_fd = epoll_create1( EPOLL_CLOEXEC );
+		if( workers[i].loop_fd < 0 )
+		{
+			logging_printf( LOGGING_ERROR, "net_socket_init: Unable to create event loop for receive worker %d: %s\n", i, strerror( errno ) );
+			return -1;
+		}
+	}
+
 	control_port = config_int_get("network.control.port");
 	data_port = config_int_get("network.data.port");
 	local_port = config_int_get("network.local.port");
@@ -883,20 +1293,38 @@ int net_socket_init( void )
 	{
 		case AF_INET: 
 		case AF_INET6:
-			if(
-				net_socket_listener_create( address_family, bind_address, control_port ) ||
-				net_socket_listener_create( address_family, bind_address, data_port ) ||
-				net_socket_listener_create( address_family, bind_address, local_port ) )
+			control_socket = net_socket_listener_open( address_family, bind_address, control_port, NET_SOCKET_CONTROL_PORT, reuse_port, epoll_fd );
+			if( control_socket ) data_socket = net_socket_listener_open( address_family, bind_address, data_port, NET_SOCKET_DATA_PORT, reuse_port, epoll_fd );
+			if( data_socket ) local_socket = net_socket_listener_open( address_family, bind_address, local_port, NET_SOCKET_LOCAL_PORT, 0, epoll_fd );
+
+			if( ! local_socket )
 			{
 				logging_printf(LOGGING_ERROR, "net_socket_init: Cannot create socket: %s\n", strerror( errno ) );
 				return -1;
 			}
+
+			// Each additional worker gets its own copy of the control and data sockets
+			for( i = 1; i < num_workers; i++ )
+			{
+				if( ! net_socket_listener_open( address_family, bind_address, control_port, NET_SOCKET_CONTROL_PORT, reuse_port, workers[i].loop_fd ) ||
+					! net_socket_listener_open( address_family, bind_address, data_port, NET_SOCKET_DATA_PORT, reuse_port, workers[i].loop_fd ) )
+				{
+					logging_printf(LOGGING_ERROR, "net_socket_init: Cannot create socket for receive worker %d: %s\n", i, strerror( errno ) );
+					return -1;
+				}
+			}
 			break;
 		default:
 			logging_printf(LOGGING_ERROR, "net_socket_init: Invalid address family [%s][%d]\n", bind_address, address_family);
 			return -1;
 	}
 
+	control_socket_fd = control_socket->fd;
+	data_socket_fd = data_socket->fd;
+	local_socket_fd = local_socket->fd;
+
+	logging_printf( LOGGING_DEBUG, "net_socket_init: receive_workers=%d\n", num_workers );
+
 	// If a file name is defined, open up the file handle to write inbound MIDI events
 	inbound_midi_filename = config_string_get("inbound_midi");
 
@@ -920,85 +1348,19 @@ int net_socket_init( void )
 	return 0;
 }
 
-void net_socket_set_fds(void)
-{
-	int i = 0;
-	size_t num_sockets = 0;
-
-	num_sockets = data_table_item_count( sockets );
-
-	net_socket_poll_fds_lock();
-	poll_fds_count = 0;
-
-	net_socket_poll_fds_add( shutdown_fd[0] );
-
-	for( i = 0; i < num_sockets; i++ )
-	{
-		const raveloxmidi_socket_t *socket = NULL;
-
-		data_table_lock( sockets );
-		socket = (const raveloxmidi_socket_t *)data_table_item_get( sockets, i );
-		data_table_unlock( sockets );
-
-		if( ! socket ) continue;
-		if( socket->fd > 0 )
-		{
-			net_socket_poll_fds_add( socket->fd );
-		}
-	}
-
-	net_socket_poll_fds_unlock();
-}
-
 int net_socket_get_data_socket( void )
 {
-	int fd = -1;
-	const raveloxmidi_socket_t *socket = NULL;
-
-	data_table_lock( sockets );
-	socket = (const raveloxmidi_socket_t *)data_table_item_get( sockets, NET_SOCKET_DATA_PORT);
-	data_table_unlock( sockets );
-
-	if( socket )
-	{
-		fd =  socket->fd;
-	}
-
-	return fd;
+	return data_socket_fd;
 }
 
 int net_socket_get_control_socket( void )
 {
-	int fd = -1;
-	const raveloxmidi_socket_t *socket = NULL;
-
-	data_table_lock( sockets );
-	socket = (const raveloxmidi_socket_t *)data_table_item_get( sockets, NET_SOCKET_CONTROL_PORT);
-	data_table_unlock( sockets );
-
-	if( socket )
-	{
-		fd =  socket->fd;
-	}
-
-	return fd;
+	return control_socket_fd;
 }
 
 int net_socket_get_local_socket( void )
 {
-	int fd = -1;
-	const raveloxmidi_socket_t *socket = NULL;
-
-	data_table_lock( sockets );
-	socket = (const raveloxmidi_socket_t *)data_table_item_get( sockets, NET_SOCKET_LOCAL_PORT);
-	data_table_unlock( sockets );
-
-	if( socket )
-	{
-		fd =  socket->fd;
-	}
-
-	return fd;
+	return local_socket_fd;
 }
 
 int net_socket_get_shutdown_fd( void )
@@ -37,6 +37,8 @@
 #include "dns_service_discover.h"
 
 #include "midi_sender.h"
+#include "midi_command.h"
+#include "data_context.h"
 
 #include "raveloxmidi_config.h"
 #include "daemon.h"
@@ -95,6 +97,9 @@ int main(int argc, char *argv[])
 		daemon_start();
 	}
 
+	midi_command_init();
+	data_context_init();
+
 	if( net_socket_init() != 0 )
 	{
 		ret = EXIT_FAILURE;
@@ -164,6 +169,9 @@ daemon_stop:
 	net_socket_teardown();
 	net_ctx_teardown();
 
+	data_context_teardown();
+	midi_command_teardown();
+
 	config_teardown();
 
 	logging_teardown();
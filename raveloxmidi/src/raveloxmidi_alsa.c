@@ -405,6 +405,7 @@ int raveloxmidi_alsa_read( int fd, snd_rawmidi_t *handle, unsigned char *buffer,
 				case ENODEV:
 					logging_printf( LOGGING_WARN, "raveloxmidi_alsa_read: ALSA device (fd=%d) not responding. Disabling polling\n", fd );
 					raveloxmidi_alsa_disable_poll_fd( fd );
+					net_socket_loop_remove( fd );
 					break;
 				case EAGAIN:
 					break;
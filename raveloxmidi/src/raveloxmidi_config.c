@@ -45,6 +45,7 @@ static void config_set_defaults( void )
 	config_add_item("network.data.port", "5005");
 	config_add_item("network.local.port", "5006");
 	config_add_item("network.socket_timeout" , "30" );
+	config_add_item("network.max_connections", "1024");
 	config_add_item("service.name", "raveloxmidi");
 	config_add_item("service.ipv4", "yes");
 	config_add_item("service.ipv6", "no");
@@ -61,7 +62,17 @@ static void config_set_defaults( void )
 	config_add_item("discover.timeout","5");
 	config_add_item("sync.interval","10");
 	config_add_item("network.read.blocksize","2048");
+	config_add_item("network.read.batch_size","8");
+	config_add_item("network.receive_workers","1");
 	config_add_item("journal.write","no");
+	config_add_item("journal.read","yes");
+	config_add_item("feedback.packets","8");
+	config_add_item("feedback.interval","50");
+	config_add_item("sender.queue_size","1024");
+	config_add_item("sender.queue_overflow","block");
+	config_add_item("sender.batch","no");
+	config_add_item("sender.batch_size","64");
+	config_add_item("sender.batch_linger","0");
 #ifdef HAVE_ALSA
 	config_add_item("alsa.input_buffer_size", "4096" );
 	config_add_item("alsa.writeback", "no");
@@ -160,6 +160,60 @@ void rtp_packet_unpack( unsigned char *buffer, size_t buffer_len, rtp_packet_t *
 	}
 }
 
+/* Parse the RTP header in place. The payload pointer refers back into buffer so nothing is copied */
+int rtp_packet_view_unpack( unsigned char *buffer, size_t buffer_len, rtp_packet_view_t *view )
+{
+	uint16_t temp_header;
+	unsigned char *p;
+	size_t current_buffer_len;
+	size_t csrc_len = 0;
+
+	if( ! buffer ) return -1;
+	if( ! view ) return -1;
+
+	memset( view, 0, sizeof( rtp_packet_view_t ) );
+
+	if( buffer_len < RTP_HEADER_SIZE )
+	{
+		logging_printf( LOGGING_WARN, "rtp_packet_view_unpack: Packet too short: %zu bytes\n", buffer_len );
+		return -1;
+	}
+
+	p = buffer;
+	current_buffer_len = buffer_len;
+
+	get_uint16(  &temp_header, &p, &current_buffer_len );
+
+	view->header.v = ( temp_header >> 8 ) >> 6;
+	view->header.p = ( temp_header >> 8 ) >> 5;
+	view->header.x = ( temp_header >> 8 ) >> 4;
+	view->header.cc = ( temp_header >> 8 ) & 0x0f;
+	view->header.m = ( temp_header & 0x80 ) >> 7;
+	view->header.pt = ( temp_header & 0x7f ); 
+
+	get_uint16( &(view->header.seq), &p, &current_buffer_len );
+	get_uint32( &(view->header.timestamp), &p, &current_buffer_len );
+	get_uint32( &(view->header.ssrc), &p, &current_buffer_len );	
+
+	/* Step over any contributing sources */
+	csrc_len = view->header.cc * sizeof( uint32_t );
+	if( csrc_len > current_buffer_len )
+	{
+		logging_printf( LOGGING_WARN, "rtp_packet_view_unpack: CSRC list (%zu bytes) exceeds packet\n", csrc_len );
+		return -1;
+	}
+	p += csrc_len;
+	current_buffer_len -= csrc_len;
+
+	if( current_buffer_len > 0 )
+	{
+		view->payload = p;
+		view->payload_len = current_buffer_len;
+	}
+
+	return 0;
+}
+
 void rtp_packet_dump( rtp_packet_t *packet )
 {
 	DEBUG_ONLY;
@@ -0,0 +1,226 @@
+/*
+   This file is part of raveloxmidi.
+
+   Copyright (C) 2026 Dave Kelly
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA 
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "utils.h"
+#include "logging.h"
+#include "spsc_ring.h"
+
+static size_t spsc_ring_round_size( size_t size )
+{
+	size_t rounded = 1;
+
+	while( rounded < size ) rounded <<= 1;
+
+	return rounded;
+}
+
+spsc_ring_t *spsc_ring_create( size_t size )
+{
+	spsc_ring_t *new_ring = NULL;
+	size_t real_size = 0;
+
+	if( size == 0 )
+	{
+		logging_printf( LOGGING_ERROR, "spsc_ring_create: invalid size specified: %zu\n", size );
+		return NULL;
+	}
+
+	real_size = spsc_ring_round_size( size );
+
+	new_ring = ( spsc_ring_t * ) X_MALLOC( sizeof( spsc_ring_t ) );
+
+	if( ! new_ring )
+	{
+		logging_printf( LOGGING_ERROR, "spsc_ring_create: insufficient memory to create new ring\n");
+		return NULL;
+	}
+
+	memset( new_ring, 0, sizeof( spsc_ring_t ) );
+
+	new_ring->data = ( unsigned char * ) X_MALLOC( real_size );
+	if( ! new_ring->data )
+	{
+		logging_printf( LOGGING_ERROR, "spsc_ring_create: insufficient memory to create internal data buffer\n");
+		X_FREE( new_ring );
+		return NULL;
+	}
+
+	memset( new_ring->data, 0, real_size );
+	new_ring->size = real_size;
+	new_ring->mask = real_size - 1;
+
+	atomic_init( &new_ring->head, 0 );
+	atomic_init( &new_ring->tail, 0 );
+
+	return new_ring;
+}
+
+void spsc_ring_destroy( spsc_ring_t **ring )
+{
+	if( ! ring ) return;
+	if( ! *ring ) return;
+
+	if( (*ring)->data )
+	{
+		X_FREE( (*ring)->data );
+		(*ring)->data = NULL;
+	}
+
+	X_FREENULL( "spsc_ring", (void **)ring );
+}
+
+/* Discard the contents. Neither the producer nor the consumer may be active */
+void spsc_ring_reset( spsc_ring_t *ring )
+{
+	if( ! ring ) return;
+
+	atomic_store_explicit( &ring->head, 0, memory_order_relaxed );
+	atomic_store_explicit( &ring->tail, 0, memory_order_relaxed );
+	ring->tail_cache = 0;
+	ring->head_cache = 0;
+	atomic_thread_fence( memory_order_seq_cst );
+}
+
+size_t spsc_ring_get_size( const spsc_ring_t *ring )
+{
+	if( ! ring ) return 0;
+
+	return ring->size;
+}
+
+size_t spsc_ring_used( spsc_ring_t *ring )
+{
+	size_t head = 0;
+	size_t tail = 0;
+
+	if( ! ring ) return 0;
+
+	tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+	head = atomic_load_explicit( &ring->head, memory_order_acquire );
+
+	return head - tail;
+}
+
+/* Either all of the data is written or none of it is */
+size_t spsc_ring_write( spsc_ring_t *ring, const void *data, size_t len )
+{
+	size_t head = 0;
+	size_t offset = 0;
+	size_t first_part = 0;
+
+	if( ! ring ) return 0;
+	if( ! ring->data ) return 0;
+	if( ! data ) return 0;
+	if( len == 0 ) return 0;
+
+	head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+
+	if( head - ring->tail_cache + len > ring->size )
+	{
+		ring->tail_cache = atomic_load_explicit( &ring->tail, memory_order_acquire );
+
+		if( head - ring->tail_cache + len > ring->size )
+		{
+			logging_printf( LOGGING_ERROR, "spsc_ring_write: ring=%p Insufficient space available in buffer\n", ring);
+			return 0;
+		}
+	}
+
+	offset = head & ring->mask;
+	first_part = MIN( len, ring->size - offset );
+
+	memcpy( ring->data + offset, data, first_part );
+	if( first_part < len )
+	{
+		memcpy( ring->data, (const unsigned char *)data + first_part, len - first_part );
+	}
+
+	atomic_store_explicit( &ring->head, head + len, memory_order_release );
+
+	return len;
+}
+
+/* Hand out the readable data as up to two contiguous spans without copying.
+   The spans stay valid until spsc_ring_commit() is called */
+size_t spsc_ring_peek_spans( spsc_ring_t *ring, spsc_ring_span_t spans[2] )
+{
+	size_t tail = 0;
+	size_t used = 0;
+	size_t offset = 0;
+
+	if( ! spans ) return 0;
+
+	spans[0].data = NULL;
+	spans[0].len = 0;
+	spans[1].data = NULL;
+	spans[1].len = 0;
+
+	if( ! ring ) return 0;
+	if( ! ring->data ) return 0;
+
+	tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+	ring->head_cache = atomic_load_explicit( &ring->head, memory_order_acquire );
+
+	used = ring->head_cache - tail;
+	if( used == 0 ) return 0;
+
+	offset = tail & ring->mask;
+
+	spans[0].data = ring->data + offset;
+	spans[0].len = MIN( used, ring->size - offset );
+
+	if( spans[0].len < used )
+	{
+		spans[1].data = ring->data;
+		spans[1].len = used - spans[0].len;
+	}
+
+	return used;
+}
+
+void spsc_ring_commit( spsc_ring_t *ring, size_t len )
+{
+	size_t tail = 0;
+	size_t used = 0;
+
+	if( ! ring ) return;
+	if( len == 0 ) return;
+
+	// Only what was handed out by the last peek can be consumed
+	tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+	used = ring->head_cache - tail;
+
+	atomic_store_explicit( &ring->tail, tail + MIN( len, used ), memory_order_release );
+}
+
+void spsc_ring_dump( spsc_ring_t *ring )
+{
+	DEBUG_ONLY;
+
+	if( ! ring ) return;
+
+	logging_printf( LOGGING_DEBUG, "spsc_ring=%p,data=%p,size=%zu,head=%zu,tail=%zu\n", ring, ring->data, ring->size,
+		atomic_load_explicit( &ring->head, memory_order_relaxed ), atomic_load_explicit( &ring->tail, memory_order_relaxed ) );
+}
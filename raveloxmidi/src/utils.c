@@ -386,6 +386,13 @@ long time_in_microseconds( void )
 	return ( currentTime.tv_sec * (int)1e6 + currentTime.tv_usec ) / 100 ;
 }
 
+/* Convert a CLOCK_REALTIME timespec to the same units as time_in_microseconds() */
+long time_from_timespec( const struct timespec *ts )
+{
+	if( ! ts ) return time_in_microseconds();
+	return ( ts->tv_sec * (int)1e6 + ( ts->tv_nsec / 1000 ) ) / 100 ;
+}
+
 void utils_lock( void )
 {
 	X_MUTEX_LOCK( &utils_thread_lock );